@@ -22,6 +22,13 @@
 ---@field mark_inline? boolean
 ---@field overflow_errors? boolean
 ---@field underflow_errors? boolean
+---@field dates? Tomlua.DatesMode
+
+---@alias Tomlua.DatesMode
+---| "string"    -- same as fancy_dates = false
+---| "userdata"  -- same as fancy_dates = true
+---| "timestamp" -- seconds since the Unix epoch, local dates and datetimes as UTC
+---| "table"     -- a plain Tomlua.DateTable with the fields of its type, fractional in microseconds
 
 ---@alias TomlType
 ---| "UNTYPED"
@@ -55,16 +62,70 @@
 ---| 12
 ---| 13
 
+---@class Tomlua.Decoder
+---@field feed fun(self:Tomlua.Decoder, chunk:string):(true?, string?) -- returns ok?, err?
+---@field finish fun(self:Tomlua.Decoder):(table?, string?) -- returns result?, err?
+
+---@class Tomlua.CacheOptions : TomluaOptions
+---@field copy? boolean -- return a copy of the cached result instead of the shared read only one
+
+---@class Tomlua.Select
+---@field only? string[] -- paths like "a.b" to decode, and nothing outside of them
+---@field exclude? string[] -- paths to skip, even inside of only
+---@field cache? string -- decode_file only, path of a snapshot of the result, which is used while the file is unchanged
+
+---@class Tomlua.Stats
+---@field decode_calls number
+---@field decode_bytes number
+---@field decode_tables number
+---@field decode_strings number
+---@field decode_keys number
+---@field defs_lookups number -- lookups of defined tables and keys
+---@field buf_reallocs number -- of scratch and output buffers
+---@field encode_calls number
+---@field encode_bytes number
+---@field encode_traversals number -- tables gone through, some more than once
+---@field prescan_ns number
+---@field decode_ns number
+---@field encode_ns number
+
+---@class Tomlua.Context
+---@field decode fun(self:Tomlua.Context, str:string, defaults?:table, select?:Tomlua.Select):(table?, string?) -- returns result?, err?
+---@field encode fun(self:Tomlua.Context, val:table):(string?, string?) -- returns result?, err?
+---@field trim fun(self:Tomlua.Context, keep?:integer) -- frees buffer memory past keep bytes, and keeps that much from then on
+
+---@alias Tomlua.Path string|(string|number)[]|nil -- "a.b.1" or { "a", "b", 1 }, nil for the tape itself
+
+---@class Tomlua.Tape
+---@field get fun(self:Tomlua.Tape, path?:Tomlua.Path):any -- tables and arrays are returned as a Tomlua.Tape, nil if missing
+---@field len fun(self:Tomlua.Tape, path?:Tomlua.Path):integer? -- elements of an array, keys of a table, or bytes of a string
+---@field type fun(self:Tomlua.Tape, path?:Tomlua.Path):TomlType?
+---@field materialize fun(self:Tomlua.Tape, path?:Tomlua.Path):any -- builds lua tables like decode does, for this value only
+
 ---@class Tomlua.main
 ---@field opts TomluaOptions
 ---@field types table<TomlType, TomlTypeNum>
----@field decode fun(str:string, defaults?:table):(any, string?): table?, string? -- returns result?, err?
+---@field decode fun(str:string, defaults?:table, select?:Tomlua.Select):(any, string?): table?, string? -- returns result?, err?
+---@field decode_file fun(path:string, defaults?:table, select?:Tomlua.Select):(table?, string?) -- returns result?, err?
+---@field decode_parallel fun(str:string, defaults?:table, threads?:integer):(table?, string?) -- returns result?, err?
+---@field cached_decode fun(str:string, opts?:Tomlua.CacheOptions):(table?, string?) -- returns a shared read only result?, err?
+---@field decode_lazy fun(str:string):(table?, string?) -- top level keys are decoded when first read, errors in them are raised then
+---@field decoder fun(opts?:TomluaOptions, defaults?:table):Tomlua.Decoder
+---@field decoder_from fun(reader:fun():string?, opts?:TomluaOptions, defaults?:table):Tomlua.Decoder -- finish reads everything from reader first
+---@field context fun(opts?:TomluaOptions, keep?:integer):Tomlua.Context -- keep is the bytes each buffer keeps between calls
+---@field parse fun(str:string):(Tomlua.Tape?, string?) -- returns tape?, err?
+---@field validate fun(str:string):(boolean, string?) -- returns ok, err?
 ---@field encode fun(val:any):(string, string?): string?, string? -- returns result?, err?
+---@field encode_to fun(sink:string|file*|fun(chunk:string), val:table, chunk_size?:integer):(boolean?, string?) -- returns true?, err?
 ---@field type fun(val:any):TomlType
 ---@field type_of fun(val:any):TomlTypeNum
 ---@field typename fun(typ:TomlTypeNum):TomlType
 ---@field str_2_mul fun(s:string):userdata -- can call tostring on the result to get it back, written as multiline string by encode.
 ---@field new_date fun(src:string|number|Tomlua.DateTable|Tomlua.Date?):Tomlua.Date
+---@field dump fun(val:table):(string?, string?) -- returns a binary snapshot?, err?
+---@field undump fun(snapshot:string):(table?, string?) -- returns result?, err?
+---@field undump_file fun(path:string):(table?, string?) -- returns result?, err?
+---@field stats fun(reset?:boolean):(Tomlua.Stats?, string?) -- only when built with TOMLUA_STATS, reset sets the counters back to 0 after returning them
 
 ---@alias Tomlua Tomlua.main | fun(opts?:TomluaOptions):Tomlua
 
@@ -0,0 +1,104 @@
+// Copyright 2025 Birdee
+#include <stddef.h>
+#include <stdlib.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "types.h"
+#include "opts.h"
+#include "decode.h"
+#include "encode.h"
+#include "context.h"
+
+// tomlua.context keeps the buffers that decode and encode would otherwise allocate and free on every call,
+// so that many small documents in a row reuse the same memory.
+// After each call, a buffer that grew past keep bytes is given back, so 1 big document does not hold on to its memory.
+
+// what a context keeps between calls by default
+#define CONTEXT_DEFAULT_KEEP (64 * 1024)
+
+typedef struct {
+    TomluaUserOpts opts;
+    DecodeArena *decode;
+    EncodeArena *encode;
+    size_t keep;
+} TomluaContext;
+
+static int context_gc(lua_State *L) {
+    TomluaContext *ctx = (TomluaContext *)lua_touserdata(L, 1);
+    free_decode_arena(ctx->decode);
+    free_encode_arena(ctx->encode);
+    ctx->decode = NULL;
+    ctx->encode = NULL;
+    return 0;
+}
+
+// context:decode(str, defaults?, select?) -> table?, err?
+static int context_decode(lua_State *L) {
+    TomluaContext *ctx = (TomluaContext *)lua_touserdata(L, lua_upvalueindex(1));
+    lua_remove(L, 1);
+    int res = decode_in_arena(L, ctx->opts, ctx->decode);
+    decode_arena_trim(ctx->decode, ctx->keep);
+    return res;
+}
+
+// context:encode(table) -> string?, err?
+static int context_encode(lua_State *L) {
+    TomluaContext *ctx = (TomluaContext *)lua_touserdata(L, lua_upvalueindex(1));
+    lua_remove(L, 1);
+    int res = encode_in_arena(L, ctx->opts, ctx->encode);
+    encode_arena_trim(ctx->encode, ctx->keep);
+    return res;
+}
+
+// context:trim(keep?) gives back everything past keep bytes now, and keeps that much from then on if given
+static int context_trim(lua_State *L) {
+    TomluaContext *ctx = (TomluaContext *)lua_touserdata(L, lua_upvalueindex(1));
+    size_t keep = 0;
+    if (!lua_isnoneornil(L, 2)) {
+        lua_Integer n = luaL_checkinteger(L, 2);
+        ctx->keep = keep = (n > 0) ? (size_t)n : 0;
+    }
+    decode_arena_trim(ctx->decode, keep);
+    encode_arena_trim(ctx->encode, keep);
+    return 0;
+}
+
+// tomlua.context(opts?, keep?) -> context
+// opts default to the options of this tomlua, and keep to CONTEXT_DEFAULT_KEEP bytes for each buffer
+int tomlua_context(lua_State *L) {
+    lua_settop(L, 2);
+    size_t keep = CONTEXT_DEFAULT_KEEP;
+    if (!lua_isnil(L, 2)) {
+        lua_Integer n = luaL_checkinteger(L, 2);
+        keep = (n > 0) ? (size_t)n : 0;
+    }
+    TomluaContext *ctx = (TomluaContext *)lua_newuserdata(L, sizeof(TomluaContext));
+    *ctx = (TomluaContext){0};
+    if (luaL_newmetatable(L, "TomluaContext")) {
+        lua_pushcfunction(L, context_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    int ctx_idx = lua_gettop(L);
+    if (lua_istable(L, 1)) {
+        opts_parse(L, ctx->opts, 1);
+    } else {
+        toml_user_opts_copy(ctx->opts, *get_opts_upval(L));
+    }
+    ctx->keep = keep;
+    ctx->decode = new_decode_arena();
+    ctx->encode = new_encode_arena();
+    if (ctx->decode == NULL || ctx->encode == NULL) return luaL_error(L, "Unable to allocate memory for context");
+    lua_createtable(L, 0, 3);
+    lua_pushvalue(L, ctx_idx);
+    lua_pushcclosure(L, context_decode, 1);
+    lua_setfield(L, -2, "decode");
+    lua_pushvalue(L, ctx_idx);
+    lua_pushcclosure(L, context_encode, 1);
+    lua_setfield(L, -2, "encode");
+    lua_pushvalue(L, ctx_idx);
+    lua_pushcclosure(L, context_trim, 1);
+    lua_setfield(L, -2, "trim");
+    return 1;
+}
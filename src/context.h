@@ -0,0 +1,9 @@
+// Copyright 2025 Birdee
+#ifndef SRC_CONTEXT_H_
+#define SRC_CONTEXT_H_
+
+#include <lua.h>
+
+int tomlua_context(lua_State *L);
+
+#endif  // SRC_CONTEXT_H_
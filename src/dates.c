@@ -206,6 +206,67 @@ bool parse_toml_date(str_iter *src, TomlDate date) {
     return true;
 }
 
+// days from 1970-01-01 to the given day of the proleptic gregorian calendar
+static int64_t days_from_civil(int64_t y, int m, int d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+int64_t toml_date_fraction(const str_iter *src, int digits) {
+    for (size_t i = 0; i < src->len; i++) {
+        if (src->buf[i] != '.') continue;
+        int64_t val = 0;
+        size_t j = i + 1;
+        // missing digits are 0, and the ones past digits are cut off
+        for (int n = 0; n < digits; n++) {
+            int d = 0;
+            if (j < src->len && char_isdigit(src->buf[j])) d = src->buf[j++] - '0';
+            val = val * 10 + d;
+        }
+        return val;
+    }
+    return 0;
+}
+
+bool parse_toml_timestamp(str_iter *src, int64_t *secs, double *frac) {
+    TomlDate date;
+    if (!parse_toml_date(src, date)) return false;
+    int64_t days = 0;
+    if (DATE_GET(date, TOML_TYPE) != TOML_LOCAL_TIME) {
+        days = days_from_civil(DATE_GET(date, YEAR), DATE_GET(date, MONTH), DATE_GET(date, DAY));
+    }
+    *secs = days * 86400
+        + (int64_t)(DATE_GET(date, HOUR) - DATE_GET(date, OFFSET_HOUR)) * 3600
+        + (int64_t)(DATE_GET(date, MINUTE) - DATE_GET(date, OFFSET_MINUTE)) * 60
+        + DATE_GET(date, SECOND);
+    *frac = (double)toml_date_fraction(src, 9) / 1e9;
+    return true;
+}
+
+bool push_toml_date_table(lua_State *L, TomlDate date) {
+    int first = TOMLDATE_YEAR;
+    int last = TOMLDATE_OFFSET_MINUTE;
+    switch (DATE_GET(date, TOML_TYPE)) {
+        case TOML_LOCAL_DATE: last = TOMLDATE_DAY; break;
+        case TOML_LOCAL_TIME: first = TOMLDATE_HOUR; last = TOMLDATE_FRACTIONAL; break;
+        case TOML_LOCAL_DATETIME: last = TOMLDATE_FRACTIONAL; break;
+        case TOML_OFFSET_DATETIME: break;
+        default: return false;
+    }
+    lua_createtable(L, 0, last - first + 2);
+    lua_pushstring(L, toml_type_names[DATE_GET(date, TOML_TYPE)]);
+    lua_setfield(L, -2, DATE_FIELD_NAMES[TOMLDATE_TOML_TYPE]);
+    for (int i = first; i <= last; i++) {
+        lua_pushinteger(L, date[i]);
+        lua_setfield(L, -2, DATE_FIELD_NAMES[i]);
+    }
+    return true;
+}
+
 static const int DAYS_IN_MONTH[12] = { 31,28,31,30,31,30,31,31,30,31,30,31 };
 
 static inline bool is_leap_year(int year) {
@@ -51,6 +51,15 @@ static inline TOMLDATE_FIELDS string_2_date_field_idx(const char *str) {
 }
 
 bool parse_toml_date(str_iter *src, TomlDate date);
+// reads a date as seconds since 1970-01-01T00:00:00Z into secs, and the exact fraction of a second into frac.
+// Local datetimes and dates are taken as UTC, and local times count from midnight
+bool parse_toml_timestamp(str_iter *src, int64_t *secs, double *frac);
+// the fraction of a second of the date in src in units of 10^-digits seconds, e.g. 500000 for ".5" with 6 digits.
+// FRACTIONAL drops leading zeros, so ".5" and ".05" both parse to 5, and this reads the digits again
+int64_t toml_date_fraction(const str_iter *src, int digits);
+// pushes the date as a plain table with the fields that its type uses, which tomlua.new_date accepts back.
+// Its fractional field is taken as it is, so set it with toml_date_fraction first
+bool push_toml_date_table(lua_State *L, TomlDate date);
 bool push_new_toml_date(lua_State *L, TomlDate date);
 bool buf_push_toml_date(str_buf *buf, TomlDate date);
 // NOTE: for lua
@@ -9,143 +9,134 @@
 #include <stdint.h>
 #include <math.h>
 #include <errno.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 #include "types.h"
 #include "opts.h"
 #include "dates.h"
+#include "decode.h"
 #include "decode_keys.h"
+#include "decode_num.h"
+#include "decode_value.h"
+#include "decode_defs.h"
+#include "decode_sizes.h"
+#include "decode_select.h"
 #include "error_context.h"
+#include "file_map.h"
+#include "tape_defs.h"
+#include "snapshot.h"
+#include "stats.h"
 
 #define DECODE_RESULT_IDX 2
-// @type { [table]: table<key, bool?> | len if array or -1 for inline tables or -2 for inline arrays }
-// or error userdata type on error
-// Yes, I know, this is very overloaded.
-// It is the best structure I thought of to achieve the desired behavior and performance together.
-#define DECODE_DEFINED_IDX 3
-
-static const int DEFINED_MARK;
+// nil, or error userdata type on error
+#define DECODE_ERR_IDX 3
 
 // NOTE: Assumes root is less than keys_start, does not pop root
+// nrec is how many keys the table being defined is expected to get
 static bool recursive_lua_nav(
     lua_State *L,
+    DefTracker *defs,
     int keys_start,
     int root_idx,
     bool had_defaults,
-    bool is_array
+    bool is_array,
+    int nrec
 ) {
     int keys_end = lua_gettop(L);
     if (keys_end - keys_start < 0) {
-        return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 28, "no keys provided to navigate");
+        return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 28, "no keys provided to navigate");
     }
     lua_pushvalue(L, root_idx);
-    lua_pushvalue(L, root_idx);
-    lua_rawget(L, DECODE_DEFINED_IDX);
+    int validx = lua_gettop(L);
     for (int key_idx = keys_start; key_idx <= keys_end; key_idx++) {
-        int defidx = lua_gettop(L);
-        int validx = defidx - 1;
-        if (lua_isnil(L, defidx)) {
-            lua_settop(L, validx);
-            lua_newtable(L);
-            lua_pushvalue(L, validx);
-            lua_pushvalue(L, -2);
-            lua_rawset(L, DECODE_DEFINED_IDX);
-        }
-        lua_pushvalue(L, key_idx);
-        lua_pushboolean(L, true);
-        lua_rawset(L, defidx);
-        lua_settop(L, validx); // remove defidx, as we are done with it for now.
+        const void *parent = lua_topointer(L, validx);
+        DefsTable *pdef = defs_get_or_add(defs, parent);
+        if (!pdef) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 3, "OOM");
+        if (pdef->state == DEFS_UNSEEN) pdef->state = DEFS_TABLE;
+        if (defs_mark_key(defs, L, parent, key_idx) < 0) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 3, "OOM");
         lua_pushvalue(L, key_idx);
         lua_rawget(L, validx);
         int vtype = lua_type(L, -1);
         if (vtype == LUA_TNIL) {
             lua_pop(L, 1);      // remove nil
-            lua_newtable(L);    // create new table
+            lua_createtable(L, 0, (key_idx == keys_end && !is_array) ? nrec : 0);  // create new table
+            STATS_INC(STATS_DECODE_TABLES);
             lua_pushvalue(L, key_idx);
             lua_pushvalue(L, -2);
             lua_rawset(L, validx);   // t[key] = new table
         } else if (vtype != LUA_TTABLE) {
-            TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+            TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
             set_tmlerr(err, false, 44, "cannot navigate through non-table! Key was: ");
             return err_push_keys(L, err, keys_start, keys_end);
         }
-        lua_remove(L, validx);  // will remove validx
-        lua_pushvalue(L, validx);  // and the new value will be shifted down into its place
-        lua_rawget(L, DECODE_DEFINED_IDX);
-        int deftype = lua_type(L, defidx); // get the type of the new defidx
+        lua_replace(L, validx);
+        DefsTable *def = defs_get(defs, lua_topointer(L, validx));
+        DefsState state = (def) ? def->state : DEFS_UNSEEN;
         if (key_idx < keys_end) {  // NOTE: not last key
-            lua_Integer len = lua_tointeger(L, defidx);
-            if (len < 0) {
-                TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+            if (state == DEFS_INLINE_TABLE || state == DEFS_INLINE_ARRAY) {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
                 set_tmlerr(err, false, 33, "value already defined inline at: ");
                 return err_push_keys(L, err, keys_start, keys_end);
             }
-            if (deftype == LUA_TNUMBER) {
-                lua_pop(L, 1);
-                lua_rawgeti(L, validx, len);
+            if (state == DEFS_ARRAY) {
+                // continue from the current entry of the [[array]]
+                lua_rawgeti(L, validx, def->len);
                 lua_replace(L, validx);
-                lua_settop(L, validx);
-                lua_pushvalue(L, validx);
-                lua_rawget(L, DECODE_DEFINED_IDX);  // update defidx for next iteration
-            } else if (deftype != LUA_TTABLE && deftype != LUA_TNIL) {
-                TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
-                set_tmlerr(err, false, 33, "value already defined inline at: ");
-                return err_push_keys(L, err, keys_start, keys_end);
             }
             if (!lua_istable(L, validx)) {
-                TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
                 set_tmlerr(err, false, 44, "cannot navigate through non-table! Key was: ");
                 return err_push_keys(L, err, keys_start, keys_end);
             }
-            lua_settop(L, defidx);
         } else {  // NOTE: Last key
             if (is_array) {
-                if (lua_istable(L, defidx)) {
-                    TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+                if (state == DEFS_TABLE) {
+                    TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
                     set_tmlerr(err, false, 26, "table already defined at: ");
                     return err_push_keys(L, err, keys_start, keys_end);
                 }
-                lua_Integer len = lua_tointeger(L, defidx);
-                if (had_defaults && deftype != LUA_TNUMBER) {
-                    len = lua_arraylen(L, validx);
-                }
-                lua_pop(L, 1);
-                if (len < 0) {
-                    TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+                if (state == DEFS_INLINE_TABLE || state == DEFS_INLINE_ARRAY) {
+                    TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
                     set_tmlerr(err, false, 33, "array already defined inline at: ");
                     return err_push_keys(L, err, keys_start, keys_end);
                 }
+                lua_Integer len = (state == DEFS_ARRAY) ? def->len : 0;
+                if (had_defaults && state != DEFS_ARRAY) {
+                    len = lua_arraylen(L, validx);
+                }
                 len++;
-                lua_newtable(L);
+                def = defs_get_or_add(defs, lua_topointer(L, validx));
+                if (!def) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 3, "OOM");
+                def->state = DEFS_ARRAY;
+                def->len = len;
+                lua_createtable(L, 0, nrec);
+                STATS_INC(STATS_DECODE_TABLES);
                 lua_pushvalue(L, -1);
                 lua_rawseti(L, validx, len);
-                lua_pushvalue(L, validx);
-                lua_pushinteger(L, len);
-                lua_rawset(L, DECODE_DEFINED_IDX);
                 lua_replace(L, validx);
-            } else if (deftype == LUA_TTABLE) {
-                lua_pushlightuserdata(L, (void *)&DEFINED_MARK);
-                lua_rawget(L, defidx);
-                if (lua_toboolean(L, -1)) {
-                    TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+            } else if (state == DEFS_TABLE) {
+                if (def->flags & DEFS_FLAG_EXPLICIT) {
+                    TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
                     set_tmlerr(err, false, 32, "table already defined! Key was: ");
                     return err_push_keys(L, err, keys_start, keys_end);
                 }
-                lua_pushlightuserdata(L, (void *)&DEFINED_MARK);
-                lua_pushboolean(L, true);
-                lua_rawset(L, defidx);
-            } else if (deftype == LUA_TNIL) {
-                lua_pushvalue(L, validx);
-                lua_newtable(L);
-                lua_pushlightuserdata(L, (void *)&DEFINED_MARK);
-                lua_pushboolean(L, true);
-                lua_rawset(L, -3);
-                lua_rawset(L, DECODE_DEFINED_IDX);
+                def->flags |= DEFS_FLAG_EXPLICIT;
+            } else if (state == DEFS_UNSEEN) {
+                def = defs_get_or_add(defs, lua_topointer(L, validx));
+                if (!def) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 3, "OOM");
+                def->state = DEFS_TABLE;
+                def->flags |= DEFS_FLAG_EXPLICIT;
             } else {
-                TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
                 set_tmlerr(err, false, 32, "table already defined! Key was: ");
                 return err_push_keys(L, err, keys_start, keys_end);
             }
-            lua_settop(L, validx);
         }
     }
     // Top is validx after loop
@@ -160,86 +151,54 @@ static bool recursive_lua_nav(
 // does the checks for set, but just returns final table and last key onto the stack
 // with the last key on top and final table below it
 // This allows decode_inline_value to set directly into it as well.
-static bool recursive_lua_set_nav(lua_State *L, int keys_start, int root_idx) {
+static bool recursive_lua_set_nav(lua_State *L, DefTracker *defs, int keys_start, int root_idx) {
     int keys_end = lua_gettop(L);
     if (keys_end - keys_start < 0) {
-        return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 28, "no keys provided to navigate");
+        return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 28, "no keys provided to navigate");
     }
     lua_pushvalue(L, root_idx);
+    int parent_idx = lua_gettop(L);
     for (int key_idx = keys_start; key_idx <= keys_end; key_idx++) {
-        int parent_idx = lua_gettop(L);
+        const void *parent = lua_topointer(L, parent_idx);
+        DefsTable *pdef = defs_get_or_add(defs, parent);
+        if (!pdef) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 3, "OOM");
         if (key_idx < keys_end) {  // NOTE: not last key
-            lua_pushvalue(L, parent_idx);
-            lua_rawget(L, DECODE_DEFINED_IDX);
-            int deftype = lua_type(L, parent_idx + 1);
-            if (deftype == LUA_TNIL) {
-                lua_pop(L, 1);
-                lua_pushvalue(L, parent_idx);
-                lua_newtable(L);
-                lua_pushvalue(L, key_idx);
-                lua_pushboolean(L, true);
-                lua_rawset(L, -3);
-                lua_pushlightuserdata(L, (void *)&DEFINED_MARK);
-                lua_pushboolean(L, true);
-                lua_rawset(L, -3);
-                lua_rawset(L, DECODE_DEFINED_IDX);
-            } else if (deftype == LUA_TTABLE) {
-                lua_pushvalue(L, key_idx);
-                lua_pushboolean(L, true);
-                lua_rawset(L, parent_idx + 1);
-            } else {
-                TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+            if (pdef->state == DEFS_UNSEEN) {
+                pdef->state = DEFS_TABLE;
+                pdef->flags |= DEFS_FLAG_EXPLICIT;
+            } else if (pdef->state != DEFS_TABLE) {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
                 set_tmlerr(err, false, 68, "Tried to use key indexing to set value in inline value or array at: ");
                 return err_push_keys(L, err, keys_start, keys_end);
             }
-            lua_settop(L, parent_idx);
+            if (defs_mark_key(defs, L, parent, key_idx) < 0) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 3, "OOM");
             lua_pushvalue(L, key_idx);
             lua_rawget(L, parent_idx);
-            if (lua_istable(L, -1)) {
-                lua_remove(L, parent_idx);
-            } else {
+            if (!lua_istable(L, -1)) {
                 lua_pop(L, 1);
                 lua_newtable(L);
+                STATS_INC(STATS_DECODE_TABLES);
                 lua_pushvalue(L, key_idx);
                 lua_pushvalue(L, -2);
                 lua_rawset(L, parent_idx);
-                lua_remove(L, parent_idx);
             }
+            lua_replace(L, parent_idx);
         } else {  // NOTE: last key
-            lua_pushvalue(L, parent_idx);
-            lua_rawget(L, DECODE_DEFINED_IDX);
-            int pdef = parent_idx + 1;
-            int pdef_type = lua_type(L, pdef);
-            if (pdef_type == LUA_TTABLE) {
-                lua_pushvalue(L, key_idx);
-                lua_rawget(L, pdef);
-                if (lua_isboolean(L, -1)) {
-                    TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
-                    set_tmlerr(err, false, 30, "key already defined! Key was: ");
-                    return err_push_keys(L, err, keys_start, keys_end);
-                }
-                lua_pop(L, 1);
-                lua_pushvalue(L, key_idx);
-                lua_pushboolean(L, true);
-                lua_rawset(L, pdef);
-                lua_settop(L, parent_idx);
-            } else if (pdef_type == LUA_TNIL) {
-                lua_pop(L, 1);  // remove nil pdef
-                lua_pushvalue(L, parent_idx);  // used to set back into def_err_idx
-                lua_newtable(L);  // new pdef
-                lua_pushvalue(L, key_idx);
-                lua_pushboolean(L, true);
-                lua_rawset(L, -3);  // add initial key to new pdef
-                lua_pushlightuserdata(L, (void *)&DEFINED_MARK);
-                lua_pushboolean(L, true);
-                lua_rawset(L, -3);
-                // stack: new pdef, parent_idx copy (key), parent_idx
-                lua_rawset(L, DECODE_DEFINED_IDX);
-            } else {
-                TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+            if (pdef->state == DEFS_UNSEEN) {
+                pdef->state = DEFS_TABLE;
+                pdef->flags |= DEFS_FLAG_EXPLICIT;
+            } else if (pdef->state != DEFS_TABLE) {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
                 set_tmlerr(err, false, 52, "Tried to use key indexing to set value in array at: ");
                 return err_push_keys(L, err, keys_start, keys_end);
             }
+            int marked = defs_mark_key(defs, L, parent, key_idx);
+            if (marked < 0) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 3, "OOM");
+            if (marked == 0) {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
+                set_tmlerr(err, false, 30, "key already defined! Key was: ");
+                return err_push_keys(L, err, keys_start, keys_end);
+            }
             // stack: parent_idx, keys...
             // NOTE: push both first so you dont overwrite yourself
             lua_pushvalue(L, parent_idx);
@@ -252,17 +211,33 @@ static bool recursive_lua_set_nav(lua_State *L, int keys_start, int root_idx) {
     return true;
 }
 
+// sets toml_type in the metatable of the table at idx, for mark_inline
+static inline void mark_inline_table(lua_State *L, int idx, const char *toml_type) {
+    if (!lua_getmetatable(L, idx)) {
+        lua_newtable(L);
+        lua_pushstring(L, toml_type);
+        lua_setfield(L, -2, "toml_type");
+        lua_setmetatable(L, idx);
+    } else {
+        lua_pushstring(L, toml_type);
+        lua_setfield(L, -2, "toml_type");
+        lua_pop(L, 1);
+    }
+}
+
 // function is to recieve src iterator starting after the first `=`,
 // it is also to recieve the table to set into, and the key to use to do it on the top of the stack, with the key on top and table below it.
 static bool decode_inline_value(
     lua_State *L,
+    DefTracker *defs,
+    SizeHints *sizes,
     str_iter *src,
     str_buf *buf,
     const TomluaUserOpts opts
 );
 
 // adds values to table on top of the lua stack and returns NULL or error
-static bool parse_inline_table(lua_State *L, str_iter *src, str_buf *buf, const TomluaUserOpts opts) {
+static bool parse_inline_table(lua_State *L, DefTracker *defs, SizeHints *sizes, str_iter *src, str_buf *buf, const TomluaUserOpts opts) {
     int root_idx = lua_gettop(L);
     bool last_was_comma = false;
     const bool int_keys = opts[TOMLOPTS_INT_KEYS];
@@ -273,20 +248,20 @@ static bool parse_inline_table(lua_State *L, str_iter *src, str_buf *buf, const
             iter_skip(src);
             if (last_was_comma && !fancy_tables) {
                 lua_pop(L, 1);
-                return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 42, "trailing comma in inline table not allowed");
+                return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 42, "trailing comma in inline table not allowed");
             }
             return true;
         } else if (iter_peek(src).v == '\n') {
             iter_skip(src);
-            if (!fancy_tables) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 35, "inline tables can not be multi-line");
+            if (!fancy_tables) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 35, "inline tables can not be multi-line");
         } else if (iter_starts_with(src, "\r\n", 2)) {
             iter_skip_n(src, 2);
-            if (!fancy_tables) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 35, "inline tables can not be multi-line");
+            if (!fancy_tables) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 35, "inline tables can not be multi-line");
         } else if (d == ',') {
             iter_skip(src);
             if (last_was_comma) {
                 lua_pop(L, 1);
-                return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 18, "2 commas in a row!");
+                return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 18, "2 commas in a row!");
             }
             last_was_comma = true;
             continue;
@@ -295,386 +270,42 @@ static bool parse_inline_table(lua_State *L, str_iter *src, str_buf *buf, const
             continue;
         }
         last_was_comma = false;
-        if (!parse_keys(L, src, buf, int_keys, DECODE_DEFINED_IDX)) return false;
+        if (!parse_keys(L, src, buf, int_keys, DECODE_ERR_IDX)) return false;
         if (iter_peek(src).ok && iter_peek(src).v != '=') {
-            return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 35, "keys for assignment must end with =");
+            return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 35, "keys for assignment must end with =");
         }
         iter_skip(src);
         if (consume_whitespace_to_line(src)) {
-            return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 76, "the value in key = value expressions must begin on the same line as the key!");
+            return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 76, "the value in key = value expressions must begin on the same line as the key!");
         }
-        if (!recursive_lua_set_nav(L, root_idx + 1, root_idx)) return false;
-        if (!decode_inline_value(L, src, buf, opts)) return false;
+        if (!recursive_lua_set_nav(L, defs, root_idx + 1, root_idx)) return false;
+        if (!decode_inline_value(L, defs, sizes, src, buf, opts)) return false;
         if (fancy_tables) {
-            while (consume_whitespace_to_line(src)) {}
+            while (consume_whitespace_to_line(src) == 1) {}
         } else if (consume_whitespace_to_line(src)) {
-            return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 39, "toml inline tables cannot be multi-line");
+            return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 39, "toml inline tables cannot be multi-line");
         }
         iter_result next = iter_peek(src);
         if (next.ok && (next.v != ',' && next.v != '}')) {
-            return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 65, "toml inline table values must be separated with , or ended with }");
-        }
-    }
-    return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 17, "missing closing }");
-}
-
-static bool push_integer_or_handle(lua_State *L, str_buf *s, int base, bool throw_on_overflow) {
-    errno = 0;
-    buf_null_terminate(s);
-    int64_t val = strtoll(s->data, NULL, base);
-    // Check if conversion failed or overflowed
-    if (errno == ERANGE || val > LUA_MAXINTEGER || val < LUA_MININTEGER) {
-        if (throw_on_overflow) {
-            return false;
-        } else {
-            // push +/- inf depending on sign
-            lua_pushnumber(L, (val < 0) ? -INFINITY : INFINITY);
-            return true;
+            return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 65, "toml inline table values must be separated with , or ended with }");
         }
     }
-    lua_pushinteger(L, (lua_Integer)val);
-    return true;
-}
-
-static inline bool push_float_or_handle(lua_State *L, str_buf *s, bool throw_on_overflow, bool throw_on_underflow) {
-    errno = 0;
-    buf_null_terminate(s);
-    lua_Number val = strtod(s->data, NULL);
-    if (errno == ERANGE) {
-        if (throw_on_overflow && !isfinite(val)) return false;
-        if (throw_on_underflow && val != 0.0 && fabs(val) < DBL_MIN) return false;
-    }
-    lua_pushnumber(L, val);
-    return true;
+    return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 17, "missing closing }");
 }
 
 // function is to recieve src iterator starting after the first `=`,
 // it is also to recieve the table to set into, and the key to use to do it on the top of the stack, with the key on top and table below it.
-bool decode_inline_value(lua_State *L, str_iter *src, str_buf *buf, const TomluaUserOpts opts) {
+bool decode_inline_value(lua_State *L, DefTracker *defs, SizeHints *sizes, str_iter *src, str_buf *buf, const TomluaUserOpts opts) {
     // stack is currently: target_key, dest_table (already checked and made ready to be set by recursive_lua_set_nav)
     int key_idx = lua_gettop(L);
     int dest_idx = key_idx - 1;
+    // nested arrays and inline tables each hold a few stack slots until they are closed
+    if (!lua_checkstack(L, 8)) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 23, "value nested too deeply");
     iter_result curr = iter_peek(src);
-    if (!curr.ok) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 34, "expected value, got end of content");
-    // --- boolean ---
-    if (iter_starts_with(src, "true", 4)) {
-        iter_skip_n(src, 4);
-        lua_pushboolean(L, 1);
-        lua_rawset(L, dest_idx);
-        lua_settop(L, dest_idx - 1);
-        return true;
-    } else if (iter_starts_with(src, "false", 5)) {
-        iter_skip_n(src, 5);
-        lua_pushboolean(L, 0);
-        lua_rawset(L, dest_idx);
-        lua_settop(L, dest_idx - 1);
-        return true;
-    // --- strings ---
-    } else if (iter_starts_with(src, "\"\"\"", 3)) {
-        buf_soft_reset(buf);
-        iter_skip_n(src, 3);
-        if (!parse_multi_basic_string(L, buf, src, DECODE_DEFINED_IDX)) {
-            return false;
-        }
-        if (opts[TOMLOPTS_MULTI_STRINGS]) {
-            str_buf *s = (str_buf *)lua_newuserdata(L, sizeof(str_buf));
-            if (!s || !buf || !buf->data) {
-                return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 59, "tomlua.decode failed to push multi-line string to lua stack");
-            }
-            *s = new_buf_from_str(buf->data, buf->len);
-            push_multi_string_mt(L);
-            lua_setmetatable(L, -2);
-        } else {
-            if (!push_buf_to_lua_string(L, buf)) {
-                return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 48, "tomlua.decode failed to push string to lua stack");
-            }
-        }
-        lua_rawset(L, dest_idx);
-        lua_settop(L, dest_idx - 1);
-        return true;
-    } else if (curr.v == '"') {
-        buf_soft_reset(buf);
-        iter_skip(src);
-        if (!parse_basic_string(L, buf, src, DECODE_DEFINED_IDX)) {
-            return false;
-        }
-        if (!push_buf_to_lua_string(L, buf)) {
-            return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 48, "tomlua.decode failed to push string to lua stack");
-        }
-        lua_rawset(L, dest_idx);
-        lua_settop(L, dest_idx - 1);
-        return true;
-    } else if (iter_starts_with(src, "'''", 3)) {
-        buf_soft_reset(buf);
-        iter_skip_n(src, 3);
-        if (!parse_multi_literal_string(L, buf, src, DECODE_DEFINED_IDX)) {
-            return false;
-        }
-        if (opts[TOMLOPTS_MULTI_STRINGS]) {
-            str_buf *s = (str_buf *)lua_newuserdata(L, sizeof(str_buf));
-            if (!s || !buf || !buf->data) {
-                return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 59, "tomlua.decode failed to push multi-line string to lua stack");
-            }
-            *s = new_buf_from_str(buf->data, buf->len);
-            push_multi_string_mt(L);
-            lua_setmetatable(L, -2);
-        } else {
-            if (!push_buf_to_lua_string(L, buf)) {
-                return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 48, "tomlua.decode failed to push string to lua stack");
-            }
-        }
-        lua_rawset(L, dest_idx);
-        lua_settop(L, dest_idx - 1);
-        return true;
-    } else if (curr.v == '\'') {
-        buf_soft_reset(buf);
-        iter_skip(src);
-        if (!parse_literal_string(L, buf, src, DECODE_DEFINED_IDX)) {
-            return false;
-        }
-        if (!push_buf_to_lua_string(L, buf)) {
-            return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 48, "tomlua.decode failed to push string to lua stack");
-        }
-        lua_rawset(L, dest_idx);
-        lua_settop(L, dest_idx - 1);
-        return true;
-    // --- numbers (and dates) ---
-    } else if (iter_starts_with(src, "inf", 3)) {
-        iter_skip_n(src, 3);
-        lua_pushnumber(L, INFINITY);
-        lua_rawset(L, dest_idx);
-        lua_settop(L, dest_idx - 1);
-        return true;
-    } else if (iter_starts_with(src, "nan", 3)) {
-        iter_skip_n(src, 3);
-        lua_pushnumber(L, NAN);
-        lua_rawset(L, dest_idx);
-        lua_settop(L, dest_idx - 1);
-        return true;
-    } else if ((curr.v >= '0' && curr.v <= '9') || curr.v == '-' || curr.v == '+') {
-        if (iter_starts_with(src, "0x", 2)) {
-            // Hex integer
-            buf_soft_reset(buf);
-            iter_skip_n(src, 2);
-            bool was_underscore = false;
-            while (iter_peek(src).ok) {
-                char ch = iter_peek(src).v;
-                if (is_hex_char(ch)) {
-                    was_underscore = false;
-                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 31, "failed to push number character");
-                    iter_skip(src);
-                } else if (ch == '_') {
-                    if (was_underscore) {
-                        return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 51, "consecutive underscores not allowed in hex literals");
-                    }
-                    was_underscore = true;
-                    iter_skip(src);
-                } else break;
-            }
-            if (was_underscore) {
-                return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 53, "hex literals not allowed to have trailing underscores");
-            }
-            if (buf->len == 0) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 17, "empty hex literal");
-            // Convert buffer to integer
-            if (!push_integer_or_handle(L, buf, 16, opts[TOMLOPTS_OVERFLOW_ERRORS])) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 41, "Parse error: hex literal integer overflow");
-            lua_rawset(L, dest_idx);
-            lua_settop(L, dest_idx - 1);
-            return true;
-        } else if (iter_starts_with(src, "0o", 2)) {
-            // Octal integer
-            buf_soft_reset(buf);
-            iter_skip_n(src, 2);
-            bool was_underscore = false;
-            while (iter_peek(src).ok) {
-                char ch = iter_peek(src).v;
-                if ((ch >= '0' && ch <= '7')) {
-                    was_underscore = false;
-                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 31, "failed to push number character");
-                    iter_skip(src);
-                } else if (ch == '_') {
-                    if (was_underscore) {
-                        return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 53, "consecutive underscores not allowed in octal literals");
-                    }
-                    was_underscore = true;
-                    iter_skip(src);
-                } else break;
-            }
-            if (was_underscore) {
-                return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 55, "octal literals not allowed to have trailing underscores");
-            }
-            if (buf->len == 0) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 19, "empty octal literal");
-            if (!push_integer_or_handle(L, buf, 8, opts[TOMLOPTS_OVERFLOW_ERRORS])) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 43, "Parse error: octal literal integer overflow");
-            lua_rawset(L, dest_idx);
-            lua_settop(L, dest_idx - 1);
-            return true;
-        } else if (iter_starts_with(src, "0b", 2)) {
-            // binary integer
-            buf_soft_reset(buf);
-            iter_skip_n(src, 2);
-            bool was_underscore = false;
-            while (iter_peek(src).ok) {
-                char ch = iter_peek(src).v;
-                if ((ch == '0' || ch == '1')) {
-                    was_underscore = false;
-                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 31, "failed to push number character");
-                    iter_skip(src);
-                } else if (ch == '_') {
-                    if (was_underscore) {
-                        return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 54, "consecutive underscores not allowed in binary literals");
-                    }
-                    was_underscore = true;
-                    iter_skip(src);
-                } else break;
-            }
-            if (was_underscore) {
-                return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 56, "binary literals not allowed to have trailing underscores");
-            }
-            if (buf->len == 0) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 20, "empty binary literal");
-            if (!push_integer_or_handle(L, buf, 2, opts[TOMLOPTS_OVERFLOW_ERRORS])) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 44, "Parse error: binary literal integer overflow");
-            lua_rawset(L, dest_idx);
-            lua_settop(L, dest_idx - 1);
-            return true;
-        } else {
-            // detect dates and pass on as strings, and numbers are allowed to have underscores in them (only 1 consecutive underscore at a time)
-            // is date if it has a - in it not immediately preceded by e or E
-            // is date if it has a : in it
-            buf_soft_reset(buf);
-            bool is_float = false;
-            bool is_date = false;
-            bool t_used = false;
-            bool last_was_T_space = false;
-            bool z_used = false;
-            bool was_underscore = true;
-            if (curr.v == '+') {
-                if (iter_starts_with(src, "+inf", 4)) {
-                    iter_skip_n(src, 4);
-                    lua_pushnumber(L, INFINITY);
-                    lua_rawset(L, dest_idx);
-                    lua_settop(L, dest_idx - 1);
-                    return true;
-                } else if (iter_starts_with(src, "+nan", 4)) {
-                    iter_skip_n(src, 4);
-                    lua_pushnumber(L, NAN);
-                    lua_rawset(L, dest_idx);
-                    lua_settop(L, dest_idx - 1);
-                    return true;
-                } else {
-                    if (!buf_push(buf, curr.v)) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 51, "failed to push leading + character to number buffer");
-                    iter_skip(src);
-                }
-            } else if (curr.v == '-') {
-                if (iter_starts_with(src, "-inf", 4)) {
-                    iter_skip_n(src, 4);
-                    lua_pushnumber(L, -INFINITY);
-                    lua_rawset(L, dest_idx);
-                    lua_settop(L, dest_idx - 1);
-                    return true;
-                } else if (iter_starts_with(src, "-nan", 4)) {
-                    iter_skip_n(src, 4);
-                    lua_pushnumber(L, -NAN);
-                    lua_rawset(L, dest_idx);
-                    lua_settop(L, dest_idx - 1);
-                    return true;
-                } else {
-                    if (!buf_push(buf, curr.v)) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 51, "failed to push leading - character to number buffer");
-                    iter_skip(src);
-                }
-            }
-            while (iter_peek(src).ok) {
-                char ch = iter_peek(src).v;
-                if (ch == '_' && !last_was_T_space) {
-                    if (is_date) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 44, "date literal not allowed to have underscores");
-                    iter_skip(src);
-                    if (was_underscore) {
-                        return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 46, "consecutive underscores not allowed in numbers");
-                    }
-                    was_underscore = true;
-                } else if ((ch == 'e' || ch == 'E') && !last_was_T_space) {
-                    if (is_date) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 41, "date literal not allowed to have exponent");
-                    is_float = true;
-                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 31, "failed to push number character");
-                    iter_skip(src);
-                    iter_result next = iter_peek(src);
-                    if (next.ok && (next.v == '+' || next.v == '-')) {
-                        if (!buf_push(buf, next.v)) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 31, "failed to push number character");
-                        iter_skip(src);
-                    }
-                    was_underscore = false;
-                } else if (ch == ':' && !last_was_T_space) {
-                    is_date = true;
-                    was_underscore = false;
-                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 29, "failed to push date character");
-                    iter_skip(src);
-                } else if (ch == '-' && !last_was_T_space) {
-                    is_date = true;
-                    was_underscore = false;
-                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 31, "failed to push number character");
-                    iter_skip(src);
-                } else if (is_date && !t_used && ch == 'T' && !last_was_T_space) {
-                    t_used = true;
-                    was_underscore = false;
-                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 29, "failed to push date character");
-                    iter_skip(src);
-                } else if (is_date && !t_used && ch == ' ' && !last_was_T_space) {
-                    t_used = true;
-                    was_underscore = false;
-                    last_was_T_space = true;
-                    iter_skip(src);
-                } else if (is_date && !z_used && ch == 'Z' && !last_was_T_space) {
-                    z_used = true;
-                    was_underscore = false;
-                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 29, "failed to push date character");
-                    iter_skip(src);
-                } else if (ch == '.' && !last_was_T_space) {
-                    is_float = true;
-                    was_underscore = false;
-                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 31, "failed to push number character");
-                    iter_skip(src);
-                } else if (ch >= '0' && ch <= '9') {
-                    if (last_was_T_space) {
-                        if (!buf_push(buf, ' ')) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 29, "failed to push date character");
-                    }
-                    last_was_T_space = false;
-                    was_underscore = false;
-                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 31, "failed to push number character");
-                    iter_skip(src);
-                } else {
-                    was_underscore = false;
-                    last_was_T_space = false;
-                    break;
-                }
-            }
-            if (was_underscore) {
-                return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 56, "number literals not allowed to have trailing underscores");
-            }
-            if (buf->len > 0) {
-                if (is_date) {
-                    if (opts[TOMLOPTS_FANCY_DATES]) {
-                        str_iter date_src = (str_iter) {
-                            .len = buf->len,
-                            .pos = 0,
-                            .buf = buf->data
-                        };
-                        TomlDate date;
-                        if (!parse_toml_date(&date_src, date))
-                            return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 29, "Invalid date format provided!");
-                        if (!push_new_toml_date(L, date))
-                            return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 51, "tomlua.decode failed to push date type to lua stack");
-                    } else if (!push_buf_to_lua_string(L, buf)) {
-                        return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 53, "tomlua.decode failed to push date string to lua stack");
-                    }
-                } else if (is_float) {
-                    if (!push_float_or_handle(L, buf, opts[TOMLOPTS_OVERFLOW_ERRORS], opts[TOMLOPTS_UNDERFLOW_ERRORS])) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 35, "Parse error: float literal overflow");
-                } else {
-                    if (!push_integer_or_handle(L, buf, 10, opts[TOMLOPTS_OVERFLOW_ERRORS])) return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 37, "Parse error: integer literal overflow");
-                }
-                lua_rawset(L, dest_idx);
-                lua_settop(L, dest_idx - 1);
-                return true;
-            }
-        }
+    if (!curr.ok) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 34, "expected value, got end of content");
     // --- array --- allows trailing comma and multiline
-    } else if (curr.v == '[') {
+    if (curr.v == '[') {
+        int narr = size_hint_at(sizes, src->pos);
         iter_skip(src);
         lua_pushvalue(L, key_idx);
         lua_rawget(L, dest_idx);
@@ -682,37 +313,21 @@ bool decode_inline_value(lua_State *L, str_iter *src, str_buf *buf, const Tomlua
         int idx;
         if (!lua_istable(L, thearray)) {
             lua_pop(L, 1);
-            lua_newtable(L);
+            lua_createtable(L, narr, 0);
+            STATS_INC(STATS_DECODE_TABLES);
             lua_pushvalue(L, key_idx);
             lua_pushvalue(L, -2);
             lua_rawset(L, dest_idx);
-            if (opts[TOMLOPTS_MARK_INLINE]) {
-                lua_newtable(L);
-                lua_pushliteral(L, "ARRAY_INLINE");
-                lua_setfield(L, -2, "toml_type");
-                lua_setmetatable(L, thearray);
-            }
             idx = 1;
         } else {
             idx = lua_arraylen(L, thearray) + 1;
-            if (opts[TOMLOPTS_MARK_INLINE]) {
-                lua_getmetatable(L, thearray);
-                if (!lua_istable(L, -1)) {
-                    lua_settop(L, thearray);
-                    lua_newtable(L);
-                    lua_pushliteral(L, "ARRAY_INLINE");
-                    lua_setfield(L, -2, "toml_type");
-                    lua_setmetatable(L, thearray);
-                } else {
-                    lua_pushliteral(L, "ARRAY_INLINE");
-                    lua_setfield(L, -2, "toml_type");
-                    lua_settop(L, thearray);
-                }
-            }
         }
-        lua_pushvalue(L, thearray);
-        lua_pushinteger(L, -2);
-        lua_rawset(L, DECODE_DEFINED_IDX);
+        if (opts[TOMLOPTS_MARK_INLINE]) mark_inline_table(L, thearray, "ARRAY_INLINE");
+        {
+            DefsTable *def = defs_get_or_add(defs, lua_topointer(L, thearray));
+            if (!def) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 3, "OOM");
+            def->state = DEFS_INLINE_ARRAY;
+        }
         while (iter_peek(src).ok) {
             char d = iter_peek(src).v;
             if (d == ']') {
@@ -725,179 +340,1553 @@ bool decode_inline_value(lua_State *L, str_iter *src, str_buf *buf, const Tomlua
             }
             lua_pushvalue(L, thearray);
             lua_pushinteger(L, idx++);
-            if (!decode_inline_value(L, src, buf, opts)) return false;
+            if (!decode_inline_value(L, defs, sizes, src, buf, opts)) return false;
         }
-        return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 17, "missing closing ]");
+        return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 17, "missing closing ]");
     // --- inline table --- does NOT support multiline or trailing comma (without fancy_tables)
     } else if (curr.v == '{') {
+        int nrec = size_hint_at(sizes, src->pos);
         iter_skip(src);
         lua_pushvalue(L, key_idx); // push key
         lua_rawget(L, dest_idx);   // get current value
         if (!lua_istable(L, -1)) {
             lua_pop(L, 1);
-            lua_newtable(L);
+            lua_createtable(L, 0, nrec);
+            STATS_INC(STATS_DECODE_TABLES);
             lua_pushvalue(L, key_idx);
             lua_pushvalue(L, -2);
             lua_rawset(L, dest_idx);
-            if (opts[TOMLOPTS_MARK_INLINE]) {
-                lua_newtable(L);
-                lua_pushliteral(L, "TABLE_INLINE");
-                lua_setfield(L, -2, "toml_type");
-                lua_setmetatable(L, -2);
-            }
-        } else {
-            if (opts[TOMLOPTS_MARK_INLINE]) {
-                lua_getmetatable(L, -1);
-                if (!lua_istable(L, -1)) {
-                    lua_pop(L, 1);
-                    lua_newtable(L);
-                    lua_pushliteral(L, "TABLE_INLINE");
-                    lua_setfield(L, -2, "toml_type");
-                    lua_setmetatable(L, -2);
-                } else {
-                    lua_pushliteral(L, "TABLE_INLINE");
-                    lua_setfield(L, -2, "toml_type");
-                    lua_pop(L, 1);
-                }
-            }
         }
-        if (!parse_inline_table(L, src, buf, opts)) return false;
-        lua_pushvalue(L, -1);
-        lua_pushinteger(L, -1);
-        lua_rawset(L, DECODE_DEFINED_IDX);
+        if (opts[TOMLOPTS_MARK_INLINE]) mark_inline_table(L, lua_gettop(L), "TABLE_INLINE");
+        if (!parse_inline_table(L, defs, sizes, src, buf, opts)) return false;
+        DefsTable *def = defs_get_or_add(defs, lua_topointer(L, -1));
+        if (!def) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 3, "OOM");
+        def->state = DEFS_INLINE_TABLE;
         lua_settop(L, dest_idx - 1);
         return true;
-
     }
-    return set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 13, "invalid value");
+    // --- everything else ---
+    TomlScalar val;
+    if (!lex_scalar(L, src, buf, opts, DECODE_ERR_IDX, &val)) return false;
+    if (!push_scalar(L, &val, opts, DECODE_ERR_IDX)) return false;
+    lua_rawset(L, dest_idx);
+    lua_settop(L, dest_idx - 1);
+    return true;
 }
 
-int tomlua_decode(lua_State *L) {
-    // process arguments and options
-    str_iter src = lua_str_to_iter(L, 1);
-    if (src.buf == NULL) {
-        lua_settop(L, 0);
+// matches the heading keys from root_idx to the top of the stack against sel
+// returns false if the section under it is skipped, in which case the keys are replaced by nil as the location
+static bool select_heading(lua_State *L, DecodeSelect *sel, SelectMatch *section, int root_idx) {
+    select_leave_heading(sel);
+    *section = select_match(L, sel, root_idx, lua_gettop(L));
+    if (*section == SELECT_SKIP) {
+        lua_settop(L, root_idx - 1);
         lua_pushnil(L);
-        lua_pushstring(L, "tomlua.decode first argument must be a string! tomlua.decode(string) -> table?, err?");
-        return 2;
-    }
-    TomluaUserOpts uopts;
-    toml_user_opts_copy(uopts, *get_opts_upval(L));
-    const bool int_keys = uopts[TOMLOPTS_INT_KEYS];
-    // DECODE_RESULT_IDX == 2 == here
-    bool had_defaults = false;
-    if (lua_istable(L, 2)) {
-        had_defaults = true;
-        lua_settop(L, 2);
-    } else {
-        lua_settop(L, 1);
-        lua_newtable(L);
+        return false;
     }
-    // DECODE_DEFINED_IDX == 3 == here
-    // @type { [table]: len if array or -1 for defined table }
-    // or error if error
-    lua_newtable(L);
+    select_enter_heading(sel, lua_gettop(L) - root_idx + 1);
+    return true;
+}
 
-    // set top as the starting location
-    lua_pushvalue(L, DECODE_RESULT_IDX);
-    int root_idx = lua_gettop(L);
-    // avoid allocations by making every parse_value use the same scratch buffer
-    str_buf scratch = new_str_buf();
-    if (scratch.data == NULL) {
-        lua_settop(L, 0);
-        lua_pushnil(L);
-        lua_pushstring(L, "Unable to allocate memory for scratch buffer");
-        return 2;
-    }
-    while (iter_peek(&src).ok) {
+// decodes the statements of src into the table at DECODE_RESULT_IDX, until the end of src
+// expects the stack to be exactly the source, the result table, nil at DECODE_ERR_IDX,
+// and the table that key = value statements currently go into, which is left there for the next call
+// with sel, statements outside of the selection are skipped over, and their values are never read
+// on failure, returns false with the error at DECODE_ERR_IDX and src at where it happened
+static bool decode_statements(
+    lua_State *L,
+    DefTracker *defs,
+    SizeHints *sizes,
+    str_iter *src,
+    str_buf *scratch,
+    const TomluaUserOpts uopts,
+    bool had_defaults,
+    DecodeSelect *sel
+) {
+    const bool int_keys = uopts[TOMLOPTS_INT_KEYS];
+    int root_idx = DECODE_ERR_IDX + 1;
+    // how the current heading matched the selection
+    SelectMatch section = (sel == NULL) ? SELECT_ALL : SELECT_SOME;
+    while (iter_peek(src).ok) {
         {
             // consume until non-blank line, consume initial whitespace, then end loop
-            int end_line = consume_whitespace_to_line(&src);
-            while (end_line == 1) end_line = consume_whitespace_to_line(&src);
+            int end_line = consume_whitespace_to_line(src);
+            while (end_line == 1) end_line = consume_whitespace_to_line(src);
             if (end_line == 2) break;
         }
-        if (iter_starts_with(&src, "[[", 2)) {
-            iter_skip_n(&src, 2);
-            lua_settop(L, DECODE_DEFINED_IDX);  // pop current location, we are moving
-            if(!parse_keys(L, &src, &scratch, int_keys, DECODE_DEFINED_IDX)) goto fail;
-            if (!iter_starts_with(&src, "]]", 2)) {
-                TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+        if (iter_starts_with(src, "[[", 2)) {
+            int nrec = size_hint_at(sizes, src->pos);
+            iter_skip_n(src, 2);
+            lua_settop(L, DECODE_ERR_IDX);  // pop current location, we are moving
+            if(!parse_keys(L, src, scratch, int_keys, DECODE_ERR_IDX)) return false;
+            if (!iter_starts_with(src, "]]", 2)) {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
                 set_tmlerr(err, false, 14, "array heading ");
                 int top = lua_gettop(L);
                 err_push_keys(L, err, root_idx, top);
                 tmlerr_push_str(err, " must end with ]]", 17);
-                goto fail;
+                return false;
             }
-            iter_skip_n(&src, 2);  // consume ]]
-            if (!consume_whitespace_to_line(&src)) {
-                TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+            iter_skip_n(src, 2);  // consume ]]
+            if (!consume_whitespace_to_line(src)) {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
                 set_tmlerr(err, false, 8, "array [[");
                 int top = lua_gettop(L);
                 err_push_keys(L, err, root_idx, top);
                 tmlerr_push_str(err, "]] must have a new line before new values", 41);
-                goto fail;
+                return false;
             }
-            if (!recursive_lua_nav(L, root_idx, DECODE_RESULT_IDX, had_defaults, true)) goto fail;
-        } else if (iter_peek(&src).v == '[') {
-            iter_skip(&src);
-            lua_settop(L, DECODE_DEFINED_IDX);  // pop current location, we are moving
-            if (!parse_keys(L, &src, &scratch, int_keys, DECODE_DEFINED_IDX)) goto fail;
-            if (iter_peek(&src).v != ']') {
-                TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+            if (sel != NULL && !select_heading(L, sel, &section, root_idx)) continue;
+            if (!recursive_lua_nav(L, defs, root_idx, DECODE_RESULT_IDX, had_defaults, true, nrec)) return false;
+        } else if (iter_peek(src).v == '[') {
+            int nrec = size_hint_at(sizes, src->pos);
+            iter_skip(src);
+            lua_settop(L, DECODE_ERR_IDX);  // pop current location, we are moving
+            if (!parse_keys(L, src, scratch, int_keys, DECODE_ERR_IDX)) return false;
+            if (iter_peek(src).v != ']') {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
                 set_tmlerr(err, false, 14, "table heading ");
                 int top = lua_gettop(L);
                 err_push_keys(L, err, root_idx, top);
                 tmlerr_push_str(err, " must end with ]", 16);
-                goto fail;
+                return false;
             }
-            iter_skip(&src);  // consume ]
-            if (!consume_whitespace_to_line(&src)) {
-                TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+            iter_skip(src);  // consume ]
+            if (!consume_whitespace_to_line(src)) {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
                 set_tmlerr(err, false, 7, "table [");
                 int top = lua_gettop(L);
                 err_push_keys(L, err, root_idx, top);
                 tmlerr_push_str(err, "] must have a new line before new values", 40);
-                goto fail;
+                return false;
             }
-            if (!recursive_lua_nav(L, root_idx, DECODE_RESULT_IDX, had_defaults, false)) goto fail;
+            if (sel != NULL && !select_heading(L, sel, &section, root_idx)) continue;
+            if (!recursive_lua_nav(L, defs, root_idx, DECODE_RESULT_IDX, had_defaults, false, nrec)) return false;
+        } else if (section == SELECT_SKIP) {
+            src->pos = prescan_skip_statement(src->buf, src->len, src->pos);
         } else {
-            if (!parse_keys(L, &src, &scratch, int_keys, DECODE_DEFINED_IDX)) goto fail;
-            if (iter_peek(&src).v != '=') {
-                TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+            if (!parse_keys(L, src, scratch, int_keys, DECODE_ERR_IDX)) return false;
+            if (iter_peek(src).v != '=') {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
                 set_tmlerr(err, false, 20, "keys for assignment ");
                 int top = lua_gettop(L);
                 err_push_keys(L, err, root_idx + 1, top);
                 tmlerr_push_str(err, " must end with =", 16);
-                goto fail;
+                return false;
             }
-            iter_skip(&src);  // consume =
-            if (consume_whitespace_to_line(&src)) {
-                TMLErr *err = new_tmlerr(L, DECODE_DEFINED_IDX);
+            iter_skip(src);  // consume =
+            if (consume_whitespace_to_line(src)) {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
                 set_tmlerr(err, false, 86, "the value in key = value expressions must begin on the same line as the key! Key was: ");
                 int top = lua_gettop(L);
                 err_push_keys(L, err, root_idx + 1, top);
-                goto fail;
+                return false;
             }
-            if (!recursive_lua_set_nav(L, root_idx + 1, root_idx)) goto fail;
-            if (!decode_inline_value(L, &src, &scratch, uopts)) goto fail;
-            if (!consume_whitespace_to_line(&src)) {
-                set_tmlerr(new_tmlerr(L, DECODE_DEFINED_IDX), false, 66, "key value pairs must be followed by a new line (or end of content)");
-                goto fail;
+            if (section == SELECT_SOME && select_match(L, sel, root_idx + 1, lua_gettop(L)) == SELECT_SKIP) {
+                src->pos = prescan_skip_statement(src->buf, src->len, src->pos);
+                lua_settop(L, root_idx);
+                continue;
+            }
+            if (!recursive_lua_set_nav(L, defs, root_idx + 1, root_idx)) return false;
+            if (!decode_inline_value(L, defs, sizes, src, scratch, uopts)) return false;
+            if (!consume_whitespace_to_line(src)) {
+                set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 66, "key value pairs must be followed by a new line (or end of content)");
+                return false;
             }
         }
         lua_settop(L, root_idx);
     }
 
-    lua_settop(L, DECODE_RESULT_IDX);
-    free_str_buf(&scratch);
-    return 1;
+    return true;
+}
 
-fail:
-    lua_settop(L, DECODE_DEFINED_IDX);
-    free_str_buf(&scratch);
+// reads the table of only and exclude paths at select_idx into sel
+// returns false with the error string on top of the stack
+static bool read_decode_select(lua_State *L, DecodeSelect *sel, int select_idx, bool int_keys) {
+    if (sel->keys.data == NULL || sel->path.data == NULL) {
+        lua_pushliteral(L, "Unable to allocate memory for selection");
+        return false;
+    }
+    if (!lua_istable(L, select_idx)) {
+        lua_pushliteral(L, "selection must be a table like { only = { \"a.b\" }, exclude = { \"a.b.c\" } }");
+        return false;
+    }
+    int top = lua_gettop(L);
+    lua_pushnil(L);
+    int erridx = top + 1;
+    for (int i = 0; i < 2; i++) {
+        const char *name = (i == 0) ? "only" : "exclude";
+        lua_getfield(L, select_idx, name);
+        if (lua_istable(L, -1)) {
+            if (!select_read_paths(L, sel, lua_gettop(L), i == 1, int_keys, erridx)) {
+                push_tmlerr_string(L, get_err_val(L, erridx));
+                return false;
+            }
+        } else if (!lua_isnil(L, -1)) {
+            lua_pushfstring(L, "%s must be a list of path strings", name);
+            return false;
+        }
+        lua_settop(L, erridx);
+    }
+    lua_settop(L, top);
+    return true;
+}
+
+// what decode_document needs besides the lua_State, which tomlua.context keeps between calls
+struct DecodeArena {
+    str_buf scratch;
+    DefTracker defs;
+    SizeHints sizes;
+};
+
+static void release_decode_arena(DecodeArena *arena) {
+    free_str_buf(&arena->scratch);
+    free_def_tracker(&arena->defs);
+    free_size_hints(&arena->sizes);
+}
+
+// decodes src, with the defaults table if any as the second argument on the stack
+// and the selection of paths to decode at select_idx, if select_idx is not 0 and there is one there
+// the buffers come from arena, and are left there for the next call, or are made for this call only if it is NULL
+// returns the number of results, which are the result, or nil and the error
+static int decode_document(lua_State *L, str_iter src, int select_idx, const TomluaUserOpts uopts, DecodeArena *arena) {
+    DecodeSelect sel_store;
+    DecodeSelect *sel = NULL;
+    if (select_idx > 0 && !lua_isnoneornil(L, select_idx)) {
+        sel_store = new_decode_select();
+        sel = &sel_store;
+        if (!read_decode_select(L, sel, select_idx, uopts[TOMLOPTS_INT_KEYS])) {
+            free_decode_select(sel);
+            lua_pushnil(L);
+            lua_insert(L, -2);
+            return 2;
+        }
+    }
+    DecodeArena temp = {0};
+    const bool owned = arena == NULL;
+    if (owned) arena = &temp;
+    // avoid allocations by making every parse_value use the same scratch buffer
+    if (arena->scratch.data == NULL) {
+        arena->scratch = new_str_buf();
+    } else {
+        buf_soft_reset(&arena->scratch);
+    }
+    // records what has been defined so far, to catch duplicate keys and redefinitions
+    if (arena->defs.tables == NULL) {
+        arena->defs = new_def_tracker();
+    } else {
+        reset_def_tracker(&arena->defs);
+    }
+    if (arena->scratch.data == NULL || arena->defs.tables == NULL) {
+        const char *msg = (arena->scratch.data == NULL)
+            ? "Unable to allocate memory for scratch buffer"
+            : "Unable to allocate memory for definition tracker";
+        if (owned) release_decode_arena(arena);
+        if (sel) free_decode_select(sel);
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, msg);
+        return 2;
+    }
+    str_buf *scratch = &arena->scratch;
+    DefTracker *defs = &arena->defs;
+    // how big each table is going to be, so they can be created at that size
+    // these are only hints, so decoding goes on without them if there was no memory for them
+    SizeHints *sizes = &arena->sizes;
+    STATS_INC(STATS_DECODE_CALLS);
+    STATS_ADD(STATS_DECODE_BYTES, src.len);
+    STATS_TIMER(prescan_start);
+    prescan_sizes(src.buf, src.len, sizes);
+    STATS_ADD_TIME(STATS_PRESCAN_NS, prescan_start);
+    // DECODE_RESULT_IDX == 2 == here
+    bool had_defaults = false;
+    if (lua_istable(L, 2)) {
+        had_defaults = true;
+        lua_settop(L, 2);
+    } else {
+        lua_settop(L, 1);
+        lua_createtable(L, 0, (int)((sizes->root_keys > INT32_MAX) ? INT32_MAX : sizes->root_keys));
+        STATS_INC(STATS_DECODE_TABLES);
+    }
+    // DECODE_ERR_IDX == 3 == here
+    lua_pushnil(L);
+    // set top as the starting location
+    lua_pushvalue(L, DECODE_RESULT_IDX);
+    STATS_TIMER(decode_start);
+    bool ok = decode_statements(L, defs, sizes, &src, scratch, uopts, had_defaults, sel);
+    STATS_ADD_TIME(STATS_DECODE_NS, decode_start);
+    if (owned) release_decode_arena(arena);
+    if (sel) free_decode_select(sel);
+    if (ok) {
+        lua_settop(L, DECODE_RESULT_IDX);
+        return 1;
+    }
+    lua_settop(L, DECODE_ERR_IDX);
     src.pos = (src.pos >= src.len) ? src.len - 1 : src.pos;
-    tmlerr_push_ctx_from_iter(get_err_val(L, DECODE_DEFINED_IDX), 7, &src);
+    tmlerr_push_ctx_from_iter(get_err_val(L, DECODE_ERR_IDX), 7, &src);
     lua_pushnil(L);
-    push_tmlerr_string(L, get_err_val(L, DECODE_DEFINED_IDX));
+    push_tmlerr_string(L, get_err_val(L, DECODE_ERR_IDX));
     return 2;
 }
+
+DecodeArena *new_decode_arena(void) {
+    return (DecodeArena *)calloc(1, sizeof(DecodeArena));
+}
+
+void free_decode_arena(DecodeArena *arena) {
+    if (!arena) return;
+    release_decode_arena(arena);
+    free(arena);
+}
+
+void decode_arena_trim(DecodeArena *arena, size_t keep) {
+    buf_trim(&arena->scratch, keep);
+    DefTracker *defs = &arena->defs;
+    if (defs->tables_cap * sizeof(DefsTable) + defs->keys_cap * sizeof(DefsKey) + defs->arena.cap > keep) {
+        // made again by the next decode
+        free_def_tracker(defs);
+    }
+    if (arena->sizes.cap * sizeof(SizeHint) > keep) free_size_hints(&arena->sizes);
+}
+
+int decode_in_arena(lua_State *L, const TomluaUserOpts opts, DecodeArena *arena) {
+    str_iter src = lua_str_to_iter(L, 1);
+    if (src.buf == NULL) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "context:decode first argument must be a string! context:decode(string, defaults?, select?) -> table?, err?");
+        return 2;
+    }
+    return decode_document(L, src, 3, opts, arena);
+}
+
+int tomlua_decode(lua_State *L) {
+    str_iter src = lua_str_to_iter(L, 1);
+    if (src.buf == NULL) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "tomlua.decode first argument must be a string! tomlua.decode(string) -> table?, err?");
+        return 2;
+    }
+    return decode_document(L, src, 3, *get_opts_upval(L), NULL);
+}
+
+static uint64_t decode_cache_hash(const char *s, size_t len);
+
+// the stamp of a decode_file cache snapshot. It is only read back if the source has the same size, mtime and hash,
+// and it was decoded with the same options and selection
+static bool decode_file_stamp(lua_State *L, str_buf *stamp, const char *path, const MappedFile *file, const TomluaUserOpts uopts) {
+    struct stat st;
+    if (stat(path, &st) != 0) return false;
+    uint64_t fields[3] = { (uint64_t)file->len, (uint64_t)st.st_mtime, decode_cache_hash(file->data, file->len) };
+    if (!buf_push_str(stamp, (const char *)fields, sizeof(fields))) return false;
+    if (!buf_push_str(stamp, (const char *)uopts, sizeof(TomluaUserOpts))) return false;
+    for (int i = 0; i < 2; i++) {
+        const char *name = (i == 0) ? "only" : "exclude";
+        lua_getfield(L, 3, name);
+        if (lua_istable(L, -1)) {
+            size_t n = lua_arraylen(L, -1);
+            for (size_t j = 1; j <= n; j++) {
+                lua_rawgeti(L, -1, (lua_Integer)j);
+                size_t len = 0;
+                const char *p = (lua_type(L, -1) == LUA_TSTRING) ? lua_tolstring(L, -1, &len) : "";
+                bool ok = buf_push(stamp, name[0]) && buf_push_str(stamp, p, len) && buf_push(stamp, '\0');
+                lua_pop(L, 1);
+                if (!ok) {
+                    lua_pop(L, 1);
+                    return false;
+                }
+            }
+        }
+        lua_pop(L, 1);
+    }
+    return true;
+}
+
+// writes the result at DECODE_RESULT_IDX to cache_path, through a temporary file so that readers never see half of it.
+// A cache that can not be written is only a cache miss the next time, so nothing is reported
+static void decode_file_write_cache(lua_State *L, const char *cache_path, const str_buf *stamp) {
+    str_buf out = new_str_buf();
+    if (out.data == NULL) return;
+    int top = lua_gettop(L);
+    if (snapshot_write(L, DECODE_RESULT_IDX, &out, stamp->data, stamp->len)) {
+        lua_pushfstring(L, "%s.tmp", cache_path);
+        const char *tmp = lua_tostring(L, -1);
+        FILE *f = fopen(tmp, "wb");
+        if (f != NULL) {
+            bool ok = fwrite(out.data, 1, out.len, f) == out.len;
+            ok = (fclose(f) == 0) && ok;
+#ifdef _WIN32
+            if (ok) remove(cache_path);
+#endif
+            if (!ok || rename(tmp, cache_path) != 0) remove(tmp);
+        }
+    }
+    lua_settop(L, top);
+    free_str_buf(&out);
+}
+
+int tomlua_decode_file(lua_State *L) {
+    const char *path = lua_tostring(L, 1);
+    if (path == NULL) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "tomlua.decode_file first argument must be a path! tomlua.decode_file(path, defaults?, select?) -> table?, err?");
+        return 2;
+    }
+    const char *cache_path = NULL;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "cache");
+        cache_path = lua_tostring(L, -1);
+        // the string stays alive in the select table at 3
+        lua_pop(L, 1);
+        if (cache_path != NULL && lua_istable(L, 2)) {
+            lua_settop(L, 0);
+            lua_pushnil(L);
+            lua_pushstring(L, "tomlua.decode_file can not use a cache together with defaults");
+            return 2;
+        }
+    }
+    // decode copies everything it keeps out of the source, so the file can be unmapped right after
+    MappedFile file;
+    if (!map_file(path, &file)) {
+        const char *reason = strerror(errno);
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushfstring(L, "unable to read %s: %s", path, reason);
+        return 2;
+    }
+    const TomluaUserOpts *uopts = get_opts_upval(L);
+    str_buf stamp = { 0 };
+    if (cache_path != NULL) {
+        stamp = new_str_buf();
+        if (stamp.data != NULL && !decode_file_stamp(L, &stamp, path, &file, *uopts)) free_str_buf(&stamp);
+    }
+    if (stamp.data != NULL) {
+        // a snapshot that is missing, stale or unreadable is a miss
+        MappedFile snap;
+        if (map_file(cache_path, &snap)) {
+            const char *err = NULL;
+            bool hit = snapshot_read(L, snap.data, snap.len, stamp.data, stamp.len, &err);
+            unmap_file(&snap);
+            if (hit) {
+                unmap_file(&file);
+                free_str_buf(&stamp);
+                return 1;
+            }
+        }
+    }
+    str_iter src = { .len = file.len, .pos = 0, .buf = file.data };
+    int res = decode_document(L, src, 3, *uopts, NULL);
+    unmap_file(&file);
+    if (stamp.data != NULL) {
+        if (res == 1) decode_file_write_cache(L, cache_path, &stamp);
+        free_str_buf(&stamp);
+    }
+    return res;
+}
+
+// decode_parallel splits the document at headings, and reads each part onto a tape of its own on a separate thread.
+// Reading is where the lexing, unescaping and number parsing happens, which does not need the lua_State.
+// The statements of each part are then replayed here in document order, through the same recursive_lua_nav
+// and recursive_lua_set_nav as decode, so the result and every redefinition error are the same.
+// If a part fails to read, the whole document is decoded again the normal way, which reports that error exactly as decode would.
+
+// smallest part worth a thread of its own
+#define PARALLEL_MIN_PART (64 * 1024)
+#define PARALLEL_MAX_THREADS 64
+
+typedef struct {
+    const char *buf;
+    size_t start;
+    size_t end;
+    TomluaUserOpts opts;
+    TapeDoc *doc;  // NULL if it failed
+} ParallelPart;
+
+#ifndef _WIN32
+static void *parallel_read_part(void *arg) {
+    ParallelPart *part = (ParallelPart *)arg;
+    part->doc = tape_log(part->buf, part->start, part->end, part->opts);
+    return NULL;
+}
+#endif
+
+// fills starts with where each part begins, the first one at 0, and the rest at headings, about len / max apart
+// returns how many parts there are
+static size_t parallel_split(const char *buf, size_t len, size_t *starts, size_t max) {
+    size_t n = 1;
+    starts[0] = 0;
+    str_iter src = { .len = len, .pos = 0, .buf = buf };
+    while (n < max && src.pos < len) {
+        {
+            int end_line = consume_whitespace_to_line(&src);
+            while (end_line == 1) end_line = consume_whitespace_to_line(&src);
+            if (end_line == 2) break;
+        }
+        if (buf[src.pos] == '[' && src.pos >= len / max * n) starts[n++] = src.pos;
+        src.pos = prescan_skip_statement(buf, len, src.pos);
+    }
+    return n;
+}
+
+static inline void push_tape_stmt_key(lua_State *L, const char *key) {
+    STATS_INC(STATS_DECODE_KEYS);
+    uint32_t len;
+    memcpy(&len, key + 1, sizeof(len));
+    if (key[0] == 'n') {
+        lua_Number n;
+        memcpy(&n, key + 1 + sizeof(len), sizeof(lua_Number));
+        lua_pushnumber(L, n);
+    } else {
+        lua_pushlstring(L, key + 1 + sizeof(len), len);
+    }
+}
+
+// pushes the keys of stmt. Returns false if there is no room for them
+static bool push_tape_stmt_keys(lua_State *L, const TapeDoc *doc, const TapeStmt *stmt) {
+    if (stmt->nkeys > INT32_MAX - 8 || !lua_checkstack(L, (int)stmt->nkeys + 8)) {
+        return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 23, "too many keys in a path");
+    }
+    const char *key = doc->arena.data + stmt->keys_off;
+    for (uint32_t i = 0; i < stmt->nkeys; i++) {
+        push_tape_stmt_key(L, key);
+        uint32_t len;
+        memcpy(&len, key + 1, sizeof(len));
+        key += 1 + sizeof(len) + len;
+    }
+    return true;
+}
+
+static bool decode_tape_value(lua_State *L, DefTracker *defs, const TapeDoc *doc, uint32_t idx, const TomluaUserOpts opts);
+
+// sets the children of the inline table node into the table at tbl_idx, the way parse_inline_table does
+// dotted keys were already merged into tables of their own on the tape, and are created or gone into here
+static bool decode_tape_children(lua_State *L, DefTracker *defs, const TapeDoc *doc, uint32_t node, int tbl_idx, const TomluaUserOpts opts) {
+    if (!lua_checkstack(L, 8)) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 23, "value nested too deeply");
+    for (uint32_t c = doc->nodes[node].first; c != TAPE_NONE; c = doc->nodes[c].next) {
+        const TapeNode *child = &doc->nodes[c];
+        lua_pushvalue(L, tbl_idx);
+        tape_push_key(L, doc, child);
+        if (child->type == TOML_TABLE) {
+            lua_pushvalue(L, -1);
+            lua_rawget(L, -3);
+            if (!lua_istable(L, -1)) {
+                lua_pop(L, 1);
+                lua_newtable(L);
+                STATS_INC(STATS_DECODE_TABLES);
+                lua_pushvalue(L, -2);
+                lua_pushvalue(L, -2);
+                lua_rawset(L, -5);
+            }
+            if (!decode_tape_children(L, defs, doc, c, lua_gettop(L), opts)) return false;
+            lua_settop(L, tbl_idx);
+        } else if (!decode_tape_value(L, defs, doc, c, opts)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// decode_inline_value, for a value that tape_log already read
+// expects the table to set into, and the key to use to do it on the top of the stack, with the key on top and table below it.
+static bool decode_tape_value(lua_State *L, DefTracker *defs, const TapeDoc *doc, uint32_t idx, const TomluaUserOpts opts) {
+    int key_idx = lua_gettop(L);
+    int dest_idx = key_idx - 1;
+    if (!lua_checkstack(L, 8)) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 23, "value nested too deeply");
+    const TapeNode *node = &doc->nodes[idx];
+    if (node->type == TOML_ARRAY_INLINE) {
+        lua_pushvalue(L, key_idx);
+        lua_rawget(L, dest_idx);
+        int thearray = lua_gettop(L);
+        lua_Integer i;
+        if (!lua_istable(L, thearray)) {
+            lua_pop(L, 1);
+            lua_createtable(L, (node->count > INT32_MAX) ? INT32_MAX : (int)node->count, 0);
+            STATS_INC(STATS_DECODE_TABLES);
+            lua_pushvalue(L, key_idx);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, dest_idx);
+            i = 1;
+        } else {
+            i = lua_arraylen(L, thearray) + 1;
+        }
+        if (opts[TOMLOPTS_MARK_INLINE]) mark_inline_table(L, thearray, "ARRAY_INLINE");
+        DefsTable *def = defs_get_or_add(defs, lua_topointer(L, thearray));
+        if (!def) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 3, "OOM");
+        def->state = DEFS_INLINE_ARRAY;
+        for (uint32_t c = node->first; c != TAPE_NONE; c = doc->nodes[c].next) {
+            lua_pushvalue(L, thearray);
+            lua_pushinteger(L, i++);
+            if (!decode_tape_value(L, defs, doc, c, opts)) return false;
+        }
+    } else if (node->type == TOML_TABLE_INLINE) {
+        lua_pushvalue(L, key_idx);
+        lua_rawget(L, dest_idx);
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            lua_createtable(L, 0, (node->count > INT32_MAX) ? INT32_MAX : (int)node->count);
+            STATS_INC(STATS_DECODE_TABLES);
+            lua_pushvalue(L, key_idx);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, dest_idx);
+        }
+        int tbl_idx = lua_gettop(L);
+        if (opts[TOMLOPTS_MARK_INLINE]) mark_inline_table(L, tbl_idx, "TABLE_INLINE");
+        if (!decode_tape_children(L, defs, doc, idx, tbl_idx, opts)) return false;
+        DefsTable *def = defs_get_or_add(defs, lua_topointer(L, tbl_idx));
+        if (!def) return set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 3, "OOM");
+        def->state = DEFS_INLINE_TABLE;
+    } else {
+        TomlScalar val;
+        tape_scalar(doc, node, &val);
+        if (!push_scalar(L, &val, opts, DECODE_ERR_IDX)) return false;
+        lua_rawset(L, dest_idx);
+    }
+    lua_settop(L, dest_idx - 1);
+    return true;
+}
+
+// decode_statements, for the statements tape_log recorded
+// on failure, returns false with the error at DECODE_ERR_IDX and *pos at where decode would have stopped
+static bool decode_tape_stmts(lua_State *L, DefTracker *defs, const TapeDoc *doc, const TomluaUserOpts uopts, bool had_defaults, size_t *pos) {
+    int root_idx = DECODE_ERR_IDX + 1;
+    for (size_t i = 0; i < doc->stmts_len; i++) {
+        const TapeStmt *stmt = &doc->stmts[i];
+        *pos = stmt->pos;
+        if (stmt->kind == TAPE_STMT_KEYVAL) {
+            if (!push_tape_stmt_keys(L, doc, stmt)) return false;
+            if (!recursive_lua_set_nav(L, defs, root_idx + 1, root_idx)) return false;
+            if (!decode_tape_value(L, defs, doc, stmt->value, uopts)) return false;
+        } else {
+            lua_settop(L, DECODE_ERR_IDX);  // pop current location, we are moving
+            if (!push_tape_stmt_keys(L, doc, stmt)) return false;
+            int nrec = (stmt->count > INT32_MAX) ? INT32_MAX : (int)stmt->count;
+            if (!recursive_lua_nav(L, defs, root_idx, DECODE_RESULT_IDX, had_defaults, stmt->kind == TAPE_STMT_ARRAY, nrec)) return false;
+        }
+        lua_settop(L, root_idx);
+    }
+    return true;
+}
+
+// decode_document, with the parts read on up to max_threads threads
+static int decode_parallel(lua_State *L, str_iter src, size_t max_threads) {
+    size_t max = src.len / PARALLEL_MIN_PART;
+    if (max > max_threads) max = max_threads;
+    if (max > PARALLEL_MAX_THREADS) max = PARALLEL_MAX_THREADS;
+    size_t starts[PARALLEL_MAX_THREADS];
+    size_t n = (max > 1) ? parallel_split(src.buf, src.len, starts, max) : 1;
+    if (n < 2) return decode_document(L, src, 0, *get_opts_upval(L), NULL);
+    STATS_TIMER(decode_start);
+    ParallelPart parts[PARALLEL_MAX_THREADS];
+    TomluaUserOpts uopts;
+    toml_user_opts_copy(uopts, *get_opts_upval(L));
+    for (size_t i = 0; i < n; i++) {
+        parts[i] = (ParallelPart){
+            .buf = src.buf,
+            .start = starts[i],
+            .end = (i + 1 < n) ? starts[i + 1] : src.len,
+        };
+        toml_user_opts_copy(parts[i].opts, uopts);
+    }
+#ifndef _WIN32
+    // the first part is read on this thread, and so is any part a thread could not be started for
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    bool started[PARALLEL_MAX_THREADS] = {false};
+    for (size_t i = 1; i < n; i++) {
+        started[i] = pthread_create(&threads[i], NULL, parallel_read_part, &parts[i]) == 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!started[i]) parts[i].doc = tape_log(parts[i].buf, parts[i].start, parts[i].end, parts[i].opts);
+    }
+    for (size_t i = 1; i < n; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+#else
+    for (size_t i = 0; i < n; i++) {
+        parts[i].doc = tape_log(parts[i].buf, parts[i].start, parts[i].end, parts[i].opts);
+    }
+#endif
+    bool read_all = true;
+    for (size_t i = 0; i < n; i++) read_all = read_all && parts[i].doc != NULL;
+    if (!read_all) {
+        for (size_t i = 0; i < n; i++) free_tape(parts[i].doc);
+        return decode_document(L, src, 0, *get_opts_upval(L), NULL);
+    }
+    STATS_INC(STATS_DECODE_CALLS);
+    STATS_ADD(STATS_DECODE_BYTES, src.len);
+    // DECODE_RESULT_IDX == 2 == here
+    bool had_defaults = false;
+    if (lua_istable(L, 2)) {
+        had_defaults = true;
+        lua_settop(L, 2);
+    } else {
+        uint32_t root_keys = 0;
+        while (root_keys < parts[0].doc->stmts_len && parts[0].doc->stmts[root_keys].kind == TAPE_STMT_KEYVAL) root_keys++;
+        lua_settop(L, 1);
+        lua_createtable(L, 0, (int)((root_keys > INT32_MAX) ? INT32_MAX : root_keys));
+        STATS_INC(STATS_DECODE_TABLES);
+    }
+    // DECODE_ERR_IDX == 3 == here
+    lua_pushnil(L);
+    DefTracker defs = new_def_tracker();
+    if (defs.tables == NULL) {
+        for (size_t i = 0; i < n; i++) free_tape(parts[i].doc);
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "Unable to allocate memory for definition tracker");
+        return 2;
+    }
+    // set top as the starting location
+    lua_pushvalue(L, DECODE_RESULT_IDX);
+    bool ok = true;
+    for (size_t i = 0; i < n && ok; i++) {
+        ok = decode_tape_stmts(L, &defs, parts[i].doc, uopts, had_defaults, &src.pos);
+    }
+    for (size_t i = 0; i < n; i++) free_tape(parts[i].doc);
+    free_def_tracker(&defs);
+    STATS_ADD_TIME(STATS_DECODE_NS, decode_start);
+    if (!ok) {
+        lua_settop(L, DECODE_ERR_IDX);
+        src.pos = (src.pos >= src.len) ? src.len - 1 : src.pos;
+        tmlerr_push_ctx_from_iter(get_err_val(L, DECODE_ERR_IDX), 7, &src);
+        lua_pushnil(L);
+        push_tmlerr_string(L, get_err_val(L, DECODE_ERR_IDX));
+        return 2;
+    }
+    lua_settop(L, DECODE_RESULT_IDX);
+    return 1;
+}
+
+int tomlua_decode_parallel(lua_State *L) {
+    str_iter src = lua_str_to_iter(L, 1);
+    if (src.buf == NULL) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "tomlua.decode_parallel first argument must be a string! tomlua.decode_parallel(string, defaults?, threads?) -> table?, err?");
+        return 2;
+    }
+    lua_Integer threads = 0;
+    if (lua_type(L, 3) == LUA_TNUMBER) {
+        threads = lua_tointeger(L, 3);
+    } else {
+#ifndef _WIN32
+        threads = (lua_Integer)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    }
+    lua_settop(L, 2);
+    return decode_parallel(L, src, (threads > 1) ? (size_t)threads : 1);
+}
+
+// cached_decode keeps the last DECODE_CACHE_SIZE results in the registry, keyed by the source and the options,
+// so that decoding the same string again only costs hashing and comparing it.
+// Errors are kept too, so a bad document is not decoded again either.
+// Results are shared between every caller, so they are handed out as read only proxies, or copied.
+
+#define DECODE_CACHE_SIZE 32
+#define DECODE_CACHE_KEY "TomluaDecodeCache"
+
+// what each cache entry table holds
+#define DECODE_CACHE_SRC 1
+#define DECODE_CACHE_RESULT 2  // false on error
+#define DECODE_CACHE_ERR 3
+#define DECODE_CACHE_PROXIES 4  // each table of the result to its proxy, made as they are first read
+
+typedef struct {
+    uint64_t hash;
+    uint64_t used;  // tick of the last hit, 0 for an empty slot
+    TomluaUserOpts opts;
+} DecodeCacheSlot;
+
+// the userdata at index 0 of the cache table, next to the entry tables at 1 to DECODE_CACHE_SIZE
+typedef struct {
+    uint64_t tick;
+    DecodeCacheSlot slots[DECODE_CACHE_SIZE];
+} DecodeCache;
+
+// 8 bytes at a time. Collisions only cost a comparison, as every hit is checked against the source it was made from
+static uint64_t decode_cache_hash(const char *s, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    uint64_t w = 0;
+    memcpy(&w, s + i, len - i);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+// pushes the cache table of this lua_State, creating it the first time
+static DecodeCache *push_decode_cache(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, DECODE_CACHE_KEY);
+    if (lua_istable(L, -1)) {
+        lua_rawgeti(L, -1, 0);
+        DecodeCache *cache = (DecodeCache *)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return cache;
+    }
+    lua_pop(L, 1);
+    lua_createtable(L, DECODE_CACHE_SIZE, 1);
+    DecodeCache *cache = (DecodeCache *)lua_newuserdata(L, sizeof(DecodeCache));
+    memset(cache, 0, sizeof(DecodeCache));
+    lua_rawseti(L, -2, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, DECODE_CACHE_KEY);
+    return cache;
+}
+
+static int frozen_newindex(lua_State *L) {
+    return luaL_error(L, "attempt to modify a result of tomlua.cached_decode, use { copy = true } for one of your own");
+}
+
+// replaces the TomluaDate at the top of the stack with a new one, as dates can be changed in place.
+// With multi_strings, the same is done for a TomluaMultiStr
+static void replace_with_udata_copy(lua_State *L, bool multi_strings) {
+    if (lua_type(L, -1) != LUA_TUSERDATA) return;
+    if (udata_is_of_type(L, -1, "TomluaDate")) {
+        TomlDate date;
+        memcpy(date, lua_touserdata(L, -1), sizeof(TomlDate));
+        push_new_toml_date(L, date);
+        lua_replace(L, -2);
+    } else if (multi_strings && udata_is_of_type(L, -1, "TomluaMultiStr")) {
+        str_buf *from = (str_buf *)lua_touserdata(L, -1);
+        str_buf *str = (str_buf *)lua_newuserdata(L, sizeof(str_buf));
+        *str = new_buf_from_str(from->data, from->len);
+        if (!str->data) luaL_error(L, "Unable to allocate memory for a copy of a multi-line string");
+        push_multi_string_mt(L);
+        lua_setmetatable(L, -2);
+        lua_replace(L, -2);
+    }
+}
+
+static void push_frozen(lua_State *L, int idx, int proxies_idx);
+
+// replaces the value at the top of the stack with what a proxy hands out for it:
+// the proxy of a table, from the proxies table at upvalue 2, or a new copy of a date
+static void replace_with_frozen(lua_State *L) {
+    if (lua_istable(L, -1)) {
+        push_frozen(L, lua_gettop(L), lua_upvalueindex(2));
+        lua_replace(L, -2);
+    } else {
+        replace_with_udata_copy(L, false);
+    }
+}
+
+// the upvalues of the proxy functions are the view and the proxies table of its cache entry
+static int frozen_index(lua_State *L) {
+    lua_settop(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    replace_with_frozen(L);
+    return 1;
+}
+
+static int frozen_next(lua_State *L) {
+    lua_settop(L, 2);
+    if (lua_next(L, lua_upvalueindex(1))) {
+        replace_with_frozen(L);
+        return 2;
+    }
+    lua_pushnil(L);
+    return 1;
+}
+
+static int frozen_pairs(lua_State *L) {
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_pushcclosure(L, frozen_next, 2);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+static int frozen_len(lua_State *L) {
+    push_frozen_view(L, 1);
+    lua_pushinteger(L, (lua_Integer)lua_arraylen(L, -1));
+    return 1;
+}
+
+// pushes the empty proxy which reads from the table at idx, a table of a cached result, making it the first time.
+// The table itself is the view, and is only in the metatable of the proxy, which __metatable keeps from lua.
+// Tables read through a proxy are handed out as proxies too, and each proxy is kept in the proxies table,
+// so the result is never copied and the same table always gives the same proxy.
+// The view keeps its metatable, so the toml_type of mark_inline is still seen by tomlua.type and encode,
+// and getmetatable gives a proxy of that metatable, to read toml_type from but not to change it
+static void push_frozen(lua_State *L, int idx, int proxies_idx) {
+    luaL_checkstack(L, 8, "cached result nested too deeply");
+    idx = absindex(lua_gettop(L), idx);
+    proxies_idx = absindex(lua_gettop(L), proxies_idx);
+    lua_pushvalue(L, idx);
+    lua_rawget(L, proxies_idx);
+    if (!lua_isnil(L, -1)) return;
+    lua_pop(L, 1);
+    lua_newtable(L);
+    int proxy_idx = lua_gettop(L);
+    lua_pushvalue(L, idx);
+    lua_pushvalue(L, proxy_idx);
+    lua_rawset(L, proxies_idx);
+    lua_createtable(L, 0, 6);
+    int mt_idx = proxy_idx + 1;
+    if (lua_getmetatable(L, idx)) {
+        push_frozen(L, lua_gettop(L), proxies_idx);
+        lua_setfield(L, mt_idx, "__metatable");
+        lua_pop(L, 1);
+    } else {
+        lua_pushboolean(L, false);
+        lua_setfield(L, mt_idx, "__metatable");
+    }
+    lua_pushvalue(L, idx);
+    lua_setfield(L, mt_idx, FROZEN_VIEW_FIELD);
+    lua_pushvalue(L, idx);
+    lua_pushvalue(L, proxies_idx);
+    lua_pushcclosure(L, frozen_index, 2);
+    lua_setfield(L, mt_idx, "__index");
+    lua_pushcfunction(L, frozen_newindex);
+    lua_setfield(L, mt_idx, "__newindex");
+    lua_pushvalue(L, idx);
+    lua_pushvalue(L, proxies_idx);
+    lua_pushcclosure(L, frozen_pairs, 2);
+    lua_setfield(L, mt_idx, "__pairs");
+    lua_pushcfunction(L, frozen_len);
+    lua_setfield(L, mt_idx, "__len");
+    lua_setmetatable(L, proxy_idx);
+    lua_settop(L, proxy_idx);
+}
+
+// pushes a copy of the table at idx and of every table, date and multi-line string in it. Metatables are shared with the original
+static void push_table_copy(lua_State *L, int idx) {
+    luaL_checkstack(L, 6, "cached result nested too deeply");
+    lua_createtable(L, (int)lua_arraylen(L, idx), 0);
+    int copy_idx = lua_gettop(L);
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        if (lua_istable(L, -1)) {
+            push_table_copy(L, lua_gettop(L));
+            lua_replace(L, -2);
+        } else {
+            replace_with_udata_copy(L, true);
+        }
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, copy_idx);
+    }
+    if (lua_getmetatable(L, idx)) lua_setmetatable(L, copy_idx);
+}
+
+// pushes what cached_decode returns for the entry at entry_idx
+static int push_decode_cache_entry(lua_State *L, int entry_idx, bool copy) {
+    lua_rawgeti(L, entry_idx, DECODE_CACHE_RESULT);
+    if (!lua_toboolean(L, -1)) {
+        lua_pushnil(L);
+        lua_rawgeti(L, entry_idx, DECODE_CACHE_ERR);
+        return 2;
+    }
+    if (copy) {
+        push_table_copy(L, lua_gettop(L));
+        return 1;
+    }
+    int result_idx = lua_gettop(L);
+    lua_rawgeti(L, entry_idx, DECODE_CACHE_PROXIES);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, entry_idx, DECODE_CACHE_PROXIES);
+    }
+    push_frozen(L, result_idx, result_idx + 1);
+    return 1;
+}
+
+// tomlua.cached_decode(str, opts?) -> result?, err?
+// opts change the options of this tomlua for this call, and copy = true returns a copy of the result
+int tomlua_cached_decode(lua_State *L) {
+    str_iter src = lua_str_to_iter(L, 1);
+    if (src.buf == NULL) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "tomlua.cached_decode first argument must be a string! tomlua.cached_decode(string, opts?) -> table?, err?");
+        return 2;
+    }
+    lua_settop(L, 2);
+    TomluaUserOpts uopts;
+    toml_user_opts_copy(uopts, *get_opts_upval(L));
+    bool copy = false;
+    if (lua_istable(L, 2)) {
+        // only the options that are given are changed, so { copy = true } keeps the rest
+        for (int i = 0; i < TOMLOPTS_LENGTH; i++) {
+            lua_getfield(L, 2, toml_opts_names[i]);
+            if (!lua_isnil(L, -1) && !opts_set(L, uopts, i, -1)) {
+                lua_settop(L, 0);
+                lua_pushnil(L);
+                lua_pushfstring(L, "invalid value for option '%s'", toml_opts_names[i]);
+                return 2;
+            }
+            lua_pop(L, 1);
+        }
+        lua_getfield(L, 2, "copy");
+        copy = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+    DecodeCache *cache = push_decode_cache(L);
+    int cache_idx = lua_gettop(L);
+    uint64_t hash = decode_cache_hash(src.buf, src.len);
+    size_t oldest = 0;
+    for (size_t i = 0; i < DECODE_CACHE_SIZE; i++) {
+        DecodeCacheSlot *slot = &cache->slots[i];
+        if (slot->used < cache->slots[oldest].used) oldest = i;
+        if (slot->used == 0 || slot->hash != hash || memcmp(slot->opts, uopts, sizeof(TomluaUserOpts)) != 0) continue;
+        lua_rawgeti(L, cache_idx, (lua_Integer)i + 1);
+        lua_rawgeti(L, -1, DECODE_CACHE_SRC);
+        bool same = lua_rawequal(L, -1, 1);
+        lua_pop(L, 1);
+        if (same) {
+            slot->used = ++cache->tick;
+            return push_decode_cache_entry(L, lua_gettop(L), copy);
+        }
+        lua_pop(L, 1);
+    }
+    lua_settop(L, 1);  // decode_document takes whatever is at 2 as the defaults
+    int nres = decode_document(L, src, 0, uopts, NULL);
+    int res_idx = lua_gettop(L) - nres + 1;
+    push_decode_cache(L);
+    cache_idx = lua_gettop(L);
+    lua_createtable(L, 4, 0);
+    int entry_idx = lua_gettop(L);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, entry_idx, DECODE_CACHE_SRC);
+    if (nres == 1) {
+        lua_pushvalue(L, res_idx);
+        lua_rawseti(L, entry_idx, DECODE_CACHE_RESULT);
+    } else {
+        lua_pushboolean(L, false);
+        lua_rawseti(L, entry_idx, DECODE_CACHE_RESULT);
+        lua_pushvalue(L, res_idx + 1);
+        lua_rawseti(L, entry_idx, DECODE_CACHE_ERR);
+    }
+    lua_pushvalue(L, entry_idx);
+    lua_rawseti(L, cache_idx, (lua_Integer)oldest + 1);
+    DecodeCacheSlot *slot = &cache->slots[oldest];
+    slot->hash = hash;
+    slot->used = ++cache->tick;
+    toml_user_opts_copy(slot->opts, uopts);
+    return push_decode_cache_entry(L, entry_idx, copy);
+}
+
+// decode_lazy only finds where each top level key is defined, and decodes them the first time they are read.
+// Every statement belongs to the top level key it starts with: a heading and everything under it,
+// or a key = value before the first heading. Nothing outside of those can conflict with that key,
+// so decoding only those statements, in order, gives the same value and the same errors as decode does.
+
+typedef struct {
+    size_t start;
+    size_t end;
+    size_t next;  // the next segment of the same top level key, or SIZE_MAX
+    size_t last;  // only kept up to date on the first segment of each key
+} LazySegment;
+
+typedef struct {
+    LazySegment *segs;
+    size_t len;
+    size_t cap;
+} LazyDoc;
+
+static int lazy_doc_gc(lua_State *L) {
+    LazyDoc *doc = (LazyDoc *)lua_touserdata(L, 1);
+    free(doc->segs);
+    *doc = (LazyDoc){0};
+    return 0;
+}
+
+// adds a segment for the top level key at key_idx, to the table of first segments at index_idx
+static bool lazy_add_segment(lua_State *L, LazyDoc *doc, int index_idx, int key_idx, size_t start, size_t end) {
+    if (doc->len >= doc->cap) {
+        size_t new_cap = (doc->cap > 0) ? doc->cap * 2 : 16;
+        LazySegment *tmp = (LazySegment *)realloc(doc->segs, new_cap * sizeof(LazySegment));
+        if (!tmp) return false;
+        doc->segs = tmp;
+        doc->cap = new_cap;
+    }
+    size_t seg = doc->len++;
+    doc->segs[seg] = (LazySegment){ .start = start, .end = end, .next = SIZE_MAX, .last = seg };
+    lua_pushvalue(L, key_idx);
+    lua_rawget(L, index_idx);
+    if (lua_isnil(L, -1)) {
+        lua_pushvalue(L, key_idx);
+        lua_pushinteger(L, (lua_Integer)seg);
+        lua_rawset(L, index_idx);
+    } else {
+        size_t first = (size_t)lua_tointeger(L, -1);
+        doc->segs[doc->segs[first].last].next = seg;
+        doc->segs[first].last = seg;
+    }
+    lua_pop(L, 1);
+    return true;
+}
+
+// (source, result, nil, doc, first segment, opts) -> result
+// decodes the segments of 1 top level key into result, or raises the same error decode would have returned
+static int lazy_decode_segments(lua_State *L) {
+    LazyDoc *doc = (LazyDoc *)lua_touserdata(L, 4);
+    size_t seg = (size_t)lua_tointeger(L, 5);
+    TomluaUserOpts uopts;
+    toml_user_opts_copy(uopts, *(TomluaUserOpts *)lua_touserdata(L, 6));
+    lua_settop(L, DECODE_ERR_IDX);
+    str_iter src = lua_str_to_iter(L, 1);
+    size_t doc_len = src.len;
+    // hints are recorded for whole documents, so the segments go without them
+    SizeHints sizes = {0};
+    str_buf scratch = new_str_buf();
+    if (scratch.data == NULL) return luaL_error(L, "Unable to allocate memory for scratch buffer");
+    DefTracker defs = new_def_tracker();
+    if (defs.tables == NULL) {
+        free_str_buf(&scratch);
+        return luaL_error(L, "Unable to allocate memory for definition tracker");
+    }
+    for (; seg != SIZE_MAX; seg = doc->segs[seg].next) {
+        src.pos = doc->segs[seg].start;
+        src.len = doc->segs[seg].end;
+        lua_pushvalue(L, DECODE_RESULT_IDX);
+        if (!decode_statements(L, &defs, &sizes, &src, &scratch, uopts, false, NULL)) {
+            free_str_buf(&scratch);
+            free_def_tracker(&defs);
+            lua_settop(L, DECODE_ERR_IDX);
+            src.len = doc_len;
+            src.pos = (src.pos >= src.len) ? src.len - 1 : src.pos;
+            tmlerr_push_ctx_from_iter(get_err_val(L, DECODE_ERR_IDX), 7, &src);
+            push_tmlerr_string(L, get_err_val(L, DECODE_ERR_IDX));
+            return lua_error(L);
+        }
+        lua_settop(L, DECODE_ERR_IDX);
+    }
+    free_str_buf(&scratch);
+    free_def_tracker(&defs);
+    lua_settop(L, DECODE_RESULT_IDX);
+    return 1;
+}
+
+// upvalues of __index and __pairs: opts, source, table of first segments of the keys not yet read, doc
+// decodes the pending key at key_idx, stores it in the proxy at proxy_idx, and pushes its value
+static void lazy_materialize(lua_State *L, int proxy_idx, int key_idx, size_t first) {
+    lua_pushcfunction(L, lazy_decode_segments);
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_newtable(L);
+    lua_pushnil(L);
+    lua_pushvalue(L, lua_upvalueindex(4));
+    lua_pushinteger(L, (lua_Integer)first);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_call(L, 6, 1);
+    lua_pushvalue(L, key_idx);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+    lua_pushvalue(L, key_idx);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, proxy_idx);
+    lua_pushvalue(L, key_idx);
+    lua_pushnil(L);
+    lua_rawset(L, lua_upvalueindex(3));
+}
+
+static int lazy_index(lua_State *L) {
+    lua_settop(L, 2);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(3));
+    // not in the document, keys already read are found before __index is ever called
+    if (lua_isnil(L, -1)) return 1;
+    size_t first = (size_t)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lazy_materialize(L, 1, 2, first);
+    return 1;
+}
+
+static int lazy_next(lua_State *L) {
+    lua_settop(L, 2);
+    if (lua_next(L, 1)) return 2;
+    lua_pushnil(L);
+    return 1;
+}
+
+// reads every key that is left, then iterates the proxy like a normal table
+static int lazy_pairs(lua_State *L) {
+    lua_settop(L, 1);
+    lua_pushnil(L);
+    while (lua_next(L, lua_upvalueindex(3)) != 0) {
+        size_t first = (size_t)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, 1);
+        bool assigned = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (assigned) {
+            // the user replaced it before it was ever read
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, lua_upvalueindex(3));
+        } else {
+            lazy_materialize(L, 1, lua_gettop(L), first);
+            lua_pop(L, 1);
+        }
+    }
+    lua_pushcfunction(L, lazy_next);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+int tomlua_decode_lazy(lua_State *L) {
+    str_iter src = lua_str_to_iter(L, 1);
+    if (src.buf == NULL) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "tomlua.decode_lazy first argument must be a string! tomlua.decode_lazy(string) -> table?, err?");
+        return 2;
+    }
+    lua_settop(L, 1);
+    // DECODE_RESULT_IDX, the first segment of each top level key
+    lua_newtable(L);
+    // DECODE_ERR_IDX
+    lua_pushnil(L);
+    TomluaUserOpts *uopts = (TomluaUserOpts *)lua_newuserdata(L, sizeof(TomluaUserOpts));
+    toml_user_opts_copy(*uopts, *get_opts_upval(L));
+    const bool int_keys = (*uopts)[TOMLOPTS_INT_KEYS];
+    int opts_idx = lua_gettop(L);
+    LazyDoc *doc = (LazyDoc *)lua_newuserdata(L, sizeof(LazyDoc));
+    *doc = (LazyDoc){0};
+    if (luaL_newmetatable(L, "TomluaLazyDoc")) {
+        lua_pushcfunction(L, lazy_doc_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    int doc_idx = lua_gettop(L);
+    str_buf scratch = new_str_buf();
+    if (scratch.data == NULL) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "Unable to allocate memory for scratch buffer");
+        return 2;
+    }
+    int key_idx = doc_idx + 1;
+    // the heading whose statements are being skipped, or SIZE_MAX before the first heading
+    size_t open = SIZE_MAX;
+    while (iter_peek(&src).ok) {
+        {
+            int end_line = consume_whitespace_to_line(&src);
+            while (end_line == 1) end_line = consume_whitespace_to_line(&src);
+            if (end_line == 2) break;
+        }
+        size_t start = src.pos;
+        bool heading = iter_peek(&src).v == '[';
+        if (!heading && open != SIZE_MAX) {
+            src.pos = prescan_skip_statement(src.buf, src.len, src.pos);
+            continue;
+        }
+        if (open != SIZE_MAX) doc->segs[open].end = start;
+        bool array = heading && iter_starts_with(&src, "[[", 2);
+        if (heading) iter_skip_n(&src, array ? 2 : 1);
+        // only the first key is needed, but parsing all of them, and what ends them, gives the same errors as decode
+        if (!parse_keys(L, &src, &scratch, int_keys, DECODE_ERR_IDX)) goto fail;
+        size_t end;
+        if (array) {
+            if (!iter_starts_with(&src, "]]", 2)) {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
+                set_tmlerr(err, false, 14, "array heading ");
+                err_push_keys(L, err, key_idx, lua_gettop(L));
+                tmlerr_push_str(err, " must end with ]]", 17);
+                goto fail;
+            }
+            iter_skip_n(&src, 2);
+            if (!consume_whitespace_to_line(&src)) {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
+                set_tmlerr(err, false, 8, "array [[");
+                err_push_keys(L, err, key_idx, lua_gettop(L));
+                tmlerr_push_str(err, "]] must have a new line before new values", 41);
+                goto fail;
+            }
+            end = src.pos;
+        } else if (heading) {
+            if (iter_peek(&src).v != ']') {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
+                set_tmlerr(err, false, 14, "table heading ");
+                err_push_keys(L, err, key_idx, lua_gettop(L));
+                tmlerr_push_str(err, " must end with ]", 16);
+                goto fail;
+            }
+            iter_skip(&src);
+            if (!consume_whitespace_to_line(&src)) {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
+                set_tmlerr(err, false, 7, "table [");
+                err_push_keys(L, err, key_idx, lua_gettop(L));
+                tmlerr_push_str(err, "] must have a new line before new values", 40);
+                goto fail;
+            }
+            end = src.pos;
+        } else {
+            if (iter_peek(&src).v != '=') {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
+                set_tmlerr(err, false, 20, "keys for assignment ");
+                err_push_keys(L, err, key_idx, lua_gettop(L));
+                tmlerr_push_str(err, " must end with =", 16);
+                goto fail;
+            }
+            iter_skip(&src);
+            if (consume_whitespace_to_line(&src)) {
+                TMLErr *err = new_tmlerr(L, DECODE_ERR_IDX);
+                set_tmlerr(err, false, 86, "the value in key = value expressions must begin on the same line as the key! Key was: ");
+                err_push_keys(L, err, key_idx, lua_gettop(L));
+                goto fail;
+            }
+            end = prescan_skip_statement(src.buf, src.len, src.pos);
+        }
+        lua_settop(L, key_idx);
+        if (!lazy_add_segment(L, doc, DECODE_RESULT_IDX, key_idx, start, end)) {
+            set_tmlerr(new_tmlerr(L, DECODE_ERR_IDX), false, 3, "OOM");
+            goto fail;
+        }
+        lua_settop(L, doc_idx);
+        open = (heading) ? doc->len - 1 : SIZE_MAX;
+        src.pos = end;
+    }
+    if (open != SIZE_MAX) doc->segs[open].end = src.len;
+    free_str_buf(&scratch);
+
+    lua_newtable(L);  // the proxy
+    lua_createtable(L, 0, 2);
+    lua_pushvalue(L, opts_idx);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, DECODE_RESULT_IDX);
+    lua_pushvalue(L, doc_idx);
+    lua_pushcclosure(L, lazy_index, 4);
+    lua_setfield(L, -2, "__index");
+    lua_pushvalue(L, opts_idx);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, DECODE_RESULT_IDX);
+    lua_pushvalue(L, doc_idx);
+    lua_pushcclosure(L, lazy_pairs, 4);
+    lua_setfield(L, -2, "__pairs");
+    lua_setmetatable(L, -2);
+    return 1;
+
+fail:
+    lua_settop(L, DECODE_ERR_IDX);
+    free_str_buf(&scratch);
+    src.pos = (src.pos >= src.len) ? src.len - 1 : src.pos;
+    tmlerr_push_ctx_from_iter(get_err_val(L, DECODE_ERR_IDX), 7, &src);
+    lua_pushnil(L);
+    push_tmlerr_string(L, get_err_val(L, DECODE_ERR_IDX));
+    return 2;
+}
+
+// tomlua.decoder keeps everything fed to it after the last complete statement,
+// and decodes the rest right away into the result, so only 1 statement needs to be held in memory at a time.
+
+typedef struct {
+    TomluaUserOpts opts;
+    DefTracker defs;
+    str_buf carry;  // the statement that has not been fed all of yet
+    str_buf scratch;
+    size_t scan_pos;  // how much of carry has been checked for the end of a statement
+    size_t scan_depth;  // arrays and inline tables open at scan_pos
+    bool had_defaults;
+    bool finished;
+} TomluaDecoder;
+
+// the second upvalue of the decoder methods, which holds what they need to keep on the lua side
+enum {
+    DECODER_RESULT = 1,
+    DECODER_LOCATION,  // the table that key = value statements currently go into
+    DECODER_READER,
+    DECODER_ERR,  // the error message, once there was one
+};
+
+static void free_decoder(TomluaDecoder *dec) {
+    free_def_tracker(&dec->defs);
+    free_str_buf(&dec->carry);
+    free_str_buf(&dec->scratch);
+}
+
+static int decoder_gc(lua_State *L) {
+    free_decoder((TomluaDecoder *)lua_touserdata(L, 1));
+    return 0;
+}
+
+// stores the error string at the top of the stack, so that it is returned again from every later call
+static int decoder_fail(lua_State *L, TomluaDecoder *dec) {
+    free_decoder(dec);
+    dec->finished = true;
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, lua_upvalueindex(2), DECODER_ERR);
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
+}
+
+// decodes every complete statement in the carry buffer, or everything in it if at_end
+// returns 0 on success, or 2 with nil and the error pushed
+static int decoder_run(lua_State *L, TomluaDecoder *dec, bool at_end) {
+    size_t end = (at_end) ? dec->carry.len
+        : prescan_statements_end(dec->carry.data, dec->carry.len, &dec->scan_pos, &dec->scan_depth);
+    if (end == 0) return 0;
+    lua_settop(L, 0);
+    // there is no source string here, and decode_statements does not need one
+    lua_pushnil(L);
+    lua_rawgeti(L, lua_upvalueindex(2), DECODER_RESULT);
+    lua_pushnil(L);
+    lua_rawgeti(L, lua_upvalueindex(2), DECODER_LOCATION);
+    str_iter src = { .len = end, .pos = 0, .buf = dec->carry.data };
+    SizeHints sizes = {0};
+    STATS_ADD(STATS_DECODE_BYTES, src.len);
+    STATS_TIMER(prescan_start);
+    prescan_sizes(src.buf, src.len, &sizes);
+    STATS_ADD_TIME(STATS_PRESCAN_NS, prescan_start);
+    STATS_TIMER(decode_start);
+    bool ok = decode_statements(L, &dec->defs, &sizes, &src, &dec->scratch, dec->opts, dec->had_defaults, NULL);
+    STATS_ADD_TIME(STATS_DECODE_NS, decode_start);
+    free_size_hints(&sizes);
+    if (!ok) {
+        lua_settop(L, DECODE_ERR_IDX);
+        src.pos = (src.pos >= src.len) ? src.len - 1 : src.pos;
+        tmlerr_push_ctx_from_iter(get_err_val(L, DECODE_ERR_IDX), 7, &src);
+        push_tmlerr_string(L, get_err_val(L, DECODE_ERR_IDX));
+        return decoder_fail(L, dec);
+    }
+    lua_settop(L, DECODE_ERR_IDX + 1);
+    lua_rawseti(L, lua_upvalueindex(2), DECODER_LOCATION);
+    memmove(dec->carry.data, dec->carry.data + end, dec->carry.len - end);
+    dec->carry.len -= end;
+    dec->scan_pos = (at_end) ? 0 : dec->scan_pos - end;
+    if (at_end) dec->scan_depth = 0;
+    return 0;
+}
+
+// returns 0 if the decoder can still be fed, or 2 with nil and the reason pushed
+static int decoder_check(lua_State *L, TomluaDecoder *dec) {
+    if (!dec->finished) return 0;
+    lua_pushnil(L);
+    lua_rawgeti(L, lua_upvalueindex(2), DECODER_ERR);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushliteral(L, "decoder has already finished");
+    }
+    return 2;
+}
+
+static int decoder_push_chunk(lua_State *L, TomluaDecoder *dec, const char *chunk, size_t len) {
+    if (!buf_push_str(&dec->carry, chunk, len)) {
+        lua_pushliteral(L, "Unable to allocate memory for decoder input");
+        return decoder_fail(L, dec);
+    }
+    return decoder_run(L, dec, false);
+}
+
+// decoder:feed(chunk) -> true?, err?
+static int decoder_feed(lua_State *L) {
+    TomluaDecoder *dec = (TomluaDecoder *)lua_touserdata(L, lua_upvalueindex(1));
+    int res = decoder_check(L, dec);
+    if (res) return res;
+    size_t len = 0;
+    const char *chunk = lua_tolstring(L, 2, &len);
+    if (chunk == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "decoder:feed argument must be a string! decoder:feed(string) -> true?, err?");
+        return 2;
+    }
+    res = decoder_push_chunk(L, dec, chunk, len);
+    if (res) return res;
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// decoder:finish() -> table?, err?
+// reads everything from the reader first if it has one
+static int decoder_finish(lua_State *L) {
+    TomluaDecoder *dec = (TomluaDecoder *)lua_touserdata(L, lua_upvalueindex(1));
+    int res = decoder_check(L, dec);
+    if (res) return res;
+    lua_settop(L, 0);
+    lua_rawgeti(L, lua_upvalueindex(2), DECODER_READER);
+    if (!lua_isnil(L, 1)) {
+        while (true) {
+            lua_settop(L, 1);
+            lua_pushvalue(L, 1);
+            lua_call(L, 0, 1);
+            size_t len = 0;
+            const char *chunk = lua_tolstring(L, 2, &len);
+            if (chunk == NULL || len == 0) break;
+            res = decoder_push_chunk(L, dec, chunk, len);
+            if (res) return res;
+            lua_rawgeti(L, lua_upvalueindex(2), DECODER_READER);
+            lua_replace(L, 1);
+        }
+    }
+    res = decoder_run(L, dec, true);
+    if (res) return res;
+    free_decoder(dec);
+    dec->finished = true;
+    lua_rawgeti(L, lua_upvalueindex(2), DECODER_RESULT);
+    return 1;
+}
+
+// tomlua.decoder(opts?, defaults?) or tomlua.decoder_from(reader, opts?, defaults?)
+static int new_decoder(lua_State *L, int reader_idx) {
+    int opts_idx = reader_idx + 1;
+    int defaults_idx = reader_idx + 2;
+    if (reader_idx > 0 && lua_type(L, reader_idx) != LUA_TFUNCTION) {
+        return luaL_error(L, "tomlua.decoder_from first argument must be a function returning the next string, or nil at the end");
+    }
+    lua_settop(L, defaults_idx);
+    TomluaDecoder *dec = (TomluaDecoder *)lua_newuserdata(L, sizeof(TomluaDecoder));
+    *dec = (TomluaDecoder){0};
+    if (luaL_newmetatable(L, "TomluaDecoder")) {
+        lua_pushcfunction(L, decoder_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    int dec_idx = lua_gettop(L);
+    if (lua_istable(L, opts_idx)) {
+        opts_parse(L, dec->opts, opts_idx);
+    } else {
+        toml_user_opts_copy(dec->opts, *get_opts_upval(L));
+    }
+    dec->carry = new_str_buf();
+    dec->scratch = new_str_buf();
+    dec->defs = new_def_tracker();
+    if (dec->carry.data == NULL || dec->scratch.data == NULL || dec->defs.tables == NULL) {
+        free_decoder(dec);
+        return luaL_error(L, "Unable to allocate memory for decoder");
+    }
+    lua_createtable(L, 4, 0);
+    if (lua_istable(L, defaults_idx)) {
+        dec->had_defaults = true;
+        lua_pushvalue(L, defaults_idx);
+    } else {
+        lua_newtable(L);
+    }
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, DECODER_RESULT);
+    lua_rawseti(L, -2, DECODER_LOCATION);
+    if (reader_idx > 0) {
+        lua_pushvalue(L, reader_idx);
+        lua_rawseti(L, -2, DECODER_READER);
+    }
+    int refs_idx = lua_gettop(L);
+    lua_createtable(L, 0, 2);
+    lua_pushvalue(L, dec_idx);
+    lua_pushvalue(L, refs_idx);
+    lua_pushcclosure(L, decoder_feed, 2);
+    lua_setfield(L, -2, "feed");
+    lua_pushvalue(L, dec_idx);
+    lua_pushvalue(L, refs_idx);
+    lua_pushcclosure(L, decoder_finish, 2);
+    lua_setfield(L, -2, "finish");
+    return 1;
+}
+
+int tomlua_decoder(lua_State *L) {
+    return new_decoder(L, 0);
+}
+
+int tomlua_decoder_from(lua_State *L) {
+    return new_decoder(L, 1);
+}
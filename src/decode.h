@@ -3,7 +3,43 @@
 #define SRC_DECODE_H_
 
 #include <lua.h>
+#include <stddef.h>
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+#include "./opts.h"
 
 int tomlua_decode(lua_State *L);
+int tomlua_decode_file(lua_State *L);
+int tomlua_decode_parallel(lua_State *L);
+int tomlua_cached_decode(lua_State *L);
+int tomlua_decode_lazy(lua_State *L);
+int tomlua_decoder(lua_State *L);
+int tomlua_decoder_from(lua_State *L);
+
+// the buffers of a decode, kept by tomlua.context from one call to the next
+typedef struct DecodeArena DecodeArena;
+DecodeArena *new_decode_arena(void);
+void free_decode_arena(DecodeArena *arena);
+// empties arena, freeing anything in it that is bigger than keep bytes
+void decode_arena_trim(DecodeArena *arena, size_t keep);
+// tomlua.decode with the buffers of arena, for the arguments of decode at 1, 2 and 3
+int decode_in_arena(lua_State *L, const TomluaUserOpts opts, DecodeArena *arena);
+
+// the field of the metatable of a cached_decode proxy that holds the table it reads from
+#define FROZEN_VIEW_FIELD "__tomlua_view"
+
+// if the value at idx is a read only result of cached_decode, pushes the table it reads from and returns true
+static inline bool push_frozen_view(lua_State *L, int idx) {
+    if (!lua_getmetatable(L, idx)) return false;
+    lua_pushliteral(L, FROZEN_VIEW_FIELD);
+    lua_rawget(L, -2);
+    if (lua_istable(L, -1)) {
+        lua_replace(L, -2);
+        return true;
+    }
+    lua_pop(L, 2);
+    return false;
+}
 
 #endif  // SRC_DECODE_H_
@@ -0,0 +1,217 @@
+// Copyright 2025 Birdee
+#ifndef SRC_DECODE_DEFS_H_
+#define SRC_DECODE_DEFS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <lua.h>
+#include "./types.h"
+
+// Records what tomlua_decode has already defined, so that it can report duplicate keys and redefinitions.
+// Lives entirely in C, and is freed in one go at the end of a decode.
+//
+// Tables are identified by lua_topointer.
+// Every table that gets an entry is reachable from the result through a key which is also recorded here,
+// and recorded keys are never overwritten, so an address cannot be reused by a new table mid-decode.
+
+typedef enum {
+    DEFS_UNSEEN,  // nothing recorded yet
+    DEFS_TABLE,  // keys set in this table are recorded
+    DEFS_ARRAY,  // [[array]] heading, len is the index of the current entry
+    DEFS_INLINE_TABLE,  // closed, nothing more may be added to it
+    DEFS_INLINE_ARRAY,  // closed, nothing more may be added to it
+} DefsState;
+
+// set when a table was created by a [heading] or a dotted key, and so cannot be defined by a heading again
+#define DEFS_FLAG_EXPLICIT 0x01
+
+typedef struct {
+    const void *tbl;  // NULL for an empty slot
+    lua_Integer len;
+    uint8_t state;
+    uint8_t flags;
+} DefsTable;
+
+typedef struct {
+    const void *tbl;  // NULL for an empty slot
+    uint64_t hash;
+    size_t off;  // offset of the key bytes in DefTracker.arena
+    size_t len;
+} DefsKey;
+
+typedef struct {
+    DefsTable *tables;
+    size_t tables_len;
+    size_t tables_cap;  // always a power of 2
+    DefsKey *keys;
+    size_t keys_len;
+    size_t keys_cap;  // always a power of 2
+    // one type tag byte followed by the key bytes, for each recorded key
+    str_buf arena;
+} DefTracker;
+
+static inline void free_def_tracker(DefTracker *defs) {
+    if (defs) {
+        free(defs->tables);
+        free(defs->keys);
+        free_str_buf(&defs->arena);
+        *defs = (DefTracker){0};
+    }
+}
+
+static inline DefTracker new_def_tracker() {
+    DefTracker defs = {
+        .tables_cap = 16,
+        .tables = (DefsTable *)calloc(16, sizeof(DefsTable)),
+        .keys_cap = 64,
+        .keys = (DefsKey *)calloc(64, sizeof(DefsKey)),
+        .arena = new_str_buf(),
+    };
+    if (!defs.tables || !defs.keys || !defs.arena.data) free_def_tracker(&defs);
+    return defs;
+}
+
+// forgets everything recorded, but keeps the memory for the next decode
+static inline void reset_def_tracker(DefTracker *defs) {
+    memset(defs->tables, 0, defs->tables_cap * sizeof(DefsTable));
+    defs->tables_len = 0;
+    memset(defs->keys, 0, defs->keys_cap * sizeof(DefsKey));
+    defs->keys_len = 0;
+    defs->arena.len = 0;
+}
+
+static inline uint64_t defs_hash_ptr(const void *p) {
+    uint64_t h = (uint64_t)(uintptr_t)p;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// FNV-1a
+static inline uint64_t defs_hash_bytes(uint64_t h, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static inline DefsTable *defs_find_table_slot(DefsTable *tables, size_t cap, const void *tbl) {
+    size_t mask = cap - 1;
+    size_t i = defs_hash_ptr(tbl) & mask;
+    while (tables[i].tbl != NULL && tables[i].tbl != tbl) i = (i + 1) & mask;
+    return &tables[i];
+}
+
+// returns NULL if nothing has been recorded for tbl
+static inline DefsTable *defs_get(DefTracker *defs, const void *tbl) {
+    STATS_INC(STATS_DEFS_LOOKUPS);
+    DefsTable *slot = defs_find_table_slot(defs->tables, defs->tables_cap, tbl);
+    return (slot->tbl == NULL) ? NULL : slot;
+}
+
+// returns NULL on OOM. The result is only valid until the next call to defs_get_or_add
+static DefsTable *defs_get_or_add(DefTracker *defs, const void *tbl) {
+    STATS_INC(STATS_DEFS_LOOKUPS);
+    DefsTable *slot = defs_find_table_slot(defs->tables, defs->tables_cap, tbl);
+    if (slot->tbl != NULL) return slot;
+    if ((defs->tables_len + 1) * 2 > defs->tables_cap) {
+        size_t new_cap = defs->tables_cap * 2;
+        DefsTable *tmp = (DefsTable *)calloc(new_cap, sizeof(DefsTable));
+        if (!tmp) return NULL;
+        for (size_t i = 0; i < defs->tables_cap; i++) {
+            if (defs->tables[i].tbl != NULL) {
+                *defs_find_table_slot(tmp, new_cap, defs->tables[i].tbl) = defs->tables[i];
+            }
+        }
+        free(defs->tables);
+        defs->tables = tmp;
+        defs->tables_cap = new_cap;
+        slot = defs_find_table_slot(defs->tables, defs->tables_cap, tbl);
+    }
+    defs->tables_len++;
+    *slot = (DefsTable){ .tbl = tbl, .len = 0, .state = DEFS_UNSEEN, .flags = 0 };
+    return slot;
+}
+
+// key bytes as recorded: a type tag and then the string, or the number for int_keys
+// returns the length written to out, which must hold at least 1 + sizeof(lua_Number) bytes,
+// or writes nothing and returns the string length to be read from *str
+static inline size_t defs_key_bytes(lua_State *L, int idx, char *out, const char **str) {
+    if (lua_type(L, idx) == LUA_TNUMBER) {
+        lua_Number n = lua_tonumber(L, idx);
+        if (n == 0) n = 0;  // -0 and 0 are the same key
+        out[0] = 'n';
+        memcpy(out + 1, &n, sizeof(lua_Number));
+        *str = NULL;
+        return 1 + sizeof(lua_Number);
+    }
+    size_t len = 0;
+    *str = lua_tolstring(L, idx, &len);
+    return len;
+}
+
+// records key at idx as set in tbl
+// returns 1 if it was newly recorded, 0 if it already was, and -1 on OOM
+static int defs_mark_key(DefTracker *defs, lua_State *L, const void *tbl, int idx) {
+    STATS_INC(STATS_DEFS_LOOKUPS);
+    char numkey[1 + sizeof(lua_Number)];
+    const char *str = NULL;
+    size_t len = defs_key_bytes(L, idx, numkey, &str);
+    // strings are stored behind an 's' tag, so hash and compare them that way too
+    uint64_t hash = 0xcbf29ce484222325ULL ^ defs_hash_ptr(tbl);
+    if (str == NULL) {
+        hash = defs_hash_bytes(hash, numkey, len);
+    } else {
+        hash = defs_hash_bytes(defs_hash_bytes(hash, "s", 1), str, len);
+        len++;
+    }
+    size_t mask = defs->keys_cap - 1;
+    size_t i = hash & mask;
+    while (defs->keys[i].tbl != NULL) {
+        DefsKey *k = &defs->keys[i];
+        if (k->hash == hash && k->tbl == tbl && k->len == len) {
+            const char *stored = defs->arena.data + k->off;
+            if (str == NULL) {
+                if (memcmp(stored, numkey, len) == 0) return 0;
+            } else if (stored[0] == 's' && memcmp(stored + 1, str, len - 1) == 0) {
+                return 0;
+            }
+        }
+        i = (i + 1) & mask;
+    }
+    if ((defs->keys_len + 1) * 2 > defs->keys_cap) {
+        size_t new_cap = defs->keys_cap * 2;
+        DefsKey *tmp = (DefsKey *)calloc(new_cap, sizeof(DefsKey));
+        if (!tmp) return -1;
+        size_t new_mask = new_cap - 1;
+        for (size_t j = 0; j < defs->keys_cap; j++) {
+            if (defs->keys[j].tbl != NULL) {
+                size_t s = defs->keys[j].hash & new_mask;
+                while (tmp[s].tbl != NULL) s = (s + 1) & new_mask;
+                tmp[s] = defs->keys[j];
+            }
+        }
+        free(defs->keys);
+        defs->keys = tmp;
+        defs->keys_cap = new_cap;
+        mask = new_mask;
+        i = hash & mask;
+        while (defs->keys[i].tbl != NULL) i = (i + 1) & mask;
+    }
+    size_t off = defs->arena.len;
+    if (str == NULL) {
+        if (!buf_push_str(&defs->arena, numkey, len)) return -1;
+    } else {
+        if (!buf_push(&defs->arena, 's')) return -1;
+        if (len > 1 && !buf_push_str(&defs->arena, str, len - 1)) return -1;
+    }
+    defs->keys[i] = (DefsKey){ .tbl = tbl, .hash = hash, .off = off, .len = len };
+    defs->keys_len++;
+    return 1;
+}
+
+#endif  // SRC_DECODE_DEFS_H_
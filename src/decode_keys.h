@@ -16,33 +16,45 @@ static inline bool parse_key(lua_State *L, str_iter *src, str_buf *buf, bool int
     }
     char c = current.v;
     bool non_string = false;
+    // keys are pushed straight from src unless they contain escapes
+    const char *start = src->buf + src->pos;
+    size_t len = 0;
     if (c == '"') {
         iter_skip(src);
-        if (!parse_basic_string(L, buf, src, erridx)) return false;
+        start++;
+        if (!iter_plain_string(src, '"', false, '\\', '\n', '\r', &len)) {
+            if (!iter_push_run(buf, src, len)) {
+                set_tmlerr(new_tmlerr(L, erridx), false, 3, "OOM");
+                return false;
+            }
+            if (!parse_basic_string(L, buf, src, erridx)) return false;
+            start = buf->data;
+            len = buf->len;
+        }
     } else if (c == '\'') {
         iter_skip(src);
-        if (!parse_literal_string(L, buf, src, erridx)) return false;
-    } else if (is_identifier_char(c)) {
-        non_string = true;
-        current = iter_peek(src);
-        while (is_identifier_char(current.v)) {
-            if (!buf_push(buf, current.v)) {
+        start++;
+        if (!iter_plain_string(src, '\'', false, '\n', '\r', '\'', &len)) {
+            if (!iter_push_run(buf, src, len)) {
                 set_tmlerr(new_tmlerr(L, erridx), false, 3, "OOM");
                 return false;
             }
-            iter_skip(src);
-            current = iter_peek(src);
+            if (!parse_literal_string(L, buf, src, erridx)) return false;
+            start = buf->data;
+            len = buf->len;
         }
+    } else if (is_identifier_char(c)) {
+        non_string = true;
+        while (src->pos < src->len && is_identifier_char(src->buf[src->pos])) src->pos++;
+        len = (size_t)(src->buf + src->pos - start);
     } else {
         TMLErr *err = new_tmlerr(L, erridx);
         set_tmlerr(err, false, 42, "called parse_key with invalid first char: ");
         tmlerr_push(err, c);
         return false;
     }
-    if (!push_buf_to_lua_string(L, buf)) {
-        set_tmlerr(new_tmlerr(L, erridx), false, 3, "OOM");
-        return false;
-    }
+    lua_pushlstring(L, start, len);
+    STATS_INC(STATS_DECODE_KEYS);
     if (int_keys && non_string && lua_isnumber(L, -1)) {
         lua_Number n = lua_tonumber(L, -1);
         if (n == (lua_Number)(lua_Integer)n) {
@@ -57,6 +69,11 @@ static int parse_keys(lua_State *L, str_iter *src, str_buf *buf, bool int_keys,
     int i = 0;
     while (iter_peek(src).ok) {
         i++;
+        // every key stays on the stack until the heading or assignment using it is resolved
+        if (!lua_checkstack(L, 4)) {
+            set_tmlerr(new_tmlerr(L, erridx), false, 23, "too many keys in a path");
+            return false;
+        }
         if (consume_whitespace_to_line(src)) {
             set_tmlerr(new_tmlerr(L, erridx), false, 33, "newlines not allowed between keys");
             return false;
@@ -87,4 +104,25 @@ static int parse_keys(lua_State *L, str_iter *src, str_buf *buf, bool int_keys,
     return i;
 }
 
+// parses a path of keys separated by . and nothing else, like "a.'b.c'.d", which points into a document from outside of it
+// returns the number of keys pushed, or 0 with the error at erridx
+static int parse_key_path(lua_State *L, str_iter *src, str_buf *buf, bool int_keys, int erridx) {
+    int i = 0;
+    while (true) {
+        if (!lua_checkstack(L, 4)) {
+            set_tmlerr(new_tmlerr(L, erridx), false, 23, "too many keys in a path");
+            return 0;
+        }
+        if (!parse_key(L, src, buf, int_keys, erridx)) return 0;
+        i++;
+        iter_result next = iter_peek(src);
+        if (!next.ok) return i;
+        if (next.v != '.') {
+            set_tmlerr(new_tmlerr(L, erridx), false, 27, "keys must be separated by .");
+            return 0;
+        }
+        iter_skip(src);
+    }
+}
+
 #endif  // SRC_DECODE_KEYS_H_
@@ -0,0 +1,255 @@
+// Copyright 2025 Birdee
+#ifndef SRC_DECODE_NUM_H_
+#define SRC_DECODE_NUM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <float.h>
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+#include "./decode_num_table.h"
+
+// Numbers are read straight out of the source, skipping underscores, without copying them anywhere first.
+// Floats use Clinger's exact fast path when the digits and exponent are small enough, then Eisel-Lemire.
+// Whatever neither can round correctly, or what would be subnormal or infinite, is left to strtod by the caller.
+
+static inline unsigned num_digit_value(char c) {
+    if (c >= '0' && c <= '9') return (unsigned)(c - '0');
+    if (c >= 'a' && c <= 'f') return (unsigned)(c - 'a' + 10);
+    if (c >= 'A' && c <= 'F') return (unsigned)(c - 'A' + 10);
+    return 255;
+}
+
+// digits in base after an optional sign, underscores are skipped, and it stops at the first other character
+// on overflow, sets *overflow and returns INT64_MAX or INT64_MIN like strtoll does
+static inline int64_t num_parse_int(const char *s, size_t len, int base, bool *overflow) {
+    size_t i = 0;
+    bool neg = false;
+    if (i < len && (s[i] == '+' || s[i] == '-')) {
+        neg = s[i] == '-';
+        i++;
+    }
+    uint64_t acc = 0;
+    bool over = false;
+    for (; i < len; i++) {
+        if (s[i] == '_') continue;
+        unsigned d = num_digit_value(s[i]);
+        if (d >= (unsigned)base) break;
+        if (acc > (UINT64_MAX - d) / (unsigned)base) over = true;
+        else acc = acc * (unsigned)base + d;
+    }
+    uint64_t limit = (neg) ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    *overflow = over || acc > limit;
+    if (*overflow) return (neg) ? INT64_MIN : INT64_MAX;
+    if (neg) return (acc == 0) ? 0 : -(int64_t)(acc - 1) - 1;
+    return (int64_t)acc;
+}
+
+// digits with single underscores only between them, at least 1 digit
+static inline bool num_lex_digits(const char *s, size_t len, size_t *pos) {
+    size_t i = *pos;
+    if (i >= len || s[i] < '0' || s[i] > '9') return false;
+    while (i < len) {
+        if (s[i] >= '0' && s[i] <= '9') {
+            i++;
+        } else if (s[i] == '_' && i + 1 < len && s[i + 1] >= '0' && s[i + 1] <= '9') {
+            i += 2;
+        } else {
+            break;
+        }
+    }
+    *pos = i;
+    return true;
+}
+
+// Measures a plain decimal integer or float at the start of s: an optional sign, digits,
+// and then optionally a fraction and an exponent, followed by something that could not continue a number or a date.
+// Returns false for anything else, which is left to the more general scanner in decode_inline_value.
+static inline bool num_lex_decimal(const char *s, size_t len, size_t *num_len, bool *is_float) {
+    size_t i = 0;
+    *is_float = false;
+    if (i < len && (s[i] == '+' || s[i] == '-')) i++;
+    if (!num_lex_digits(s, len, &i)) return false;
+    if (i < len && s[i] == '.') {
+        i++;
+        *is_float = true;
+        if (!num_lex_digits(s, len, &i)) return false;
+    }
+    if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+        i++;
+        *is_float = true;
+        if (i < len && (s[i] == '+' || s[i] == '-')) i++;
+        if (!num_lex_digits(s, len, &i)) return false;
+    }
+    if (i < len) {
+        char c = s[i];
+        if (c == '_' || c == '.' || c == 'e' || c == 'E' || c == ':' || c == '-') return false;
+    }
+    *num_len = i;
+    return true;
+}
+
+typedef struct {
+    uint64_t w;  // the first 19 significant digits
+    int64_t q;  // power of 10 to scale w by
+    bool neg;
+    bool truncated;  // there were more nonzero digits than fit in w
+} NumDecimal;
+
+static inline void num_push_digit(NumDecimal *d, int *sig, char c, bool fraction) {
+    if (*sig < 19) {
+        d->w = d->w * 10 + (uint64_t)(c - '0');
+        if (d->w != 0) (*sig)++;
+        if (fraction) d->q--;
+    } else {
+        if (c != '0') d->truncated = true;
+        if (!fraction) d->q++;
+    }
+}
+
+// reads the longest prefix of s that strtod would, for the characters a float in the source can contain
+// returns false if there were no digits, in which case strtod would not have converted anything
+static inline bool num_scan_decimal(const char *s, size_t len, NumDecimal *d) {
+    *d = (NumDecimal){0};
+    size_t i = 0;
+    if (i < len && (s[i] == '+' || s[i] == '-')) {
+        d->neg = s[i] == '-';
+        i++;
+    }
+    int sig = 0;
+    bool any = false;
+    for (; i < len; i++) {
+        if (s[i] == '_') continue;
+        if (s[i] < '0' || s[i] > '9') break;
+        any = true;
+        num_push_digit(d, &sig, s[i], false);
+    }
+    if (i < len && s[i] == '.') {
+        for (i++; i < len; i++) {
+            if (s[i] == '_') continue;
+            if (s[i] < '0' || s[i] > '9') break;
+            any = true;
+            num_push_digit(d, &sig, s[i], true);
+        }
+    }
+    if (!any) return false;
+    if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+        size_t j = i + 1;
+        bool eneg = false;
+        if (j < len && (s[j] == '+' || s[j] == '-')) {
+            eneg = s[j] == '-';
+            j++;
+        }
+        if (j < len && s[j] >= '0' && s[j] <= '9') {
+            int64_t e = 0;
+            for (; j < len; j++) {
+                if (s[j] == '_') continue;
+                if (s[j] < '0' || s[j] > '9') break;
+                // anything this large is out of range either way
+                if (e < 100000) e = e * 10 + (s[j] - '0');
+            }
+            d->q += (eneg) ? -e : e;
+        }
+    }
+    return true;
+}
+
+static inline int num_clz64(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clzll(v);
+#else
+    int n = 0;
+    while (!(v & 0x8000000000000000ULL)) { v <<= 1; n++; }
+    return n;
+#endif
+}
+
+// full 128 bit product, returns the high half
+static inline uint64_t num_mul128(uint64_t a, uint64_t b, uint64_t *lo) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)a * b;
+    *lo = (uint64_t)r;
+    return (uint64_t)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    uint64_t hi;
+    *lo = _umul128(a, b, &hi);
+    return hi;
+#else
+    uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+    uint64_t ll = a_lo * b_lo, lh = a_lo * b_hi, hl = a_hi * b_lo, hh = a_hi * b_hi;
+    uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+    *lo = (mid << 32) | (uint32_t)ll;
+    return hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+// the double nearest w * 10^q for w != 0, following the Eisel-Lemire algorithm
+// returns false when the result would be subnormal or infinite, or when the rounding cannot be decided from 128 bits
+static inline bool num_eisel_lemire(uint64_t w, int64_t q, bool neg, double *out) {
+    if (q < NUM_POW5_MIN_EXP || q > NUM_POW5_MAX_EXP) return false;
+    int lz = num_clz64(w);
+    w <<= lz;
+    const uint64_t *pow5 = num_pow5_128[q - NUM_POW5_MIN_EXP];
+    uint64_t lo;
+    uint64_t hi = num_mul128(w, pow5[0], &lo);
+    // only the top 54 bits are kept, widen the product when the bits below them might carry into them
+    if ((hi & 0x1FF) == 0x1FF) {
+        uint64_t lo2;
+        uint64_t hi2 = num_mul128(w, pow5[1], &lo2);
+        lo += hi2;
+        if (hi2 > lo) hi++;
+    }
+    // outside of this range, a low half of all ones may be hiding a carry that 128 bits of 5^q cannot resolve
+    if (lo == UINT64_MAX && (q < -27 || q > 55)) return false;
+    int upperbit = (int)(hi >> 63);
+    int shift = upperbit + 9;
+    uint64_t mantissa = hi >> shift;
+    int64_t power2 = (((int64_t)217706 * q) >> 16) + 63 + upperbit - lz + 1023;
+    if (power2 <= 0) return false;
+    // exactly halfway between two doubles, round to even
+    if (lo <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 && (mantissa << shift) == hi) {
+        mantissa &= ~(uint64_t)1;
+    }
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= ((uint64_t)2 << 52)) {
+        mantissa = (uint64_t)1 << 52;
+        power2++;
+    }
+    mantissa &= ~((uint64_t)1 << 52);
+    if (power2 >= 0x7FF) return false;
+    uint64_t bits = ((uint64_t)power2 << 52) | mantissa | ((uint64_t)neg << 63);
+    memcpy(out, &bits, sizeof(bits));
+    return true;
+}
+
+// returns false when the caller needs to fall back to strtod
+static inline bool num_decimal_to_double(const NumDecimal *d, double *out) {
+    if (d->truncated) return false;
+    if (d->w == 0) {
+        *out = (d->neg) ? -0.0 : 0.0;
+        return true;
+    }
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+    // both w and 10^q are exact doubles, so a single multiply or divide is correctly rounded
+    if (d->w <= ((uint64_t)1 << 53) && d->q >= -22 && d->q <= 22) {
+        static const double exact_pow10[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+        };
+        double v = (double)d->w;
+        v = (d->q < 0) ? v / exact_pow10[-d->q] : v * exact_pow10[d->q];
+        *out = (d->neg) ? -v : v;
+        return true;
+    }
+#endif
+    return num_eisel_lemire(d->w, d->q, d->neg, out);
+}
+
+#endif  // SRC_DECODE_NUM_H_
@@ -0,0 +1,188 @@
+// Copyright 2025 Birdee
+#ifndef SRC_DECODE_SELECT_H_
+#define SRC_DECODE_SELECT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <lua.h>
+#include "./types.h"
+#include "./decode_keys.h"
+#include "./decode_defs.h"
+#include "./error_context.h"
+
+// The only and exclude paths of a selective decode.
+// Statements whose path is outside of the selection are skipped without reading their values.
+//
+// Paths are kept as key records: a uint32_t length, then the bytes defs_key_bytes gives for the key,
+// behind an 's' tag for strings, so that 2 keys are the same exactly when their records are.
+
+typedef enum {
+    SELECT_SKIP,  // the statement is outside of the selection
+    SELECT_SOME,  // the statement leads to something selected, but may contain things that are not
+    SELECT_ALL,  // everything in the statement is selected
+} SelectMatch;
+
+typedef struct {
+    size_t off;  // of the first key record in DecodeSelect.keys
+    size_t nkeys;
+    bool exclude;
+} SelectPath;
+
+typedef struct {
+    SelectPath *paths;
+    size_t len;
+    size_t cap;
+    str_buf keys;
+    // the path of the statement being matched, which starts with the keys of the current heading
+    str_buf path;
+    size_t heading_len;
+    size_t heading_keys;
+    bool has_only;
+} DecodeSelect;
+
+static inline DecodeSelect new_decode_select() {
+    return (DecodeSelect) {
+        .paths = NULL,
+        .len = 0,
+        .cap = 0,
+        .keys = new_str_buf(),
+        .path = new_str_buf(),
+        .heading_len = 0,
+        .heading_keys = 0,
+        .has_only = false,
+    };
+}
+
+static inline void free_decode_select(DecodeSelect *sel) {
+    free(sel->paths);
+    sel->paths = NULL;
+    sel->len = sel->cap = 0;
+    free_str_buf(&sel->keys);
+    free_str_buf(&sel->path);
+}
+
+// appends the record of the key at idx to buf. Returns false on OOM
+static bool select_push_key(lua_State *L, str_buf *buf, int idx) {
+    char numkey[1 + sizeof(lua_Number)];
+    const char *str = NULL;
+    size_t len = defs_key_bytes(L, idx, numkey, &str);
+    uint32_t rec_len = (uint32_t)((str == NULL) ? len : len + 1);
+    if (!buf_push_str(buf, (const char *)&rec_len, sizeof(uint32_t))) return false;
+    if (str == NULL) return buf_push_str(buf, numkey, len);
+    return buf_push(buf, 's') && buf_push_str(buf, str, len);
+}
+
+// records the keys from keys_start to the top of the stack as a path. Returns false on OOM
+static bool select_add_path(lua_State *L, DecodeSelect *sel, int keys_start, bool exclude) {
+    if (sel->len >= sel->cap) {
+        size_t new_cap = sel->cap ? sel->cap * 2 : 4;
+        SelectPath *tmp = (SelectPath *)realloc(sel->paths, new_cap * sizeof(SelectPath));
+        if (!tmp) return false;
+        sel->paths = tmp;
+        sel->cap = new_cap;
+    }
+    SelectPath *p = &sel->paths[sel->len];
+    p->off = sel->keys.len;
+    p->exclude = exclude;
+    int top = lua_gettop(L);
+    p->nkeys = (size_t)(top - keys_start + 1);
+    for (int i = keys_start; i <= top; i++) {
+        if (!select_push_key(L, &sel->keys, i)) return false;
+    }
+    sel->len++;
+    return true;
+}
+
+// reads the list of path strings at list_idx into sel. Returns false with the error at erridx
+static bool select_read_paths(lua_State *L, DecodeSelect *sel, int list_idx, bool exclude, bool int_keys, int erridx) {
+    const char *name = exclude ? "exclude" : "only";
+    if (!exclude) sel->has_only = true;
+    size_t len = lua_arraylen(L, list_idx);
+    for (size_t i = 1; i <= len; i++) {
+        lua_rawgeti(L, list_idx, (lua_Integer)i);
+        size_t path_len = 0;
+        const char *path = (lua_type(L, -1) == LUA_TSTRING) ? lua_tolstring(L, -1, &path_len) : NULL;
+        if (path == NULL) {
+            TMLErr *err = new_tmlerr(L, erridx);
+            set_tmlerr(err, false, strlen(name), (char *)name);
+            tmlerr_push_str(err, " must be a list of path strings", 31);
+            return false;
+        }
+        int keys_start = lua_gettop(L) + 1;
+        str_iter src = { .len = path_len, .pos = 0, .buf = path };
+        if (!parse_key_path(L, &src, &sel->path, int_keys, erridx)) {
+            // put the path in front of what was wrong with it
+            TMLErr *err = get_err_val(L, erridx);
+            lua_pushfstring(L, "invalid %s path \"%s\": ", name, path);
+            push_tmlerr_string(L, err);
+            lua_concat(L, 2);
+            size_t msg_len = 0;
+            const char *msg = lua_tolstring(L, -1, &msg_len);
+            set_tmlerr(new_tmlerr(L, erridx), false, msg_len, (char *)msg);
+            return false;
+        }
+        if (!select_add_path(L, sel, keys_start, exclude)) {
+            set_tmlerr(new_tmlerr(L, erridx), false, 3, "OOM");
+            return false;
+        }
+        lua_settop(L, keys_start - 2);
+    }
+    return true;
+}
+
+// returns true if the paths of na keys at a and nb keys at b agree for as many keys as the shorter one has
+static inline bool select_same_prefix(const char *a, size_t na, const char *b, size_t nb) {
+    size_t n = (na < nb) ? na : nb;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t la, lb;
+        memcpy(&la, a, sizeof(uint32_t));
+        memcpy(&lb, b, sizeof(uint32_t));
+        if (la != lb || memcmp(a + sizeof(uint32_t), b + sizeof(uint32_t), la) != 0) return false;
+        a += sizeof(uint32_t) + la;
+        b += sizeof(uint32_t) + lb;
+    }
+    return true;
+}
+
+// matches the path made of the current heading and the keys from keys_start to keys_end against the selection
+// on OOM, returns SELECT_ALL, as decoding something that was not asked for is better than missing something that was
+static SelectMatch select_match(lua_State *L, DecodeSelect *sel, int keys_start, int keys_end) {
+    sel->path.len = sel->heading_len;
+    for (int i = keys_start; i <= keys_end; i++) {
+        if (!select_push_key(L, &sel->path, i)) return SELECT_ALL;
+    }
+    size_t n = sel->heading_keys + (size_t)(keys_end - keys_start + 1);
+    bool inside_only = false;
+    bool leads_to_only = false;
+    bool leads_to_exclude = false;
+    for (size_t i = 0; i < sel->len; i++) {
+        const SelectPath *p = &sel->paths[i];
+        if (!select_same_prefix(sel->path.data, n, sel->keys.data + p->off, p->nkeys)) continue;
+        if (p->exclude) {
+            if (p->nkeys <= n) return SELECT_SKIP;
+            leads_to_exclude = true;
+        } else if (p->nkeys <= n) {
+            inside_only = true;
+        } else {
+            leads_to_only = true;
+        }
+    }
+    if (sel->has_only && !inside_only) return leads_to_only ? SELECT_SOME : SELECT_SKIP;
+    return leads_to_exclude ? SELECT_SOME : SELECT_ALL;
+}
+
+// headings are matched from the root
+static inline void select_leave_heading(DecodeSelect *sel) {
+    sel->heading_len = 0;
+    sel->heading_keys = 0;
+}
+
+// makes the heading matched by the last select_match the current one
+static inline void select_enter_heading(DecodeSelect *sel, int nkeys) {
+    sel->heading_len = sel->path.len;
+    sel->heading_keys = (size_t)nkeys;
+}
+
+#endif  // SRC_DECODE_SELECT_H_
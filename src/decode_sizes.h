@@ -0,0 +1,265 @@
+// Copyright 2025 Birdee
+#ifndef SRC_DECODE_SIZES_H_
+#define SRC_DECODE_SIZES_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+#include "./scan.h"
+
+// A quick structural pass over the source before decoding, which counts the elements of every inline array,
+// and the keys of every inline table and heading, so that tomlua_decode can create them with lua_createtable
+// at their final size instead of growing them one rawset at a time.
+// It does not validate anything. A count that turns out wrong only makes a table the wrong size to start with.
+
+typedef struct {
+    size_t pos;  // offset in the source of the [ or { opening it, or of the first [ of its heading
+    uint32_t count;  // elements of an array, keys of a table
+} SizeHint;
+
+typedef struct {
+    SizeHint *hints;  // in order of pos
+    size_t len;
+    size_t cap;
+    size_t next;  // every hint before this has been passed by the decoder
+    uint32_t root_keys;  // keys before the first heading
+} SizeHints;
+
+static inline void free_size_hints(SizeHints *sizes) {
+    if (sizes) {
+        free(sizes->hints);
+        *sizes = (SizeHints){0};
+    }
+}
+
+// returns the count recorded for the container opened at pos, or 0 if there is none
+// must be called with increasing pos
+static inline int size_hint_at(SizeHints *sizes, size_t pos) {
+    while (sizes->next < sizes->len && sizes->hints[sizes->next].pos < pos) sizes->next++;
+    if (sizes->next < sizes->len && sizes->hints[sizes->next].pos == pos) {
+        uint32_t count = sizes->hints[sizes->next].count;
+        return (count > INT32_MAX) ? INT32_MAX : (int)count;
+    }
+    return 0;
+}
+
+static bool size_hints_push(SizeHints *sizes, size_t pos) {
+    if (sizes->len >= sizes->cap) {
+        size_t new_cap = (sizes->cap > 0) ? sizes->cap * 2 : 16;
+        SizeHint *tmp = (SizeHint *)realloc(sizes->hints, new_cap * sizeof(SizeHint));
+        if (!tmp) return false;
+        sizes->hints = tmp;
+        sizes->cap = new_cap;
+    }
+    sizes->hints[sizes->len++] = (SizeHint){ .pos = pos, .count = 0 };
+    return true;
+}
+
+// returns the position just past the string starting at s[i], or len if it is not closed
+static inline size_t prescan_skip_string(const char *s, size_t len, size_t i) {
+    char q = s[i];
+    bool multi = i + 2 < len && s[i + 1] == q && s[i + 2] == q;
+    i += (multi) ? 3 : 1;
+    while (i < len) {
+        // literal strings have no escapes, and single line strings end at a newline either way
+        i += (multi) ? scan_find_any4(s + i, len - i, q, '\\', q, q) : scan_find_any4(s + i, len - i, q, '\\', '\n', q);
+        if (i >= len) return len;
+        char c = s[i];
+        if (c == '\\') {
+            i += (q == '"') ? 2 : 1;
+        } else if (c == '\n') {
+            return i;
+        } else if (!multi) {
+            return i + 1;
+        } else if (i + 2 < len && s[i + 1] == q && s[i + 2] == q) {
+            i += 3;
+            // up to 2 more quotes directly before the closing ones
+            while (i < len && s[i] == q) i++;
+            return i;
+        } else {
+            i++;
+        }
+    }
+    return len;
+}
+
+// whether anything was between the ] or } at s[i] and the previous comma or the opening bracket at s[open]
+static inline bool prescan_had_value(const char *s, size_t i, size_t open) {
+    while (i > open + 1 && (s[i - 1] == ' ' || s[i - 1] == '\t' || s[i - 1] == '\r' || s[i - 1] == '\n')) i--;
+    return i > open + 1 && s[i - 1] != ',';
+}
+
+// returns the position just past the newline ending the statement that s[i] is part of, or len if there is none
+// arrays and inline tables may span several lines, and brackets inside strings and comments do not count
+static size_t prescan_skip_statement(const char *s, size_t len, size_t i) {
+    size_t depth = 0;
+    while (i < len) {
+        size_t commas = 0;
+        i += scan_find_structural(s + i, len - i, &commas);
+        if (i >= len) break;
+        switch (s[i]) {
+            case '\n':
+                if (depth == 0) return i + 1;
+                i++;
+                break;
+            case '#':
+                i += scan_find_byte(s + i, len - i, '\n');
+                break;
+            case '"':
+            case '\'':
+                i = prescan_skip_string(s, len, i);
+                break;
+            case '[':
+            case '{':
+                depth++;
+                i++;
+                break;
+            default:  // ] or }, including the ones closing a heading
+                if (depth > 0) depth--;
+                i++;
+        }
+    }
+    return len;
+}
+
+// returns the position just past the last newline in s that ends a statement, or 0 if there is none yet
+// scanning starts from *pos with *depth arrays and inline tables open, and both are left at where it can go on from
+// once more has been appended to s. A string or comment that reaches the end of s is scanned again from its start
+static inline size_t prescan_statements_end(const char *s, size_t len, size_t *pos, size_t *depth) {
+    size_t last = 0;
+    size_t i = *pos;
+    size_t d = *depth;
+    while (i < len) {
+        size_t commas = 0;
+        i += scan_find_structural(s + i, len - i, &commas);
+        if (i >= len) break;
+        switch (s[i]) {
+            case '\n':
+                if (d == 0) last = i + 1;
+                i++;
+                break;
+            case '#': {
+                size_t nl = i + scan_find_byte(s + i, len - i, '\n');
+                if (nl >= len) goto unfinished;
+                i = nl;
+            } break;
+            case '"':
+            case '\'': {
+                // a string ending right at len could still turn out to be the start of a multiline one, or have more quotes
+                size_t after = prescan_skip_string(s, len, i);
+                if (after >= len) goto unfinished;
+                i = after;
+            } break;
+            case '[':
+            case '{':
+                d++;
+                i++;
+                break;
+            default:
+                if (d > 0) d--;
+                i++;
+        }
+    }
+    *pos = len;
+    *depth = d;
+    return last;
+unfinished:
+    *pos = i;
+    *depth = d;
+    return last;
+}
+
+// fills sizes from the document in s. Returns false on OOM, in which case sizes is left empty
+// sizes must be zeroed or filled before, and keeps its memory for the new hints
+static bool prescan_sizes(const char *s, size_t len, SizeHints *sizes) {
+    sizes->len = 0;
+    sizes->next = 0;
+    sizes->root_keys = 0;
+    size_t stack_cap = 16;
+    size_t depth = 0;
+    // indices into sizes->hints of the arrays and inline tables currently open
+    size_t *stack = (size_t *)malloc(stack_cap * sizeof(size_t));
+    if (!stack) return false;
+    // the heading whose keys are being counted, or the root table before the first heading
+    uint32_t *table_count = &sizes->root_keys;
+    size_t table_hint = SIZE_MAX;
+    bool line_start = true;
+    size_t i = 0;
+    while (i < len) {
+        if (line_start) {
+            char c = s[i];
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+                i++;
+                continue;
+            } else if (c == '#') {
+                i += scan_find_byte(s + i, len - i, '\n');
+                continue;
+            }
+            line_start = false;
+            if (c == '[') {
+                if (!size_hints_push(sizes, i)) goto oom;
+                table_hint = sizes->len - 1;
+                table_count = NULL;
+            } else if (table_count) {
+                (*table_count)++;
+            } else {
+                sizes->hints[table_hint].count++;
+            }
+            // skip over the keys, which may be quoted and contain anything, up to the = or the end of the heading
+            while (i < len && s[i] != '\n' && s[i] != '=' && s[i] != '#') {
+                if (s[i] == '"' || s[i] == '\'') i = prescan_skip_string(s, len, i);
+                else i++;
+            }
+            if (i < len && s[i] == '=') i++;
+            continue;
+        }
+        // inside a value, only a few bytes matter, and commas only need counting
+        size_t commas = 0;
+        i += scan_find_structural(s + i, len - i, &commas);
+        if (depth > 0) sizes->hints[stack[depth - 1]].count += (uint32_t)commas;
+        if (i >= len) break;
+        switch (s[i]) {
+            case '\n':
+                if (depth == 0) line_start = true;
+                i++;
+                break;
+            case '#':
+                i += scan_find_byte(s + i, len - i, '\n');
+                break;
+            case '"':
+            case '\'':
+                i = prescan_skip_string(s, len, i);
+                break;
+            case '[':
+            case '{':
+                if (!size_hints_push(sizes, i)) goto oom;
+                if (depth >= stack_cap) {
+                    stack_cap *= 2;
+                    size_t *tmp = (size_t *)realloc(stack, stack_cap * sizeof(size_t));
+                    if (!tmp) goto oom;
+                    stack = tmp;
+                }
+                stack[depth++] = sizes->len - 1;
+                i++;
+                break;
+            default:  // ] or }
+                if (depth > 0) {
+                    // commas were counted already, add the last value if it had no comma after it
+                    SizeHint *top = &sizes->hints[stack[--depth]];
+                    if (prescan_had_value(s, i, top->pos)) top->count++;
+                }
+                i++;
+        }
+    }
+    free(stack);
+    return true;
+oom:
+    free(stack);
+    free_size_hints(sizes);
+    return false;
+}
+
+#endif  // SRC_DECODE_SIZES_H_
@@ -4,6 +4,7 @@
 
 #include <stdint.h>
 #include "./types.h"
+#include "./scan.h"
 #include "./error_context.h"
 
 // Convert a hex string to a codepoint
@@ -38,9 +39,58 @@ static inline bool push_unicode(lua_State *L, str_buf *dst, char src[], int len,
     return true;
 }
 
+// copies the next run bytes of src into dst in one go and advances past them
+static inline bool iter_push_run(str_buf *dst, str_iter *src, size_t run) {
+    if (!buf_push_str(dst, src->buf + src->pos, run)) return false;
+    src->pos += run;
+    return true;
+}
+
+// Finds the end of a string whose value is the same bytes as its body, so it can be pushed straight from src.
+// a, b and c are the bytes which mean the string parser is needed instead; repeat q to look for fewer.
+// Returns true with *len set to the length of the value starting at the old pos, and pos past the closing quotes.
+// Otherwise returns false with *len set to how many bytes are known to be plain, and pos unchanged.
+static bool iter_plain_string(str_iter *src, char q, bool multi, char a, char b, char c, size_t *len) {
+    const char *s = src->buf + src->pos;
+    size_t rem = src->len - src->pos;
+    size_t i = 0;
+    while (true) {
+        i += scan_find_any4(s + i, rem - i, q, a, b, c);
+        if (i >= rem || s[i] != q) {
+            *len = i;
+            return false;
+        }
+        if (!multi) {
+            *len = i;
+            src->pos += i + 1;
+            return true;
+        }
+        if (i + 3 <= rem && s[i + 1] == q && s[i + 2] == q) {
+            // up to 2 more quotes directly before the closing ones belong to the value
+            size_t extra = 0;
+            while (extra < 2 && i + 3 + extra < rem && s[i + 3 + extra] == q) extra++;
+            *len = i + extra;
+            src->pos += i + 3 + extra;
+            return true;
+        }
+        i++;
+    }
+}
+
+// multi-line strings drop a newline directly after the opening quotes
+static inline void iter_skip_multi_string_start(str_iter *src) {
+    if (iter_peek(src).v == '\n') iter_skip(src);
+    else if (iter_starts_with(src, "\r\n", 2)) iter_skip_n(src, 2);
+}
+
 // pushes string to dst, advances pos
 static bool parse_basic_string(lua_State *L, str_buf *dst, str_iter *src, int erridx) {
     while (iter_peek(src).ok) {
+        size_t run = scan_find_any4(src->buf + src->pos, src->len - src->pos, '"', '\\', '\n', '\r');
+        if (run > 0) {
+            if (!iter_push_run(dst, src, run)) return set_tmlerr(new_tmlerr(L, erridx), false, 3, "OOM");
+            continue;
+        }
         iter_result current = iter_next(src);
         char c = current.v;
         iter_result nextres = iter_peek(src);
@@ -97,10 +147,15 @@ static bool parse_basic_string(lua_State *L, str_buf *dst, str_iter *src, int er
     return set_tmlerr(new_tmlerr(L, erridx), false, 43, "end of content reached before end of string");
 }
 
+// expects iter_skip_multi_string_start to have been called
 static bool parse_multi_basic_string(lua_State *L, str_buf *dst, str_iter *src, int erridx) {
-    if (iter_peek(src).v == '\n') iter_skip(src);
-    else if (iter_starts_with(src, "\r\n", 2)) iter_skip_n(src, 2);
     while (iter_peek(src).ok) {
+        // newlines are kept as they are, so only quotes and escapes need a closer look
+        size_t run = scan_find_any4(src->buf + src->pos, src->len - src->pos, '"', '\\', '"', '\\');
+        if (run > 0) {
+            if (!iter_push_run(dst, src, run)) return set_tmlerr(new_tmlerr(L, erridx), false, 3, "OOM");
+            continue;
+        }
         iter_result current = iter_next(src);
         char c = current.v;
         iter_result nextres = iter_peek(src);
@@ -173,6 +228,11 @@ static bool parse_multi_basic_string(lua_State *L, str_buf *dst, str_iter *src,
 
 static bool parse_literal_string(lua_State *L, str_buf *dst, str_iter *src, int erridx) {
     while (iter_peek(src).ok) {
+        size_t run = scan_find_any4(src->buf + src->pos, src->len - src->pos, '\'', '\n', '\r', '\'');
+        if (run > 0) {
+            if (!iter_push_run(dst, src, run)) return set_tmlerr(new_tmlerr(L, erridx), false, 3, "OOM");
+            continue;
+        }
         iter_result current = iter_next(src);
         char c = current.v;
         iter_result nextres = iter_peek(src);
@@ -187,10 +247,14 @@ static bool parse_literal_string(lua_State *L, str_buf *dst, str_iter *src, int
     return set_tmlerr(new_tmlerr(L, erridx), false, 43, "end of content reached before end of string");
 }
 
+// expects iter_skip_multi_string_start to have been called
 static bool parse_multi_literal_string(lua_State *L, str_buf *dst, str_iter *src, int erridx) {
-    if (iter_peek(src).v == '\n') iter_skip(src);
-    else if (iter_starts_with(src, "\r\n", 2)) iter_skip_n(src, 2);
     while (iter_peek(src).ok) {
+        size_t run = scan_find_byte(src->buf + src->pos, src->len - src->pos, '\'');
+        if (run > 0) {
+            if (!iter_push_run(dst, src, run)) return set_tmlerr(new_tmlerr(L, erridx), false, 3, "OOM");
+            continue;
+        }
         iter_result current = iter_next(src);
         char c = current.v;
         if (c == '\'' && iter_starts_with(src, "''", 2)) {
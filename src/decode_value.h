@@ -0,0 +1,481 @@
+// Copyright 2025 Birdee
+#ifndef SRC_DECODE_VALUE_H_
+#define SRC_DECODE_VALUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <errno.h>
+#include <lua.h>
+#include "./types.h"
+#include "./opts.h"
+#include "./dates.h"
+#include "./decode_str.h"
+#include "./decode_num.h"
+#include "./error_context.h"
+
+// The grammar of every value that is not an array or an inline table.
+// lex_scalar reads one into a TomlScalar without touching the lua stack, so that decode can push it
+// and tomlua.parse can put it on its tape, and both accept exactly the same values.
+
+typedef struct {
+    // TOML_BOOL, TOML_INTEGER, TOML_FLOAT, TOML_STRING, TOML_STRING_MULTI,
+    // or the type of the date when dates are userdata or tables. Dates are TOML_STRING as strings,
+    // and TOML_INTEGER or TOML_FLOAT as timestamps
+    TomlType type;
+    union {
+        bool b;
+        lua_Integer i;
+        lua_Number f;
+        // points into the source or the scratch buffer, so it is only valid until either changes
+        struct {
+            const char *data;
+            size_t len;
+        } str;
+        TomlDate date;
+    } v;
+} TomlScalar;
+
+static bool lex_integer_or_handle(TomlScalar *out, const char *s, size_t len, int base, bool throw_on_overflow) {
+    bool overflow = false;
+    int64_t val = num_parse_int(s, len, base, &overflow);
+    // Check if conversion overflowed
+    if (overflow || val > LUA_MAXINTEGER || val < LUA_MININTEGER) {
+        if (throw_on_overflow) {
+            return false;
+        } else {
+            // +/- inf depending on sign
+            out->type = TOML_FLOAT;
+            out->v.f = (val < 0) ? -INFINITY : INFINITY;
+            return true;
+        }
+    }
+    out->type = TOML_INTEGER;
+    out->v.i = (lua_Integer)val;
+    return true;
+}
+
+// scratch may hold s already, otherwise it is only used when strtod is needed
+static bool lex_float_or_handle(TomlScalar *out, str_buf *scratch, const char *s, size_t len, bool throw_on_overflow, bool throw_on_underflow) {
+    NumDecimal d;
+    lua_Number val;
+    out->type = TOML_FLOAT;
+    if (num_scan_decimal(s, len, &d) && num_decimal_to_double(&d, &val)) {
+        out->v.f = val;
+        return true;
+    }
+    // strtod sets errno for what we could not convert ourselves, and needs a terminated copy without underscores
+    if (s != scratch->data) {
+        buf_soft_reset(scratch);
+        for (size_t i = 0; i < len; i++) {
+            if (s[i] != '_' && !buf_push(scratch, s[i])) return false;
+        }
+    }
+    errno = 0;
+    buf_null_terminate(scratch);
+    val = strtod(scratch->data, NULL);
+    if (errno == ERANGE) {
+        if (throw_on_overflow && !isfinite(val)) return false;
+        if (throw_on_underflow && val != 0.0 && fabs(val) < DBL_MIN) return false;
+    }
+    out->v.f = val;
+    return true;
+}
+
+static inline void lex_number(TomlScalar *out, lua_Number n) {
+    out->type = TOML_FLOAT;
+    out->v.f = n;
+}
+
+static inline void lex_string(TomlScalar *out, TomlType type, const char *data, size_t len) {
+    out->type = type;
+    out->v.str.data = data;
+    out->v.str.len = len;
+}
+
+// function is to recieve src iterator at the start of a value that is not an array or inline table.
+// on failure, returns false with the error at erridx. buf is used as scratch space
+static bool lex_scalar(lua_State *L, str_iter *src, str_buf *buf, const TomluaUserOpts opts, int erridx, TomlScalar *out) {
+    iter_result curr = iter_peek(src);
+    if (!curr.ok) return set_tmlerr(new_tmlerr(L, erridx), false, 34, "expected value, got end of content");
+    // plain integers and floats are the most common values, so they are tried first, and converted straight from src
+    if (((curr.v >= '0' && curr.v <= '9') || curr.v == '-' || curr.v == '+')
+        && !iter_starts_with(src, "0x", 2) && !iter_starts_with(src, "0o", 2) && !iter_starts_with(src, "0b", 2)) {
+        size_t num_len = 0;
+        bool num_is_float = false;
+        if (num_lex_decimal(src->buf + src->pos, src->len - src->pos, &num_len, &num_is_float)) {
+            const char *start = src->buf + src->pos;
+            src->pos += num_len;
+            if (num_is_float) {
+                if (!lex_float_or_handle(out, buf, start, num_len, opts[TOMLOPTS_OVERFLOW_ERRORS], opts[TOMLOPTS_UNDERFLOW_ERRORS])) return set_tmlerr(new_tmlerr(L, erridx), false, 35, "Parse error: float literal overflow");
+            } else {
+                if (!lex_integer_or_handle(out, start, num_len, 10, opts[TOMLOPTS_OVERFLOW_ERRORS])) return set_tmlerr(new_tmlerr(L, erridx), false, 37, "Parse error: integer literal overflow");
+            }
+            return true;
+        }
+    }
+    // --- boolean ---
+    if (iter_starts_with(src, "true", 4)) {
+        iter_skip_n(src, 4);
+        out->type = TOML_BOOL;
+        out->v.b = true;
+        return true;
+    } else if (iter_starts_with(src, "false", 5)) {
+        iter_skip_n(src, 5);
+        out->type = TOML_BOOL;
+        out->v.b = false;
+        return true;
+    // --- strings ---
+    } else if (iter_starts_with(src, "\"\"\"", 3)) {
+        iter_skip_n(src, 3);
+        iter_skip_multi_string_start(src);
+        const char *start = src->buf + src->pos;
+        size_t len = 0;
+        if (!iter_plain_string(src, '"', true, '\\', '\\', '\\', &len)) {
+            buf_soft_reset(buf);
+            if (!iter_push_run(buf, src, len)) return set_tmlerr(new_tmlerr(L, erridx), false, 3, "OOM");
+            if (!parse_multi_basic_string(L, buf, src, erridx)) {
+                return false;
+            }
+            start = buf->data;
+            len = buf->len;
+        }
+        lex_string(out, TOML_STRING_MULTI, start, len);
+        return true;
+    } else if (curr.v == '"') {
+        iter_skip(src);
+        const char *start = src->buf + src->pos;
+        size_t len = 0;
+        if (!iter_plain_string(src, '"', false, '\\', '\n', '\r', &len)) {
+            buf_soft_reset(buf);
+            if (!iter_push_run(buf, src, len)) return set_tmlerr(new_tmlerr(L, erridx), false, 3, "OOM");
+            if (!parse_basic_string(L, buf, src, erridx)) {
+                return false;
+            }
+            start = buf->data;
+            len = buf->len;
+        }
+        lex_string(out, TOML_STRING, start, len);
+        return true;
+    } else if (iter_starts_with(src, "'''", 3)) {
+        iter_skip_n(src, 3);
+        iter_skip_multi_string_start(src);
+        const char *start = src->buf + src->pos;
+        size_t len = 0;
+        // every byte of a multi-line literal string is kept, so this only falls back when the string is unterminated
+        if (!iter_plain_string(src, '\'', true, '\'', '\'', '\'', &len)) {
+            buf_soft_reset(buf);
+            if (!iter_push_run(buf, src, len)) return set_tmlerr(new_tmlerr(L, erridx), false, 3, "OOM");
+            if (!parse_multi_literal_string(L, buf, src, erridx)) {
+                return false;
+            }
+            start = buf->data;
+            len = buf->len;
+        }
+        lex_string(out, TOML_STRING_MULTI, start, len);
+        return true;
+    } else if (curr.v == '\'') {
+        iter_skip(src);
+        const char *start = src->buf + src->pos;
+        size_t len = 0;
+        if (!iter_plain_string(src, '\'', false, '\n', '\r', '\'', &len)) {
+            buf_soft_reset(buf);
+            if (!iter_push_run(buf, src, len)) return set_tmlerr(new_tmlerr(L, erridx), false, 3, "OOM");
+            if (!parse_literal_string(L, buf, src, erridx)) {
+                return false;
+            }
+            start = buf->data;
+            len = buf->len;
+        }
+        lex_string(out, TOML_STRING, start, len);
+        return true;
+    // --- numbers (and dates) ---
+    } else if (iter_starts_with(src, "inf", 3)) {
+        iter_skip_n(src, 3);
+        lex_number(out, INFINITY);
+        return true;
+    } else if (iter_starts_with(src, "nan", 3)) {
+        iter_skip_n(src, 3);
+        lex_number(out, NAN);
+        return true;
+    } else if ((curr.v >= '0' && curr.v <= '9') || curr.v == '-' || curr.v == '+') {
+        if (iter_starts_with(src, "0x", 2)) {
+            // Hex integer
+            iter_skip_n(src, 2);
+            const char *start = src->buf + src->pos;
+            size_t digits = 0;
+            bool was_underscore = false;
+            while (iter_peek(src).ok) {
+                char ch = iter_peek(src).v;
+                if (is_hex_char(ch)) {
+                    was_underscore = false;
+                    digits++;
+                    iter_skip(src);
+                } else if (ch == '_') {
+                    if (was_underscore) {
+                        return set_tmlerr(new_tmlerr(L, erridx), false, 51, "consecutive underscores not allowed in hex literals");
+                    }
+                    was_underscore = true;
+                    iter_skip(src);
+                } else break;
+            }
+            if (was_underscore) {
+                return set_tmlerr(new_tmlerr(L, erridx), false, 53, "hex literals not allowed to have trailing underscores");
+            }
+            if (digits == 0) return set_tmlerr(new_tmlerr(L, erridx), false, 17, "empty hex literal");
+            // Convert buffer to integer
+            if (!lex_integer_or_handle(out, start, (size_t)(src->buf + src->pos - start), 16, opts[TOMLOPTS_OVERFLOW_ERRORS])) return set_tmlerr(new_tmlerr(L, erridx), false, 41, "Parse error: hex literal integer overflow");
+            return true;
+        } else if (iter_starts_with(src, "0o", 2)) {
+            // Octal integer
+            iter_skip_n(src, 2);
+            const char *start = src->buf + src->pos;
+            size_t digits = 0;
+            bool was_underscore = false;
+            while (iter_peek(src).ok) {
+                char ch = iter_peek(src).v;
+                if ((ch >= '0' && ch <= '7')) {
+                    was_underscore = false;
+                    digits++;
+                    iter_skip(src);
+                } else if (ch == '_') {
+                    if (was_underscore) {
+                        return set_tmlerr(new_tmlerr(L, erridx), false, 53, "consecutive underscores not allowed in octal literals");
+                    }
+                    was_underscore = true;
+                    iter_skip(src);
+                } else break;
+            }
+            if (was_underscore) {
+                return set_tmlerr(new_tmlerr(L, erridx), false, 55, "octal literals not allowed to have trailing underscores");
+            }
+            if (digits == 0) return set_tmlerr(new_tmlerr(L, erridx), false, 19, "empty octal literal");
+            if (!lex_integer_or_handle(out, start, (size_t)(src->buf + src->pos - start), 8, opts[TOMLOPTS_OVERFLOW_ERRORS])) return set_tmlerr(new_tmlerr(L, erridx), false, 43, "Parse error: octal literal integer overflow");
+            return true;
+        } else if (iter_starts_with(src, "0b", 2)) {
+            // binary integer
+            iter_skip_n(src, 2);
+            const char *start = src->buf + src->pos;
+            size_t digits = 0;
+            bool was_underscore = false;
+            while (iter_peek(src).ok) {
+                char ch = iter_peek(src).v;
+                if ((ch == '0' || ch == '1')) {
+                    was_underscore = false;
+                    digits++;
+                    iter_skip(src);
+                } else if (ch == '_') {
+                    if (was_underscore) {
+                        return set_tmlerr(new_tmlerr(L, erridx), false, 54, "consecutive underscores not allowed in binary literals");
+                    }
+                    was_underscore = true;
+                    iter_skip(src);
+                } else break;
+            }
+            if (was_underscore) {
+                return set_tmlerr(new_tmlerr(L, erridx), false, 56, "binary literals not allowed to have trailing underscores");
+            }
+            if (digits == 0) return set_tmlerr(new_tmlerr(L, erridx), false, 20, "empty binary literal");
+            if (!lex_integer_or_handle(out, start, (size_t)(src->buf + src->pos - start), 2, opts[TOMLOPTS_OVERFLOW_ERRORS])) return set_tmlerr(new_tmlerr(L, erridx), false, 44, "Parse error: binary literal integer overflow");
+            return true;
+        } else {
+            // plain integers and floats that num_lex_decimal did not take at the top of this function
+            // detect dates and pass on as strings, and numbers are allowed to have underscores in them (only 1 consecutive underscore at a time)
+            // is date if it has a - in it not immediately preceded by e or E
+            // is date if it has a : in it
+            buf_soft_reset(buf);
+            bool is_float = false;
+            bool is_date = false;
+            bool t_used = false;
+            bool last_was_T_space = false;
+            bool z_used = false;
+            bool was_underscore = true;
+            if (curr.v == '+') {
+                if (iter_starts_with(src, "+inf", 4)) {
+                    iter_skip_n(src, 4);
+                    lex_number(out, INFINITY);
+                    return true;
+                } else if (iter_starts_with(src, "+nan", 4)) {
+                    iter_skip_n(src, 4);
+                    lex_number(out, NAN);
+                    return true;
+                } else {
+                    if (!buf_push(buf, curr.v)) return set_tmlerr(new_tmlerr(L, erridx), false, 51, "failed to push leading + character to number buffer");
+                    iter_skip(src);
+                }
+            } else if (curr.v == '-') {
+                if (iter_starts_with(src, "-inf", 4)) {
+                    iter_skip_n(src, 4);
+                    lex_number(out, -INFINITY);
+                    return true;
+                } else if (iter_starts_with(src, "-nan", 4)) {
+                    iter_skip_n(src, 4);
+                    lex_number(out, -NAN);
+                    return true;
+                } else {
+                    if (!buf_push(buf, curr.v)) return set_tmlerr(new_tmlerr(L, erridx), false, 51, "failed to push leading - character to number buffer");
+                    iter_skip(src);
+                }
+            }
+            while (iter_peek(src).ok) {
+                char ch = iter_peek(src).v;
+                if (ch == '_' && !last_was_T_space) {
+                    if (is_date) return set_tmlerr(new_tmlerr(L, erridx), false, 44, "date literal not allowed to have underscores");
+                    iter_skip(src);
+                    if (was_underscore) {
+                        return set_tmlerr(new_tmlerr(L, erridx), false, 46, "consecutive underscores not allowed in numbers");
+                    }
+                    was_underscore = true;
+                } else if ((ch == 'e' || ch == 'E') && !last_was_T_space) {
+                    if (is_date) return set_tmlerr(new_tmlerr(L, erridx), false, 41, "date literal not allowed to have exponent");
+                    is_float = true;
+                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, erridx), false, 31, "failed to push number character");
+                    iter_skip(src);
+                    iter_result next = iter_peek(src);
+                    if (next.ok && (next.v == '+' || next.v == '-')) {
+                        if (!buf_push(buf, next.v)) return set_tmlerr(new_tmlerr(L, erridx), false, 31, "failed to push number character");
+                        iter_skip(src);
+                    }
+                    was_underscore = false;
+                } else if (ch == ':' && !last_was_T_space) {
+                    is_date = true;
+                    was_underscore = false;
+                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, erridx), false, 29, "failed to push date character");
+                    iter_skip(src);
+                } else if (ch == '-' && !last_was_T_space) {
+                    is_date = true;
+                    was_underscore = false;
+                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, erridx), false, 31, "failed to push number character");
+                    iter_skip(src);
+                } else if (is_date && !t_used && ch == 'T' && !last_was_T_space) {
+                    t_used = true;
+                    was_underscore = false;
+                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, erridx), false, 29, "failed to push date character");
+                    iter_skip(src);
+                } else if (is_date && !t_used && ch == ' ' && !last_was_T_space) {
+                    t_used = true;
+                    was_underscore = false;
+                    last_was_T_space = true;
+                    iter_skip(src);
+                } else if (is_date && !z_used && ch == 'Z' && !last_was_T_space) {
+                    z_used = true;
+                    was_underscore = false;
+                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, erridx), false, 29, "failed to push date character");
+                    iter_skip(src);
+                } else if (ch == '.' && !last_was_T_space) {
+                    is_float = true;
+                    was_underscore = false;
+                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, erridx), false, 31, "failed to push number character");
+                    iter_skip(src);
+                } else if (ch >= '0' && ch <= '9') {
+                    if (last_was_T_space) {
+                        if (!buf_push(buf, ' ')) return set_tmlerr(new_tmlerr(L, erridx), false, 29, "failed to push date character");
+                    }
+                    last_was_T_space = false;
+                    was_underscore = false;
+                    if (!buf_push(buf, ch)) return set_tmlerr(new_tmlerr(L, erridx), false, 31, "failed to push number character");
+                    iter_skip(src);
+                } else {
+                    was_underscore = false;
+                    last_was_T_space = false;
+                    break;
+                }
+            }
+            if (was_underscore) {
+                return set_tmlerr(new_tmlerr(L, erridx), false, 56, "number literals not allowed to have trailing underscores");
+            }
+            if (buf->len > 0) {
+                if (is_date) {
+                    TOMLDATES dates = opts_dates(opts);
+                    str_iter date_src = (str_iter) {
+                        .len = buf->len,
+                        .pos = 0,
+                        .buf = buf->data
+                    };
+                    if (dates == TOMLDATES_STRING) {
+                        lex_string(out, TOML_STRING, buf->data, buf->len);
+                    } else if (dates == TOMLDATES_TIMESTAMP) {
+                        int64_t secs = 0;
+                        double frac = 0;
+                        if (!parse_toml_timestamp(&date_src, &secs, &frac))
+                            return set_tmlerr(new_tmlerr(L, erridx), false, 29, "Invalid date format provided!");
+                        if (frac == 0) {
+                            out->type = TOML_INTEGER;
+                            out->v.i = (lua_Integer)secs;
+                        } else {
+                            out->type = TOML_FLOAT;
+                            out->v.f = (lua_Number)secs + frac;
+                        }
+                    } else {
+                        if (!parse_toml_date(&date_src, out->v.date))
+                            return set_tmlerr(new_tmlerr(L, erridx), false, 29, "Invalid date format provided!");
+                        out->type = (TomlType)out->v.date[TOMLDATE_TOML_TYPE];
+                        // as microseconds, so that the field of the table means the same for any number of digits
+                        if (dates == TOMLDATES_TABLE) out->v.date[TOMLDATE_FRACTIONAL] = (int)toml_date_fraction(&date_src, 6);
+                    }
+                } else if (is_float) {
+                    if (!lex_float_or_handle(out, buf, buf->data, buf->len, opts[TOMLOPTS_OVERFLOW_ERRORS], opts[TOMLOPTS_UNDERFLOW_ERRORS])) return set_tmlerr(new_tmlerr(L, erridx), false, 35, "Parse error: float literal overflow");
+                } else {
+                    if (!lex_integer_or_handle(out, buf->data, buf->len, 10, opts[TOMLOPTS_OVERFLOW_ERRORS])) return set_tmlerr(new_tmlerr(L, erridx), false, 37, "Parse error: integer literal overflow");
+                }
+                return true;
+            }
+        }
+    }
+    return set_tmlerr(new_tmlerr(L, erridx), false, 13, "invalid value");
+}
+
+// pushes the value of a multi-line string, as a TomluaMultiStr if requested
+static inline bool push_multi_string(lua_State *L, const char *str, size_t len, bool as_multi, int erridx) {
+    if (!as_multi) {
+        lua_pushlstring(L, str, len);
+        return true;
+    }
+    str_buf *s = (str_buf *)lua_newuserdata(L, sizeof(str_buf));
+    if (!s) {
+        return set_tmlerr(new_tmlerr(L, erridx), false, 59, "tomlua.decode failed to push multi-line string to lua stack");
+    }
+    *s = new_buf_from_str(str, len);
+    if (!s->data) {
+        return set_tmlerr(new_tmlerr(L, erridx), false, 59, "tomlua.decode failed to push multi-line string to lua stack");
+    }
+    push_multi_string_mt(L);
+    lua_setmetatable(L, -2);
+    return true;
+}
+
+// pushes a value read by lex_scalar, multi-line strings as TomluaMultiStr if multi_strings is set,
+// and dates as plain tables if dates is "table"
+static inline bool push_scalar(lua_State *L, TomlScalar *val, const TomluaUserOpts opts, int erridx) {
+    switch (val->type) {
+        case TOML_BOOL:
+            lua_pushboolean(L, val->v.b);
+            return true;
+        case TOML_INTEGER:
+            lua_pushinteger(L, val->v.i);
+            return true;
+        case TOML_FLOAT:
+            lua_pushnumber(L, val->v.f);
+            return true;
+        case TOML_STRING:
+            STATS_INC(STATS_DECODE_STRINGS);
+            lua_pushlstring(L, val->v.str.data, val->v.str.len);
+            return true;
+        case TOML_STRING_MULTI:
+            STATS_INC(STATS_DECODE_STRINGS);
+            return push_multi_string(L, val->v.str.data, val->v.str.len, opts[TOMLOPTS_MULTI_STRINGS], erridx);
+        default:
+            if (opts_dates(opts) == TOMLDATES_TABLE) {
+                if (!push_toml_date_table(L, val->v.date))
+                    return set_tmlerr(new_tmlerr(L, erridx), false, 51, "tomlua.decode failed to push date type to lua stack");
+                return true;
+            }
+            if (!push_new_toml_date(L, val->v.date))
+                return set_tmlerr(new_tmlerr(L, erridx), false, 51, "tomlua.decode failed to push date type to lua stack");
+            return true;
+    }
+}
+
+#endif  // SRC_DECODE_VALUE_H_
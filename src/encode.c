@@ -2,24 +2,35 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <lauxlib.h>
 #include "dates.h"
 #include "types.h"
 #include "opts.h"
 #include "encode.h"
+#include "decode.h"
+#include "encode_num.h"
+#include "encode_str.h"
+#include "scan.h"
 #include "error_context.h"
+#include "stats.h"
 
 #define ENCODE_VISITED_IDX 2
+#define ENCODE_HELD_IDX 3
+#define ENCODE_SINK_IDX 4
 
 typedef struct {
+    size_t off;  // of the key in Keys.arena
     size_t len;
-    char * str;
     bool wasnum;
 } KeyEntry;
 
+// the keys of the heading being written. Their strings are copied into 1 arena, which pop_key truncates
 typedef struct {
     int len;
     int cap;
     KeyEntry *keys;
+    str_buf arena;
 } Keys;
 
 static inline Keys new_keys() {
@@ -27,8 +38,14 @@ static inline Keys new_keys() {
         .len = 0,
         .cap = 2,
         .keys = malloc(sizeof(KeyEntry) * k.cap),
+        .arena = new_str_buf(),
     };
-    if (k.keys == NULL) k.cap = 0;
+    if (k.keys == NULL || k.arena.data == NULL) {
+        free(k.keys);
+        free_str_buf(&k.arena);
+        k.keys = NULL;
+        k.cap = 0;
+    }
     return k;
 }
 
@@ -38,12 +55,11 @@ static inline bool push_lua_key(lua_State *L, Keys *keys, int idx) {
     const char *str = lua_tolstring(L, idx, &klen);
     if (str == NULL) return false;
     KeyEntry k = {
-        .str = malloc(klen + 1),
+        .off = keys->arena.len,
         .len = klen,
         .wasnum = wasnum
     };
-    memcpy(k.str, str, klen);
-    k.str[klen] = '\0';
+    if (klen > 0 && !buf_push_str(&keys->arena, str, klen)) return false;
     size_t required_len = keys->len + 1;
     if (required_len > keys->cap) {
         size_t new_capacity = keys->cap > 0 ? keys->cap : 1;
@@ -59,10 +75,8 @@ static inline bool push_lua_key(lua_State *L, Keys *keys, int idx) {
 
 static inline void free_keys(Keys *k) {
     if (k && k->keys) {
-        for (int i = 0; i < k->len; i++) {
-            free(k->keys[i].str);
-        }
         free(k->keys);
+        free_str_buf(&k->arena);
         k->keys = NULL;
         k->len = 0;
         k->cap = 0;
@@ -70,42 +84,15 @@ static inline void free_keys(Keys *k) {
 }
 
 static inline void pop_key(Keys *k) {
-    free(k->keys[k->len - 1].str);
-    k->len--;
-}
-
-// works for char or uint32_t
-static inline bool buf_push_toml_escaped_char(str_buf *buf, const uint32_t c, const bool esc_non_ascii) {
-    switch (c) {
-        case '"':  return buf_push_str(buf, "\\\"", 2); break;
-        case '\n': return buf_push_str(buf, "\\n", 2); break;
-        case '\r': return buf_push_str(buf, "\\r", 2); break;
-        case '\\': return buf_push_str(buf, "\\\\", 2); break;
-        case '\b': return buf_push_str(buf, "\\b", 2); break;
-        case '\t': return buf_push_str(buf, "\\t", 2); break;
-        case '\f': return buf_push_str(buf, "\\f", 2); break;
-        default:
-            if (c <= 0x7F) {
-                return buf_push(buf, c);  // normal ASCII
-            } else if (esc_non_ascii) {
-                if (c <= 0xFFFF) {
-                    char out[7];
-                    int len = snprintf(out, sizeof(out), "\\u%04X", c);
-                    return buf_push_str(buf, out, len);
-                } else {
-                    char out[11];
-                    int len = snprintf(out, sizeof(out), "\\U%08X", c);
-                    return buf_push_str(buf, out, len);
-                }
-            } else {
-                return buf_push_utf8(buf, c);
-            }
-    }
+    k->arena.len = k->keys[--k->len].off;
 }
 
 // 0 for print inline, 1 for table heading, 2 for array heading
 // does not verify that the value is a table for optimization reasons
-static inline int toml_heading_type(lua_State *L, int idx) {
+// sets is_array to whether is_lua_array would be true for it when that was found out on the way, and -1 otherwise,
+// so that an inline value does not need to be looked through again before it is written
+static inline int toml_heading_type(lua_State *L, int idx, int *is_array) {
+    *is_array = -1;
     int old_top = lua_gettop(L);
     idx = absindex(old_top, idx);
     if (!lua_istable(L, idx)) return 0;
@@ -114,14 +101,17 @@ static inline int toml_heading_type(lua_State *L, int idx) {
         case TOML_TABLE_INLINE:
             return 0;
         case TOML_ARRAY:
-            if (lua_arraylen(L, idx) == 0) return 0;
-            else break;
+            if (lua_arraylen(L, idx) == 0) {
+                *is_array = 1;
+                return 0;
+            } else break;
         default:
             if (lua_arraylen(L, idx) == 0) return 1;
     }
     bool is_array_heading = true;
     int count = 0;
     lua_Number highest_int_key = 0;
+    STATS_INC(STATS_ENCODE_TRAVERSALS);
     lua_pushnil(L);  // next(nil) // get first kv pair on stack
     while (lua_next(L, idx) != 0) {
         // now at stack: key value
@@ -142,6 +132,7 @@ static inline int toml_heading_type(lua_State *L, int idx) {
     }
     lua_settop(L, old_top);
     if (highest_int_key != count || count == 0) return 1;
+    *is_array = 1;
     return (is_array_heading) ? 2 : 0;
 }
 
@@ -158,6 +149,7 @@ static inline bool is_lua_array(lua_State *L, int idx) {
     }
     int count = 0;
     lua_Number highest_int_key = 0;
+    STATS_INC(STATS_ENCODE_TRAVERSALS);
     lua_pushnil(L);  // next(nil) // get first kv pair on stack
     while (lua_next(L, idx) != 0) {
         // now at stack: key value
@@ -180,63 +172,11 @@ static inline bool is_lua_array(lua_State *L, int idx) {
     return true;
 }
 
-static bool buf_push_esc_multi(str_buf *dst, str_iter *src) {
-    if (!buf_push_str(dst, "\"\"\"", 3)) return false;
-    while (iter_peek(src).ok) {
-        char c = iter_peek(src).v;
-        if (iter_starts_with(src, "\r\n", 2)) {
-            iter_skip_n(src, 2);
-            if (!buf_push_str(dst, "\r\n", 2)) return false;
-        } else if (iter_starts_with(src, "\"\"\"", 3)) {
-            iter_skip_n(src, 3);
-            if (!buf_push_str(dst, "\"\"\\\"", 4)) return false;
-        } else if (c == '"') {
-            iter_skip(src);
-            if (!buf_push(dst, '"')) return false;
-        } else if (c == '\n') {
-            iter_skip(src);
-            if (!buf_push(dst, '\n')) return false;
-        } else {
-            iter_utf8_result res = iter_next_utf8(src);
-            if (!res.ok) break;
-            if (!buf_push_toml_escaped_char(dst, res.v, false)) return false;
-        }
-    }
-    if (!buf_push_str(dst, "\"\"\"", 3)) return false;
-    return true;
-}
-
-static bool buf_push_esc_simple(str_buf *dst, str_iter *src) {
-    if (!buf_push(dst, '"')) return false;
-    for (iter_utf8_result curr = iter_next_utf8(src); curr.ok; curr = iter_next_utf8(src)) {
-        if (!buf_push_toml_escaped_char(dst, curr.v, false)) return false;
-    }
-    if (!buf_push(dst, '"')) return false;
-    return true;
-}
-
-static inline bool buf_push_esc_key(str_buf *buf, str_iter *iter, bool wasnum) {
-    bool all_digits = true;
-    for (iter_result curr = iter_next(iter); curr.ok; curr = iter_next(iter)) {
-        char c = curr.v;
-        if (c < '0' || '9' < c) all_digits = false;
-        if (!is_identifier_char(c)) {
-            iter_reset_pos(iter);
-            return buf_push_esc_simple(buf, iter);
-        }
-    }
-    if (all_digits && !wasnum) {
-        iter_reset_pos(iter);
-        return buf_push_esc_simple(buf, iter);
-    }
-    return buf_push_str(buf, iter->buf, iter->len);
-}
-
 static bool buf_push_keys(str_buf *buf, const Keys *keys) {
     for (int i = 0; i < keys->len; i++) {
         KeyEntry k = keys->keys[i];
         str_iter src = {
-            .buf = k.str,
+            .buf = keys->arena.data + k.off,
             .pos = 0,
             .len = k.len,
         };
@@ -293,7 +233,57 @@ static inline bool buf_push_heading(lua_State *L, str_buf *buf, const Keys *keys
     return true;
 }
 
-static bool buf_push_inline_value(lua_State *L, str_buf *buf, bool int_keys, int level) {
+static bool buf_push_inline_value(lua_State *L, str_buf *buf, bool int_keys, int is_array, int level);
+
+// the text between the values of an inline array at level, or before the first one. -1 keeps it on 1 line
+static inline size_t array_indent(char *indent, int level) {
+    size_t inlen = (level >= 0) ? (size_t)(level + 1) * 2 + 1 : 1;
+    indent[0] = (level >= 0) ? '\n' : ' ';
+    for (size_t i = 1; i < inlen; i++) indent[i] = ' ';
+    return inlen;
+}
+
+// writes the values of the table at val_idx as an inline array, in the order lua_next gives them.
+// For a table only made of an array part, that is 1 to len, so it is both checked and written in 1 traversal.
+// Returns 1 if it was written, 0 if its keys did not come as 1 to len, in which case buf is left as it was, or -1 on error
+static int buf_push_next_array(lua_State *L, str_buf *buf, int val_idx, size_t len, bool int_keys, int level) {
+    size_t start = buf->len;
+    char indent[(level >= 0) ? (level + 1) * 2 + 1 : 1];
+    size_t inlen = array_indent(indent, level);
+    if (!buf_push(buf, '[') || !buf_push_str(buf, indent, inlen)) {
+        set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 26, "failed to push array start");
+        return -1;
+    }
+    size_t expected = 1;
+    STATS_INC(STATS_ENCODE_TRAVERSALS);
+    lua_pushnil(L);  // next(nil) // get first kv pair on stack
+    while (lua_next(L, val_idx) != 0) {
+        // now at stack: key value
+        if (expected > len || lua_type(L, -2) != LUA_TNUMBER || lua_tonumber(L, -2) != (lua_Number)expected) {
+            lua_settop(L, val_idx);
+            buf->len = start;
+            return 0;
+        }
+        if (expected > 1) {
+            if (!buf_push(buf, ',')) { set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 30, "failed to push array separator"); return -1; }
+            if (!buf_push_str(buf, indent, inlen)) { set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 30, "failed to push indent to array"); return -1; }
+        }
+        // pops the value, leaving the key for lua_next
+        if (!buf_push_inline_value(L, buf, int_keys, -1, (level >= 0) ? level + 1 : -1)) return -1;
+        expected++;
+    }
+    if (expected - 1 != len) {
+        buf->len = start;
+        return 0;
+    }
+    inlen = (level >= 0) ? (size_t)level * 2 + 1 : 1;
+    if (!buf_push_str(buf, indent, inlen)) { set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 30, "failed to push indent to array"); return -1; }
+    if (!buf_push(buf, ']')) { set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 24, "failed to push array end"); return -1; }
+    return 1;
+}
+
+// is_array is whether is_lua_array is true for the value if that is already known, or -1
+static bool buf_push_inline_value(lua_State *L, str_buf *buf, bool int_keys, int is_array, int level) {
     int val_idx = lua_gettop(L);
     int vtype = lua_type(L, val_idx);
     switch (vtype) {
@@ -302,9 +292,15 @@ static bool buf_push_inline_value(lua_State *L, str_buf *buf, bool int_keys, int
             if (src.buf == NULL || !buf_push_esc_simple(buf, &src)) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 36, "failed to push escaped simple string");
         } break;
         case LUA_TNUMBER: {
-            size_t len;
-            const char *str = lua_tolstring(L, val_idx, &len);
-            if (!buf_push_str(buf, str, len)) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 21, "failed to push number");
+#if LUA_VERSION_NUM >= 503
+            bool pushed = (lua_isinteger(L, val_idx))
+                ? buf_push_int(buf, (int64_t)lua_tointeger(L, val_idx))
+                : buf_push_float(buf, (double)lua_tonumber(L, val_idx), true);
+#else
+            // there are only floats, so the integral ones are written as integers
+            bool pushed = buf_push_float(buf, (double)lua_tonumber(L, val_idx), false);
+#endif
+            if (!pushed) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 21, "failed to push number");
         } break;
         case LUA_TBOOLEAN: if (lua_toboolean(L, val_idx)) {
                 buf_push_str(buf, "true", 4);
@@ -312,6 +308,8 @@ static bool buf_push_inline_value(lua_State *L, str_buf *buf, bool int_keys, int
                 buf_push_str(buf, "false", 5);
             } break;
         case LUA_TTABLE: {
+            if (!lua_checkstack(L, 8)) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 23, "value nested too deeply");
+            if (push_frozen_view(L, val_idx)) lua_replace(L, val_idx);
             // cycle detection
             lua_pushvalue(L, val_idx);
             lua_rawget(L, ENCODE_VISITED_IDX);
@@ -321,29 +319,35 @@ static bool buf_push_inline_value(lua_State *L, str_buf *buf, bool int_keys, int
             lua_pushboolean(L, true);
             lua_rawset(L, ENCODE_VISITED_IDX);
 
-            if (is_lua_array(L, val_idx)) {
-                int len = lua_arraylen(L, val_idx);
+            size_t len = lua_arraylen(L, val_idx);
+            int written = 0;
+            if (is_array < 0 && len > 0) {
+                written = buf_push_next_array(L, buf, val_idx, len, int_keys, level);
+                if (written < 0) return false;
+            }
+            if (written) {
+                // already written while finding out that it is an array
+            } else if ((is_array < 0) ? is_lua_array(L, val_idx) : is_array) {
                 if (!buf_push(buf, '[')) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 26, "failed to push array start");
                 if (len > 0) {
-                    int inlen = (level >= 0) ? (level + 1) * 2 + 1 : 1;
-                    char indent[inlen];
-                    indent[0] = (level >= 0) ? '\n' : ' ';
-                    for (int i = 1; i < inlen; i++) indent[i] = ' ';
+                    char indent[(level >= 0) ? (level + 1) * 2 + 1 : 1];
+                    size_t inlen = array_indent(indent, level);
                     if (!buf_push_str(buf, indent, inlen)) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 30, "failed to push indent to array");
-                    for (int i = 1; i <= len; i++) {
+                    for (size_t i = 1; i <= len; i++) {
                         lua_rawgeti(L, val_idx, i);
-                        if(!buf_push_inline_value(L, buf, int_keys, (level >= 0) ? level + 1 : -1)) return false;
+                        if(!buf_push_inline_value(L, buf, int_keys, -1, (level >= 0) ? level + 1 : -1)) return false;
                         if (i != len) {
                             if (!buf_push(buf, ',')) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 30, "failed to push array separator");
                             if (!buf_push_str(buf, indent, inlen)) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 30, "failed to push indent to array");
                         }
                     }
-                    inlen = (level >= 0) ? level * 2 + 1 : 1;
+                    inlen = (level >= 0) ? (size_t)level * 2 + 1 : 1;
                     if (!buf_push_str(buf, indent, inlen)) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 30, "failed to push indent to array");
                 }
                 if (!buf_push(buf, ']')) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 24, "failed to push array end");
             } else {
                 if (!buf_push(buf, '{')) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 26, "failed to push table start");
+                STATS_INC(STATS_ENCODE_TRAVERSALS);
                 lua_pushnil(L); // for lua_next
                 bool first = true;
                 while (lua_next(L, val_idx) != 0) {
@@ -365,7 +369,7 @@ static bool buf_push_inline_value(lua_State *L, str_buf *buf, bool int_keys, int
                     lua_pop(L, 1);
                     if (!buf_push_str(buf, " = ", 3)) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 27, "failed to push table equals");
                     // pop and push value to buffer (-1 because no newlines allowed)
-                    if (!buf_push_inline_value(L, buf, int_keys, -1)) return false;
+                    if (!buf_push_inline_value(L, buf, int_keys, -1, -1)) return false;
                 }
                 if (!first) {
                     if (!buf_push(buf, ' ')) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 35, "failed to push table trailing space");
@@ -404,31 +408,85 @@ static bool buf_push_inline_value(lua_State *L, str_buf *buf, bool int_keys, int
     return true;
 }
 
-//---@class Tomlua.Deferred_Heading
-//---@field is_array boolean
-//---@field key string
-//---@field value any
-// leaves stack how it found it, writes entries to residx list
-static bool buf_push_heading_table(lua_State *L, str_buf *buf, const int validx, bool int_keys) {
-    lua_newtable(L);
-    int residx = lua_gettop(L);
-    int result_len = 0;
+// where tomlua.encode_to sends the output. It is handed over in chunks of exactly chunk bytes, and the rest at the end.
+// The buffer is only flushed between statements, never inside a value, as writing an inline array can rewind it
+typedef struct {
+    FILE *file;  // opened from a path, otherwise the sink is the file handle or function at ENCODE_SINK_IDX
+    bool is_handle;  // the value at ENCODE_SINK_IDX has a write method
+    size_t chunk;
+} EncodeSink;
+
+// hands every full chunk in buf to the sink, and what is left when all is set
+static bool sink_flush(lua_State *L, str_buf *buf, EncodeSink *sink, bool all) {
+    size_t done = 0;
+    while (buf->len - done >= sink->chunk || (all && done < buf->len)) {
+        size_t n = buf->len - done;
+        if (n > sink->chunk) n = sink->chunk;
+        if (sink->file) {
+            if (fwrite(buf->data + done, 1, n, sink->file) != n) {
+                tmlerr_push_fmt(new_tmlerr(L, ENCODE_VISITED_IDX), "failed to write to file: %s", strerror(errno));
+                return false;
+            }
+        } else {
+            int top = lua_gettop(L);
+            if (sink->is_handle) {
+                lua_getfield(L, ENCODE_SINK_IDX, "write");
+                lua_pushvalue(L, ENCODE_SINK_IDX);
+            } else {
+                lua_pushvalue(L, ENCODE_SINK_IDX);
+            }
+            lua_pushlstring(L, buf->data + done, n);
+            if (lua_pcall(L, (sink->is_handle) ? 2 : 1, 2, 0) != 0) {
+                const char *msg = lua_tostring(L, -1);
+                tmlerr_push_fmt(new_tmlerr(L, ENCODE_VISITED_IDX), "encode_to sink error: %s", (msg) ? msg : "(no message)");
+                return false;
+            }
+            // file:write returns nil and a message when it fails
+            if (sink->is_handle && lua_isnil(L, -2)) {
+                const char *msg = lua_tostring(L, -1);
+                tmlerr_push_fmt(new_tmlerr(L, ENCODE_VISITED_IDX), "failed to write to file: %s", (msg) ? msg : "(no message)");
+                return false;
+            }
+            lua_settop(L, top);
+        }
+        STATS_ADD(STATS_ENCODE_BYTES, n);
+        done += n;
+    }
+    if (done > 0) {
+        memmove(buf->data, buf->data + done, buf->len - done);
+        buf->len -= done;
+    }
+    return true;
+}
+
+static inline bool sink_maybe_flush(lua_State *L, str_buf *buf, EncodeSink *sink) {
+    if (!sink || buf->len < sink->chunk) return true;
+    return sink_flush(L, buf, sink, false);
+}
+
+// the headings of the tables being written, in the order they are written after the plain values of their table.
+// Each table's headings come after those of its parents, and are removed once they are written.
+// Only whether each is an array heading is kept here. Their keys and values are kept in the table at ENCODE_HELD_IDX,
+// at 2 * i + 1 and 2 * i + 2 for the heading at i, as the lua stack is too small to hold them on some lua versions
+typedef str_buf DeferQueue;
+
+// leaves stack how it found it, appends its headings to q
+static bool buf_push_heading_table(lua_State *L, str_buf *buf, const int validx, DeferQueue *q, EncodeSink *sink, bool int_keys) {
+    STATS_INC(STATS_ENCODE_TRAVERSALS);
     lua_pushnil(L);  // next(nil) // get first kv pair on stack
     while (lua_next(L, validx) != 0) {
         int vidx = lua_gettop(L);
         int key_idx = vidx - 1;
+        if (lua_istable(L, vidx) && push_frozen_view(L, vidx)) lua_replace(L, vidx);
         // 0(inline), 1(table), or 2(is_array)
-        int table_type = toml_heading_type(L, vidx);
+        int is_array = -1;
+        int table_type = toml_heading_type(L, vidx, &is_array);
         if (table_type) {
-            // create Deferred_Heading
-            lua_newtable(L);
-            lua_pushboolean(L, table_type == 2);
-            lua_setfield(L, -2, "is_array");
+            lua_Integer held = (lua_Integer)q->len * 2;
+            if (!buf_push(q, table_type == 2)) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 30, "failed to queue table heading");
             lua_pushvalue(L, key_idx);
-            lua_setfield(L, -2, "key");
-            lua_pushvalue(L, vidx);
-            lua_setfield(L, -2, "value");
-            lua_rawseti(L, residx, ++result_len);
+            lua_rawseti(L, ENCODE_HELD_IDX, held + 1);
+            lua_rawseti(L, ENCODE_HELD_IDX, held + 2);
         } else {
             lua_pushvalue(L, key_idx);
             bool wasnum = lua_type(L, -1) == LUA_TNUMBER;
@@ -440,30 +498,28 @@ static bool buf_push_heading_table(lua_State *L, str_buf *buf, const int validx,
             if (!buf_push_esc_key(buf, &lstr, wasnum)) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 32, "failed to push table heading key");
             lua_pop(L, 1);
             if (!buf_push_str(buf, " = ", 3)) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 44, "failed to push equals in table heading entry");
-            if (!buf_push_inline_value(L, buf, int_keys, 0)) return false;
+            if (!buf_push_inline_value(L, buf, int_keys, is_array, 0)) return false;
             if (!buf_push(buf, '\n')) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 48, "failed to push newline after table heading entry");
+            if (!sink_maybe_flush(L, buf, sink)) return false;
         }
         lua_settop(L, key_idx);
     }
-    lua_settop(L, residx);
     return true;
 }
 
-static bool flush_q(lua_State *L, str_buf *buf, Keys *keys, bool int_keys) {
-    int input_idx = lua_gettop(L);
-    size_t inlen = lua_arraylen(L, input_idx);
-    for (size_t i = 1; i <= inlen; i++) {
-        lua_rawgeti(L, input_idx, i);
-        int deferred = lua_gettop(L);
-        lua_getfield(L, deferred, "is_array");
-        bool is_heading_array = lua_toboolean(L, -1);
-        lua_settop(L, deferred);
-        lua_getfield(L, deferred, "key");
+// writes the headings queued from index from onwards, then removes them from q
+static bool flush_q(lua_State *L, str_buf *buf, Keys *keys, DeferQueue *q, size_t from, EncodeSink *sink, bool int_keys) {
+    // every heading nested in another one is flushed 1 call deeper
+    if (!lua_checkstack(L, 8)) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 23, "value nested too deeply");
+    for (size_t i = from; i < q->len; i++) {
+        bool is_heading_array = q->data[i];
+        lua_rawgeti(L, ENCODE_HELD_IDX, (lua_Integer)i * 2 + 1);
         // NOTE: because you pop these, you have to copy them, or they may get GC'd
         if (!push_lua_key(L, keys, -1)) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 20, "failed to store key!");
-        lua_settop(L, deferred);
-        lua_getfield(L, deferred, "value");
-        lua_replace(L, deferred);
+        lua_pop(L, 1);
+        lua_rawgeti(L, ENCODE_HELD_IDX, (lua_Integer)i * 2 + 2);
+        int deferred = lua_gettop(L);
+        size_t mark = q->len;
         if (is_heading_array) {
             size_t array_len = lua_arraylen(L, deferred);
             for (size_t i = 1; i <= array_len; i++) {
@@ -471,6 +527,7 @@ static bool flush_q(lua_State *L, str_buf *buf, Keys *keys, bool int_keys) {
                 if (!buf_push_heading(L, buf, keys, true)) return false;
                 lua_rawgeti(L, deferred, i);
                 int tidx = lua_gettop(L);
+                if (push_frozen_view(L, tidx)) lua_replace(L, tidx);
                 // cycle detection
                 lua_pushvalue(L, tidx);
                 lua_rawget(L, ENCODE_VISITED_IDX);
@@ -480,14 +537,12 @@ static bool flush_q(lua_State *L, str_buf *buf, Keys *keys, bool int_keys) {
                 lua_pushboolean(L, true);
                 lua_rawset(L, ENCODE_VISITED_IDX);
 
-                if(!buf_push_heading_table(L, buf, tidx, int_keys)) return false;
-                if(!flush_q(L, buf, keys, int_keys)) return false;
+                if(!buf_push_heading_table(L, buf, tidx, q, sink, int_keys)) return false;
+                if(!flush_q(L, buf, keys, q, mark, sink, int_keys)) return false;
 
-                lua_settop(L, tidx);
                 lua_pushnil(L);
                 lua_rawset(L, ENCODE_VISITED_IDX);
             }
-            lua_settop(L, deferred - 1);
         } else {
             if (!buf_push(buf, '\n')) return set_tmlerr(new_tmlerr(L, ENCODE_VISITED_IDX), false, 54, "failed to push newline before processing table heading");
             // cycle detection
@@ -500,29 +555,74 @@ static bool flush_q(lua_State *L, str_buf *buf, Keys *keys, bool int_keys) {
             lua_rawset(L, ENCODE_VISITED_IDX);
 
             if(!buf_push_heading(L, buf, keys, false)) return false;
-            if(!buf_push_heading_table(L, buf, deferred, int_keys)) return false;
-            if(!flush_q(L, buf, keys, int_keys)) return false;
+            if(!buf_push_heading_table(L, buf, deferred, q, sink, int_keys)) return false;
+            if(!flush_q(L, buf, keys, q, mark, sink, int_keys)) return false;
 
-            lua_settop(L, deferred);
+            lua_pushvalue(L, deferred);
             lua_pushnil(L);
             lua_rawset(L, ENCODE_VISITED_IDX);
         }
+        lua_settop(L, deferred - 1);
         // frees and removes last key
         pop_key(keys);
     }
-    lua_settop(L, input_idx - 1);
+    q->len = from;
     return true;
 }
 
-int encode(lua_State *L) {
-    TomluaUserOpts *opts = get_opts_upval(L);
-    bool int_keys = (*opts)[TOMLOPTS_INT_KEYS];
+// encodes the table at index 1 into buf, which is expected to be empty, with keys and q as scratch space
+// returns the number of results, which are the encoded string, or nil and the error.
+// With a sink, the output goes to it instead, and the result is true. Its file handle or function is at index 2
+static int encode_into(lua_State *L, str_buf *buf, Keys *keys, DeferQueue *q, EncodeSink *sink, bool int_keys) {
     if (!lua_istable(L, 1)) {
         lua_settop(L, 0);
         lua_pushnil(L);
         lua_pushstring(L, "Argument must be a table");
         return 2;
     }
+    STATS_INC(STATS_ENCODE_CALLS);
+    STATS_TIMER(encode_start);
+    lua_settop(L, (sink) ? 2 : 1);
+    // a result of cached_decode is an empty proxy, so what is written is the table it reads from.
+    // The same is done for every table in it, where each table is first looked at
+    if (push_frozen_view(L, 1)) lua_replace(L, 1);
+    // NOTE: ENCODE_VISITED_IDX; // 2
+    // This will also be where our error ends up if we get one.
+    lua_newtable(L);
+    lua_insert(L, ENCODE_VISITED_IDX);
+    // ENCODE_HELD_IDX // 3
+    lua_newtable(L);
+    lua_insert(L, ENCODE_HELD_IDX);
+    // ENCODE_SINK_IDX // 4, only with a sink
+    if(!buf_push_heading_table(L, buf, 1, q, sink, int_keys)) goto fail;
+    if(!flush_q(L, buf, keys, q, 0, sink, int_keys)) goto fail;
+    if (sink) {
+        if (!sink_flush(L, buf, sink, true)) goto fail;
+        STATS_ADD_TIME(STATS_ENCODE_NS, encode_start);
+        lua_settop(L, 0);
+        lua_pushboolean(L, true);
+        return 1;
+    }
+    STATS_ADD(STATS_ENCODE_BYTES, buf->len);
+    STATS_ADD_TIME(STATS_ENCODE_NS, encode_start);
+    lua_settop(L, 0);
+    push_buf_to_lua_string(L, buf);
+    return 1;
+fail:
+    STATS_ADD_TIME(STATS_ENCODE_NS, encode_start);
+    // the keys of the headings being written when it failed
+    keys->len = 0;
+    keys->arena.len = 0;
+    q->len = 0;
+    lua_settop(L, ENCODE_VISITED_IDX);
+    lua_pushnil(L);
+    push_tmlerr_string(L, get_err_val(L, ENCODE_VISITED_IDX));
+    return 2;
+}
+
+int encode(lua_State *L) {
+    TomluaUserOpts *opts = get_opts_upval(L);
+    bool int_keys = (*opts)[TOMLOPTS_INT_KEYS];
     str_buf buf = new_str_buf();
     if (buf.data == NULL) {
         lua_settop(L, 0);
@@ -532,27 +632,200 @@ int encode(lua_State *L) {
     }
     Keys keys = new_keys();
     if (keys.keys == NULL) {
+        free_str_buf(&buf);
         lua_settop(L, 0);
         lua_pushnil(L);
         lua_pushstring(L, "Unable to allocate memory for keys struct");
         return 2;
     }
-    lua_settop(L, 1);
-    // NOTE: ENCODE_VISITED_IDX; // 2
-    // This will also be where our error ends up if we get one.
-    lua_newtable(L);
-    if(!buf_push_heading_table(L, &buf, 1, int_keys)) goto fail;
-    if(!flush_q(L, &buf, &keys, int_keys)) goto fail;
-    free_keys(&keys);
-    lua_settop(L, 0);
-    push_buf_to_lua_string(L, &buf);
+    DeferQueue q = new_str_buf();
+    int res = encode_into(L, &buf, &keys, &q, NULL, int_keys);
     free_str_buf(&buf);
-    return 1;
-fail:
+    free_keys(&keys);
+    free_str_buf(&q);
+    return res;
+}
+
+// the file a path sink is written to. The output goes to path.tmp, which only replaces path once all of it is written,
+// so a failed encode leaves the file at path as it was. The paths follow the struct, as "path\0path.tmp\0"
+typedef struct {
+    FILE *file;
+    size_t path_len;
+} EncodeFile;
+
+static inline char *encode_file_path(EncodeFile *ef) { return (char *)(ef + 1); }
+static inline char *encode_file_tmp(EncodeFile *ef) { return encode_file_path(ef) + ef->path_len + 1; }
+
+// closes the file and removes path.tmp, unless it was already done
+static void encode_file_abort(EncodeFile *ef) {
+    if (ef->file == NULL) return;
+    fclose(ef->file);
+    ef->file = NULL;
+    remove(encode_file_tmp(ef));
+}
+
+// also when a lua error unwinds through encode_to
+static int encode_file_gc(lua_State *L) {
+    encode_file_abort((EncodeFile *)lua_touserdata(L, 1));
+    return 0;
+}
+
+// closes path.tmp and moves it to path, returns false with errno set if that failed, after removing path.tmp
+static bool encode_file_commit(EncodeFile *ef) {
+    FILE *f = ef->file;
+    ef->file = NULL;
+    if (fclose(f) != 0) {
+        int e = errno;
+        remove(encode_file_tmp(ef));
+        errno = e;
+        return false;
+    }
+#ifdef _WIN32
+    remove(encode_file_path(ef));
+#endif
+    if (rename(encode_file_tmp(ef), encode_file_path(ef)) != 0) {
+        int e = errno;
+        remove(encode_file_tmp(ef));
+        errno = e;
+        return false;
+    }
+    return true;
+}
+
+// opens path.tmp for the path at index 1, and replaces the path with the EncodeFile that owns it.
+// returns NULL with errno set if it could not be opened
+static EncodeFile *encode_file_open(lua_State *L) {
+    size_t len;
+    const char *path = lua_tolstring(L, 1, &len);
+    EncodeFile *ef = (EncodeFile *)lua_newuserdata(L, sizeof(EncodeFile) + len * 2 + 6);
+    ef->file = NULL;
+    ef->path_len = len;
+    memcpy(encode_file_path(ef), path, len + 1);
+    memcpy(encode_file_tmp(ef), path, len);
+    memcpy(encode_file_tmp(ef) + len, ".tmp", 5);
+    if (luaL_newmetatable(L, "TomluaEncodeFile")) {
+        lua_pushcfunction(L, encode_file_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    lua_replace(L, 1);
+    ef->file = fopen(encode_file_tmp(ef), "wb");
+    return (ef->file) ? ef : NULL;
+}
+
+// tomlua.encode_to(sink, table, chunk_size?) -> true?, err?
+int encode_to(lua_State *L) {
+    TomluaUserOpts *opts = get_opts_upval(L);
+    bool int_keys = (*opts)[TOMLOPTS_INT_KEYS];
+    lua_Integer chunk = luaL_optinteger(L, 3, ENCODE_TO_DEFAULT_CHUNK);
+    if (chunk <= 0) return luaL_argerror(L, 3, "chunk size must be positive");
+    // before anything is opened, so that a bad argument can not truncate the file
+    if (!lua_istable(L, 2)) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "Argument must be a table");
+        return 2;
+    }
+    EncodeSink sink = { .file = NULL, .is_handle = false, .chunk = (size_t)chunk };
+    EncodeFile *ef = NULL;
+    switch (lua_type(L, 1)) {
+        case LUA_TSTRING:
+            ef = encode_file_open(L);
+            if (!ef) {
+                lua_settop(L, 0);
+                lua_pushnil(L);
+                lua_pushfstring(L, "failed to open file: %s", strerror(errno));
+                return 2;
+            }
+            sink.file = ef->file;
+            break;
+        case LUA_TFUNCTION:
+            break;
+        case LUA_TTABLE:
+        case LUA_TUSERDATA:
+            lua_getfield(L, 1, "write");
+            if (lua_isnil(L, -1)) return luaL_argerror(L, 1, "file handle has no write method");
+            lua_pop(L, 1);
+            sink.is_handle = true;
+            break;
+        default:
+            return luaL_argerror(L, 1, "expected a path, a file handle or a function");
+    }
+    // the table goes first, with the sink after it
+    lua_settop(L, 2);
+    lua_insert(L, 1);
+    // For a path, the EncodeFile is also held in the registry until encode_to is done with it,
+    // as encode_into takes it off the stack before it returns
+    if (ef) {
+        lua_pushlightuserdata(L, ef);
+        lua_pushvalue(L, 2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    str_buf buf = new_str_buf();
+    Keys keys = new_keys();
+    DeferQueue q = new_str_buf();
+    int res;
+    if (buf.data == NULL || keys.keys == NULL) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "Unable to allocate memory for output buffer");
+        res = 2;
+    } else {
+        res = encode_into(L, &buf, &keys, &q, &sink, int_keys);
+    }
     free_str_buf(&buf);
     free_keys(&keys);
-    lua_settop(L, ENCODE_VISITED_IDX);
-    lua_pushnil(L);
-    push_tmlerr_string(L, get_err_val(L, ENCODE_VISITED_IDX));
-    return 2;
+    free_str_buf(&q);
+    if (ef) {
+        if (res != 1) {
+            encode_file_abort(ef);
+        } else if (!encode_file_commit(ef)) {
+            lua_settop(L, 0);
+            lua_pushnil(L);
+            lua_pushfstring(L, "failed to write to file: %s", strerror(errno));
+            res = 2;
+        }
+        lua_pushlightuserdata(L, ef);
+        lua_pushnil(L);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    return res;
+}
+
+struct EncodeArena {
+    str_buf buf;
+    Keys keys;
+    DeferQueue q;
+};
+
+EncodeArena *new_encode_arena(void) {
+    EncodeArena *arena = (EncodeArena *)malloc(sizeof(EncodeArena));
+    if (!arena) return NULL;
+    arena->buf = new_str_buf();
+    arena->keys = new_keys();
+    arena->q = new_str_buf();
+    if (arena->buf.data == NULL || arena->keys.keys == NULL || arena->q.data == NULL) {
+        free_encode_arena(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+void free_encode_arena(EncodeArena *arena) {
+    if (!arena) return;
+    free_str_buf(&arena->buf);
+    free_keys(&arena->keys);
+    free_str_buf(&arena->q);
+    free(arena);
+}
+
+void encode_arena_trim(EncodeArena *arena, size_t keep) {
+    buf_trim(&arena->buf, keep);
+    buf_trim(&arena->keys.arena, keep);
+    buf_trim(&arena->q, keep);
+}
+
+int encode_in_arena(lua_State *L, const TomluaUserOpts opts, EncodeArena *arena) {
+    arena->buf.len = 0;
+    return encode_into(L, &arena->buf, &arena->keys, &arena->q, NULL, opts[TOMLOPTS_INT_KEYS]);
 }
@@ -5,8 +5,21 @@
 #include <lua.h>
 #include <stddef.h>
 #include "./types.h"
+#include "./opts.h"
 
 int encode(lua_State *L);
+// tomlua.encode_to(sink, table, chunk_size?), sink being a path, a file handle, or a function taking each chunk
+int encode_to(lua_State *L);
+#define ENCODE_TO_DEFAULT_CHUNK 65536
+
+// the buffers of an encode, kept by tomlua.context from one call to the next
+typedef struct EncodeArena EncodeArena;
+EncodeArena *new_encode_arena(void);
+void free_encode_arena(EncodeArena *arena);
+// empties arena, freeing anything in it that is bigger than keep bytes
+void encode_arena_trim(EncodeArena *arena, size_t keep);
+// tomlua.encode with the buffers of arena, for the table at 1
+int encode_in_arena(lua_State *L, const TomluaUserOpts opts, EncodeArena *arena);
 
 // getmetatable(idx).toml_type to allow overriding of representation
 static inline TomlType get_meta_toml_type(lua_State *L, int idx) {
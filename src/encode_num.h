@@ -0,0 +1,185 @@
+// Copyright 2025 Birdee
+#ifndef SRC_ENCODE_NUM_H_
+#define SRC_ENCODE_NUM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+#include "./types.h"
+#include "./decode_num.h"
+#include "./encode_num_table.h"
+
+// Numbers are written straight into the output, instead of through lua_tolstring,
+// which interns a lua string for each of them and prints floats with only 14 significant digits.
+// Integers are written 2 digits at a time. Integral floats small enough to be exact are written the same way.
+// Other floats get the shortest digits that read back as the same double, found with Schubfach
+// (Raffaello Giulietti, "The Schubfach way to render doubles"), and are written like %g would write that many digits.
+
+static const char NUM_DIGIT_PAIRS[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// writes the digits of v so that they end right before end, and returns where they start
+static inline char *num_format_u64(uint64_t v, char *end) {
+    while (v >= 100) {
+        size_t pair = (size_t)(v % 100) * 2;
+        v /= 100;
+        end -= 2;
+        memcpy(end, NUM_DIGIT_PAIRS + pair, 2);
+    }
+    if (v >= 10) {
+        end -= 2;
+        memcpy(end, NUM_DIGIT_PAIRS + (size_t)v * 2, 2);
+    } else {
+        *--end = (char)('0' + v);
+    }
+    return end;
+}
+
+static inline bool buf_push_int(str_buf *buf, int64_t v) {
+    char tmp[24];
+    char *end = tmp + sizeof(tmp);
+    // negated as unsigned, so that INT64_MIN does not overflow
+    char *start = num_format_u64((v < 0) ? 0 - (uint64_t)v : (uint64_t)v, end);
+    if (v < 0) *--start = '-';
+    return buf_push_str(buf, start, (size_t)(end - start));
+}
+
+// floor(log10(2^e)), floor(log10(3/4 * 2^e)) and floor(log2(10^e)), exact for every exponent a double can need
+static inline int num_floor_log10_pow2(int e) { return (e * 1262611) >> 22; }
+static inline int num_floor_log10_three_quarters_pow2(int e) { return (e * 1262611 - 524031) >> 22; }
+static inline int num_floor_log2_pow10(int e) { return (e * 1741647) >> 19; }
+
+// the integer part of g * cp / 2^128, with its lowest bit set if the rest is not 0, which is all Schubfach needs of it
+static inline uint64_t num_round_to_odd(const uint64_t *g, uint64_t cp) {
+    uint64_t x0, y0;
+    uint64_t x1 = num_mul128(g[1], cp, &x0);
+    uint64_t y1 = num_mul128(g[0], cp, &y0);
+    uint64_t z = y0 + x1;
+    y1 += (z < y0);
+    return y1 | (z > 1);
+}
+
+// returns the fewest digits, times 10^*exp10, that read back as the positive finite double v.
+// Of those, the one nearest to v, and the even one on a tie
+static inline uint64_t num_shortest_decimal(double v, int *exp10) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    uint64_t t = bits & ((1ULL << 52) - 1);
+    int be = (int)((bits >> 52) & 0x7FF);
+    // v is c * 2^q
+    uint64_t c = (be == 0) ? t : t | (1ULL << 52);
+    int q = (be == 0) ? -1074 : be - 1075;
+    uint64_t out = c & 1;
+    // the doubles next to a power of 2 are closer below it than above it
+    bool lower_closer = t == 0 && be > 1;
+    // v and the halfway points to the doubles next to it, times 4
+    uint64_t cb = c << 2;
+    uint64_t cbr = cb + 2;
+    uint64_t cbl = (lower_closer) ? cb - 1 : cb - 2;
+    int k = (lower_closer) ? num_floor_log10_three_quarters_pow2(q) : num_floor_log10_pow2(q);
+    int h = q + num_floor_log2_pow10(-k) + 1;
+    const uint64_t *g = num_pow10_128[-k - NUM_POW10_MIN_EXP];
+    // the same, times 10^-k, which leaves 1 or 2 digits more than could be needed in front of the point
+    uint64_t vb = num_round_to_odd(g, cb << h);
+    uint64_t vbl = num_round_to_odd(g, cbl << h);
+    uint64_t vbr = num_round_to_odd(g, cbr << h);
+    // an odd c has its halfway points round to the doubles next to it, so they are left out
+    uint64_t lower = vbl + out;
+    uint64_t upper = vbr - out;
+    uint64_t s = vb >> 2;
+    if (s >= 10) {
+        // if only 1 of the 2 multiples of 10 around v is in range, that one has a digit less
+        uint64_t sp = s / 10;
+        bool up_in = lower <= sp * 40;
+        bool wp_in = sp * 40 + 40 <= upper;
+        if (up_in != wp_in) {
+            *exp10 = k + 1;
+            return sp + wp_in;
+        }
+    }
+    bool u_in = lower <= s << 2;
+    bool w_in = (s << 2) + 4 <= upper;
+    *exp10 = k;
+    if (u_in != w_in) return s + w_in;
+    // both are in range, so the nearest to v
+    uint64_t mid = (s << 2) + 2;
+    return s + (vb > mid || (vb == mid && (s & 1)));
+}
+
+// as_float adds a ".0" to integral values, otherwise they are written as TOML integers
+static inline bool buf_push_float(str_buf *buf, double v, bool as_float) {
+    if (isnan(v)) return buf_push_str(buf, "nan", 3);
+    if (isinf(v)) return (v < 0) ? buf_push_str(buf, "-inf", 4) : buf_push_str(buf, "inf", 3);
+    if (v == floor(v) && fabs(v) < 9007199254740992.0) {
+        // -0.0 is integral, but its sign is lost by the cast
+        if (v == 0 && signbit(v) && !buf_push(buf, '-')) return false;
+        if (!buf_push_int(buf, (int64_t)v)) return false;
+        return !as_float || buf_push_str(buf, ".0", 2);
+    }
+    int exp10;
+    uint64_t digits = num_shortest_decimal(fabs(v), &exp10);
+    while (digits % 10 == 0) {
+        digits /= 10;
+        exp10++;
+    }
+    char dtmp[24];
+    char *dend = dtmp + sizeof(dtmp);
+    char *d = num_format_u64(digits, dend);
+    int n = (int)(dend - d);
+    // the exponent of the first digit, which %g would switch to an exponent for below -4, or at 17 digits or more
+    int x = exp10 + n - 1;
+    // at most "-0.0000" and 17 digits, or "-d." 16 digits and "e-324"
+    char tmp[32];
+    char *p = tmp;
+    if (signbit(v)) *p++ = '-';
+    if (x < -4 || x >= 17) {
+        *p++ = d[0];
+        if (n > 1) {
+            *p++ = '.';
+            memcpy(p, d + 1, (size_t)n - 1);
+            p += n - 1;
+        }
+        *p++ = 'e';
+        *p++ = (x < 0) ? '-' : '+';
+        unsigned ax = (unsigned)((x < 0) ? -x : x);
+        if (ax >= 100) *p++ = (char)('0' + ax / 100);
+        memcpy(p, NUM_DIGIT_PAIRS + (ax % 100) * 2, 2);
+        p += 2;
+    } else if (x < 0) {
+        memcpy(p, "0.0000", (size_t)(1 - x));
+        p += 1 - x;
+        memcpy(p, d, (size_t)n);
+        p += n;
+    } else if (x >= n - 1) {
+        // integral, and only reached for values of 2^53 and up
+        memcpy(p, d, (size_t)n);
+        p += n;
+        for (int i = n - 1; i < x; i++) *p++ = '0';
+        if (as_float) {
+            memcpy(p, ".0", 2);
+            p += 2;
+        }
+    } else {
+        memcpy(p, d, (size_t)x + 1);
+        p += x + 1;
+        *p++ = '.';
+        memcpy(p, d + x + 1, (size_t)(n - x - 1));
+        p += n - x - 1;
+    }
+    return buf_push_str(buf, tmp, (size_t)(p - tmp));
+}
+
+#endif  // SRC_ENCODE_NUM_H_
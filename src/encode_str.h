@@ -0,0 +1,120 @@
+// Copyright 2025 Birdee
+#ifndef SRC_ENCODE_STR_H_
+#define SRC_ENCODE_STR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+#include "./types.h"
+#include "./scan.h"
+
+// works for char or uint32_t
+static inline bool buf_push_toml_escaped_char(str_buf *buf, const uint32_t c, const bool esc_non_ascii) {
+    switch (c) {
+        case '"':  return buf_push_str(buf, "\\\"", 2); break;
+        case '\n': return buf_push_str(buf, "\\n", 2); break;
+        case '\r': return buf_push_str(buf, "\\r", 2); break;
+        case '\\': return buf_push_str(buf, "\\\\", 2); break;
+        case '\b': return buf_push_str(buf, "\\b", 2); break;
+        case '\t': return buf_push_str(buf, "\\t", 2); break;
+        case '\f': return buf_push_str(buf, "\\f", 2); break;
+        default:
+            if (c < 0x20 || c == 0x7F) {
+                // the other control characters have no short escape
+                char out[7];
+                int len = snprintf(out, sizeof(out), "\\u%04X", c);
+                return buf_push_str(buf, out, len);
+            } else if (c <= 0x7F) {
+                return buf_push(buf, c);  // normal ASCII
+            } else if (esc_non_ascii) {
+                if (c <= 0xFFFF) {
+                    char out[7];
+                    int len = snprintf(out, sizeof(out), "\\u%04X", c);
+                    return buf_push_str(buf, out, len);
+                } else {
+                    char out[11];
+                    int len = snprintf(out, sizeof(out), "\\U%08X", c);
+                    return buf_push_str(buf, out, len);
+                }
+            } else {
+                return buf_push_utf8(buf, c);
+            }
+    }
+}
+
+// Strings are written a run at a time: scan_find_escape finds the next byte that needs escaping,
+// and everything before it is copied as it is. Like iter_next_utf8 did, they end at the first invalid UTF-8,
+// which scan_utf8_valid finds for the whole string first.
+
+static bool buf_push_esc_multi(str_buf *dst, str_iter *src) {
+    if (!buf_push_str(dst, "\"\"\"", 3)) return false;
+    const char *s = src->buf + src->pos;
+    size_t len = scan_utf8_valid(s, src->len - src->pos);
+    size_t i = 0;
+    while (i < len) {
+        size_t run = scan_find_escape(s + i, len - i);
+        if (run > 0) {
+            if (!buf_push_str(dst, s + i, run)) return false;
+            i += run;
+            continue;
+        }
+        char c = s[i];
+        if (c == '\r' && i + 1 < len && s[i + 1] == '\n') {
+            if (!buf_push_str(dst, "\r\n", 2)) return false;
+            i += 2;
+        } else if (c == '"' && i + 2 < len && s[i + 1] == '"' && s[i + 2] == '"') {
+            if (!buf_push_str(dst, "\"\"\\\"", 4)) return false;
+            i += 3;
+        } else if (c == '"' || c == '\n') {
+            if (!buf_push(dst, c)) return false;
+            i++;
+        } else {
+            if (!buf_push_toml_escaped_char(dst, (unsigned char)c, false)) return false;
+            i++;
+        }
+    }
+    src->pos += len;
+    if (!buf_push_str(dst, "\"\"\"", 3)) return false;
+    return true;
+}
+
+static bool buf_push_esc_simple(str_buf *dst, str_iter *src) {
+    if (!buf_push(dst, '"')) return false;
+    const char *s = src->buf + src->pos;
+    size_t len = scan_utf8_valid(s, src->len - src->pos);
+    size_t i = 0;
+    while (i < len) {
+        size_t run = scan_find_escape(s + i, len - i);
+        if (!buf_push_str(dst, s + i, run)) return false;
+        i += run;
+        if (i < len) {
+            if (!buf_push_toml_escaped_char(dst, (unsigned char)s[i], false)) return false;
+            i++;
+        }
+    }
+    src->pos += len;
+    if (!buf_push(dst, '"')) return false;
+    return true;
+}
+
+static inline bool buf_push_esc_key(str_buf *buf, str_iter *iter, bool wasnum) {
+    bool all_digits = true;
+    for (iter_result curr = iter_next(iter); curr.ok; curr = iter_next(iter)) {
+        char c = curr.v;
+        if (c < '0' || '9' < c) all_digits = false;
+        if (!is_identifier_char(c)) {
+            iter_reset_pos(iter);
+            return buf_push_esc_simple(buf, iter);
+        }
+    }
+    if (all_digits && !wasnum) {
+        iter_reset_pos(iter);
+        return buf_push_esc_simple(buf, iter);
+    }
+    return buf_push_str(buf, iter->buf, iter->len);
+}
+
+#endif  // SRC_ENCODE_STR_H_
@@ -0,0 +1,121 @@
+// Copyright 2025 Birdee
+#ifndef SRC_FILE_MAP_H_
+#define SRC_FILE_MAP_H_
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Read only view of a whole file. Regular files are mapped, so reading them costs no copy.
+// Pipes, special files, empty files, and everything on windows are read into a malloc buffer instead.
+// A mapped file that is truncated by someone else while it is being read is undefined behavior, like with any mmap.
+
+typedef struct {
+    const char *data;
+    size_t len;
+    bool mapped;
+} MappedFile;
+
+static inline void unmap_file(MappedFile *file) {
+    if (!file || !file->data) return;
+#ifndef _WIN32
+    if (file->mapped) {
+        munmap((void *)file->data, file->len);
+    } else {
+        free((void *)file->data);
+    }
+#else
+    free((void *)file->data);
+#endif
+    *file = (MappedFile){0};
+}
+
+// reads everything left in f into a malloc buffer
+static bool file_map_read_all(FILE *f, MappedFile *out) {
+    size_t cap = 65536;
+    size_t len = 0;
+    char *data = (char *)malloc(cap);
+    if (!data) return false;
+    while (true) {
+        if (len == cap) {
+            char *tmp = (char *)realloc(data, cap * 2);
+            if (!tmp) {
+                free(data);
+                errno = ENOMEM;
+                return false;
+            }
+            data = tmp;
+            cap *= 2;
+        }
+        size_t n = fread(data + len, 1, cap - len, f);
+        len += n;
+        if (n == 0) {
+            if (ferror(f)) {
+                free(data);
+                return false;
+            }
+            break;
+        }
+    }
+    *out = (MappedFile){ .data = data, .len = len, .mapped = false };
+    return true;
+}
+
+// returns false with errno set if the file could not be read
+static bool map_file(const char *path, MappedFile *out) {
+    *out = (MappedFile){0};
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return false;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        close(fd);
+        errno = EISDIR;
+        return false;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            close(fd);
+#ifdef MADV_SEQUENTIAL
+            madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+            *out = (MappedFile){ .data = (const char *)data, .len = (size_t)st.st_size, .mapped = true };
+            return true;
+        }
+    }
+    FILE *f = fdopen(fd, "rb");
+    if (!f) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return false;
+    }
+#else
+    FILE *f = fopen(path, "rb");
+    if (!f) return false;
+#endif
+    bool ok = file_map_read_all(f, out);
+    int saved = errno;
+    fclose(f);
+    errno = saved;
+    return ok;
+}
+
+#endif  // SRC_FILE_MAP_H_
@@ -3,6 +3,7 @@
 #define SRC_OPTS_H_
 
 #include <string.h>
+#include <stdint.h>
 #include <lua.h>
 #include <lauxlib.h>
 
@@ -18,6 +19,8 @@ typedef enum {
     TOMLOPTS_MARK_INLINE,
     TOMLOPTS_OVERFLOW_ERRORS,
     TOMLOPTS_UNDERFLOW_ERRORS,
+    // one of TOMLDATES, the only option that is not a boolean
+    TOMLOPTS_DATES,
     TOMLOPTS_LENGTH
 } TOMLOPTS;
 static const char *toml_opts_names[TOMLOPTS_LENGTH] = {
@@ -27,28 +30,86 @@ static const char *toml_opts_names[TOMLOPTS_LENGTH] = {
     "multi_strings",
     "mark_inline",
     "overflow_errors",
-    "underflow_errors"
+    "underflow_errors",
+    "dates",
+};
+typedef uint8_t TomluaUserOpts[TOMLOPTS_LENGTH];
+
+// how decode returns dates
+typedef enum {
+    TOMLDATES_DEFAULT,  // whatever fancy_dates says
+    TOMLDATES_STRING,
+    TOMLDATES_USERDATA,
+    TOMLDATES_TIMESTAMP,
+    TOMLDATES_TABLE,
+    TOMLDATES_LENGTH
+} TOMLDATES;
+static const char *toml_dates_names[TOMLDATES_LENGTH] = {
+    "default",
+    "string",
+    "userdata",
+    "timestamp",
+    "table",
 };
-typedef bool TomluaUserOpts[TOMLOPTS_LENGTH];
 
 static inline TomluaUserOpts *get_opts_upval(lua_State *L) {
     return (TomluaUserOpts *)lua_touserdata(L, lua_upvalueindex(1));
 }
-static inline TomluaUserOpts *toml_user_opts_copy(TomluaUserOpts dst, TomluaUserOpts src) {
+static inline TomluaUserOpts *toml_user_opts_copy(TomluaUserOpts dst, const TomluaUserOpts src) {
     return memcpy(dst, src, sizeof(TomluaUserOpts));
 }
 
+static inline TOMLDATES opts_dates(const TomluaUserOpts opts) {
+    if (opts[TOMLOPTS_DATES] != TOMLDATES_DEFAULT) return (TOMLDATES)opts[TOMLOPTS_DATES];
+    return opts[TOMLOPTS_FANCY_DATES] ? TOMLDATES_USERDATA : TOMLDATES_STRING;
+}
+
+// pushes the value of option i
+static inline void opts_push(lua_State *L, const TomluaUserOpts opts, int i) {
+    if (i == TOMLOPTS_DATES) {
+        lua_pushstring(L, toml_dates_names[opts_dates(opts)]);
+    } else {
+        lua_pushboolean(L, opts[i]);
+    }
+}
+
+// sets option i from the value at idx. Returns false if it is not a valid value for it
+// fancy_dates and dates are kept in agreement, with the one set last deciding how dates are returned
+static bool opts_set(lua_State *L, TomluaUserOpts opts, int i, int idx) {
+    if (i != TOMLOPTS_DATES) {
+        opts[i] = lua_toboolean(L, idx);
+        if (i == TOMLOPTS_FANCY_DATES) opts[TOMLOPTS_DATES] = TOMLDATES_DEFAULT;
+        return true;
+    }
+    if (lua_isnil(L, idx)) {
+        opts[TOMLOPTS_DATES] = TOMLDATES_DEFAULT;
+        return true;
+    }
+    const char *name = lua_tostring(L, idx);
+    if (name == NULL) return false;
+    for (int d = TOMLDATES_STRING; d < TOMLDATES_LENGTH; d++) {
+        if (strcmp(name, toml_dates_names[d]) == 0) {
+            opts[TOMLOPTS_DATES] = (uint8_t)d;
+            opts[TOMLOPTS_FANCY_DATES] = d == TOMLDATES_USERDATA;
+            return true;
+        }
+    }
+    return false;
+}
+
 // negative taridx means all false
 static bool opts_parse(lua_State *L, TomluaUserOpts dst, int taridx) {
+    memset(dst, 0, sizeof(TomluaUserOpts));
     if (taridx > 0) {
         luaL_checktype(L, taridx, LUA_TTABLE);
+        // dates comes last, so that it wins over fancy_dates when both are given
         for (int i = 0; i < TOMLOPTS_LENGTH; i++) {
             lua_getfield(L, taridx, toml_opts_names[i]);
-            dst[i] = lua_toboolean(L, -1);
+            if (!opts_set(L, dst, i, -1)) {
+                luaL_error(L, "invalid value for option '%s'", toml_opts_names[i]);
+            }
             lua_pop(L, 1);
         }
-    } else {
-        memset(dst, false, sizeof(TomluaUserOpts));
     }
     return false;
 }
@@ -57,7 +118,7 @@ static int opts_call(lua_State *L) {
     if (lua_gettop(L) == 1) {
         lua_newtable(L);
         for (int i = 0; i < TOMLOPTS_LENGTH; i++) {
-            lua_pushboolean(L, (*opts)[i]);
+            opts_push(L, *opts, i);
             lua_setfield(L, -2, toml_opts_names[i]);
         }
         return 1;
@@ -70,7 +131,7 @@ static int opts_index(lua_State *L) {
     const char *key = luaL_checkstring(L, 2);
     for (int i = 0; i < TOMLOPTS_LENGTH; i++) {
         if (strcmp(key, toml_opts_names[i]) == 0) {
-            lua_pushboolean(L, (*opts)[i]);
+            opts_push(L, *opts, i);
             return 1;
         }
     }
@@ -80,11 +141,10 @@ static int opts_index(lua_State *L) {
 static int opts_newindex(lua_State *L) {
     TomluaUserOpts *opts = (TomluaUserOpts *)lua_touserdata(L, lua_upvalueindex(1));
     const char *key = luaL_checkstring(L, 2);
-    int value = lua_toboolean(L, 3);
     int i = 0;
     while (i < TOMLOPTS_LENGTH) {
         if (strcmp(key, toml_opts_names[i]) == 0) {
-            (*opts)[i] = value;
+            if (!opts_set(L, *opts, i, 3)) return luaL_error(L, "invalid value for option '%s'", key);
             return 0;
         }
         i++;
@@ -0,0 +1,348 @@
+// Copyright 2025 Birdee
+#ifndef SRC_SCAN_H_
+#define SRC_SCAN_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Byte scanning kernels for the hot loops of the parser.
+// AVX2 is used when the compiler targets it (-mavx2 or -march=native),
+// SSE2 otherwise on x86-64, and an 8 byte at a time SWAR fallback everywhere else.
+// Every function here returns the length of the input if nothing was found.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TOMLUA_SCAN_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TOMLUA_SCAN_SSE2
+#endif
+
+static inline unsigned scan_ctz32(uint32_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctz(v);
+#else
+    unsigned n = 0;
+    while (!(v & 1)) { v >>= 1; n++; }
+    return n;
+#endif
+}
+
+static inline unsigned scan_ctz64(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctzll(v);
+#else
+    unsigned n = 0;
+    while (!(v & 1)) { v >>= 1; n++; }
+    return n;
+#endif
+}
+
+#define SCAN_SWAR_ONES 0x0101010101010101ULL
+#define SCAN_SWAR_LOW7 0x7F7F7F7F7F7F7F7FULL
+#define SCAN_SWAR_HIGH 0x8080808080808080ULL
+
+static inline uint64_t scan_swar_load(const char *s) {
+    uint64_t v;
+    memcpy(&v, s, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+// high bit set in every byte of v that equals c, and nowhere else
+static inline uint64_t scan_swar_eq(uint64_t v, char c) {
+    uint64_t t = v ^ (SCAN_SWAR_ONES * (unsigned char)c);
+    return ~(((t & SCAN_SWAR_LOW7) + SCAN_SWAR_LOW7) | t) & SCAN_SWAR_HIGH;
+}
+
+// number of leading spaces and tabs
+static inline size_t scan_blank_run(const char *s, size_t len) {
+    size_t i = 0;
+    // most runs are a single space, check before setting anything up
+    if (i < len && s[i] != ' ' && s[i] != '\t') return 0;
+#if defined(TOMLUA_SCAN_AVX2)
+    const __m256i sp32 = _mm256_set1_epi8(' ');
+    const __m256i tab32 = _mm256_set1_epi8('\t');
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(v, sp32), _mm256_cmpeq_epi8(v, tab32));
+        uint32_t other = ~(uint32_t)_mm256_movemask_epi8(blank);
+        if (other) return i + scan_ctz32(other);
+    }
+#endif
+#if defined(TOMLUA_SCAN_AVX2) || defined(TOMLUA_SCAN_SSE2)
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab));
+        uint32_t other = ~(uint32_t)_mm_movemask_epi8(blank) & 0xFFFF;
+        if (other) return i + scan_ctz32(other);
+    }
+#else
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v = scan_swar_load(s + i);
+        uint64_t other = ~(scan_swar_eq(v, ' ') | scan_swar_eq(v, '\t')) & SCAN_SWAR_HIGH;
+        if (other) return i + scan_ctz64(other) / 8;
+    }
+#endif
+    while (i < len && (s[i] == ' ' || s[i] == '\t')) i++;
+    return i;
+}
+
+// position of the first c, uses the libc memchr which is already vectorized
+static inline size_t scan_find_byte(const char *s, size_t len, char c) {
+    const char *found = (const char *)memchr(s, c, len);
+    return (found) ? (size_t)(found - s) : len;
+}
+
+// position of the first byte that is any of a, b, c or d
+// repeat one of them to search for fewer
+static inline size_t scan_find_any4(const char *s, size_t len, char a, char b, char c, char d) {
+    size_t i = 0;
+#define SCAN_IS_ANY4(x) ((x) == a || (x) == b || (x) == c || (x) == d)
+    // strings are often short or start with something interesting
+    if (i < len && SCAN_IS_ANY4(s[i])) return 0;
+#if defined(TOMLUA_SCAN_AVX2)
+    const __m256i a32 = _mm256_set1_epi8(a);
+    const __m256i b32 = _mm256_set1_epi8(b);
+    const __m256i c32 = _mm256_set1_epi8(c);
+    const __m256i d32 = _mm256_set1_epi8(d);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i hit = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, a32), _mm256_cmpeq_epi8(v, b32)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, c32), _mm256_cmpeq_epi8(v, d32))
+        );
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hit);
+        if (mask) return i + scan_ctz32(mask);
+    }
+#endif
+#if defined(TOMLUA_SCAN_AVX2) || defined(TOMLUA_SCAN_SSE2)
+    const __m128i a16 = _mm_set1_epi8(a);
+    const __m128i b16 = _mm_set1_epi8(b);
+    const __m128i c16 = _mm_set1_epi8(c);
+    const __m128i d16 = _mm_set1_epi8(d);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i hit = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, a16), _mm_cmpeq_epi8(v, b16)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, c16), _mm_cmpeq_epi8(v, d16))
+        );
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(hit);
+        if (mask) return i + scan_ctz32(mask);
+    }
+#else
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v = scan_swar_load(s + i);
+        uint64_t mask = scan_swar_eq(v, a) | scan_swar_eq(v, b) | scan_swar_eq(v, c) | scan_swar_eq(v, d);
+        if (mask) return i + scan_ctz64(mask) / 8;
+    }
+#endif
+    while (i < len && !SCAN_IS_ANY4(s[i])) i++;
+#undef SCAN_IS_ANY4
+    return i;
+}
+
+static inline unsigned scan_popcount64(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_popcountll(v);
+#else
+    unsigned n = 0;
+    for (; v; v &= v - 1) n++;
+    return n;
+#endif
+}
+
+// position of the first byte that can change the structure of a document: a newline, a quote, #, or a bracket or brace
+// adds the number of commas before it to *commas
+static inline size_t scan_find_structural(const char *s, size_t len, size_t *commas) {
+    size_t i = 0;
+#define SCAN_IS_STRUCTURAL(x) ((x) == '\n' || (x) == '"' || (x) == '\'' || (x) == '#' \
+    || (x) == '[' || (x) == ']' || (x) == '{' || (x) == '}')
+#if defined(TOMLUA_SCAN_AVX2)
+    const __m256i nl32 = _mm256_set1_epi8('\n');
+    const __m256i dq32 = _mm256_set1_epi8('"');
+    const __m256i sq32 = _mm256_set1_epi8('\'');
+    const __m256i hash32 = _mm256_set1_epi8('#');
+    const __m256i comma32 = _mm256_set1_epi8(',');
+    // [ ] { } are the only bytes that are { or } once bit 5 is set
+    const __m256i lower32 = _mm256_set1_epi8(0x20);
+    const __m256i open32 = _mm256_set1_epi8('{');
+    const __m256i close32 = _mm256_set1_epi8('}');
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i folded = _mm256_or_si256(v, lower32);
+        __m256i hit = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, nl32), _mm256_cmpeq_epi8(v, dq32)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, sq32), _mm256_cmpeq_epi8(v, hash32))
+            ),
+            _mm256_or_si256(_mm256_cmpeq_epi8(folded, open32), _mm256_cmpeq_epi8(folded, close32))
+        );
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hit);
+        uint32_t comma_mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, comma32));
+        if (mask) {
+            *commas += scan_popcount64(comma_mask & ((mask & (0u - mask)) - 1));
+            return i + scan_ctz32(mask);
+        }
+        *commas += scan_popcount64(comma_mask);
+    }
+#endif
+#if defined(TOMLUA_SCAN_AVX2) || defined(TOMLUA_SCAN_SSE2)
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i dq = _mm_set1_epi8('"');
+    const __m128i sq = _mm_set1_epi8('\'');
+    const __m128i hash = _mm_set1_epi8('#');
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i folded = _mm_or_si128(v, lower);
+        __m128i hit = _mm_or_si128(
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, dq)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, sq), _mm_cmpeq_epi8(v, hash))
+            ),
+            _mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close))
+        );
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(hit);
+        uint32_t comma_mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, comma));
+        if (mask) {
+            *commas += scan_popcount64(comma_mask & ((mask & (0u - mask)) - 1));
+            return i + scan_ctz32(mask);
+        }
+        *commas += scan_popcount64(comma_mask);
+    }
+#else
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v = scan_swar_load(s + i);
+        uint64_t folded = v | (SCAN_SWAR_ONES * 0x20);
+        uint64_t mask = scan_swar_eq(v, '\n') | scan_swar_eq(v, '"') | scan_swar_eq(v, '\'') | scan_swar_eq(v, '#')
+            | scan_swar_eq(folded, '{') | scan_swar_eq(folded, '}');
+        uint64_t comma_mask = scan_swar_eq(v, ',');
+        if (mask) {
+            *commas += scan_popcount64(comma_mask & ((mask & (0 - mask)) - 1));
+            return i + scan_ctz64(mask) / 8;
+        }
+        *commas += scan_popcount64(comma_mask);
+    }
+#endif
+    for (; i < len && !SCAN_IS_STRUCTURAL(s[i]); i++) {
+        if (s[i] == ',') (*commas)++;
+    }
+#undef SCAN_IS_STRUCTURAL
+    return i;
+}
+
+// position of the first byte a TOML basic string cannot hold as it is: a control character, ", \ or DEL
+static inline size_t scan_find_escape(const char *s, size_t len) {
+    size_t i = 0;
+#define SCAN_IS_ESCAPE(x) ((unsigned char)(x) < 0x20 || (x) == '"' || (x) == '\\' || (x) == 0x7F)
+#if defined(TOMLUA_SCAN_AVX2)
+    const __m256i ctrl32 = _mm256_set1_epi8(0x1F);
+    const __m256i dq32 = _mm256_set1_epi8('"');
+    const __m256i bs32 = _mm256_set1_epi8('\\');
+    const __m256i del32 = _mm256_set1_epi8(0x7F);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        // v is at most 0x1F exactly when max(v, 0x1F) is 0x1F
+        __m256i hit = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl32), ctrl32), _mm256_cmpeq_epi8(v, dq32)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, bs32), _mm256_cmpeq_epi8(v, del32))
+        );
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hit);
+        if (mask) return i + scan_ctz32(mask);
+    }
+#endif
+#if defined(TOMLUA_SCAN_AVX2) || defined(TOMLUA_SCAN_SSE2)
+    const __m128i ctrl = _mm_set1_epi8(0x1F);
+    const __m128i dq = _mm_set1_epi8('"');
+    const __m128i bs = _mm_set1_epi8('\\');
+    const __m128i del = _mm_set1_epi8(0x7F);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i hit = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl), _mm_cmpeq_epi8(v, dq)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, bs), _mm_cmpeq_epi8(v, del))
+        );
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(hit);
+        if (mask) return i + scan_ctz32(mask);
+    }
+#else
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v = scan_swar_load(s + i);
+        // bytes below 0x20. Only bytes after the first one can be wrong, through the borrow
+        uint64_t ctrl = (v - SCAN_SWAR_ONES * 0x20) & ~v & SCAN_SWAR_HIGH;
+        uint64_t mask = ctrl | scan_swar_eq(v, '"') | scan_swar_eq(v, '\\') | scan_swar_eq(v, 0x7F);
+        if (mask) return i + scan_ctz64(mask) / 8;
+    }
+#endif
+    while (i < len && !SCAN_IS_ESCAPE(s[i])) i++;
+#undef SCAN_IS_ESCAPE
+    return i;
+}
+
+// position of the first byte that is not ASCII
+static inline size_t scan_ascii_run(const char *s, size_t len) {
+    size_t i = 0;
+#if defined(TOMLUA_SCAN_AVX2)
+    for (; i + 32 <= len; i += 32) {
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(s + i)));
+        if (mask) return i + scan_ctz32(mask);
+    }
+#endif
+#if defined(TOMLUA_SCAN_AVX2) || defined(TOMLUA_SCAN_SSE2)
+    for (; i + 16 <= len; i += 16) {
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+        if (mask) return i + scan_ctz32(mask);
+    }
+#else
+    for (; i + 8 <= len; i += 8) {
+        uint64_t mask = scan_swar_load(s + i) & SCAN_SWAR_HIGH;
+        if (mask) return i + scan_ctz64(mask) / 8;
+    }
+#endif
+    while (i < len && !((unsigned char)s[i] & 0x80)) i++;
+    return i;
+}
+
+// length of the longest prefix of s that is whole, valid UTF-8 codepoints, by the same rules as iter_next_utf8.
+// ASCII runs are skipped in bulk, and only the bytes of other codepoints are looked at 1 at a time
+static inline size_t scan_utf8_valid(const char *str, size_t len) {
+    const unsigned char *s = (const unsigned char *)str;
+    size_t i = 0;
+    for (;;) {
+        i += scan_ascii_run(str + i, len - i);
+        if (i >= len) return len;
+        unsigned char c = s[i];
+        size_t rem = len - i;
+        uint32_t cp;
+        if ((c & 0xE0) == 0xC0) {
+            if (rem < 2 || (s[i + 1] & 0xC0) != 0x80) return i;
+            cp = ((uint32_t)(c & 0x1F) << 6) | (s[i + 1] & 0x3F);
+            if (cp < 0x80) return i;
+            i += 2;
+        } else if ((c & 0xF0) == 0xE0) {
+            if (rem < 3 || (s[i + 1] & 0xC0) != 0x80 || (s[i + 2] & 0xC0) != 0x80) return i;
+            cp = ((uint32_t)(c & 0x0F) << 12) | ((uint32_t)(s[i + 1] & 0x3F) << 6) | (s[i + 2] & 0x3F);
+            if (cp < 0x800) return i;
+            i += 3;
+        } else if ((c & 0xF8) == 0xF0) {
+            if (rem < 4 || (s[i + 1] & 0xC0) != 0x80 || (s[i + 2] & 0xC0) != 0x80 || (s[i + 3] & 0xC0) != 0x80) return i;
+            cp = ((uint32_t)(c & 0x07) << 18) | ((uint32_t)(s[i + 1] & 0x3F) << 12)
+                | ((uint32_t)(s[i + 2] & 0x3F) << 6) | (s[i + 3] & 0x3F);
+            if (cp < 0x10000 || cp > 0x10FFFF) return i;
+            i += 4;
+        } else {
+            return i;
+        }
+    }
+}
+
+#endif  // SRC_SCAN_H_
@@ -0,0 +1,417 @@
+// Copyright 2025 Birdee
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "types.h"
+#include "dates.h"
+#include "encode.h"
+#include "decode.h"
+#include "file_map.h"
+#include "snapshot.h"
+
+// A snapshot is a decoded table tree written out as it is, so it can be read back without lexing anything.
+// Every integer in it is little endian, whatever the machine, so snapshots can be moved between them.
+//
+// header: "TMLS", a version byte, a u32 stamp length and the stamp, which tomlua.dump leaves empty
+// value:  a tag byte, then
+//   'F' 'T'  false and true
+//   'i'      u64 integer
+//   'f'      u64 bits of a double
+//   's' 'm'  u64 length and the bytes, of a string or a TomluaMultiStr
+//   'd'      the TomlDate fields, each a u32
+//   't'      u8 toml_type of its metatable or 0 for none, u32 array length, u32 hash length,
+//            the array values, then the key and value of each hash entry
+
+#define SNAPSHOT_MAGIC "TMLS"
+#define SNAPSHOT_VERSION 1
+// how deep tables can be nested, so that reading a corrupt snapshot cannot run out of C stack
+#define SNAPSHOT_MAX_DEPTH 10000
+
+static inline bool snap_push_u32(str_buf *buf, uint32_t v) {
+    char b[4] = { (char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24) };
+    return buf_push_str(buf, b, 4);
+}
+
+static inline bool snap_push_u64(str_buf *buf, uint64_t v) {
+    return snap_push_u32(buf, (uint32_t)v) && snap_push_u32(buf, (uint32_t)(v >> 32));
+}
+
+static inline void snap_set_u32(str_buf *buf, size_t off, uint32_t v) {
+    for (int i = 0; i < 4; i++) buf->data[off + i] = (char)(v >> (8 * i));
+}
+
+static inline bool snap_push_bytes(str_buf *buf, char tag, const char *s, size_t len) {
+    return buf_push(buf, tag) && snap_push_u64(buf, (uint64_t)len) && buf_push_str(buf, s, len);
+}
+
+static bool snap_write_value(lua_State *L, str_buf *buf, int idx, int visited_idx, int depth);
+
+// true if the key at idx is an integer from 1 to narr, which is written as part of the array
+static inline bool snap_is_array_key(lua_State *L, int idx, size_t narr) {
+    if (lua_type(L, idx) != LUA_TNUMBER) return false;
+    lua_Number n = lua_tonumber(L, idx);
+    return n >= 1 && n <= (lua_Number)narr && n == (lua_Number)(lua_Integer)n;
+}
+
+static bool snap_write_table(lua_State *L, str_buf *buf, int idx, int visited_idx, int depth) {
+    if (depth >= SNAPSHOT_MAX_DEPTH || !lua_checkstack(L, 8)) {
+        lua_pushliteral(L, "table nested too deeply for a snapshot");
+        return false;
+    }
+    lua_pushvalue(L, idx);
+    lua_rawget(L, visited_idx);
+    if (!lua_isnil(L, -1)) {
+        lua_pushliteral(L, "Circular reference in table");
+        return false;
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, idx);
+    lua_pushboolean(L, true);
+    lua_rawset(L, visited_idx);
+
+    // the array part ends at the first nil, anything after it is written with the hash part
+    size_t narr = lua_arraylen(L, idx);
+    for (size_t i = 1; i <= narr; i++) {
+        lua_rawgeti(L, idx, (lua_Integer)i);
+        bool is_nil = lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (is_nil) {
+            narr = i - 1;
+            break;
+        }
+    }
+    if (narr > UINT32_MAX) narr = UINT32_MAX;
+    TomlType mark = get_meta_toml_type(L, idx);
+    if (!buf_push(buf, 't') || !buf_push(buf, (char)mark) || !snap_push_u32(buf, (uint32_t)narr)) goto oom;
+    size_t count_off = buf->len;
+    if (!snap_push_u32(buf, 0)) goto oom;
+    for (size_t i = 1; i <= narr; i++) {
+        lua_rawgeti(L, idx, (lua_Integer)i);
+        if (!snap_write_value(L, buf, lua_gettop(L), visited_idx, depth + 1)) return false;
+        lua_pop(L, 1);
+    }
+    uint32_t nhash = 0;
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        int vidx = lua_gettop(L);
+        if (snap_is_array_key(L, vidx - 1, narr)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        if (lua_istable(L, vidx - 1)) {
+            lua_pushliteral(L, "tables can not be keys in a snapshot");
+            return false;
+        }
+        if (nhash == UINT32_MAX) {
+            lua_pushliteral(L, "table too big for a snapshot");
+            return false;
+        }
+        if (!snap_write_value(L, buf, vidx - 1, visited_idx, depth + 1)) return false;
+        if (!snap_write_value(L, buf, vidx, visited_idx, depth + 1)) return false;
+        nhash++;
+        lua_pop(L, 1);
+    }
+    snap_set_u32(buf, count_off, nhash);
+
+    lua_pushvalue(L, idx);
+    lua_pushnil(L);
+    lua_rawset(L, visited_idx);
+    return true;
+oom:
+    lua_pushliteral(L, "Unable to allocate memory for snapshot");
+    return false;
+}
+
+static bool snap_write_value(lua_State *L, str_buf *buf, int idx, int visited_idx, int depth) {
+    bool ok = true;
+    switch (lua_type(L, idx)) {
+        case LUA_TBOOLEAN:
+            ok = buf_push(buf, lua_toboolean(L, idx) ? 'T' : 'F');
+            break;
+        case LUA_TNUMBER: {
+#if LUA_VERSION_NUM >= 503
+            if (lua_isinteger(L, idx)) {
+                ok = buf_push(buf, 'i') && snap_push_u64(buf, (uint64_t)lua_tointeger(L, idx));
+                break;
+            }
+#endif
+            double d = (double)lua_tonumber(L, idx);
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            ok = buf_push(buf, 'f') && snap_push_u64(buf, bits);
+        } break;
+        case LUA_TSTRING: {
+            size_t len = 0;
+            const char *s = lua_tolstring(L, idx, &len);
+            ok = snap_push_bytes(buf, 's', s, len);
+        } break;
+        case LUA_TTABLE:
+            // a result of cached_decode is an empty proxy of the table it reads from
+            if (push_frozen_view(L, idx)) {
+                if (!snap_write_table(L, buf, lua_gettop(L), visited_idx, depth)) return false;
+                lua_pop(L, 1);
+                return true;
+            }
+            return snap_write_table(L, buf, idx, visited_idx, depth);
+        case LUA_TUSERDATA:
+            if (udata_is_of_type(L, idx, "TomluaDate")) {
+                TomlDate *date = (TomlDate *)lua_touserdata(L, idx);
+                ok = buf_push(buf, 'd');
+                for (int i = 0; ok && i < TOMLDATE_DATE_LENGTH; i++) ok = snap_push_u32(buf, (uint32_t)(*date)[i]);
+                break;
+            } else if (udata_is_of_type(L, idx, "TomluaMultiStr")) {
+                str_buf *str = (str_buf *)lua_touserdata(L, idx);
+                ok = snap_push_bytes(buf, 'm', str->data ? str->data : "", str->len);
+                break;
+            }
+            // fall through
+        default:
+            lua_pushfstring(L, "%s can not be in a snapshot", luaL_typename(L, idx));
+            return false;
+    }
+    if (!ok) lua_pushliteral(L, "Unable to allocate memory for snapshot");
+    return ok;
+}
+
+bool snapshot_write(lua_State *L, int idx, str_buf *buf, const char *stamp, size_t stamp_len) {
+    idx = absindex(lua_gettop(L), idx);
+    if (!lua_istable(L, idx)) {
+        lua_pushliteral(L, "a snapshot can only be made of a table");
+        return false;
+    }
+    if (!buf_push_str(buf, SNAPSHOT_MAGIC, 4) || !buf_push(buf, SNAPSHOT_VERSION)
+        || !snap_push_u32(buf, (uint32_t)stamp_len) || !buf_push_str(buf, stamp, stamp_len)) {
+        lua_pushliteral(L, "Unable to allocate memory for snapshot");
+        return false;
+    }
+    int top = lua_gettop(L);
+    lua_newtable(L);
+    if (!snap_write_value(L, buf, idx, top + 1, 0)) {
+        // leave only the error
+        lua_replace(L, top + 1);
+        lua_settop(L, top + 1);
+        return false;
+    }
+    lua_settop(L, top);
+    return true;
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+} SnapReader;
+
+static inline bool snap_read_u32(SnapReader *r, uint32_t *out) {
+    if (r->len - r->pos < 4) return false;
+    const unsigned char *p = r->data + r->pos;
+    *out = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    r->pos += 4;
+    return true;
+}
+
+static inline bool snap_read_u64(SnapReader *r, uint64_t *out) {
+    uint32_t lo, hi;
+    if (!snap_read_u32(r, &lo) || !snap_read_u32(r, &hi)) return false;
+    *out = (uint64_t)lo | ((uint64_t)hi << 32);
+    return true;
+}
+
+static inline bool snap_read_bytes(SnapReader *r, const char **s, size_t *len) {
+    uint64_t n;
+    if (!snap_read_u64(r, &n) || n > r->len - r->pos) return false;
+    *s = (const char *)r->data + r->pos;
+    *len = (size_t)n;
+    r->pos += (size_t)n;
+    return true;
+}
+
+// pushes the next value. Returns false, with the stack as it was, if the snapshot is cut short or corrupt
+static bool snap_read_value(lua_State *L, SnapReader *r, int depth) {
+    if (r->pos >= r->len || depth >= SNAPSHOT_MAX_DEPTH || !lua_checkstack(L, 4)) return false;
+    int top = lua_gettop(L);
+    char tag = (char)r->data[r->pos++];
+    switch (tag) {
+        case 'F':
+        case 'T':
+            lua_pushboolean(L, tag == 'T');
+            return true;
+        case 'i': {
+            uint64_t v;
+            if (!snap_read_u64(r, &v)) return false;
+            lua_pushinteger(L, (lua_Integer)(int64_t)v);
+            return true;
+        }
+        case 'f': {
+            uint64_t bits;
+            if (!snap_read_u64(r, &bits)) return false;
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            lua_pushnumber(L, (lua_Number)d);
+            return true;
+        }
+        case 's':
+        case 'm': {
+            const char *s;
+            size_t len;
+            if (!snap_read_bytes(r, &s, &len)) return false;
+            if (tag == 's') {
+                lua_pushlstring(L, s, len);
+                return true;
+            }
+            str_buf *str = (str_buf *)lua_newuserdata(L, sizeof(str_buf));
+            *str = new_buf_from_str(s, len);
+            if (!str->data) {
+                lua_settop(L, top);
+                return false;
+            }
+            push_multi_string_mt(L);
+            lua_setmetatable(L, -2);
+            return true;
+        }
+        case 'd': {
+            TomlDate date;
+            for (int i = 0; i < TOMLDATE_DATE_LENGTH; i++) {
+                uint32_t v;
+                if (!snap_read_u32(r, &v)) return false;
+                date[i] = (int)(int32_t)v;
+            }
+            if (!is_valid_toml_type(date[TOMLDATE_TOML_TYPE])) return false;
+            push_new_toml_date(L, date);
+            return true;
+        }
+        case 't': {
+            uint32_t narr, nhash;
+            if (r->pos >= r->len) return false;
+            unsigned char mark = r->data[r->pos++];
+            if (!snap_read_u32(r, &narr) || !snap_read_u32(r, &nhash)) return false;
+            // every value takes at least 1 byte, so bigger counts can only be corrupt, and are not used to size anything
+            if (narr > r->len - r->pos || nhash > (r->len - r->pos) / 2) return false;
+            lua_createtable(L, (int)((narr > INT32_MAX) ? INT32_MAX : narr), (int)((nhash > INT32_MAX) ? INT32_MAX : nhash));
+            int tidx = lua_gettop(L);
+            for (uint32_t i = 1; i <= narr; i++) {
+                if (!snap_read_value(L, r, depth + 1)) goto fail;
+                lua_rawseti(L, tidx, (lua_Integer)i);
+            }
+            for (uint32_t i = 0; i < nhash; i++) {
+                if (!snap_read_value(L, r, depth + 1)) goto fail;
+                if (lua_isnil(L, -1) || lua_istable(L, -1)) goto fail;
+                if (!snap_read_value(L, r, depth + 1)) goto fail;
+                lua_rawset(L, tidx);
+            }
+            if (mark != 0) {
+                if (!is_valid_toml_type(mark)) goto fail;
+                lua_createtable(L, 0, 1);
+                lua_pushstring(L, toml_type_names[mark]);
+                lua_setfield(L, -2, "toml_type");
+                lua_setmetatable(L, tidx);
+            }
+            return true;
+fail:
+            lua_settop(L, top);
+            return false;
+        }
+        default:
+            return false;
+    }
+}
+
+bool snapshot_read(lua_State *L, const char *data, size_t len, const char *stamp, size_t stamp_len, const char **err) {
+    SnapReader r = { .data = (const unsigned char *)data, .len = len, .pos = 0 };
+    uint32_t have_len;
+    if (len < 5 || memcmp(data, SNAPSHOT_MAGIC, 4) != 0) {
+        *err = "not a tomlua snapshot";
+        return false;
+    }
+    if ((unsigned char)data[4] != SNAPSHOT_VERSION) {
+        *err = "snapshot was made by a different version of tomlua";
+        return false;
+    }
+    r.pos = 5;
+    if (!snap_read_u32(&r, &have_len) || have_len > r.len - r.pos) {
+        *err = "snapshot is cut short or corrupt";
+        return false;
+    }
+    if (stamp && (have_len != stamp_len || memcmp(data + r.pos, stamp, stamp_len) != 0)) {
+        *err = NULL;
+        return false;
+    }
+    r.pos += have_len;
+    if (r.pos < r.len && r.data[r.pos] == 't' && snap_read_value(L, &r, 0)) {
+        if (r.pos == r.len) return true;
+        lua_pop(L, 1);
+    }
+    *err = "snapshot is cut short or corrupt";
+    return false;
+}
+
+int tomlua_dump(lua_State *L) {
+    str_buf buf = new_str_buf();
+    if (buf.data == NULL) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "Unable to allocate memory for snapshot");
+        return 2;
+    }
+    lua_settop(L, 1);
+    if (!snapshot_write(L, 1, &buf, "", 0)) {
+        free_str_buf(&buf);
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
+    }
+    lua_settop(L, 0);
+    push_buf_to_lua_string(L, &buf);
+    free_str_buf(&buf);
+    return 1;
+}
+
+int tomlua_undump(lua_State *L) {
+    size_t len = 0;
+    const char *data = lua_tolstring(L, 1, &len);
+    if (data == NULL || lua_type(L, 1) != LUA_TSTRING) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "tomlua.undump first argument must be a string! tomlua.undump(string) -> table?, err?");
+        return 2;
+    }
+    const char *err = NULL;
+    if (!snapshot_read(L, data, len, NULL, 0, &err)) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+    return 1;
+}
+
+int tomlua_undump_file(lua_State *L) {
+    const char *path = lua_tostring(L, 1);
+    if (path == NULL) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "tomlua.undump_file first argument must be a path! tomlua.undump_file(path) -> table?, err?");
+        return 2;
+    }
+    MappedFile file;
+    if (!map_file(path, &file)) {
+        const char *reason = strerror(errno);
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushfstring(L, "unable to read %s: %s", path, reason);
+        return 2;
+    }
+    const char *err = NULL;
+    bool ok = snapshot_read(L, file.data, file.len, NULL, 0, &err);
+    unmap_file(&file);
+    if (!ok) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+    return 1;
+}
@@ -0,0 +1,23 @@
+// Copyright 2025 Birdee
+#ifndef SRC_SNAPSHOT_H_
+#define SRC_SNAPSHOT_H_
+
+#include <lua.h>
+#include <stddef.h>
+#include "./types.h"
+
+// tomlua.dump(table) -> string?, err?
+int tomlua_dump(lua_State *L);
+// tomlua.undump(string) -> table?, err?
+int tomlua_undump(lua_State *L);
+// tomlua.undump_file(path) -> table?, err?
+int tomlua_undump_file(lua_State *L);
+
+// appends the snapshot of the table at idx to buf, with stamp in its header.
+// Returns false with the error pushed
+bool snapshot_write(lua_State *L, int idx, str_buf *buf, const char *stamp, size_t stamp_len);
+// pushes the table in the snapshot and returns true. Otherwise pushes nothing, and sets err.
+// When stamp is not NULL, a snapshot whose stamp is different is not read, and err is NULL
+bool snapshot_read(lua_State *L, const char *data, size_t len, const char *stamp, size_t stamp_len, const char **err);
+
+#endif  // SRC_SNAPSHOT_H_
@@ -0,0 +1,61 @@
+// Copyright 2025 Birdee
+#include <stdint.h>
+#include <lua.h>
+#include <lauxlib.h>
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+#include "stats.h"
+
+#ifdef TOMLUA_STATS
+// the names of the fields of the table tomlua.stats returns
+static const char *stats_names[STATS_LENGTH] = {
+    "decode_calls",
+    "decode_bytes",
+    "decode_tables",
+    "decode_strings",
+    "decode_keys",
+    "defs_lookups",
+    "buf_reallocs",
+    "encode_calls",
+    "encode_bytes",
+    "encode_traversals",
+    "prescan_ns",
+    "decode_ns",
+    "encode_ns",
+};
+
+uint64_t tomlua_stats_counters[STATS_LENGTH];
+
+static inline uint64_t stats_take(int i, bool reset) {
+#if defined(__GNUC__) || defined(__clang__)
+    return reset
+        ? __atomic_exchange_n(&tomlua_stats_counters[i], 0, __ATOMIC_RELAXED)
+        : __atomic_load_n(&tomlua_stats_counters[i], __ATOMIC_RELAXED);
+#else
+    uint64_t v = tomlua_stats_counters[i];
+    if (reset) tomlua_stats_counters[i] = 0;
+    return v;
+#endif
+}
+#endif
+
+// returns the counters, and sets them back to 0 after reading them if the first argument is true
+int tomlua_stats(lua_State *L) {
+#ifdef TOMLUA_STATS
+    bool reset = lua_toboolean(L, 1);
+    lua_settop(L, 0);
+    lua_createtable(L, 0, STATS_LENGTH);
+    for (int i = 0; i < STATS_LENGTH; i++) {
+        lua_pushnumber(L, (lua_Number)stats_take(i, reset));
+        lua_setfield(L, -2, stats_names[i]);
+    }
+    return 1;
+#else
+    lua_settop(L, 0);
+    lua_pushnil(L);
+    lua_pushliteral(L, "tomlua was built without TOMLUA_STATS");
+    return 2;
+#endif
+}
@@ -0,0 +1,71 @@
+// Copyright 2025 Birdee
+#ifndef SRC_STATS_H_
+#define SRC_STATS_H_
+
+#include <stdint.h>
+#include <lua.h>
+#ifdef TOMLUA_STATS
+#include <time.h>
+#endif
+
+// Counters of the work decode and encode did, which tomlua.stats returns.
+// They are only kept when built with TOMLUA_STATS defined (make build TOMLUA_STATS=1),
+// otherwise every STATS_ macro compiles to nothing, arguments included.
+// There is 1 set of counters per process, shared by every lua_State and by the threads of decode_parallel,
+// so they are added to atomically where the compiler allows it.
+
+typedef enum {
+    STATS_DECODE_CALLS,
+    // bytes of documents given to decode, decode_file and decode_parallel
+    STATS_DECODE_BYTES,
+    STATS_DECODE_TABLES,
+    // string values and keys pushed to lua
+    STATS_DECODE_STRINGS,
+    STATS_DECODE_KEYS,
+    // lookups in the tracker of defined tables and keys
+    STATS_DEFS_LOOKUPS,
+    // reallocs of any str_buf, the scratch and output buffers included
+    STATS_BUF_REALLOCS,
+    STATS_ENCODE_CALLS,
+    STATS_ENCODE_BYTES,
+    // tables gone through with lua_next, which can be more than once per table
+    STATS_ENCODE_TRAVERSALS,
+    STATS_PRESCAN_NS,
+    STATS_DECODE_NS,
+    STATS_ENCODE_NS,
+    STATS_LENGTH
+} TomluaStatsField;
+
+// tomlua.stats(reset?) -> table?, err?
+int tomlua_stats(lua_State *L);
+
+#ifdef TOMLUA_STATS
+extern uint64_t tomlua_stats_counters[STATS_LENGTH];
+
+#if defined(__GNUC__) || defined(__clang__)
+#define STATS_ADD(field, n) ((void)__atomic_fetch_add(&tomlua_stats_counters[field], (uint64_t)(n), __ATOMIC_RELAXED))
+#else
+#define STATS_ADD(field, n) ((void)(tomlua_stats_counters[field] += (uint64_t)(n)))
+#endif
+
+static inline uint64_t stats_now_ns(void) {
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+// declares name as the time now, for STATS_ADD_TIME
+#define STATS_TIMER(name) uint64_t name = stats_now_ns()
+#define STATS_ADD_TIME(field, start) STATS_ADD(field, stats_now_ns() - (start))
+#else
+#define STATS_ADD(field, n) ((void)0)
+#define STATS_TIMER(name) ((void)0)
+#define STATS_ADD_TIME(field, start) ((void)0)
+#endif
+
+#define STATS_INC(field) STATS_ADD(field, 1)
+
+#endif  // SRC_STATS_H_
@@ -0,0 +1,945 @@
+// Copyright 2025 Birdee
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "types.h"
+#include "opts.h"
+#include "dates.h"
+#include "decode_keys.h"
+#include "decode_value.h"
+#include "decode_defs.h"
+#include "error_context.h"
+#include "tape_defs.h"
+#include "tape.h"
+
+// tomlua.parse reads a document into a tape instead of lua tables. Queries walk the tape,
+// and only materialize builds lua tables, for just the part of the document asked for.
+//
+// It accepts exactly what tomlua.decode accepts. Values go through the same lex_scalar and keys through the same parse_keys,
+// and the redefinition checks below follow recursive_lua_nav and recursive_lua_set_nav in decode.c step by step,
+// with the DefsState of each table kept on its node instead of in a DefTracker.
+
+// nil, or error userdata type on error
+#define TAPE_ERR_IDX 3
+
+// the userdata. The whole document, or a table or array inside it returned by get
+typedef struct {
+    TapeDoc *doc;
+    uint32_t node;
+} TapeView;
+
+// a key as stored in the arena, after its tag: 's' and the string, or 'n' and the number for int_keys
+typedef struct {
+    char tag;
+    const char *data;
+    size_t len;
+    char num[sizeof(lua_Number)];
+} TapeKey;
+
+void free_tape(TapeDoc *doc) {
+    if (!doc) return;
+    free(doc->nodes);
+    free(doc->stmts);
+    free(doc->slots);
+    free(doc->dates);
+    free_str_buf(&doc->arena);
+    free(doc);
+}
+
+static TapeDoc *new_tape(TomluaUserOpts opts) {
+    TapeDoc *doc = (TapeDoc *)calloc(1, sizeof(TapeDoc));
+    if (!doc) return NULL;
+    doc->cap = 64;
+    doc->nodes = (TapeNode *)malloc(doc->cap * sizeof(TapeNode));
+    doc->slots_cap = 64;
+    doc->slots = (TapeSlot *)calloc(doc->slots_cap, sizeof(TapeSlot));
+    doc->arena = new_str_buf();
+    if (!doc->nodes || !doc->slots || !doc->arena.data) {
+        free_tape(doc);
+        return NULL;
+    }
+    toml_user_opts_copy(doc->opts, opts);
+    doc->nodes[TAPE_ROOT] = (TapeNode){
+        .type = TOML_TABLE,
+        .state = DEFS_UNSEEN,
+        .parent = TAPE_NONE,
+        .next = TAPE_NONE,
+        .first = TAPE_NONE,
+        .last = TAPE_NONE,
+    };
+    doc->len = 1;
+    doc->seek_array = TAPE_NONE;
+    return doc;
+}
+
+// appends a node to the children of parent. Returns TAPE_NONE on OOM
+static uint32_t tape_add(TapeDoc *doc, uint32_t parent, uint8_t type) {
+    if (doc->len >= doc->cap) {
+        if (doc->cap >= UINT32_MAX / 2) return TAPE_NONE;
+        uint32_t new_cap = doc->cap * 2;
+        TapeNode *tmp = (TapeNode *)realloc(doc->nodes, new_cap * sizeof(TapeNode));
+        if (!tmp) return TAPE_NONE;
+        doc->nodes = tmp;
+        doc->cap = new_cap;
+    }
+    uint32_t idx = doc->len++;
+    doc->nodes[idx] = (TapeNode){
+        .type = type,
+        .state = DEFS_UNSEEN,
+        .parent = parent,
+        .next = TAPE_NONE,
+        .first = TAPE_NONE,
+        .last = TAPE_NONE,
+    };
+    TapeNode *p = &doc->nodes[parent];
+    if (p->last == TAPE_NONE) {
+        p->first = idx;
+    } else {
+        doc->nodes[p->last].next = idx;
+    }
+    p->last = idx;
+    p->count++;
+    return idx;
+}
+
+// returns false if the key at idx is not a string or a number
+static inline bool tape_key_at(lua_State *L, int idx, TapeKey *key) {
+    int t = lua_type(L, idx);
+    if (t != LUA_TSTRING && t != LUA_TNUMBER) return false;
+    if (t == LUA_TNUMBER) {
+        lua_Number n = lua_tonumber(L, idx);
+        if (n == 0) n = 0;  // -0 and 0 are the same key
+        key->tag = 'n';
+        memcpy(key->num, &n, sizeof(lua_Number));
+        key->data = key->num;
+        key->len = sizeof(lua_Number);
+    } else {
+        key->tag = 's';
+        key->data = lua_tolstring(L, idx, &key->len);
+    }
+    return true;
+}
+
+static inline uint64_t tape_key_hash(uint32_t parent, const TapeKey *key) {
+    uint64_t h = defs_hash_bytes(0xcbf29ce484222325ULL, (const char *)&parent, sizeof(parent));
+    h = defs_hash_bytes(h, &key->tag, 1);
+    return defs_hash_bytes(h, key->data, key->len);
+}
+
+// returns the slot holding key in parent, or the empty slot it would go into
+static TapeSlot *tape_slot(TapeDoc *doc, uint32_t parent, const TapeKey *key, uint64_t hash) {
+    size_t mask = doc->slots_cap - 1;
+    size_t i = hash & mask;
+    while (doc->slots[i].node != 0) {
+        TapeSlot *slot = &doc->slots[i];
+        const TapeNode *node = &doc->nodes[slot->node];
+        if (slot->hash == hash && node->parent == parent && node->key_len == key->len + 1) {
+            const char *stored = doc->arena.data + node->key_off;
+            if (stored[0] == key->tag && memcmp(stored + 1, key->data, key->len) == 0) return slot;
+        }
+        i = (i + 1) & mask;
+    }
+    return &doc->slots[i];
+}
+
+// returns TAPE_NONE if parent has nothing at key
+static inline uint32_t tape_find(TapeDoc *doc, uint32_t parent, const TapeKey *key) {
+    uint32_t node = tape_slot(doc, parent, key, tape_key_hash(parent, key))->node;
+    return (node == 0) ? TAPE_NONE : node;
+}
+
+// adds a child to parent at key, in place of whatever was there before. Returns TAPE_NONE on OOM
+static uint32_t tape_add_keyed(TapeDoc *doc, uint32_t parent, uint8_t type, const TapeKey *key) {
+    if ((doc->slots_len + 1) * 2 > doc->slots_cap) {
+        size_t new_cap = doc->slots_cap * 2;
+        TapeSlot *tmp = (TapeSlot *)calloc(new_cap, sizeof(TapeSlot));
+        if (!tmp) return TAPE_NONE;
+        size_t new_mask = new_cap - 1;
+        for (size_t j = 0; j < doc->slots_cap; j++) {
+            if (doc->slots[j].node != 0) {
+                size_t s = doc->slots[j].hash & new_mask;
+                while (tmp[s].node != 0) s = (s + 1) & new_mask;
+                tmp[s] = doc->slots[j];
+            }
+        }
+        free(doc->slots);
+        doc->slots = tmp;
+        doc->slots_cap = new_cap;
+    }
+    if (key->len >= UINT32_MAX) return TAPE_NONE;
+    size_t off = doc->arena.len;
+    if (!buf_push(&doc->arena, key->tag)) return TAPE_NONE;
+    if (key->len > 0 && !buf_push_str(&doc->arena, key->data, key->len)) return TAPE_NONE;
+    uint64_t hash = tape_key_hash(parent, key);
+    uint32_t idx = tape_add(doc, parent, type);
+    if (idx == TAPE_NONE) return TAPE_NONE;
+    doc->nodes[idx].key_off = off;
+    doc->nodes[idx].key_len = (uint32_t)(key->len + 1);
+    TapeSlot *slot = tape_slot(doc, parent, key, hash);
+    if (slot->node != 0) {
+        doc->nodes[slot->node].flags |= TAPE_FLAG_DEAD;
+        doc->nodes[parent].count--;
+    } else {
+        doc->slots_len++;
+    }
+    *slot = (TapeSlot){ .hash = hash, .node = idx };
+    return idx;
+}
+
+// adds a value to parent, at the key at key_idx, or as the next element of an array if key_idx is 0
+static inline uint32_t tape_add_value(lua_State *L, TapeDoc *doc, uint32_t parent, int key_idx, uint8_t type) {
+    if (key_idx == 0) return tape_add(doc, parent, type);
+    TapeKey key;
+    tape_key_at(L, key_idx, &key);
+    return tape_add_keyed(doc, parent, type, &key);
+}
+
+static bool tape_set_scalar(TapeDoc *doc, uint32_t idx, const TomlScalar *val) {
+    TapeNode *node = &doc->nodes[idx];
+    if (doc->shape_only) return true;
+    switch (val->type) {
+        case TOML_BOOL:
+            node->v.b = val->v.b;
+            return true;
+        case TOML_INTEGER:
+            node->v.i = val->v.i;
+            return true;
+        case TOML_FLOAT:
+            node->v.f = val->v.f;
+            return true;
+        case TOML_STRING:
+        case TOML_STRING_MULTI:
+            node->v.str.off = doc->arena.len;
+            node->v.str.len = val->v.str.len;
+            return val->v.str.len == 0 || buf_push_str(&doc->arena, val->v.str.data, val->v.str.len);
+        default:
+            if (doc->dates_len >= doc->dates_cap) {
+                size_t new_cap = (doc->dates_cap > 0) ? doc->dates_cap * 2 : 16;
+                TomlDate *tmp = (TomlDate *)realloc(doc->dates, new_cap * sizeof(TomlDate));
+                if (!tmp) return false;
+                doc->dates = tmp;
+                doc->dates_cap = new_cap;
+            }
+            memcpy(doc->dates[doc->dates_len], val->v.date, sizeof(TomlDate));
+            node->v.date = doc->dates_len++;
+            return true;
+    }
+}
+
+static inline uint32_t tape_oom(lua_State *L) {
+    set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 3, "OOM");
+    return TAPE_NONE;
+}
+
+static inline uint32_t tape_keys_err(lua_State *L, size_t len, char *msg, int keys_start, int keys_end) {
+    TMLErr *err = new_tmlerr(L, TAPE_ERR_IDX);
+    set_tmlerr(err, false, len, msg);
+    err_push_keys(L, err, keys_start, keys_end);
+    return TAPE_NONE;
+}
+
+// recursive_lua_nav, for the keys of a heading from keys_start to the top of the stack
+// returns the table that the statements after the heading go into, or TAPE_NONE on error
+static uint32_t tape_nav(lua_State *L, TapeDoc *doc, int keys_start, bool is_array) {
+    int keys_end = lua_gettop(L);
+    if (keys_end - keys_start < 0) {
+        set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 28, "no keys provided to navigate");
+        return TAPE_NONE;
+    }
+    uint32_t cur = TAPE_ROOT;
+    for (int key_idx = keys_start; key_idx <= keys_end; key_idx++) {
+        if (doc->nodes[cur].state == DEFS_UNSEEN) doc->nodes[cur].state = DEFS_TABLE;
+        TapeKey key;
+        tape_key_at(L, key_idx, &key);
+        uint32_t child = tape_find(doc, cur, &key);
+        if (child == TAPE_NONE) {
+            child = tape_add_keyed(doc, cur, TOML_TABLE, &key);
+            if (child == TAPE_NONE) return tape_oom(L);
+        } else if (!tape_is_table(&doc->nodes[child])) {
+            return tape_keys_err(L, 44, "cannot navigate through non-table! Key was: ", keys_start, keys_end);
+        }
+        TapeNode *node = &doc->nodes[child];
+        DefsState state = (DefsState)node->state;
+        if (key_idx < keys_end) {  // NOTE: not last key
+            if (state == DEFS_INLINE_TABLE || state == DEFS_INLINE_ARRAY) {
+                return tape_keys_err(L, 33, "value already defined inline at: ", keys_start, keys_end);
+            }
+            // continue from the current entry of the [[array]]
+            if (state == DEFS_ARRAY) child = node->last;
+        } else {  // NOTE: Last key
+            if (is_array) {
+                if (state == DEFS_TABLE) {
+                    return tape_keys_err(L, 26, "table already defined at: ", keys_start, keys_end);
+                }
+                if (state == DEFS_INLINE_TABLE || state == DEFS_INLINE_ARRAY) {
+                    return tape_keys_err(L, 33, "array already defined inline at: ", keys_start, keys_end);
+                }
+                node->state = DEFS_ARRAY;
+                node->type = TOML_ARRAY;
+                child = tape_add(doc, child, TOML_TABLE);
+                if (child == TAPE_NONE) return tape_oom(L);
+            } else if (state == DEFS_TABLE) {
+                if (node->flags & DEFS_FLAG_EXPLICIT) {
+                    return tape_keys_err(L, 32, "table already defined! Key was: ", keys_start, keys_end);
+                }
+                node->flags |= DEFS_FLAG_EXPLICIT;
+            } else if (state == DEFS_UNSEEN) {
+                node->state = DEFS_TABLE;
+                node->flags |= DEFS_FLAG_EXPLICIT;
+            } else {
+                return tape_keys_err(L, 32, "table already defined! Key was: ", keys_start, keys_end);
+            }
+        }
+        cur = child;
+    }
+    return cur;
+}
+
+// recursive_lua_set_nav, for the keys from keys_start to the top of the stack, starting from root
+// returns the table to set the last key in, or TAPE_NONE on error
+static uint32_t tape_set_nav(lua_State *L, TapeDoc *doc, int keys_start, uint32_t root) {
+    int keys_end = lua_gettop(L);
+    if (keys_end - keys_start < 0) {
+        set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 28, "no keys provided to navigate");
+        return TAPE_NONE;
+    }
+    uint32_t parent = root;
+    for (int key_idx = keys_start; key_idx <= keys_end; key_idx++) {
+        TapeNode *pnode = &doc->nodes[parent];
+        if (pnode->state == DEFS_UNSEEN) {
+            pnode->state = DEFS_TABLE;
+            pnode->flags |= DEFS_FLAG_EXPLICIT;
+        } else if (pnode->state != DEFS_TABLE) {
+            if (key_idx < keys_end) {
+                return tape_keys_err(L, 68, "Tried to use key indexing to set value in inline value or array at: ", keys_start, keys_end);
+            }
+            return tape_keys_err(L, 52, "Tried to use key indexing to set value in array at: ", keys_start, keys_end);
+        }
+        TapeKey key;
+        tape_key_at(L, key_idx, &key);
+        uint32_t child = tape_find(doc, parent, &key);
+        if (key_idx < keys_end) {  // NOTE: not last key
+            if (child == TAPE_NONE || !tape_is_table(&doc->nodes[child])) {
+                child = tape_add_keyed(doc, parent, TOML_TABLE, &key);
+                if (child == TAPE_NONE) return tape_oom(L);
+            }
+            parent = child;
+        } else if (child != TAPE_NONE) {  // NOTE: last key
+            return tape_keys_err(L, 30, "key already defined! Key was: ", keys_start, keys_end);
+        }
+    }
+    return parent;
+}
+
+static bool tape_value(lua_State *L, TapeDoc *doc, str_iter *src, str_buf *buf, uint32_t parent, int key_idx);
+
+// parse_inline_table, into the table node tbl
+static bool tape_inline_table(lua_State *L, TapeDoc *doc, str_iter *src, str_buf *buf, uint32_t tbl) {
+    int keys_start = lua_gettop(L) + 1;
+    bool last_was_comma = false;
+    const bool int_keys = doc->opts[TOMLOPTS_INT_KEYS];
+    const bool fancy_tables = doc->opts[TOMLOPTS_FANCY_TABLES];
+    while (iter_peek(src).ok) {
+        char d = iter_peek(src).v;
+        if (d == '}') {  // NOTE: SUCCESSFUL EXIT
+            iter_skip(src);
+            if (last_was_comma && !fancy_tables) {
+                return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 42, "trailing comma in inline table not allowed");
+            }
+            return true;
+        } else if (d == '\n') {
+            iter_skip(src);
+            if (!fancy_tables) return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 35, "inline tables can not be multi-line");
+        } else if (iter_starts_with(src, "\r\n", 2)) {
+            iter_skip_n(src, 2);
+            if (!fancy_tables) return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 35, "inline tables can not be multi-line");
+        } else if (d == ',') {
+            iter_skip(src);
+            if (last_was_comma) {
+                return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 18, "2 commas in a row!");
+            }
+            last_was_comma = true;
+            continue;
+        } else if (d == ' ' || d == '\t') {
+            iter_skip(src);
+            continue;
+        }
+        last_was_comma = false;
+        if (!parse_keys(L, src, buf, int_keys, TAPE_ERR_IDX)) return false;
+        if (iter_peek(src).ok && iter_peek(src).v != '=') {
+            return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 35, "keys for assignment must end with =");
+        }
+        iter_skip(src);
+        if (consume_whitespace_to_line(src)) {
+            return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 76, "the value in key = value expressions must begin on the same line as the key!");
+        }
+        uint32_t dest = tape_set_nav(L, doc, keys_start, tbl);
+        if (dest == TAPE_NONE) return false;
+        if (!tape_value(L, doc, src, buf, dest, lua_gettop(L))) return false;
+        lua_settop(L, keys_start - 1);
+        if (fancy_tables) {
+            while (consume_whitespace_to_line(src) == 1) {}
+        } else if (consume_whitespace_to_line(src)) {
+            return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 39, "toml inline tables cannot be multi-line");
+        }
+        iter_result next = iter_peek(src);
+        if (next.ok && (next.v != ',' && next.v != '}')) {
+            return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 65, "toml inline table values must be separated with , or ended with }");
+        }
+    }
+    return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 17, "missing closing }");
+}
+
+// decode_inline_value, setting the key at key_idx of parent, or appending to it if key_idx is 0
+static bool tape_value(lua_State *L, TapeDoc *doc, str_iter *src, str_buf *buf, uint32_t parent, int key_idx) {
+    iter_result curr = iter_peek(src);
+    if (!curr.ok) return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 34, "expected value, got end of content");
+    // --- array --- allows trailing comma and multiline
+    if (curr.v == '[') {
+        iter_skip(src);
+        uint32_t arr = tape_add_value(L, doc, parent, key_idx, TOML_ARRAY_INLINE);
+        if (arr == TAPE_NONE) return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 3, "OOM");
+        doc->nodes[arr].state = DEFS_INLINE_ARRAY;
+        while (iter_peek(src).ok) {
+            char d = iter_peek(src).v;
+            if (d == ']') {
+                iter_skip(src);
+                return true;
+            } else if (d == ',' || d == ' ' || d == '\t' || d == '\n' || d == '\r') {
+                iter_skip(src);
+                continue;
+            }
+            if (!tape_value(L, doc, src, buf, arr, 0)) return false;
+        }
+        return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 17, "missing closing ]");
+    // --- inline table --- does NOT support multiline or trailing comma (without fancy_tables)
+    } else if (curr.v == '{') {
+        iter_skip(src);
+        uint32_t tbl = tape_add_value(L, doc, parent, key_idx, TOML_TABLE_INLINE);
+        if (tbl == TAPE_NONE) return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 3, "OOM");
+        if (!tape_inline_table(L, doc, src, buf, tbl)) return false;
+        doc->nodes[tbl].state = DEFS_INLINE_TABLE;
+        return true;
+    }
+    // --- everything else ---
+    TomlScalar val;
+    if (!lex_scalar(L, src, buf, doc->opts, TAPE_ERR_IDX, &val)) return false;
+    uint32_t node = tape_add_value(L, doc, parent, key_idx, (uint8_t)val.type);
+    if (node == TAPE_NONE || !tape_set_scalar(doc, node, &val)) return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 3, "OOM");
+    return true;
+}
+
+// records a statement with the keys from keys_start to the top of the stack, for tape_log
+static bool tape_log_stmt(lua_State *L, TapeDoc *doc, TapeStmtKind kind, int keys_start, size_t pos) {
+    if (doc->stmts_len >= doc->stmts_cap) {
+        size_t new_cap = (doc->stmts_cap > 0) ? doc->stmts_cap * 2 : 64;
+        TapeStmt *tmp = (TapeStmt *)realloc(doc->stmts, new_cap * sizeof(TapeStmt));
+        if (!tmp) return false;
+        doc->stmts = tmp;
+        doc->stmts_cap = new_cap;
+    }
+    int keys_end = lua_gettop(L);
+    TapeStmt *stmt = &doc->stmts[doc->stmts_len];
+    *stmt = (TapeStmt){
+        .kind = kind,
+        .nkeys = (uint32_t)(keys_end - keys_start + 1),
+        .keys_off = doc->arena.len,
+        .value = TAPE_NONE,
+        .pos = pos,
+    };
+    for (int key_idx = keys_start; key_idx <= keys_end; key_idx++) {
+        TapeKey key;
+        tape_key_at(L, key_idx, &key);
+        if (key.len >= UINT32_MAX) return false;
+        uint32_t len = (uint32_t)key.len;
+        if (!buf_push(&doc->arena, key.tag)) return false;
+        if (!buf_push_str(&doc->arena, (const char *)&len, sizeof(len))) return false;
+        if (len > 0 && !buf_push_str(&doc->arena, key.data, len)) return false;
+    }
+    doc->stmts_len++;
+    return true;
+}
+
+// decode_statements, onto the tape
+// if log is set, statements are recorded in doc->stmts as they are instead of being checked and merged into the tape,
+// with the value of each key = value read onto the tape as an element of the root
+// expects the stack to be exactly the source, the tape, and nil at TAPE_ERR_IDX
+// on failure, returns false with the error at TAPE_ERR_IDX and src at where it happened
+static bool tape_statements(lua_State *L, TapeDoc *doc, str_iter *src, str_buf *scratch, bool log) {
+    const bool int_keys = doc->opts[TOMLOPTS_INT_KEYS];
+    const int keys_start = TAPE_ERR_IDX + 1;
+    // the table that key = value statements currently go into
+    uint32_t location = TAPE_ROOT;
+    // the statement of the current heading when logging
+    size_t heading = SIZE_MAX;
+    while (iter_peek(src).ok) {
+        {
+            // consume until non-blank line, consume initial whitespace, then end loop
+            int end_line = consume_whitespace_to_line(src);
+            while (end_line == 1) end_line = consume_whitespace_to_line(src);
+            if (end_line == 2) break;
+        }
+        if (iter_starts_with(src, "[[", 2)) {
+            iter_skip_n(src, 2);
+            if (!parse_keys(L, src, scratch, int_keys, TAPE_ERR_IDX)) return false;
+            if (!iter_starts_with(src, "]]", 2)) {
+                TMLErr *err = new_tmlerr(L, TAPE_ERR_IDX);
+                set_tmlerr(err, false, 14, "array heading ");
+                err_push_keys(L, err, keys_start, lua_gettop(L));
+                tmlerr_push_str(err, " must end with ]]", 17);
+                return false;
+            }
+            iter_skip_n(src, 2);  // consume ]]
+            if (!consume_whitespace_to_line(src)) {
+                TMLErr *err = new_tmlerr(L, TAPE_ERR_IDX);
+                set_tmlerr(err, false, 8, "array [[");
+                err_push_keys(L, err, keys_start, lua_gettop(L));
+                tmlerr_push_str(err, "]] must have a new line before new values", 41);
+                return false;
+            }
+            if (log) {
+                if (!tape_log_stmt(L, doc, TAPE_STMT_ARRAY, keys_start, src->pos)) return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 3, "OOM");
+                heading = doc->stmts_len - 1;
+            } else {
+                location = tape_nav(L, doc, keys_start, true);
+                if (location == TAPE_NONE) return false;
+            }
+        } else if (iter_peek(src).v == '[') {
+            iter_skip(src);
+            if (!parse_keys(L, src, scratch, int_keys, TAPE_ERR_IDX)) return false;
+            if (iter_peek(src).v != ']') {
+                TMLErr *err = new_tmlerr(L, TAPE_ERR_IDX);
+                set_tmlerr(err, false, 14, "table heading ");
+                err_push_keys(L, err, keys_start, lua_gettop(L));
+                tmlerr_push_str(err, " must end with ]", 16);
+                return false;
+            }
+            iter_skip(src);  // consume ]
+            if (!consume_whitespace_to_line(src)) {
+                TMLErr *err = new_tmlerr(L, TAPE_ERR_IDX);
+                set_tmlerr(err, false, 7, "table [");
+                err_push_keys(L, err, keys_start, lua_gettop(L));
+                tmlerr_push_str(err, "] must have a new line before new values", 40);
+                return false;
+            }
+            if (log) {
+                if (!tape_log_stmt(L, doc, TAPE_STMT_TABLE, keys_start, src->pos)) return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 3, "OOM");
+                heading = doc->stmts_len - 1;
+            } else {
+                location = tape_nav(L, doc, keys_start, false);
+                if (location == TAPE_NONE) return false;
+            }
+        } else {
+            if (!parse_keys(L, src, scratch, int_keys, TAPE_ERR_IDX)) return false;
+            if (iter_peek(src).v != '=') {
+                TMLErr *err = new_tmlerr(L, TAPE_ERR_IDX);
+                set_tmlerr(err, false, 20, "keys for assignment ");
+                err_push_keys(L, err, keys_start, lua_gettop(L));
+                tmlerr_push_str(err, " must end with =", 16);
+                return false;
+            }
+            iter_skip(src);  // consume =
+            if (consume_whitespace_to_line(src)) {
+                TMLErr *err = new_tmlerr(L, TAPE_ERR_IDX);
+                set_tmlerr(err, false, 86, "the value in key = value expressions must begin on the same line as the key! Key was: ");
+                err_push_keys(L, err, keys_start, lua_gettop(L));
+                return false;
+            }
+            if (log) {
+                if (!tape_log_stmt(L, doc, TAPE_STMT_KEYVAL, keys_start, src->pos)) return set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 3, "OOM");
+                if (heading != SIZE_MAX) doc->stmts[heading].count++;
+                if (!tape_value(L, doc, src, scratch, TAPE_ROOT, 0)) return false;
+                doc->stmts[doc->stmts_len - 1].value = doc->nodes[TAPE_ROOT].last;
+            } else {
+                uint32_t dest = tape_set_nav(L, doc, keys_start, location);
+                if (dest == TAPE_NONE) return false;
+                if (!tape_value(L, doc, src, scratch, dest, lua_gettop(L))) return false;
+            }
+            if (!consume_whitespace_to_line(src)) {
+                set_tmlerr(new_tmlerr(L, TAPE_ERR_IDX), false, 66, "key value pairs must be followed by a new line (or end of content)");
+                return false;
+            }
+        }
+        lua_settop(L, TAPE_ERR_IDX);
+    }
+    return true;
+}
+
+// --- queries ---
+
+static int tape_gc(lua_State *L) {
+    TapeView *view = (TapeView *)lua_touserdata(L, 1);
+    if (view && view->doc && --view->doc->refs == 0) free_tape(view->doc);
+    if (view) view->doc = NULL;
+    return 0;
+}
+
+static int tape_get(lua_State *L);
+static int tape_len(lua_State *L);
+static int tape_type(lua_State *L);
+static int tape_materialize(lua_State *L);
+
+static void push_tape_mt(lua_State *L) {
+    if (luaL_newmetatable(L, "TomluaTape")) {
+        lua_pushcfunction(L, tape_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_newtable(L);
+        lua_pushcfunction(L, tape_get);
+        lua_setfield(L, -2, "get");
+        lua_pushcfunction(L, tape_len);
+        lua_setfield(L, -2, "len");
+        lua_pushcfunction(L, tape_type);
+        lua_setfield(L, -2, "type");
+        lua_pushcfunction(L, tape_materialize);
+        lua_setfield(L, -2, "materialize");
+        lua_setfield(L, -2, "__index");
+    }
+}
+
+static void push_tape_view(lua_State *L, TapeDoc *doc, uint32_t node) {
+    TapeView *view = (TapeView *)lua_newuserdata(L, sizeof(TapeView));
+    *view = (TapeView){ .doc = doc, .node = node };
+    if (doc) doc->refs++;
+    push_tape_mt(L);
+    lua_setmetatable(L, -2);
+}
+
+// the element at pos, counting from 1, of an array with at least that many
+static uint32_t tape_element(TapeDoc *doc, uint32_t arr, uint32_t pos) {
+    uint32_t i = 1;
+    uint32_t node = doc->nodes[arr].first;
+    if (doc->seek_array == arr && doc->seek_pos <= pos) {
+        i = doc->seek_pos;
+        node = doc->seek_node;
+    }
+    while (i < pos) {
+        node = doc->nodes[node].next;
+        i++;
+    }
+    doc->seek_array = arr;
+    doc->seek_pos = pos;
+    doc->seek_node = node;
+    return node;
+}
+
+// the child of node at the key at key_idx, or TAPE_NONE
+static uint32_t tape_child(lua_State *L, TapeDoc *doc, uint32_t node, int key_idx) {
+    const TapeNode *n = &doc->nodes[node];
+    if (tape_is_array(n)) {
+        if (!lua_isnumber(L, key_idx)) return TAPE_NONE;
+        lua_Number pos = lua_tonumber(L, key_idx);
+        if (pos < 1 || pos > n->count || pos != (lua_Number)(uint32_t)pos) return TAPE_NONE;
+        return tape_element(doc, node, (uint32_t)pos);
+    } else if (n->type == TOML_TABLE || n->type == TOML_TABLE_INLINE) {
+        TapeKey key;
+        if (!tape_key_at(L, key_idx, &key)) return TAPE_NONE;
+        return tape_find(doc, node, &key);
+    }
+    return TAPE_NONE;
+}
+
+// resolves the path at index 2 from the node of the view at index 1. Returns TAPE_NONE if there is nothing there
+// a path is a string of keys like in a heading, with numbers for array elements, a table of keys, or nil for the node itself
+static uint32_t tape_resolve(lua_State *L, TapeView *view) {
+    TapeDoc *doc = view->doc;
+    uint32_t node = view->node;
+    int t = lua_type(L, 2);
+    if (t == LUA_TNIL || t == LUA_TNONE) return node;
+    lua_settop(L, 2);
+    lua_pushnil(L);  // TAPE_ERR_IDX
+    if (t == LUA_TSTRING) {
+        str_iter src = lua_str_to_iter(L, 2);
+        if (src.len == 0) return node;
+        str_buf scratch = new_str_buf();
+        if (scratch.data == NULL) luaL_error(L, "Unable to allocate memory for scratch buffer");
+        if (!parse_key_path(L, &src, &scratch, doc->opts[TOMLOPTS_INT_KEYS], TAPE_ERR_IDX)) {
+            free_str_buf(&scratch);
+            lua_pushliteral(L, "invalid path: ");
+            push_tmlerr_string(L, get_err_val(L, TAPE_ERR_IDX));
+            lua_concat(L, 2);
+            lua_error(L);
+        }
+        free_str_buf(&scratch);
+    } else if (t == LUA_TTABLE) {
+        size_t len = lua_arraylen(L, 2);
+        luaL_checkstack(L, (int)((len > INT32_MAX - 8) ? INT32_MAX - 8 : len), "too many keys in a path");
+        for (size_t i = 1; i <= len; i++) lua_rawgeti(L, 2, (lua_Integer)i);
+    } else {
+        luaL_argerror(L, 2, "path must be a string, a table of keys, or nil");
+    }
+    int keys_end = lua_gettop(L);
+    for (int key_idx = TAPE_ERR_IDX + 1; key_idx <= keys_end && node != TAPE_NONE; key_idx++) {
+        node = tape_child(L, doc, node, key_idx);
+    }
+    lua_settop(L, 2);
+    return node;
+}
+
+static inline TapeView *check_tape(lua_State *L) {
+    TapeView *view = (TapeView *)luaL_checkudata(L, 1, "TomluaTape");
+    if (!view->doc) luaL_error(L, "tape was already freed");
+    return view;
+}
+
+static void tape_push_scalar(lua_State *L, TapeDoc *doc, const TapeNode *node) {
+    TomlScalar val;
+    tape_scalar(doc, node, &val);
+    int erridx = lua_gettop(L) + 1;
+    lua_pushnil(L);
+    if (!push_scalar(L, &val, doc->opts, erridx)) {
+        push_tmlerr_string(L, get_err_val(L, erridx));
+        lua_error(L);
+    }
+    lua_remove(L, erridx);
+}
+
+// pushes the value of node, building tables for it like tomlua.decode would
+static void tape_push(lua_State *L, TapeDoc *doc, uint32_t idx) {
+    const TapeNode *node = &doc->nodes[idx];
+    if (!tape_is_table(node)) {
+        tape_push_scalar(L, doc, node);
+        return;
+    }
+    luaL_checkstack(L, 8, "value nested too deeply");
+    const bool mark_inline = doc->opts[TOMLOPTS_MARK_INLINE];
+    if (tape_is_array(node)) {
+        lua_createtable(L, (node->count > INT32_MAX) ? INT32_MAX : (int)node->count, 0);
+        STATS_INC(STATS_DECODE_TABLES);
+        if (mark_inline && node->type == TOML_ARRAY_INLINE) {
+            lua_newtable(L);
+            lua_pushliteral(L, "ARRAY_INLINE");
+            lua_setfield(L, -2, "toml_type");
+            lua_setmetatable(L, -2);
+        }
+        lua_Integer i = 1;
+        for (uint32_t c = node->first; c != TAPE_NONE; c = doc->nodes[c].next) {
+            tape_push(L, doc, c);
+            lua_rawseti(L, -2, i++);
+        }
+        return;
+    }
+    lua_createtable(L, 0, (node->count > INT32_MAX) ? INT32_MAX : (int)node->count);
+    STATS_INC(STATS_DECODE_TABLES);
+    if (mark_inline && node->type == TOML_TABLE_INLINE) {
+        lua_newtable(L);
+        lua_pushliteral(L, "TABLE_INLINE");
+        lua_setfield(L, -2, "toml_type");
+        lua_setmetatable(L, -2);
+    }
+    for (uint32_t c = node->first; c != TAPE_NONE; c = doc->nodes[c].next) {
+        const TapeNode *child = &doc->nodes[c];
+        if (child->flags & TAPE_FLAG_DEAD) continue;
+        tape_push_key(L, doc, child);
+        tape_push(L, doc, c);
+        lua_rawset(L, -3);
+    }
+}
+
+// doc:get(path) -> the value, with tables and arrays as tapes of their own, or nil
+static int tape_get(lua_State *L) {
+    TapeView *view = check_tape(L);
+    uint32_t node = tape_resolve(L, view);
+    if (node == TAPE_NONE) {
+        lua_pushnil(L);
+    } else if (tape_is_table(&view->doc->nodes[node])) {
+        push_tape_view(L, view->doc, node);
+    } else {
+        tape_push_scalar(L, view->doc, &view->doc->nodes[node]);
+    }
+    return 1;
+}
+
+// doc:len(path) -> number of elements of an array, keys of a table, or bytes of a string, or nil
+static int tape_len(lua_State *L) {
+    TapeView *view = check_tape(L);
+    uint32_t node = tape_resolve(L, view);
+    if (node == TAPE_NONE) {
+        lua_pushnil(L);
+        return 1;
+    }
+    const TapeNode *n = &view->doc->nodes[node];
+    if (tape_is_table(n)) {
+        lua_pushinteger(L, (lua_Integer)n->count);
+    } else if (n->type == TOML_STRING || n->type == TOML_STRING_MULTI) {
+        lua_pushinteger(L, (lua_Integer)n->v.str.len);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+// doc:type(path) -> name of the toml type of the value, or nil
+static int tape_type(lua_State *L) {
+    TapeView *view = check_tape(L);
+    uint32_t node = tape_resolve(L, view);
+    if (node == TAPE_NONE) {
+        lua_pushnil(L);
+        return 1;
+    }
+    int type = view->doc->nodes[node].type;
+    // like tomlua.type of what materialize returns
+    if (type == TOML_STRING_MULTI && !view->doc->opts[TOMLOPTS_MULTI_STRINGS]) type = TOML_STRING;
+    lua_pushstring(L, toml_type_to_lua_name(type));
+    return 1;
+}
+
+// doc:materialize(path) -> the value, built into lua tables like tomlua.decode would, or nil
+static int tape_materialize(lua_State *L) {
+    TapeView *view = check_tape(L);
+    uint32_t node = tape_resolve(L, view);
+    if (node == TAPE_NONE) {
+        lua_pushnil(L);
+    } else {
+        tape_push(L, view->doc, node);
+    }
+    return 1;
+}
+
+int tomlua_parse(lua_State *L) {
+    str_iter src = lua_str_to_iter(L, 1);
+    if (src.buf == NULL) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "tomlua.parse first argument must be a string! tomlua.parse(string) -> tape?, err?");
+        return 2;
+    }
+    lua_settop(L, 1);
+    // the userdata goes on the stack first, so the tape is freed along with it whatever happens below
+    push_tape_view(L, NULL, TAPE_ROOT);
+    TapeView *view = (TapeView *)lua_touserdata(L, 2);
+    view->doc = new_tape(*get_opts_upval(L));
+    if (!view->doc) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "Unable to allocate memory for tape");
+        return 2;
+    }
+    view->doc->refs = 1;
+    TapeDoc *doc = view->doc;
+    // TAPE_ERR_IDX
+    lua_pushnil(L);
+    str_buf scratch = new_str_buf();
+    if (scratch.data == NULL) {
+        lua_settop(L, 0);
+        lua_pushnil(L);
+        lua_pushstring(L, "Unable to allocate memory for scratch buffer");
+        return 2;
+    }
+    if (!tape_statements(L, doc, &src, &scratch, false)) {
+        lua_settop(L, TAPE_ERR_IDX);
+        free_str_buf(&scratch);
+        src.pos = (src.pos >= src.len) ? src.len - 1 : src.pos;
+        tmlerr_push_ctx_from_iter(get_err_val(L, TAPE_ERR_IDX), 7, &src);
+        lua_pushnil(L);
+        push_tmlerr_string(L, get_err_val(L, TAPE_ERR_IDX));
+        return 2;
+    }
+    free_str_buf(&scratch);
+    // done growing
+    TapeNode *nodes = (TapeNode *)realloc(doc->nodes, doc->len * sizeof(TapeNode));
+    if (nodes) {
+        doc->nodes = nodes;
+        doc->cap = doc->len;
+    }
+    lua_settop(L, 2);
+    return 1;
+}
+
+typedef struct {
+    TapeDoc *doc;
+    str_iter src;
+    str_buf scratch;
+    bool ok;
+} TapeLogJob;
+
+static int tape_log_run(lua_State *L) {
+    TapeLogJob *job = (TapeLogJob *)lua_touserdata(L, 1);
+    lua_settop(L, 0);
+    // nothing needs the source or the tape on the stack, only TAPE_ERR_IDX has to be where tape_statements expects it
+    lua_pushnil(L);
+    lua_pushnil(L);
+    lua_pushnil(L);
+    job->ok = tape_statements(L, job->doc, &job->src, &job->scratch, true);
+    return 0;
+}
+
+TapeDoc *tape_log(const char *buf, size_t start, size_t end, TomluaUserOpts opts) {
+    TapeLogJob job = {
+        .doc = new_tape(opts),
+        .src = { .len = end, .pos = start, .buf = buf },
+        .scratch = new_str_buf(),
+    };
+    // parse_keys and lex_scalar keep keys and errors on a lua stack, which can only be used by 1 thread at a time
+    lua_State *L = (job.doc && job.scratch.data) ? luaL_newstate() : NULL;
+    if (L) {
+        lua_pushcfunction(L, tape_log_run);
+        lua_pushlightuserdata(L, &job);
+        if (lua_pcall(L, 1, 0, 0) != 0) job.ok = false;
+        lua_close(L);
+    }
+    free_str_buf(&job.scratch);
+    if (!job.ok) {
+        free_tape(job.doc);
+        return NULL;
+    }
+    return job.doc;
+}
+
+static int tape_validate_run(lua_State *L) {
+    TapeLogJob *job = (TapeLogJob *)lua_touserdata(L, 1);
+    lua_settop(L, 0);
+    lua_pushnil(L);
+    lua_pushnil(L);
+    lua_pushnil(L);  // TAPE_ERR_IDX
+    job->ok = tape_statements(L, job->doc, &job->src, &job->scratch, false);
+    if (job->ok) return 0;
+    str_iter *src = &job->src;
+    src->pos = (src->pos >= src->len) ? src->len - 1 : src->pos;
+    tmlerr_push_ctx_from_iter(get_err_val(L, TAPE_ERR_IDX), 7, src);
+    push_tmlerr_string(L, get_err_val(L, TAPE_ERR_IDX));
+    return 1;
+}
+
+// tomlua.validate(str) -> true, or false and the error decode would have returned
+// the document is read onto a tape which only keeps what the checks need, so no lua tables or values are made for it.
+// It runs protected so that the tape is freed even if lua raises an error on the way
+int tomlua_validate(lua_State *L) {
+    str_iter src = lua_str_to_iter(L, 1);
+    if (src.buf == NULL) {
+        lua_settop(L, 0);
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "tomlua.validate first argument must be a string! tomlua.validate(string) -> ok, err?");
+        return 2;
+    }
+    TapeLogJob job = {
+        .doc = new_tape(*get_opts_upval(L)),
+        .src = src,
+        .scratch = new_str_buf(),
+    };
+    lua_settop(L, 1);
+    if (!job.doc || !job.scratch.data) {
+        free_tape(job.doc);
+        free_str_buf(&job.scratch);
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "Unable to allocate memory for tape");
+        return 2;
+    }
+    job.doc->shape_only = true;
+    lua_pushcfunction(L, tape_validate_run);
+    lua_pushlightuserdata(L, &job);
+    int status = lua_pcall(L, 1, 1, 0);
+    free_tape(job.doc);
+    free_str_buf(&job.scratch);
+    if (status == 0 && job.ok) {
+        lua_pushboolean(L, true);
+        return 1;
+    }
+    lua_pushboolean(L, false);
+    lua_insert(L, -2);
+    return 2;
+}
@@ -0,0 +1,10 @@
+// Copyright 2025 Birdee
+#ifndef SRC_TAPE_H_
+#define SRC_TAPE_H_
+
+#include <lua.h>
+
+int tomlua_parse(lua_State *L);
+int tomlua_validate(lua_State *L);
+
+#endif  // SRC_TAPE_H_
@@ -0,0 +1,142 @@
+// Copyright 2025 Birdee
+#ifndef SRC_TAPE_DEFS_H_
+#define SRC_TAPE_DEFS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <lua.h>
+#include "./types.h"
+#include "./opts.h"
+#include "./dates.h"
+#include "./decode_value.h"
+
+// The tape that tomlua.parse builds, shared with decode_parallel, which reads each part of a document onto one.
+// It is one array of nodes in C memory, in the order they were defined, with every key and string copied
+// into an arena next to it, so the source does not need to stay alive.
+
+#define TAPE_NONE UINT32_MAX
+#define TAPE_ROOT 0
+// set on a value that a dotted key went through, which decode replaces with a new table
+#define TAPE_FLAG_DEAD 0x02
+
+typedef struct {
+    uint8_t type;  // TomlType
+    uint8_t state;  // DefsState, for tables and arrays
+    uint8_t flags;  // DEFS_FLAG_EXPLICIT, TAPE_FLAG_DEAD
+    uint32_t parent;
+    uint32_t next;  // next sibling, TAPE_NONE for the last one
+    uint32_t first;  // first child, TAPE_NONE if there are none
+    uint32_t last;  // last child, which is the current entry of an [[array]]
+    uint32_t count;  // children, not counting dead ones
+    uint32_t key_len;  // 0 for array elements
+    size_t key_off;  // offset in the arena of the key, tagged like DefTracker keys
+    union {
+        bool b;
+        lua_Integer i;
+        lua_Number f;
+        struct {
+            size_t off;  // offset in the arena
+            size_t len;
+        } str;
+        size_t date;  // index into TapeDoc.dates
+    } v;
+} TapeNode;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t node;  // 0 for an empty slot, as the root is nobody's child
+} TapeSlot;
+
+typedef enum {
+    TAPE_STMT_TABLE,  // [heading]
+    TAPE_STMT_ARRAY,  // [[heading]]
+    TAPE_STMT_KEYVAL,  // key = value
+} TapeStmtKind;
+
+// one statement as read by tape_log, which leaves checking the keys to whoever replays it
+typedef struct {
+    uint8_t kind;  // TapeStmtKind
+    uint32_t nkeys;
+    size_t keys_off;  // offset in the arena of the keys, each one its tag, its length as a uint32_t, then its bytes
+    uint32_t value;  // the node holding the value of a key = value, a child of the root
+    uint32_t count;  // key = value statements under a heading
+    size_t pos;  // where in the source decode would be when checking the keys, for the context of errors
+} TapeStmt;
+
+typedef struct {
+    TapeNode *nodes;
+    uint32_t len;
+    uint32_t cap;
+    // child of each (parent, key), for lookups and to catch duplicate keys
+    TapeSlot *slots;
+    size_t slots_len;
+    size_t slots_cap;  // always a power of 2
+    TomlDate *dates;
+    size_t dates_len;
+    size_t dates_cap;
+    str_buf arena;
+    TomluaUserOpts opts;
+    // the last element found in an array, so that going through one in order does not start over each time
+    uint32_t seek_array;
+    uint32_t seek_pos;
+    uint32_t seek_node;
+    size_t refs;  // userdata pointing at this tape
+    // set by tomlua.validate, which only needs the shape of the document, so strings and dates are not kept
+    bool shape_only;
+    // only filled by tape_log
+    TapeStmt *stmts;
+    size_t stmts_len;
+    size_t stmts_cap;
+} TapeDoc;
+
+static inline bool tape_is_table(const TapeNode *node) {
+    return node->type == TOML_TABLE || node->type == TOML_TABLE_INLINE || node->type == TOML_ARRAY || node->type == TOML_ARRAY_INLINE;
+}
+
+static inline bool tape_is_array(const TapeNode *node) {
+    return node->type == TOML_ARRAY || node->type == TOML_ARRAY_INLINE;
+}
+
+// pushes the key of node, which must not be an array element
+static inline void tape_push_key(lua_State *L, const TapeDoc *doc, const TapeNode *node) {
+    STATS_INC(STATS_DECODE_KEYS);
+    const char *key = doc->arena.data + node->key_off;
+    if (key[0] == 'n') {
+        lua_Number n;
+        memcpy(&n, key + 1, sizeof(lua_Number));
+        lua_pushnumber(L, n);
+    } else {
+        lua_pushlstring(L, key + 1, node->key_len - 1);
+    }
+}
+
+// the value of a node that is not a table or an array, as lex_scalar read it
+static inline void tape_scalar(const TapeDoc *doc, const TapeNode *node, TomlScalar *out) {
+    out->type = (TomlType)node->type;
+    switch (out->type) {
+        case TOML_BOOL:
+            out->v.b = node->v.b;
+            break;
+        case TOML_INTEGER:
+            out->v.i = node->v.i;
+            break;
+        case TOML_FLOAT:
+            out->v.f = node->v.f;
+            break;
+        case TOML_STRING:
+        case TOML_STRING_MULTI:
+            out->v.str.data = doc->arena.data + node->v.str.off;
+            out->v.str.len = node->v.str.len;
+            break;
+        default:
+            memcpy(out->v.date, doc->dates[node->v.date], sizeof(TomlDate));
+    }
+}
+
+void free_tape(TapeDoc *doc);
+// reads the statements of buf from start to end onto a new tape, in a lua_State of its own, so it can run on any thread.
+// Returns NULL on any error, which is left for tomlua.decode to report
+TapeDoc *tape_log(const char *buf, size_t start, size_t end, TomluaUserOpts opts);
+
+#endif  // SRC_TAPE_DEFS_H_
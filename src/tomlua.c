@@ -6,11 +6,21 @@
 #include "dates.h"
 #include "opts.h"
 #include "decode.h"
+#include "tape.h"
 #include "encode.h"
+#include "context.h"
+#include "snapshot.h"
+#include "stats.h"
 
-static inline TomlType toml_table_type(lua_State *L, int idx) {
+static TomlType toml_table_type(lua_State *L, int idx) {
     int old_top = lua_gettop(L);
     idx = absindex(old_top, idx);
+    // a result of cached_decode has the type of the table it reads from
+    if (push_frozen_view(L, idx)) {
+        TomlType t = toml_table_type(L, old_top + 1);
+        lua_settop(L, old_top);
+        return t;
+    }
     bool is_inline = false;
     switch (get_meta_toml_type(L, idx)) {
         case TOML_ARRAY: if (lua_arraylen(L, idx) == 0) return TOML_ARRAY; else break;
@@ -165,9 +175,39 @@ int luaopen_tomlua(lua_State *L) {
     lua_pushcclosure(L, tomlua_decode, 1);
     lua_setfield(L, 1, "decode");
     lua_pushvalue(L, -1);
+    lua_pushcclosure(L, tomlua_decode_file, 1);
+    lua_setfield(L, 1, "decode_file");
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, tomlua_decode_parallel, 1);
+    lua_setfield(L, 1, "decode_parallel");
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, tomlua_cached_decode, 1);
+    lua_setfield(L, 1, "cached_decode");
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, tomlua_decode_lazy, 1);
+    lua_setfield(L, 1, "decode_lazy");
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, tomlua_decoder, 1);
+    lua_setfield(L, 1, "decoder");
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, tomlua_decoder_from, 1);
+    lua_setfield(L, 1, "decoder_from");
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, tomlua_context, 1);
+    lua_setfield(L, 1, "context");
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, tomlua_parse, 1);
+    lua_setfield(L, 1, "parse");
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, tomlua_validate, 1);
+    lua_setfield(L, 1, "validate");
+    lua_pushvalue(L, -1);
     lua_pushcclosure(L, encode, 1);
     lua_setfield(L, 1, "encode");
     lua_pushvalue(L, -1);
+    lua_pushcclosure(L, encode_to, 1);
+    lua_setfield(L, 1, "encode_to");
+    lua_pushvalue(L, -1);
     lua_pushcclosure(L, opts_index, 1);
     lua_setfield(L, argtop + 2, "__index");
     lua_pushvalue(L, -1);
@@ -193,6 +233,14 @@ int luaopen_tomlua(lua_State *L) {
     lua_setfield(L, 1, "type");
     lua_pushcfunction(L, str_2_mul);
     lua_setfield(L, 1, "str_2_mul");
+    lua_pushcfunction(L, tomlua_dump);
+    lua_setfield(L, 1, "dump");
+    lua_pushcfunction(L, tomlua_undump);
+    lua_setfield(L, 1, "undump");
+    lua_pushcfunction(L, tomlua_undump_file);
+    lua_setfield(L, 1, "undump_file");
+    lua_pushcfunction(L, tomlua_stats);
+    lua_setfield(L, 1, "stats");
     lua_newtable(L);
     lua_pushcfunction(L, luaopen_tomlua);
     lua_setfield(L, 2, "__call");
@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include <lua.h>
 #include <lauxlib.h>
+#include "./scan.h"
+#include "./stats.h"
 #ifndef __cplusplus
 #include <stdbool.h>
 #endif
@@ -255,6 +257,7 @@ static bool buf_push(str_buf *buf, char c) {
         size_t new_capacity = buf->cap > 0 ? buf->cap * 2 : 1;
         char *tmp = (char *)realloc(buf->data, new_capacity * sizeof(char));
         if (!tmp) return false;
+        STATS_INC(STATS_BUF_REALLOCS);
         buf->data = tmp;
         buf->cap = new_capacity;
     }
@@ -270,6 +273,7 @@ static bool buf_push_str(str_buf *buf, const char *str, size_t len) {
         while (new_capacity < required_len) new_capacity *= 2;
         char *tmp = (char *)realloc(buf->data, new_capacity * sizeof(char));
         if (!tmp) return false;
+        STATS_INC(STATS_BUF_REALLOCS);
         buf->data = tmp;
         buf->cap = new_capacity;
     }
@@ -290,6 +294,7 @@ static bool buf_grow(str_buf *buf, size_t new_cap) {
     while (cap < new_cap) cap *= 2;
     char *tmp = (char *)realloc(buf->data, cap * sizeof(char));
     if (!tmp) return false;
+    STATS_INC(STATS_BUF_REALLOCS);
     buf->data = tmp;
     buf->cap = cap;
     return true;
@@ -301,6 +306,7 @@ static bool buf_null_terminate(str_buf *buf) {
         size_t new_capacity = buf->cap > 0 ? buf->cap * 2 : 1;
         char *tmp = (char *)realloc(buf->data, new_capacity * sizeof(char));
         if (!tmp) return false;
+        STATS_INC(STATS_BUF_REALLOCS);
         buf->data = tmp;
         buf->cap = new_capacity;
     }
@@ -308,6 +314,18 @@ static bool buf_null_terminate(str_buf *buf) {
     return true;
 }
 
+// empties buf, and gives back the memory it holds past keep bytes, down to a power of 2 no smaller than 16
+static inline void buf_trim(str_buf *buf, size_t keep) {
+    buf->len = 0;
+    if (buf->cap <= keep || buf->cap <= 16) return;
+    size_t cap = 16;
+    while (cap * 2 <= keep) cap *= 2;
+    char *tmp = (char *)realloc(buf->data, cap * sizeof(char));
+    if (!tmp) return;
+    buf->data = tmp;
+    buf->cap = cap;
+}
+
 static inline bool push_buf_to_lua_string(lua_State *L, const str_buf *buf) {
     if (!buf || !buf->data) return false;
     lua_pushlstring(L, buf->data, buf->len);
@@ -442,44 +460,56 @@ static inline iter_utf8_result iter_next_utf8(str_iter *iter) {
     return res;
 }
 
+// the rest of consume_whitespace_to_line, for when the first byte after the blanks at pos is not a plain value byte:
+// the end of the file, a comment, or a \r. Kept out of line, as most calls never get here
+static int consume_whitespace_to_line_slow(str_iter *src, size_t pos) {
+    const char *buf = src->buf;
+    size_t len = src->len;
+    if (pos >= len) {
+        // read whitespace until EOF
+        src->pos = len;
+        return 2;
+    }
+    char d = buf[pos];
+    if (d == '#') {
+        // skips through the end of the line on trailing comments and failed parses
+        pos++;
+        pos += scan_find_byte(buf + pos, len - pos, '\n');
+        if (pos >= len) {
+            // reached EOF in a comment
+            src->pos = len;
+            return 2;
+        }
+        src->pos = pos + 1;
+        return true;
+    } else if (d == '\r' && pos + 1 < len && buf[pos + 1] == '\n') {
+        src->pos = pos + 2;
+        return true;
+    }
+    // read non-whitespace
+    src->pos = pos;
+    return false;
+}
+
 // consumes whitespace until end of whitespace, line, or file.
 // returns true if the end of the line or file was found
 // 0 for whitespace ending before end of line
 // 1 for end of line, 2 for end of file
 // (both 1 and 2 will be read as true in if statements)
 static inline int consume_whitespace_to_line(str_iter *src) {
-    // skips through the end of the line on trailing comments and failed parses
-    while (iter_peek(src).ok) {
-        char d = iter_peek(src).v;
-        if (d == '#') {
-            iter_skip(src);
-            iter_result curr = iter_next(src);
-            while (curr.ok) {
-                if (curr.v == '\n') {
-                    return true;
-                } else if (curr.v == '\r' && iter_peek(src).v == '\n') {
-                    iter_skip(src);
-                    return true;
-                }
-                curr = iter_next(src);
-            }
-            // reached EOF in a comment
-            return 2;
-        } else if (d == '\n') {
-            iter_skip(src);
-            return true;
-        } else if (iter_starts_with(src, "\r\n", 2)) {
-            iter_skip_n(src, 2);
+    if (!src || !src->buf || src->pos >= src->len) return 2;
+    size_t pos = src->pos + scan_blank_run(src->buf + src->pos, src->len - src->pos);
+    if (pos < src->len) {
+        char d = src->buf[pos];
+        if (d == '\n') {
+            src->pos = pos + 1;
             return true;
-        } else if (d == ' ' || d == '\t') {
-            iter_skip(src);
-        } else {
-            // read non-whitespace
+        } else if (d != '#' && d != '\r') {
+            src->pos = pos;
             return false;
         }
     }
-    // read whitespace until EOF
-    return 2;
+    return consume_whitespace_to_line_slow(src, pos);
 }
 
 #endif  // SRC_TYPES_H_
@@ -0,0 +1,346 @@
+// Copyright 2025 Birdee
+// make bench-c
+// Times the kernels that decode and encode are made of, each on its own input, so that a regression
+// can be pinned on one of them instead of on the total of bench.lua. Every kernel is run on its input
+// a few times to warm up, then timed for a number of repetitions, and the median and p99 of those are reported.
+// usage: bench [example.toml] [repetitions]
+#define _POSIX_C_SOURCE 200809L
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "types.h"
+#include "opts.h"
+#include "dates.h"
+#include "decode_keys.h"
+#include "decode_value.h"
+#include "encode_str.h"
+
+extern int luaopen_tomlua(lua_State *L);
+
+// how many bytes of input each generated corpus has, about
+#define BENCH_CORPUS_SIZE (256 * 1024)
+#define BENCH_WARMUP 3
+#define BENCH_DEFAULT_REPS 50
+// repetitions shorter than this run their kernel several times, so that the clock resolution does not matter
+#define BENCH_MIN_REP_NS 2000000.0
+
+// stack slots of the lua_State that the kernels share
+#define BENCH_TOMLUA_IDX 1
+#define BENCH_ERR_IDX 2
+#define BENCH_ARG_IDX 3
+
+typedef struct {
+    lua_State *L;
+    str_buf scratch;
+    str_buf out;
+    TomluaUserOpts opts;
+} BenchCtx;
+
+// runs the kernel over all of input once, and returns false if it failed
+typedef bool (*BenchFn)(BenchCtx *ctx, const str_buf *input);
+
+typedef struct {
+    const char *name;
+    BenchFn fn;
+    str_buf input;
+} BenchKernel;
+
+static inline double bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// repeats the samples in order until the corpus is about BENCH_CORPUS_SIZE bytes
+static str_buf bench_corpus(const char *const *samples) {
+    str_buf buf = new_str_buf();
+    while (buf.data != NULL && buf.len < BENCH_CORPUS_SIZE) {
+        for (const char *const *s = samples; *s != NULL; s++) {
+            if (!buf_push_str(&buf, *s, strlen(*s))) {
+                free_str_buf(&buf);
+                break;
+            }
+        }
+    }
+    return buf;
+}
+
+static inline str_iter bench_iter(const str_buf *input) {
+    return (str_iter){ .len = input->len, .pos = 0, .buf = input->data };
+}
+
+static bool bench_whitespace(BenchCtx *ctx, const str_buf *input) {
+    str_iter src = bench_iter(input);
+    int code;
+    while ((code = consume_whitespace_to_line(&src)) == 1) {}
+    return code == 2;
+}
+
+// every line is a dotted key followed by " = "
+static bool bench_keys(BenchCtx *ctx, const str_buf *input) {
+    lua_State *L = ctx->L;
+    str_iter src = bench_iter(input);
+    while (src.pos < src.len) {
+        if (!parse_keys(L, &src, &ctx->scratch, false, BENCH_ERR_IDX)) return false;
+        lua_settop(L, BENCH_ERR_IDX);
+        if (iter_next(&src).v != '=' || consume_whitespace_to_line(&src) != 1) return false;
+    }
+    return true;
+}
+
+// every line is a value that lex_scalar reads, used for the strings, numbers and dates
+static bool bench_scalars(BenchCtx *ctx, const str_buf *input) {
+    str_iter src = bench_iter(input);
+    TomlScalar out;
+    while (src.pos < src.len) {
+        if (!lex_scalar(ctx->L, &src, &ctx->scratch, ctx->opts, BENCH_ERR_IDX, &out)) return false;
+        if (consume_whitespace_to_line(&src) == 0) return false;
+    }
+    return true;
+}
+
+// every line is a string to escape, the newline is escaped with it
+static bool bench_escape_simple(BenchCtx *ctx, const str_buf *input) {
+    str_iter src = bench_iter(input);
+    buf_soft_reset(&ctx->out);
+    return buf_push_esc_simple(&ctx->out, &src);
+}
+
+static bool bench_escape_multi(BenchCtx *ctx, const str_buf *input) {
+    str_iter src = bench_iter(input);
+    buf_soft_reset(&ctx->out);
+    return buf_push_esc_multi(&ctx->out, &src);
+}
+
+// calls the tomlua function name with the value at BENCH_ARG_IDX
+static bool bench_call(BenchCtx *ctx, const char *name) {
+    lua_State *L = ctx->L;
+    lua_getfield(L, BENCH_TOMLUA_IDX, name);
+    lua_pushvalue(L, BENCH_ARG_IDX);
+    bool ok = lua_pcall(L, 1, 1, 0) == 0 && !lua_isnil(L, -1);
+    lua_settop(L, BENCH_ARG_IDX);
+    return ok;
+}
+
+// the input is also at BENCH_ARG_IDX as a lua string
+static bool bench_decode(BenchCtx *ctx, const str_buf *input) {
+    return bench_call(ctx, "decode");
+}
+
+// the decoded input is at BENCH_ARG_IDX
+static bool bench_encode(BenchCtx *ctx, const str_buf *input) {
+    return bench_call(ctx, "encode");
+}
+
+static int bench_cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static bool bench_run(BenchCtx *ctx, const BenchKernel *k, int reps, double *times) {
+    double start = bench_now_ns();
+    for (int i = 0; i < BENCH_WARMUP; i++) {
+        if (!k->fn(ctx, &k->input)) return false;
+    }
+    double warm = (bench_now_ns() - start) / BENCH_WARMUP;
+    int inner = (warm >= BENCH_MIN_REP_NS) ? 1 : (int)(BENCH_MIN_REP_NS / ((warm > 1) ? warm : 1)) + 1;
+    for (int r = 0; r < reps; r++) {
+        start = bench_now_ns();
+        for (int i = 0; i < inner; i++) {
+            if (!k->fn(ctx, &k->input)) return false;
+        }
+        times[r] = (bench_now_ns() - start) / inner;
+    }
+    qsort(times, (size_t)reps, sizeof(double), bench_cmp_double);
+    return true;
+}
+
+static void bench_report(const BenchKernel *k, const double *times, int reps) {
+    double bytes = (double)k->input.len;
+    double median = (reps % 2) ? times[reps / 2] : (times[reps / 2 - 1] + times[reps / 2]) / 2;
+    int p99_idx = (int)(0.99 * reps + 0.999999) - 1;
+    double p99 = times[(p99_idx < 0) ? 0 : p99_idx];
+    // bytes per ns * 1e3 is MB/s
+    printf("%-24s %10zu %12.3f %12.3f %12.3f %10.1f\n",
+        k->name, k->input.len, times[0] / bytes, median / bytes, p99 / bytes, bytes / median * 1e3);
+}
+
+static const char *const WHITESPACE_SAMPLES[] = {
+    "    \t  \n",
+    "        # a comment about the next value\n",
+    "\t\t\r\n",
+    "\n",
+    "  # another comment\n",
+    NULL,
+};
+static const char *const KEY_SAMPLES[] = {
+    "name = \n",
+    "server.host = \n",
+    "database.connection_max = \n",
+    "\"quoted key\".inner = \n",
+    "'literal.key'.a.b = \n",
+    "owner.address.street_name_with_long_key = \n",
+    NULL,
+};
+static const char *const BASIC_STRING_SAMPLES[] = {
+    "\"Tom Preston-Werner\"\n",
+    "\"a string with \\\"escapes\\\" and a tab\\t in it\"\n",
+    "\"unicode \\u00E9 and \\U0001F600 escapes\"\n",
+    "\"192.168.1.1\"\n",
+    NULL,
+};
+static const char *const MULTI_BASIC_STRING_SAMPLES[] = {
+    "\"\"\"\nRoses are red\nViolets are blue\"\"\"\n",
+    "\"\"\"\nThe quick brown \\\n  fox jumps over \\\n  the lazy dog.\"\"\"\n",
+    "\"\"\"with \\\"escapes\\\" and \\n newlines\"\"\"\n",
+    NULL,
+};
+static const char *const LITERAL_STRING_SAMPLES[] = {
+    "'C:\\Users\\nodejs\\templates'\n",
+    "'\\\\ServerX\\admin$\\system32\\'\n",
+    "'Tom \"Dubs\" Preston-Werner'\n",
+    "'<\\i\\c*\\s*>'\n",
+    NULL,
+};
+static const char *const MULTI_LITERAL_STRING_SAMPLES[] = {
+    "'''\nThe first newline is\ntrimmed in raw strings.\n   All other whitespace\n   is preserved.\n'''\n",
+    "'''I [dw]on't need \\d{2} apples'''\n",
+    NULL,
+};
+static const char *const NUMBER_SAMPLES[] = {
+    "99\n", "-17\n", "5_349_221\n", "0xDEADBEEF\n", "0o755\n", "0b11010110\n",
+    "3.1415\n", "-0.01\n", "5e+22\n", "6.626e-34\n", "224_617.445_991_228\n", "1234567890123\n",
+    NULL,
+};
+static const char *const DATE_SAMPLES[] = {
+    "1979-05-27T07:32:00Z\n",
+    "1979-05-27T00:32:00.999999-07:00\n",
+    "1979-05-27 07:32:00Z\n",
+    "1979-05-27T07:32:00\n",
+    "1979-05-27\n",
+    "07:32:00.999\n",
+    NULL,
+};
+static const char *const ESCAPE_SAMPLES[] = {
+    "plain ascii text that needs no escaping at all, which is most of it\n",
+    "C:\\path\\with\\backslashes and \"quotes\"\n",
+    "tabs\tand\tcontrol\x01characters\n",
+    "unicode text: \xC3\xA9\xC3\xA0\xC3\xBC \xE2\x82\xAC \xF0\x9F\x98\x80\n",
+    NULL,
+};
+
+// headings and dotted keys, so that most of the time goes to finding and creating tables
+static str_buf bench_navigation_corpus(void) {
+    str_buf buf = new_str_buf();
+    char line[128];
+    for (int i = 0; buf.data != NULL && buf.len < BENCH_CORPUS_SIZE; i++) {
+        int n = snprintf(line, sizeof(line),
+            "[servers.group%d.host%d]\nip.v4 = 1\nip.v6 = 2\n[[products.list]]\nname.first = %d\nname.last.x = 0\n",
+            i % 16, i, i);
+        if (n <= 0 || !buf_push_str(&buf, line, (size_t)n)) free_str_buf(&buf);
+    }
+    return buf;
+}
+
+static str_buf bench_read_file(const char *path) {
+    str_buf buf = new_str_buf();
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        free_str_buf(&buf);
+        return buf;
+    }
+    char chunk[4096];
+    size_t n;
+    while (buf.data != NULL && (n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        if (!buf_push_str(&buf, chunk, n)) free_str_buf(&buf);
+    }
+    fclose(f);
+    return buf;
+}
+
+int main(int argc, char **argv) {
+    const char *example = (argc > 1) ? argv[1] : "tests/example.toml";
+    int reps = (argc > 2) ? atoi(argv[2]) : BENCH_DEFAULT_REPS;
+    if (reps < 1) reps = BENCH_DEFAULT_REPS;
+
+    BenchKernel kernels[] = {
+        { "whitespace", bench_whitespace, bench_corpus(WHITESPACE_SAMPLES) },
+        { "keys", bench_keys, bench_corpus(KEY_SAMPLES) },
+        { "string basic", bench_scalars, bench_corpus(BASIC_STRING_SAMPLES) },
+        { "string multi basic", bench_scalars, bench_corpus(MULTI_BASIC_STRING_SAMPLES) },
+        { "string literal", bench_scalars, bench_corpus(LITERAL_STRING_SAMPLES) },
+        { "string multi literal", bench_scalars, bench_corpus(MULTI_LITERAL_STRING_SAMPLES) },
+        { "numbers", bench_scalars, bench_corpus(NUMBER_SAMPLES) },
+        { "dates", bench_scalars, bench_corpus(DATE_SAMPLES) },
+        { "table navigation", bench_decode, bench_navigation_corpus() },
+        { "encode escape simple", bench_escape_simple, bench_corpus(ESCAPE_SAMPLES) },
+        { "encode escape multi", bench_escape_multi, bench_corpus(ESCAPE_SAMPLES) },
+        { "decode example.toml", bench_decode, bench_read_file(example) },
+        { "encode example.toml", bench_encode, bench_read_file(example) },
+    };
+    const size_t nkernels = sizeof(kernels) / sizeof(kernels[0]);
+
+    BenchCtx ctx = {
+        .L = luaL_newstate(),
+        .scratch = new_str_buf(),
+        .out = new_str_buf(),
+    };
+    memset(ctx.opts, 0, sizeof(TomluaUserOpts));
+    // dates are parsed all the way, like they are for userdata
+    ctx.opts[TOMLOPTS_DATES] = TOMLDATES_USERDATA;
+    double *times = (double *)malloc(sizeof(double) * (size_t)reps);
+    if (ctx.L == NULL || ctx.scratch.data == NULL || ctx.out.data == NULL || times == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    lua_State *L = ctx.L;
+    luaL_openlibs(L);
+    lua_pushcfunction(L, luaopen_tomlua);
+    lua_call(L, 0, 1);  // BENCH_TOMLUA_IDX
+
+    int status = 0;
+    printf("%d repetitions after %d to warm up, times are per byte of input\n", reps, BENCH_WARMUP);
+    printf("%-24s %10s %12s %12s %12s %10s\n", "kernel", "bytes", "min ns/B", "median ns/B", "p99 ns/B", "MB/s");
+    for (size_t i = 0; i < nkernels; i++) {
+        BenchKernel *k = &kernels[i];
+        if (k->input.data == NULL) {
+            fprintf(stderr, "%s: unable to make its input\n", k->name);
+            status = 1;
+            continue;
+        }
+        lua_settop(L, BENCH_TOMLUA_IDX);
+        lua_pushnil(L);  // BENCH_ERR_IDX
+        lua_pushlstring(L, k->input.data, k->input.len);  // BENCH_ARG_IDX
+        if (k->fn == bench_encode) {
+            // encode takes the decoded input
+            lua_getfield(L, BENCH_TOMLUA_IDX, "decode");
+            lua_insert(L, BENCH_ARG_IDX);
+            lua_call(L, 1, 1);
+        }
+        if (!bench_run(&ctx, k, reps, times)) {
+            if (lua_isnil(L, BENCH_ERR_IDX)) {
+                fprintf(stderr, "%s: failed\n", k->name);
+            } else {
+                push_tmlerr_string(L, get_err_val(L, BENCH_ERR_IDX));
+                fprintf(stderr, "%s: %s\n", k->name, lua_tostring(L, -1));
+            }
+            status = 1;
+            continue;
+        }
+        bench_report(k, times, reps);
+    }
+
+    for (size_t i = 0; i < nkernels; i++) free_str_buf(&kernels[i].input);
+    free_str_buf(&ctx.scratch);
+    free_str_buf(&ctx.out);
+    free(times);
+    lua_close(L);
+    return status;
+}
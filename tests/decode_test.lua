@@ -16,6 +16,23 @@ local tomlua_overflow_errors = require("tomlua")({ overflow_errors = true })
 ---@type Tomlua
 local tomlua_underflow_errors = require("tomlua")({ underflow_errors = true })
 
+-- whether a and b hold the same values, however their tables were built.
+-- pairs order can differ between tables with the same contents, so they are compared value by value.
+-- NaN is the same as NaN, toml_type marks have to match, and userdata like dates are compared by tostring
+local function same(a, b)
+	if type(a) ~= type(b) then return false end
+	if type(a) == "userdata" then return a == b or tostring(a) == tostring(b) end
+	if type(a) ~= "table" then return a == b or (a ~= a and b ~= b) end
+	if (getmetatable(a) or {}).toml_type ~= (getmetatable(b) or {}).toml_type then return false end
+	for k, v in pairs(a) do
+		if not same(v, b[k]) then return false end
+	end
+	for k in pairs(b) do
+		if a[k] == nil then return false end
+	end
+	return true
+end
+
 define("decode example.toml", function()
 	local f = io.open(("%sexample.toml"):format(test_dir), "r")
 	local contents
@@ -30,6 +47,139 @@ define("decode example.toml", function()
 	end, "Should not error on valid TOML")
 end)
 
+define("decode_file reads the same as decode", function()
+	local path = ("%sexample.toml"):format(test_dir)
+	local f = assert(io.open(path, "rb"))
+	local contents = f:read("*a")
+	f:close()
+	local expected = tomlua_default.decode(contents)
+	local data, err = tomlua_default.decode_file(path)
+	ok(err == nil, "Should not error on valid TOML")
+	ok(tomlua_default.encode(data) == tomlua_default.encode(expected), "Should match decode of the same file")
+	data, err = tomlua_default.decode_file(path, { extra = 1 })
+	ok(err == nil and data.extra == 1, "Should accept defaults")
+	data, err = tomlua_default.decode_file(path .. ".missing")
+	ok(data == nil and err:find("unable to read", 1, true), "Should error on a missing file")
+	data, err = tomlua_default.decode_file(test_dir)
+	ok(data == nil and err ~= nil, "Should error on a directory")
+	local empty = os.tmpname()
+	f = assert(io.open(empty, "wb"))
+	f:close()
+	data, err = tomlua_default.decode_file(empty)
+	os.remove(empty)
+	ok(err == nil and next(data) == nil, "Should decode an empty file")
+end)
+
+define("dump and undump round trip decoded tables", function()
+	local src = [=[
+a = 1
+b = 2.5
+c = "str"
+d = 1979-05-27T07:32:00Z
+e = 07:32:00
+f = [1, 2, [3, "x"]]
+g = { h = true, i = false }
+m = """
+multi"""
+[[t]]
+n = 1
+[[t]]
+n = 2
+]=]
+	for _, tomlua in ipairs({ tomlua_default, tomlua_fancy_dates, tomlua_multi_strings, tomlua_mark_inline }) do
+		local data = assert(tomlua.decode(src))
+		local blob, err = tomlua.dump(data)
+		ok(err == nil and type(blob) == "string", "Should dump")
+		local back
+		back, err = tomlua.undump(blob)
+		ok(err == nil and back ~= nil, "Should undump")
+		ok(same(back, data), "Should have the same contents")
+		ok(tomlua.type_of(back.d) == tomlua.type_of(data.d) and tostring(back.d) == tostring(data.d), "Should keep dates")
+		ok(tostring(back.m) == tostring(data.m) and type(back.m) == type(data.m), "Should keep multi line strings")
+		ok(getmetatable(back.g) == nil == (getmetatable(data.g) == nil), "Should keep toml_type marks")
+		if getmetatable(data.g) then
+			ok(getmetatable(back.g).toml_type == getmetatable(data.g).toml_type, "with the same type")
+		end
+		ok(#back.t == 2 and back.t[2].n == 2 and back.f[3][2] == "x", "Should keep arrays")
+	end
+	local sparse = assert(tomlua_default.undump(assert(tomlua_default.dump({ 1, 2, nil, 4, x = { [0] = "z" } }))))
+	ok(sparse[1] == 1 and sparse[2] == 2 and sparse[3] == nil and sparse[4] == 4 and sparse.x[0] == "z", "Should keep sparse keys")
+	local path = os.tmpname()
+	local f = assert(io.open(path, "wb"))
+	f:write(tomlua_default.dump({ a = { b = "c" } }))
+	f:close()
+	local data, err = tomlua_default.undump_file(path)
+	os.remove(path)
+	ok(err == nil and data.a.b == "c", "undump_file")
+	local cyclic = {}
+	cyclic.c = cyclic
+	data, err = tomlua_default.dump(cyclic)
+	ok(data == nil and err ~= nil, "Should error on cycles")
+	data, err = tomlua_default.dump({ f = print })
+	ok(data == nil and err ~= nil, "Should error on functions")
+	local blob = tomlua_default.dump({ a = "b" })
+	data, err = tomlua_default.undump(blob:sub(1, -2))
+	ok(data == nil and err ~= nil, "Should error on a cut short snapshot")
+	data, err = tomlua_default.undump(blob .. "x")
+	ok(data == nil and err ~= nil, "Should error on trailing bytes")
+	data, err = tomlua_default.undump("not a snapshot")
+	ok(data == nil and err ~= nil, "Should error on other strings")
+	for i = 1, #blob do
+		local corrupt = blob:sub(1, i - 1) .. string.char((blob:byte(i) + 97) % 256) .. blob:sub(i + 1)
+		data, err = tomlua_default.undump(corrupt)
+		ok(data ~= nil or err ~= nil, "Should not crash on corrupt bytes")
+	end
+end)
+
+define("decode_file cache", function()
+	local path = os.tmpname()
+	local cache = path .. ".snap"
+	local function write(contents)
+		local f = assert(io.open(path, "wb"))
+		f:write(contents)
+		f:close()
+	end
+	write("a = 1\n[b]\nc = 2\n")
+	local data, err = tomlua_default.decode_file(path, nil, { cache = cache })
+	ok(err == nil and data.a == 1 and data.b.c == 2, "Should decode on a miss")
+	local f = io.open(cache, "rb")
+	ok(f ~= nil, "Should write the cache")
+	if f then f:close() end
+	data, err = tomlua_default.decode_file(path, nil, { cache = cache })
+	ok(err == nil and data.a == 1 and data.b.c == 2, "Should read the cache on a hit")
+	-- a snapshot of other data, under the stamp of the one decode_file wrote, can only be seen on a hit
+	f = assert(io.open(cache, "rb"))
+	local written = f:read("*a")
+	f:close()
+	local b1, b2, b3, b4 = written:byte(6, 9)
+	local header_len = 9 + b1 + b2 * 256 + b3 * 65536 + b4 * 16777216
+	local other = assert(tomlua_default.dump({ a = 42, from_cache = true }))
+	f = assert(io.open(cache, "wb"))
+	f:write(written:sub(1, header_len) .. other:sub(10))
+	f:close()
+	data, err = tomlua_default.decode_file(path, nil, { cache = cache })
+	ok(err == nil and data.a == 42 and data.from_cache == true, "A hit should return what the snapshot holds")
+	data, err = tomlua_default.decode_file(path, nil, { cache = cache, only = { "b" } })
+	ok(err == nil and data.a == nil and data.b.c == 2, "Should not reuse a cache of another selection")
+	data, err = tomlua_int_keys.decode_file(path, nil, { cache = cache })
+	ok(err == nil and data.a == 1, "Should not reuse a cache of other options")
+	write("a = 3\n[b]\nc = 4\n")
+	data, err = tomlua_default.decode_file(path, nil, { cache = cache })
+	ok(err == nil and data.a == 3 and data.b.c == 4, "Should decode again when the source changes")
+	f = assert(io.open(cache, "wb"))
+	f:write("garbage")
+	f:close()
+	data, err = tomlua_default.decode_file(path, nil, { cache = cache })
+	ok(err == nil and data.a == 3, "Should decode again when the cache is corrupt")
+	data, err = tomlua_default.decode_file(path, {}, { cache = cache })
+	ok(data == nil and err ~= nil, "Should error with defaults")
+	write("a = ")
+	data, err = tomlua_default.decode_file(path, nil, { cache = cache })
+	ok(data == nil and err ~= nil, "Should still error on invalid TOML")
+	os.remove(path)
+	os.remove(cache)
+end)
+
 define("reading headings to default table", function()
 	local appendtoml = [=[
 [example]
@@ -194,6 +344,34 @@ b = 1
 	end, "This should NOT error though")
 end)
 
+define("duplicates are still caught across many tables and keys", function()
+	local parts = {}
+	for i = 1, 500 do
+		parts[#parts + 1] = ("[t%d]\nk%d = %d\nsub.v = %d\n[[arr%d]]\nx = 1\n[[arr%d]]\nx = 2"):format(i, i, i, i, i % 7, i % 7)
+	end
+	local base = table.concat(parts, "\n")
+	local data, err = tomlua_default.decode(base)
+	ok(function()
+		assert(err == nil, err)
+	end, "Should not error on many distinct tables")
+	ok(data.t250.k250 == 250 and data.t250.sub.v == 250, "Values should be set")
+	ok(#data.arr3 > 2, "Array headings should keep appending")
+	data, err = tomlua_default.decode(base .. "\n[t123]\nother = 1")
+	ok(err ~= nil, "Should error on a table redefined long after it was defined")
+	data, err = tomlua_default.decode(base .. "\n[t321]\nk321 = 1")
+	ok(err ~= nil, "Should error on a table redefined long after it was defined")
+	data, err = tomlua_default.decode(base .. "\n[fresh]\na.b = 1\nc = 2\na.b = 3")
+	ok(err ~= nil, "Should error on a duplicate dotted key")
+	data, err = tomlua_default.decode(base .. "\n[t99.sub]")
+	ok(err ~= nil, "Should error on a heading for a table defined by dotted keys")
+	data, err = tomlua_int_keys.decode("1 = 'a'\n'1' = 'b'\n-0 = 'c'")
+	ok(function()
+		assert(err == nil, err)
+	end, "Quoted and bare integer keys are different keys with int_keys")
+	data, err = tomlua_int_keys.decode("1 = 'a'\n01 = 'b'")
+	ok(err ~= nil, "Should error when two bare keys are the same integer with int_keys")
+end)
+
 define("redefining inline table via key should fail", function()
 	local errtoml = [=[
 [product]
@@ -461,6 +639,65 @@ define("decode various float formats", function()
 	ok(data.key8 == 9224617.445991228, "Underscored float should be correct")
 end)
 
+define("decode floats and integers that are hard to round or near their limits", function()
+	local floats = {
+		"0.1", "0.30000000000000004", "9007199254740993.0", "9007199254740995.0", "2.2250738585072014e-308",
+		"1.7976931348623157e308", "4.9406564584124654e-324", "123456789012345678901234567890.5",
+		"7.038531e-26", "1.00000000000000011102230246251565404236316680908203125", "8.98846567431158e307",
+		"0.000000000000000000000000000000000000000000000000000000000000000000000000000000123456789e100",
+	}
+	for _, f in ipairs(floats) do
+		local data, err = tomlua_default.decode("f = " .. f)
+		ok(err == nil, "Should not error on " .. f)
+		ok(data.f == tonumber(f), "float " .. f .. " should round the same as tonumber")
+	end
+	local data, err = tomlua_default.decode("neg_zero = -0.0\nunderscored = 1_0.2_5e1_0")
+	ok(err == nil, "Should not error")
+	ok(1 / data.neg_zero == -math.huge, "negative zero should keep its sign")
+	ok(data.underscored == 10.25e10, "underscores should be skipped in every part of a float")
+	data, err = tomlua_default.decode(
+		"hex = 0xdead_BEEF\nhex_max = 0x7FFFFFFFFFFFFFFF\noct = 0o7_55\nbin = 0b1_0_1\nmin = -9223372036854775808"
+	)
+	ok(err == nil, "Should not error")
+	ok(data.hex == 0xdeadbeef, "hex integer with underscores")
+	ok(data.hex_max == 9223372036854775807, "largest hex integer")
+	ok(data.oct == 493, "octal integer with underscores")
+	ok(data.bin == 5, "binary integer with underscores")
+	ok(data.min == -9223372036854775808, "smallest integer")
+	_, err = tomlua_overflow_errors.decode("hex = 0x8000000000000000")
+	ok(err ~= nil, "hex integer past the largest integer should overflow")
+end)
+
+define("decode large and nested arrays and tables at their full size", function()
+	local parts = { "root = 0" }
+	for i = 1, 40 do
+		parts[#parts + 1] = ("k%d = %d"):format(i, i)
+	end
+	local items = {}
+	for i = 1, 300 do
+		items[#items + 1] = ("{ a = %d, b = [%d, %d,], c = { d = 'x,]' } }"):format(i, i, i + 1)
+	end
+	parts[#parts + 1] = "arr = [ " .. table.concat(items, ", ") .. ", ]"
+	parts[#parts + 1] = "empty = [ ]\nempty_tbl = {}\n[tbl] # a, b, c\nx = [\n  1,\n  2,\n]\ny = \"[{,\"\n[[aot]]\nz = 1\n[[aot]]"
+	local data, err = tomlua_default.decode(table.concat(parts, "\n"))
+	ok(err == nil, "Should not error")
+	ok(data.k40 == 40, "root keys")
+	ok(#data.arr == 300, "array of inline tables")
+	ok(data.arr[300].a == 300 and data.arr[300].b[2] == 301 and data.arr[300].c.d == "x,]", "nested values")
+	ok(#data.empty == 0 and next(data.empty_tbl) == nil, "empty containers")
+	ok(#data.tbl.x == 2 and data.tbl.y == "[{,", "brackets in comments and strings and multiline arrays")
+	ok(#data.aot == 2 and data.aot[1].z == 1, "array of tables")
+end)
+
+define("decode marks inline values merged into defaults without a metatable", function()
+	local data, err = tomlua_mark_inline.decode("a = [2, 3]\nt = { y = 2 }", { a = { 1 }, t = { x = 1 } })
+	ok(err == nil, "Should not error")
+	ok(#data.a == 3 and data.a[3] == 3, "array should be appended to")
+	ok(getmetatable(data.a).toml_type == "ARRAY_INLINE", "appended array should be marked")
+	ok(data.t.x == 1 and data.t.y == 2, "table should be merged")
+	ok(getmetatable(data.t).toml_type == "TABLE_INLINE", "merged table should be marked")
+end)
+
 define("decode boolean values", function()
 	local data, err = tomlua_default.decode("key1 = true\nkey2 = false")
 	ok(err == nil, "Should not error")
@@ -573,6 +810,41 @@ time_only = 07:32:00
 	ok(type(data.time_only) == "userdata", "Local time should be userdata")
 end)
 
+define("dates option", function()
+	local toml_str = [[
+date_offset = 1979-05-27T00:32:00.05-07:00
+date_local = 1979-05-27T07:32:00
+date_only = 1979-05-27
+time_only = 07:32:00.5
+arr = [ 1970-01-01T00:00:00Z ]
+]]
+	local data = assert(tomlua_default.decode(toml_str))
+	local strs = assert(require("tomlua")({ dates = "string" }).decode(toml_str))
+	ok(strs.date_only == "1979-05-27" and data.date_only == "1979-05-27", "string is the same as without fancy_dates")
+	local stamps = assert(require("tomlua")({ dates = "timestamp" }).decode(toml_str))
+	ok((math.type == nil or math.type(stamps.date_local) == "integer") and stamps.date_local == 296638320, "local datetimes are UTC seconds")
+	ok(stamps.date_offset == 296638320.05, "the offset is applied and the fraction kept exactly")
+	ok(stamps.date_only == 296611200, "local dates are midnight")
+	ok(stamps.time_only == 27120.5, "local times are seconds since midnight")
+	ok(stamps.arr[1] == 0, "dates in arrays")
+	local tbls = assert(require("tomlua")({ dates = "table" }).decode(toml_str))
+	ok(type(tbls.date_offset) == "table" and getmetatable(tbls.date_offset) == nil, "tables are plain tables")
+	ok(tbls.date_offset.toml_type == "OFFSET_DATETIME" and tbls.date_offset.hour == 0 and tbls.date_offset.offset_hour == -7, "offset datetime fields")
+	ok(tbls.date_only.toml_type == "LOCAL_DATE" and tbls.date_only.day == 27 and tbls.date_only.hour == nil, "only the fields of the type")
+	ok(tbls.time_only.toml_type == "LOCAL_TIME" and tbls.time_only.year == nil and tbls.time_only.second == 0, "local time fields")
+	ok(tbls.date_offset.fractional == 50000 and tbls.time_only.fractional == 500000 and tbls.date_local.fractional == 0, "fractions are in microseconds")
+	local fracs = assert(require("tomlua")({ dates = "table" }).decode("a = 07:32:00.5\nb = 07:32:00.500\nc = 07:32:00.000005\nd = 07:32:00.1234567\n"))
+	ok(fracs.a.fractional == 500000 and fracs.b.fractional == 500000 and fracs.c.fractional == 5 and fracs.d.fractional == 123456, "fractions mean the same for any number of digits")
+	local fancy = assert(tomlua_fancy_dates.decode(toml_str))
+	for _, k in ipairs({ "date_local", "date_only" }) do
+		ok(tomlua_default.new_date(tbls[k]) == fancy[k], "tables give back the same date: " .. k)
+	end
+	local ud = assert(require("tomlua")({ dates = "userdata" }).decode(toml_str))
+	ok(type(ud.date_local) == "userdata", "userdata is the same as fancy_dates")
+	local doc = assert(require("tomlua")({ dates = "timestamp" }).parse(toml_str))
+	ok(doc:get("date_only") == 296611200, "parse uses the same representation")
+end)
+
 define("int_keys option: mixed integer and string keys", function()
 	local toml_str = [[
 123 = "value1"
@@ -748,6 +1020,51 @@ escaped_tab = "Col1\tCol2"
 	ok(data.escaped_tab == "Col1\tCol2", "Escaped tab should be correct")
 end)
 
+define("decode long strings with escapes and quotes at every offset", function()
+	for i = 1, 70 do
+		local run = string.rep("x", i)
+		local toml_str = "basic = \"" .. run .. "\\\"" .. run .. "\\\\\"\n"
+			.. "literal = '" .. run .. "\"\\" .. run .. "'\n"
+			.. "multi = \"\"\"\n" .. run .. "\r\n" .. run .. "\"\\t\"\"" .. run .. "\"\"\"\"\n"
+			.. "multi_lit = '''" .. run .. "'" .. run .. "''" .. run .. "''''\n"
+		local data, err = tomlua_default.decode(toml_str)
+		ok(err == nil, "Should not error at offset " .. i)
+		ok(data.basic == run .. "\"" .. run .. "\\", "basic string at offset " .. i)
+		ok(data.literal == run .. "\"\\" .. run, "literal string at offset " .. i)
+		ok(data.multi == run .. "\r\n" .. run .. "\"\t\"\"" .. run .. "\"", "multiline string at offset " .. i)
+		ok(data.multi_lit == run .. "'" .. run .. "''" .. run .. "'", "multiline literal string at offset " .. i)
+	end
+	local _, err = tomlua_default.decode("s = \"" .. string.rep("y", 100) .. "\nz = 1")
+	ok(err ~= nil, "newline after a long run in a basic string should fail")
+	_, err = tomlua_default.decode("s = '" .. string.rep("y", 100))
+	ok(err ~= nil, "long unterminated literal string should fail")
+end)
+
+define("decode keys and strings with and without escapes", function()
+	local toml_str = [[
+"plain key" = "plain value"
+"esc\tkey" = "esc\tvalue"
+'lit "key"' = 'C:\path'
+a."b.c".'d' = """
+first line
+second \
+    line"""
+plain_multi = """
+no escapes "here" at all"""
+]]
+	local data, err = tomlua_default.decode(toml_str)
+	ok(err == nil, "Should not error")
+	ok(data["plain key"] == "plain value", "plain quoted key and value")
+	ok(data["esc\tkey"] == "esc\tvalue", "escaped quoted key and value")
+	ok(data['lit "key"'] == "C:\\path", "literal key and value")
+	ok(data.a["b.c"].d == "first line\nsecond line", "escaped multiline string under dotted quoted keys")
+	ok(data.plain_multi == 'no escapes "here" at all', "plain multiline string")
+	local mdata, merr = tomlua_multi_strings.decode(toml_str)
+	ok(merr == nil, "Should not error with multi_strings")
+	ok(tostring(mdata.plain_multi) == 'no escapes "here" at all', "plain multiline string with multi_strings")
+	ok(tostring(mdata.a["b.c"].d) == "first line\nsecond line", "escaped multiline string with multi_strings")
+end)
+
 define("decode empty tables and arrays", function()
 	local toml_str = [[
 empty_table = {}
@@ -984,6 +1301,22 @@ define("decode table with nested tables and array of tables", function()
 	ok(data.server.clients[1].name == "ClientA", "First client name should be correct")
 end)
 
+define("decode heading with brackets and braces in its comment", function()
+	local toml_str = [=[
+[server] # ] {
+  ip = "127.0.0.1"
+
+  [[server.clients]] # [[ }
+    id = 1
+]=]
+	local data, err = tomlua_default.decode(toml_str)
+	ok(err == nil, "Should not error")
+	ok(data.server.ip == "127.0.0.1", "Values after the heading should be in it")
+	ok(data.server.clients[1].id == 1, "Array of tables heading should be read")
+	local lazy = tomlua_default.decode_lazy(toml_str)
+	ok(lazy.server.ip == "127.0.0.1" and lazy.server.clients[1].id == 1, "decode_lazy should find the same headings")
+end)
+
 define("decode table with mixed bare and quoted keys at top level", function()
 	local toml_str = [[
 key1 = 1
@@ -2381,3 +2714,461 @@ define(
 		ok(err ~= nil, "Should error on duplicate table in array of tables")
 	end
 )
+
+define("decode_lazy reads each top level key only when it is first used", function()
+	local toml_str = [=[
+title = "lazy" # comment with [brackets]
+owner.name = "someone"
+list = [
+  1, 2,
+  3,
+]
+[server] # ] {
+host = "localhost"
+ports = [ 80, 443 ]
+[server.tls]
+enabled = true
+[[plugins]]
+name = "a"
+[owner.contact]
+email = "x@y.z"
+[[plugins]]
+name = "b"
+[broken]
+key = 1
+key = 2
+]=]
+	local expected, err = tomlua_default.decode(toml_str:gsub("key = 2\n", ""))
+	ok(err == nil, "Should not error without the duplicate")
+	local data, lerr = tomlua_default.decode_lazy(toml_str)
+	ok(lerr == nil, "Should not error before reading the duplicate")
+	ok(rawget(data, "server") == nil, "nothing should be decoded yet")
+	ok(data.title == "lazy", "root value")
+	ok(#data.list == 3, "array spanning several lines")
+	ok(data.server.host == "localhost" and data.server.ports[2] == 443, "heading")
+	ok(data.server.tls.enabled == true, "subtable of a heading")
+	ok(data.owner.name == "someone" and data.owner.contact.email == "x@y.z", "dotted key and a later heading")
+	ok(#data.plugins == 2 and data.plugins[2].name == "b", "array of tables split around another heading")
+	ok(rawget(data, "server") ~= nil, "values should be kept once read")
+	ok(data.missing == nil, "missing key")
+	local success, msg = pcall(function() return data.broken end)
+	ok(not success and tostring(msg):find("key already defined", 1, true), "duplicate key should error when read")
+	if _VERSION ~= "Lua 5.1" then
+		data = tomlua_default.decode_lazy(toml_str:gsub("key = 2\n", ""))
+		local copy = {}
+		for k, v in pairs(data) do copy[k] = v end
+		ok(same(copy, expected), "pairs should read every key")
+	end
+	_, lerr = tomlua_default.decode_lazy('[a."b]\nc = 1')
+	ok(lerr ~= nil, "bad heading keys should error right away")
+	data = tomlua_int_keys.decode_lazy("1 = 'one'\n[2]\nx = 1")
+	ok(data[1] == "one" and data[2].x == 1, "int_keys applies to the top level keys")
+end)
+
+define("decode_lazy gives the same errors as decode for unterminated statements", function()
+	for _, toml_str in ipairs({ "y.''.e]\n]", "a.b\nc = 1", "[a\nb = 1", "[[a]\nb = 1", "[a] b = 1", "[[a]] b", "a =\n1" }) do
+		local _, expected = tomlua_default.decode(toml_str)
+		local data, err = tomlua_default.decode_lazy(toml_str)
+		ok(data == nil and expected ~= nil and err == expected, "same error for: " .. toml_str:gsub("\n", "\\n"))
+	end
+end)
+
+define("decoder gives the same result however the input is split", function()
+	local toml_str = [=[
+title = "stream" # comment with [brackets] and "quotes"
+list = [
+  "a]", 'b{',
+  3,
+]
+multi = """
+line 1 "" \"""
+line 2"""""
+literal = '''it's ''done'''''
+[server]
+ports = [ 80, 443 ]
+[[plugins]]
+name = "a"
+[[plugins]]
+name = "b"
+]=]
+	local expected, err = tomlua_default.decode(toml_str)
+	ok(err == nil, "Should not error")
+	local all_same = true
+	for size = 1, 12 do
+		local d = tomlua_default.decoder()
+		for i = 1, #toml_str, size do
+			assert(d:feed(toml_str:sub(i, i + size - 1)))
+		end
+		local data, derr = d:finish()
+		if derr or data.multi ~= expected.multi or data.literal ~= expected.literal
+			or #data.list ~= 3 or data.list[2] ~= "b{" or data.plugins[2].name ~= "b" or data.server.ports[2] ~= 443 then
+			all_same = false
+		end
+	end
+	ok(all_same, "every chunk size should decode the same")
+	local pos = 1
+	local data = tomlua_default.decoder_from(function()
+		local chunk = toml_str:sub(pos, pos + 4)
+		pos = pos + 5
+		return chunk ~= "" and chunk or nil
+	end):finish()
+	ok(data.title == "stream" and data.plugins[1].name == "a", "reader function")
+	local d = tomlua_int_keys.decoder(nil, { extra = true })
+	d:feed("1 = 'one'\n")
+	data = d:finish()
+	ok(data[1] == "one" and data.extra == true, "module options and defaults")
+	d = tomlua_default.decoder({ int_keys = true })
+	d:feed("1 = 'one'")
+	ok(d:finish()[1] == "one", "options given to the decoder")
+end)
+
+define("decoder reports errors once and stops", function()
+	local d = tomlua_default.decoder()
+	ok(d:feed("a = 1\n[b]\nc = 1\n"), "valid statements")
+	local res, err = d:feed("c = 2\n")
+	ok(res == nil and err:find("key already defined", 1, true), "duplicate key across chunks")
+	res, err = d:feed("d = 1\n")
+	ok(res == nil and err:find("key already defined", 1, true), "later feeds return the same error")
+	res, err = d:finish()
+	ok(res == nil and err:find("key already defined", 1, true), "finish returns the same error")
+	d = tomlua_default.decoder()
+	d:feed('a = "unterminated')
+	res, err = d:finish()
+	ok(res == nil and err ~= nil, "an unfinished statement should error at finish")
+	_, err = d:feed("b = 1")
+	ok(err ~= nil, "feeding after finish should error")
+end)
+
+define("fancy_tables inline table left open at the end of the input", function()
+	local fancy = require("tomlua")({ fancy_tables = true })
+	local data, err = fancy.decode("a = { b = 1,\n  c = 2 # comment")
+	ok(data == nil and err:find("missing closing }", 1, true), "should error instead of looping")
+end)
+
+define("parse answers path queries from the tape", function()
+	local toml_str = [=[
+title = "tape"
+servers.alpha.ip = "10.0.0.1"
+servers."a.b".ip = "10.0.0.2"
+[[products]]
+name = "Hammer"
+[[products]]
+name = "Nail"
+sizes = [1, [2, 3], { w = 4 }]
+]=]
+	local doc, err = tomlua_default.parse(toml_str)
+	ok(err == nil, "Should not error")
+	ok(doc:get("title") == "tape", "top level value")
+	ok(doc:get("servers.alpha.ip") == "10.0.0.1", "dotted path")
+	ok(doc:get('servers."a.b".ip') == "10.0.0.2", "quoted key in a path")
+	ok(doc:get({ "servers", "a.b", "ip" }) == "10.0.0.2", "table of keys as a path")
+	ok(doc:get("products.2.name") == "Nail" and doc:get("products.2.sizes.2.1") == 2, "numbers index arrays")
+	ok(doc:get("products.2.sizes.3.w") == 4, "inline table in an array")
+	ok(doc:get("missing") == nil and doc:get("products.3") == nil and doc:get("title.x") == nil, "missing values")
+	ok(doc:len("products") == 2 and doc:len("products.2.sizes") == 3 and doc:len("servers") == 2, "len")
+	ok(doc:len("title") == 4 and doc:len("products.1.name.x") == nil, "len of a string and of nothing")
+	ok(doc:type("products") == "ARRAY" and doc:type("products.2.sizes") == "ARRAY_INLINE", "array types")
+	ok(doc:type("servers") == "TABLE" and doc:type("products.2.sizes.3") == "TABLE_INLINE", "table types")
+	ok(doc:type("title") == "STRING" and doc:type("products.2.sizes.1") == "INTEGER", "value types")
+	local products = doc:get("products")
+	ok(type(products) == "userdata" and products:get("1.name") == "Hammer", "tables and arrays come back as tapes")
+	doc = nil
+	collectgarbage()
+	collectgarbage()
+	ok(products:len() == 2 and products:materialize()[2].sizes[3].w == 4, "sub tapes outlive the document")
+	ok(not pcall(products.get, products, "a b"), "bad paths should raise")
+end)
+
+define("parse materializes what decode would return", function()
+	local f = io.open(("%sexample.toml"):format(test_dir), "r")
+	local contents = f:read("*a")
+	f:close()
+	for _, t in ipairs({ tomlua_default, tomlua_int_keys, tomlua_mark_inline }) do
+		local expected = assert(t.decode(contents))
+		local doc = assert(t.parse(contents))
+		ok(same(doc:materialize(), expected), "whole document")
+	end
+	local doc = assert(tomlua_default.parse(contents))
+	local expected = assert(tomlua_default.decode(contents))
+	local k = next(expected)
+	ok(same(doc:materialize(k), expected[k]), "one key")
+	doc = assert(tomlua_mark_inline.parse("a = [1]\nb = { c = 1 }\n[d]"))
+	ok(getmetatable(doc:materialize("a")).toml_type == "ARRAY_INLINE", "mark_inline on arrays")
+	ok(getmetatable(doc:materialize("b")).toml_type == "TABLE_INLINE", "mark_inline on tables")
+	ok(getmetatable(doc:materialize("d")) == nil, "no mark on headings")
+	doc = assert(tomlua_fancy_dates.parse("d = 1979-05-27T07:32:00Z"))
+	ok(doc:type("d") == "OFFSET_DATETIME" and tomlua_default.type(doc:get("d")) == "OFFSET_DATETIME", "fancy_dates")
+	doc = assert(tomlua_multi_strings.parse('m = """\nhi"""'))
+	ok(doc:type("m") == "STRING_MULTI" and tostring(doc:get("m")) == "hi", "multi_strings")
+	doc = assert(tomlua_int_keys.parse("[n]\n1 = 'one'"))
+	ok(doc:get("n.1") == "one" and doc:get({ "n", 1 }) == "one", "int_keys")
+end)
+
+define("parse reports the same errors as decode", function()
+	for _, toml_str in ipairs({
+		"a = 1\na = 2",
+		"[a]\n[a]",
+		"a = [1\n",
+		"a = { b = 1 }\n[a.c]",
+		"a = 1\n[[a]]",
+		'a = "unterminated',
+	}) do
+		local _, expected = tomlua_default.decode(toml_str)
+		local doc, err = tomlua_default.parse(toml_str)
+		ok(doc == nil and err == expected, "same error for " .. toml_str:gsub("\n", "\\n"))
+	end
+	local _, err = tomlua_default.parse({})
+	ok(err ~= nil, "non string input should error")
+end)
+
+define("decode_parallel gives the same result as decode", function()
+	local parts = { 'title = "lock"\nversion = 3\n' }
+	for i = 1, 2000 do
+		parts[#parts + 1] = ([=[
+[[package]]
+name = "pkg-%d"
+version = "1.%d.0"
+source.kind = 'registry'
+source.url = "https://example.com/\"%d\""
+checksum = 0x%x
+dependencies = [ "a", { name = "b", optional = true }, [ 1.5, -2 ] ]
+notes = """
+[not.a.heading]
+line %d"""
+]=]):format(i, i, i, i, i)
+	end
+	parts[#parts + 1] = "[metadata]\ncount = 2000\n[metadata.nested]\nx = 1\n[[package]]\nname = 'last'\n"
+	local toml_str = table.concat(parts)
+	for _, t in ipairs({ tomlua_default, tomlua_mark_inline, tomlua_int_keys }) do
+		local expected = assert(t.decode(toml_str))
+		local data, err = t.decode_parallel(toml_str, nil, 4)
+		ok(err == nil and same(data, expected), "same result on 4 threads")
+	end
+	local data = assert(tomlua_default.decode_parallel(toml_str))
+	ok(#data.package == 2001 and data.package[1234].source.url == 'https://example.com/"1234"', "default thread count")
+	ok(data.package[7].notes == "[not.a.heading]\nline 7", "headings inside strings do not split the document")
+	data = assert(tomlua_default.decode_parallel(toml_str, { package = { { name = "default" } }, extra = true }, 3))
+	ok(#data.package == 2002 and data.package[1].name == "default" and data.extra, "defaults")
+	data = assert(tomlua_default.decode_parallel("a = 1\n[b]\nc = 2", nil, 8))
+	ok(data.a == 1 and data.b.c == 2, "small documents")
+	local _, expected = tomlua_default.decode(toml_str .. "[metadata]\n")
+	local _, err = tomlua_default.decode_parallel(toml_str .. "[metadata]\n", nil, 4)
+	ok(err ~= nil and err == expected, "redefinitions across parts report the same error")
+	_, expected = tomlua_default.decode(toml_str .. "[metadata.nested]\nx = 2\n")
+	_, err = tomlua_default.decode_parallel(toml_str .. "[metadata.nested]\nx = 2\n", nil, 4)
+	ok(err ~= nil and err == expected, "duplicate keys across parts report the same error")
+	_, expected = tomlua_default.decode(toml_str .. "[bad\n")
+	_, err = tomlua_default.decode_parallel(toml_str .. "[bad\n", nil, 4)
+	ok(err ~= nil and err == expected, "syntax errors report the same error")
+end)
+
+define("decode only reads the selected paths", function()
+	local toml_str = [=[
+name = "app"
+server.host = "localhost"
+server.port = 8080
+[db]
+url = "postgres://"
+pool.size = 4
+pool.idle = { seconds = 30 }
+[db.replica]
+url = "postgres://replica"
+[[features]]
+name = "a"
+[[features]]
+name = "b"
+[logging]
+level = "info"
+broken = [ "]", { x = "}" }, 'a"b', """
+not = "a key"
+""" ]
+]=]
+	local data = assert(tomlua_default.decode(toml_str, nil, { only = { "server", "db.pool", "features" } }))
+	ok(data.name == nil and data.logging == nil, "unselected keys and sections are skipped")
+	ok(data.server.host == "localhost" and data.server.port == 8080, "dotted keys under a selected key")
+	ok(data.db.url == nil and data.db.replica == nil, "siblings of a selected path are skipped")
+	ok(data.db.pool.size == 4 and data.db.pool.idle.seconds == 30, "selected path inside a section")
+	ok(#data.features == 2 and data.features[2].name == "b", "array headings")
+	data = assert(tomlua_default.decode(toml_str, nil, { exclude = { "logging", "db.replica", "server.port" } }))
+	ok(data.name == "app" and data.server.host == "localhost" and data.server.port == nil, "excluded dotted key")
+	ok(data.logging == nil and data.db.replica == nil and data.db.url == "postgres://", "excluded sections")
+	data = assert(tomlua_default.decode(toml_str, nil, { only = { "db" }, exclude = { "db.pool" } }))
+	ok(data.db.url and data.db.replica.url and data.db.pool == nil and data.server == nil, "only and exclude together")
+	data = assert(tomlua_default.decode(toml_str, { db = { pool = { size = 1, max = 9 } } }, { only = { "db.pool" } }))
+	ok(data.db.pool.size == 4 and data.db.pool.max == 9, "defaults")
+	data = assert(tomlua_default.decode('a."b.c" = 1\na.d = 2', nil, { only = { "a.'b.c'" } }))
+	ok(data.a["b.c"] == 1 and data.a.d == nil, "quoted keys in paths")
+	data = assert(tomlua_int_keys.decode("[a.1]\nx = 1\n[a.2]\nx = 2", nil, { only = { "a.2" } }))
+	ok(data.a[1] == nil and data.a[2].x == 2, "int_keys paths")
+	local _, err = tomlua_default.decode("a = 1\n[b]\nc = 2\nc = 3", nil, { only = { "a" } })
+	ok(err == nil, "skipped statements are not checked")
+	_, err = tomlua_default.decode("a = 1\na = 2", nil, { only = { "a" } })
+	ok(err ~= nil, "selected statements are still checked")
+	_, err = tomlua_default.decode("a = 1", nil, { only = { "a..b" } })
+	ok(err ~= nil and err:find("invalid only path", 1, true), "invalid paths are reported")
+	_, err = tomlua_default.decode("a = 1", nil, { exclude = "a" })
+	ok(err ~= nil, "paths must be a list")
+end)
+
+define("validate checks what decode checks", function()
+	for _, toml_str in ipairs({
+		"a = 1\na = 2",
+		"[a]\n[a]",
+		"a = [1\n",
+		"a = { b = 1 }\n[a.c]",
+		"a = 1\n[[a]]",
+		"a.b = 1\n[a]\nc = 2\n[a.b]",
+		'a = "unterminated',
+		"a = 1979-05-27T07:32:00Z x",
+	}) do
+		local _, expected = tomlua_default.decode(toml_str)
+		local valid, err = tomlua_default.validate(toml_str)
+		ok(valid == false and err == expected, "same error for " .. toml_str:gsub("\n", "\\n"))
+	end
+	for _, toml_str in ipairs({
+		"",
+		"a = 1\n[b]\nc = 'x'\n[[d]]\ne = 1979-05-27\n[[d]]\nf = \"\"\"\nmulti\"\"\"",
+		"a = { b = [ 1, { c = 2 } ] }\n[e.f]\ng.h = true",
+	}) do
+		local valid, err = tomlua_default.validate(toml_str)
+		ok(valid == true and err == nil, "valid document " .. toml_str:gsub("\n", "\\n"))
+	end
+	local _, expected = tomlua_int_keys.decode("a.1 = 1\na.1 = 2")
+	local valid, err = tomlua_int_keys.validate("a.1 = 1\na.1 = 2")
+	ok(valid == false and err == expected, "uses the options of its tomlua")
+	valid, err = tomlua_default.validate({})
+	ok(valid == false and err ~= nil, "non string input should error")
+end)
+
+define("cached_decode shares results between calls", function()
+	local toml_str = "a = 1\n[b]\nc = [ 1, 2, { d = 'x' } ]\ne = { f = 1979-05-27 }\n"
+	local first = assert(tomlua_default.cached_decode(toml_str))
+	local again = assert(tomlua_default.cached_decode(toml_str))
+	ok(first == again, "the same frozen result is returned for the same source")
+	ok(first.a == 1 and first.b.c[3].d == "x", "reads through the proxies")
+	ok(first.b.c[3] == again.b.c[3], "the same table is always read as the same proxy")
+	ok(not pcall(function() first.a = 2 end), "writes to the result error")
+	ok(not pcall(function() first.b.c[3].d = "y" end), "writes to nested tables error")
+	ok(not pcall(function() first.b.new = true end), "new keys error")
+	if _VERSION ~= "Lua 5.1" then
+		local keys = {}
+		for k in pairs(first.b) do keys[#keys + 1] = k end
+		table.sort(keys)
+		ok(#keys == 2 and keys[1] == "c" and keys[2] == "e", "pairs goes through the proxy")
+		ok(#first.b.c == 3, "length goes through the proxy")
+	end
+	local copy = assert(tomlua_default.cached_decode(toml_str, { copy = true }))
+	ok(copy ~= first and copy.b.c[3].d == "x" and rawget(copy, "a") == 1, "copies are plain tables")
+	copy.b.c[3].d = "y"
+	ok(tomlua_default.cached_decode(toml_str).b.c[3].d == "x", "copies do not change the cache")
+	local other = assert(tomlua_default.cached_decode(toml_str, { copy = true }))
+	ok(other.b.c[3].d == "x", "each copy is new")
+	local marked = assert(tomlua_mark_inline.cached_decode(toml_str))
+	ok(marked ~= first and tomlua_mark_inline.type(marked.b.e) == "TABLE_INLINE", "options are part of the key")
+	marked = assert(tomlua_mark_inline.cached_decode(toml_str, { copy = true }))
+	ok(getmetatable(marked.b.e).toml_type ~= nil, "options that are not given are kept")
+	local dated = assert(tomlua_default.cached_decode(toml_str, { fancy_dates = true, copy = true }))
+	ok(type(dated.b.e.f) == "userdata" and type(first.b.e.f) == "string", "options can be given per call")
+	local _, expected = tomlua_default.decode("a = 1\na = 2")
+	local data, err = tomlua_default.cached_decode("a = 1\na = 2")
+	ok(data == nil and err == expected, "errors are returned like decode")
+	data, err = tomlua_default.cached_decode("a = 1\na = 2")
+	ok(data == nil and err == expected, "and cached too")
+	for i = 1, 100 do
+		assert(tomlua_default.cached_decode("n = " .. i))
+	end
+	ok(tomlua_default.cached_decode("n = 7").n == 7 and tomlua_default.cached_decode("n = 100").n == 100, "entries are evicted")
+	data, err = tomlua_default.cached_decode("a = 1", { dates = "nonsense" })
+	ok(data == nil and err == "invalid value for option 'dates'", "invalid options are returned as an error")
+end)
+
+define("cached_decode results do not share anything that can be changed", function()
+	local toml_str = "[b]\ne = { f = 1979-05-27 }\nm = \"\"\"multi\nline\"\"\"\n"
+	local opts = { fancy_dates = true, multi_strings = true, copy = true }
+	local copy = assert(tomlua_default.cached_decode(toml_str, opts))
+	copy.b.e.f.year = 2000
+	ok(assert(tomlua_default.cached_decode(toml_str, opts)).b.e.f.year == 1979, "dates in copies are copies too")
+	ok(copy.b.m ~= assert(tomlua_default.cached_decode(toml_str, opts)).b.m, "multi-line strings in copies are copies too")
+	ok(tostring(copy.b.m) == "multi\nline", "copied multi-line strings keep their text")
+	local frozen = assert(tomlua_default.cached_decode(toml_str, { fancy_dates = true }))
+	frozen.b.e.f.year = 2000
+	ok(frozen.b.e.f.year == 1979, "dates read from a frozen result are new each time")
+	ok(assert(tomlua_default.cached_decode(toml_str, { fancy_dates = true, copy = true })).b.e.f.year == 1979, "and do not change the cache")
+	ok(getmetatable(frozen) == false and getmetatable(frozen.b) == false, "the metatable of a proxy is hidden")
+	ok(not pcall(setmetatable, frozen, {}), "and can not be replaced")
+	local marked = assert(tomlua_mark_inline.cached_decode(toml_str))
+	ok(getmetatable(marked.b.e).toml_type == "TABLE_INLINE", "toml_type can still be read from the metatable")
+	ok(not pcall(function() getmetatable(marked.b.e).toml_type = "ARRAY" end), "but not changed")
+	ok(tomlua_mark_inline.type(assert(tomlua_mark_inline.cached_decode(toml_str)).b.e) == "TABLE_INLINE", "so the type stays the same")
+	ok(getmetatable(assert(tomlua_mark_inline.cached_decode(toml_str, { copy = true })).b.e).toml_type == "TABLE_INLINE", "the cached result keeps its marks")
+end)
+
+define("cached_decode results encode and dump like the tables they stand for", function()
+	local toml_str = "a = 1\n[b]\nc = [ 1, 2, { d = 'x' } ]\ne = { f = 1979-05-27 }\n[[g]]\nh = 1\n[[g]]\nh = 2\n"
+	local frozen = assert(tomlua_default.cached_decode(toml_str))
+	local str, err = tomlua_default.encode(frozen)
+	ok(err == nil and str ~= "", "encode should read through the proxies")
+	local back = assert(tomlua_default.decode(str))
+	ok(back.a == 1 and back.b.c[3].d == "x" and back.b.e.f == "1979-05-27" and #back.g == 2 and back.g[2].h == 2, "the encoded document should have every value")
+	str = assert(tomlua_default.encode({ nested = frozen.b }))
+	ok(assert(tomlua_default.decode(str)).nested.c[2] == 2, "proxies inside other tables should be read through too")
+	local marked = assert(tomlua_mark_inline.cached_decode("t = { a = 1 }\n"))
+	ok(assert(tomlua_default.encode(marked)):find("{", 1, true) ~= nil, "toml_type marks should still apply")
+	local snap = assert(tomlua_default.dump(frozen))
+	ok(assert(tomlua_default.undump(snap)).g[1].h == 1, "dump should read through the proxies")
+end)
+
+define("context decodes and encodes like tomlua, reusing its buffers", function()
+	local ctx = tomlua_default.context()
+	local toml_str = 'a = 1\n[b.c]\nd = "x\\ty"\n[[e]]\nf = [ 1, { g = 2 } ]\n[[e]]\nf = []\n'
+	for _ = 1, 3 do
+		local data, err = ctx:decode(toml_str)
+		ok(err == nil and data.b.c.d == "x\ty" and data.e[1].f[2].g == 2 and #data.e == 2, "decodes the same every time")
+		local str, eerr = ctx:encode(data)
+		local expected = tomlua_default.encode(data)
+		ok(eerr == nil and str == expected, "encodes the same as encode")
+	end
+	local _, expected = tomlua_default.decode("a = 1\na = 2")
+	local data, err = ctx:decode("a = 1\na = 2")
+	ok(data == nil and err == expected, "decode errors")
+	data, err = ctx:decode("x = 1\n[y]\nz = 2")
+	ok(err == nil and data.x == 1 and data.y.z == 2, "decodes again after an error")
+	local cyclic = { t = {} }
+	cyclic.t.t = cyclic.t
+	local str
+	str, err = ctx:encode(cyclic)
+	ok(str == nil and err ~= nil, "encode errors")
+	str, err = ctx:encode({ h = { i = { j = 1 } } })
+	ok(err == nil and str == tomlua_default.encode({ h = { i = { j = 1 } } }), "encodes again after an error")
+	data = assert(ctx:decode("a = 1\n[b]\nc = 2", { a = 0, d = 3 }, { only = { "b" } }))
+	ok(data.a == 0 and data.b.c == 2 and data.d == 3, "defaults and selection")
+	local big = {}
+	for i = 1, 5000 do big[#big + 1] = ("k%d = %d"):format(i, i) end
+	local small = tomlua_default.context(nil, 256)
+	data = assert(small:decode(table.concat(big, "\n")))
+	ok(data.k5000 == 5000, "documents bigger than what is kept")
+	ok(small:decode("a = 1").a == 1 and small:encode({ a = 1 }) == "a = 1\n", "and after them")
+	small:trim(0)
+	ok(small:decode("a = 2").a == 2, "trim")
+	local ik = tomlua_default.context({ int_keys = true })
+	ok(ik:decode("a.1 = 1").a[1] == 1, "options")
+end)
+
+define("stats counts the work of decode and encode", function()
+	local before, err = tomlua_default.stats(true)
+	if before == nil then
+		ok(type(err) == "string", "Should say that it was built without TOMLUA_STATS")
+		return
+	end
+	local src = 'a = "str"\n[b.c]\nd = [1, { e = 2 }]\n[[f]]\ng = 1979-05-27\n'
+	local data = assert(tomlua_default.decode(src))
+	local out = assert(tomlua_default.encode(data))
+	local stats = tomlua_default.stats()
+	ok(stats.decode_calls == 1 and stats.decode_bytes == #src, "Should count decode calls and bytes")
+	ok(stats.decode_tables >= 6 and stats.decode_keys >= 6 and stats.decode_strings >= 2, "Should count tables, keys and strings")
+	ok(stats.defs_lookups > 0 and stats.decode_ns > 0, "Should count lookups and time")
+	ok(stats.encode_calls == 1 and stats.encode_bytes == #out and stats.encode_traversals > 0, "Should count encode")
+	local taken = tomlua_default.stats(true)
+	ok(taken.decode_calls == 1, "Should return the counters it resets")
+	ok(tomlua_default.stats().decode_calls == 0, "Should reset them")
+end)
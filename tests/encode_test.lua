@@ -666,3 +666,184 @@ define("encode table with array of tables and escaped strings in values", functi
 		"Second message content with escaped quotes should be correct"
 	)
 end)
+
+define("encode many headings, nested within each other and within arrays of tables", function()
+	local test_table = { top = 1 }
+	for i = 1, 10000 do
+		test_table["t" .. i] = { v = i, sub = { w = i }, list = { { x = i }, { x = -i, deep = { y = i } } } }
+	end
+	local encoded_str, err = tomlua_default.encode(test_table)
+	ok(err == nil, "Should not error during encoding")
+	local decoded = assert(tomlua_default.decode(encoded_str))
+	local same = decoded.top == 1
+	for i = 1, 10000 do
+		local t = decoded["t" .. i]
+		same = same and t.v == i and t.sub.w == i and #t.list == 2 and t.list[1].x == i and t.list[2].deep.y == i
+	end
+	ok(same, "Every heading should decode back to its value")
+	encoded_str = assert(tomlua_default.encode({ a = { b = { c = 1 }, d = { { e = { f = 2 } } } } }))
+	local expected_b = "\n[a.b]\nc = 1\n"
+	local expected_d = "\n[[a.d]]\n\n[a.d.e]\nf = 2\n"
+	ok(
+		encoded_str == "\n[a]\n" .. expected_b .. expected_d or encoded_str == "\n[a]\n" .. expected_d .. expected_b,
+		"Subtables should follow their heading in order"
+	)
+end)
+
+define("encode arrays however their keys are stored", function()
+	local backwards = {}
+	for i = 3, 1, -1 do backwards[i] = i end
+	local encoded_str, err = tomlua_default.encode({ a = backwards, b = { 1, { 2, 3 } } })
+	ok(err == nil, "Should not error during encoding")
+	ok(string.find(encoded_str, "a = [\n  1,\n  2,\n  3\n]", nil, true) ~= nil, "Array with keys in the hash part should be in order")
+	ok(string.find(encoded_str, "b = [\n  1,\n  [\n    2,\n    3\n  ]\n]", nil, true) ~= nil, "Nested arrays should be indented")
+	local tomlua_int_keys = require("tomlua")({ int_keys = true })
+	encoded_str, err = tomlua_int_keys.encode({ c = { 1, { 1, 2, z = 3 } } })
+	ok(err == nil, "Should not error during encoding with int_keys")
+	local decoded = assert(tomlua_int_keys.decode(encoded_str))
+	ok(decoded.c[1] == 1 and decoded.c[2][2] == 2 and decoded.c[2].z == 3, "Tables that start like arrays should be written as tables")
+	_, err = tomlua_default.encode({ c = { 1, { 1, 2, z = 3 } } })
+	ok(err ~= nil, "Tables that start like arrays still need int_keys")
+end)
+
+define("encode numbers so that they read back the same", function()
+	local values = { 0.1, 1 / 3, 1e300, 5e-324, 123456.789, -2.5e-8, 2 ^ 60 + 2 ^ 8, math.huge, -math.huge }
+	local data = { nums = values, nan = 0 / 0, negzero = -0.0 }
+	if math.type then
+		data.ints = { math.maxinteger, math.mininteger, 0, -1, 1234567890123 }
+		data.whole = 3.0
+	end
+	local encoded_str, err = tomlua_default.encode(data)
+	ok(err == nil, "Should not error during encoding")
+	ok(string.find(encoded_str, "0.1,", nil, true) ~= nil, "Floats should use the shortest digits that read back the same")
+	ok(string.find(encoded_str, "  inf,\n  -inf", nil, true) ~= nil, "Infinities should be TOML inf")
+	local shortest = { [5e-324] = "5e-324", [1e-310] = "1e-310", [1 / 3] = "0.3333333333333333", [-2.5e-8] = "-2.5e-08", [1e300] = "1e+300", [123456.789] = "123456.789" }
+	for v, expected in pairs(shortest) do
+		local s = assert(tomlua_default.encode({ v = v }))
+		ok(s == "v = " .. expected .. "\n", "Should use the shortest digits, also for subnormals: " .. expected)
+	end
+	ok(string.find(encoded_str, "nan = nan", nil, true) ~= nil, "NaN should be TOML nan")
+	local decoded = assert(tomlua_default.decode(encoded_str))
+	local same = true
+	for i, v in ipairs(values) do
+		same = same and decoded.nums[i] == v
+	end
+	ok(same, "Every float should decode to the same value")
+	ok(decoded.nan ~= decoded.nan, "NaN should decode as NaN")
+	ok(decoded.negzero == 0 and 1 / decoded.negzero < 0, "Negative zero should keep its sign")
+	if math.type then
+		ok(string.find(encoded_str, "whole = 3.0", nil, true) ~= nil, "Integral floats should stay floats")
+		ok(math.type(decoded.whole) == "float" and math.type(decoded.nums[7]) == "float", "Integral floats should decode as floats")
+		for i, v in ipairs(data.ints) do
+			ok(decoded.ints[i] == v and math.type(decoded.ints[i]) == "integer", "Integer should decode the same: " .. tostring(v))
+		end
+	end
+end)
+
+define("encode strings with escapes anywhere in long runs", function()
+	local filler = string.rep("plain text é ", 5)
+	local values = {
+		filler .. '"' .. filler .. "\\" .. filler .. "\n\t\r\b\f",
+		"\1\31\127 controls",
+		filler .. "日本語 and 🎉",
+	}
+	local data = { s = values }
+	local encoded_str, err = tomlua_default.encode(data)
+	ok(err == nil, "Should not error during encoding")
+	ok(string.find(encoded_str, '"\\u0001\\u001F\\u007F controls"', nil, true) ~= nil, "Control characters and DEL should be escaped")
+	local decoded = assert(tomlua_default.decode(encoded_str))
+	for i, v in ipairs(values) do
+		ok(decoded.s[i] == v, "String should decode back the same: " .. i)
+	end
+	local multi = require("tomlua")({ multi_strings = true })
+	local str = assert(multi.decode('m = """\n' .. filler .. '\r\nline ""\\"" with \\t tab and \\r alone\n"""')).m
+	encoded_str = assert(multi.encode({ m = str }))
+	ok(string.find(encoded_str, '""\\"', nil, true) ~= nil and string.find(encoded_str, "\r\nline", nil, true) ~= nil, "Multi-line strings should keep newlines and escape triple quotes")
+	ok(tostring(assert(multi.decode(encoded_str)).m) == tostring(str), "Multi-line string should decode back the same")
+end)
+
+define("encode_to a function, a file handle and a path", function()
+	local data = { title = "streamed", list = {} }
+	for i = 1, 2000 do
+		data["t" .. i] = { name = ("entry %d"):format(i), values = { i, i * 2 } }
+	end
+	local expected = assert(tomlua_default.encode(data))
+	local chunks = {}
+	ok(tomlua_default.encode_to(function(chunk) chunks[#chunks + 1] = chunk end, data, 1000) == true, "Should return true")
+	local sizes_ok = #chunks > 1
+	for i = 1, #chunks - 1 do
+		sizes_ok = sizes_ok and #chunks[i] == 1000
+	end
+	ok(sizes_ok and #chunks[#chunks] <= 1000, "Chunks should be exactly the chunk size, except the last")
+	local joined = table.concat(chunks)
+	ok(#joined == #expected and assert(tomlua_default.decode(joined)).t2000.values[2] == 4000, "Chunks should make up the same document")
+	local path = os.tmpname()
+	ok(tomlua_default.encode_to(path, data) == true, "Should write to a path")
+	local f = assert(io.open(path, "rb"))
+	local from_path = f:read("*a")
+	f:close()
+	ok(#from_path == #expected and assert(tomlua_default.decode(from_path)).t1.name == "entry 1", "Path should hold the document")
+	f = assert(io.open(path, "wb"))
+	ok(tomlua_default.encode_to(f, data, 4096) == true, "Should write to a file handle")
+	f:close()
+	f = assert(io.open(path, "rb"))
+	ok(#f:read("*a") == #expected, "File handle should get the whole document")
+	f:close()
+	os.remove(path)
+	local res, err = tomlua_default.encode_to(function() error("sink failed") end, data, 100)
+	ok(res == nil and err:find("sink failed", 1, true) ~= nil, "Errors in the sink should be returned")
+	res, err = tomlua_default.encode_to(function() end, { bad = function() end })
+	ok(res == nil and err ~= nil, "Encode errors should be returned")
+	res, err = tomlua_default.encode_to("/nonexistent_dir/x/y.toml", data)
+	ok(res == nil and err ~= nil, "Unopenable paths should be an error")
+end)
+
+define("encode_to a path keeps the old file when it fails", function()
+	local path = os.tmpname()
+	local f = assert(io.open(path, "wb"))
+	f:write("old = 1\n")
+	f:close()
+	local function contents()
+		local fh = assert(io.open(path, "rb"))
+		local s = fh:read("*a")
+		fh:close()
+		return s
+	end
+	local res, err = tomlua_default.encode_to(path, "not a table")
+	ok(res == nil and err ~= nil, "A value that is not a table should be an error")
+	ok(contents() == "old = 1\n", "A bad argument should leave the file as it was")
+	local cycle = { a = 1 }
+	cycle.self = cycle
+	res, err = tomlua_default.encode_to(path, cycle)
+	ok(res == nil and err ~= nil, "A cycle should be an error")
+	ok(contents() == "old = 1\n", "A failed encode should leave the file as it was")
+	ok(io.open(path .. ".tmp", "rb") == nil, "A failed encode should remove the temporary file")
+	ok(tomlua_default.encode_to(path, { new = 2 }) == true, "Should replace the file")
+	ok(assert(tomlua_default.decode(contents())).new == 2, "The file should hold the new document")
+	os.remove(path)
+end)
+
+define("encode deeply nested headings and inline values", function()
+	local root = {}
+	local t = root
+	for i = 1, 1000 do
+		t.v = i
+		t.sub = {}
+		t = t.sub
+	end
+	t.v = 0
+	local str, err = tomlua_default.encode(root)
+	ok(err == nil and str ~= nil, "Should encode 1000 nested headings")
+	local back = assert(tomlua_default.decode(str))
+	t = back
+	for _ = 1, 1000 do t = t.sub end
+	ok(t.v == 0, "Should decode back to the same depth")
+	local arr = {}
+	t = arr
+	for _ = 1, 1000 do
+		t[1] = {}
+		t = t[1]
+	end
+	str, err = tomlua_default.encode({ a = arr })
+	ok(err == nil and str ~= nil, "Should encode 1000 nested inline arrays")
+end)
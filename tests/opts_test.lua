@@ -42,3 +42,17 @@ define("opts({ int_keys = true }) doesn't copy", function()
     local opts = tomlua.opts()
     ok(type(opts) == "table", "opts when called with no args should return a table")
 end)
+
+define("opts.dates and fancy_dates agree", function()
+    local t = tomlua{ dates = "timestamp" }
+    ok(t.opts.dates == "timestamp" and t.opts.fancy_dates == false, "dates option is read back")
+    t.opts.dates = "userdata"
+    ok(t.opts.fancy_dates == true, "userdata dates set fancy_dates")
+    t.opts.fancy_dates = false
+    ok(t.opts.dates == "string", "fancy_dates decides dates when set last")
+    ok(tomlua{ fancy_dates = true }.opts.dates == "userdata", "default dates follow fancy_dates")
+    ok(tomlua{ fancy_dates = true, dates = "table" }.opts.dates == "table", "dates wins over fancy_dates when both are given")
+    ok(not pcall(function() t.opts.dates = "nope" end), "invalid dates errors")
+    ok(not pcall(tomlua, { dates = "nope" }), "invalid dates errors when copying")
+    ok(t.opts().dates == "string", "opts() includes dates")
+end)
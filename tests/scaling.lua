@@ -0,0 +1,118 @@
+-- make bench-scaling
+-- Generates documents of each shape at growing sizes, and reports the time and lua heap per byte
+-- of decode and encode at each size. A cost per byte that keeps growing with the size is superlinear,
+-- and the growth column, which is the exponent of the time between this size and the one before, shows it as > 1.
+return function(test_dir, max_scale, min_time)
+    max_scale = max_scale or 1
+    min_time = min_time or 0.05
+    local tomlua = require("tomlua")
+
+    local function lines(n, fn)
+        local out = {}
+        for i = 1, n do out[i] = fn(i) end
+        return table.concat(out, "\n") .. "\n"
+    end
+
+    local DATES = {
+        "1979-05-27T07:32:00Z",
+        "1979-05-27T00:32:00.999999-07:00",
+        "1979-05-27",
+        "07:32:00",
+    }
+
+    -- name, the sizes to sweep, and the document for each size
+    local shapes = {
+        { "top level keys", { 64, 256, 1024, 4096, 16384, 65536 }, function(n)
+            return lines(n, function(i) return ("key%d = %d"):format(i, i) end)
+        end },
+        { "nesting depth", { 4, 16, 64, 256, 1024 }, function(n)
+            -- a heading at every depth, so each one has to walk the whole path again
+            local path = {}
+            return lines(n, function(i)
+                path[i] = "t" .. i
+                return ("[%s]\nv = %d"):format(table.concat(path, "."), i)
+            end)
+        end },
+        { "[[array]] entries", { 64, 256, 1024, 4096, 16384 }, function(n)
+            return lines(n, function(i) return ("[[items]]\nid = %d\nname = \"item %d\""):format(i, i) end)
+        end },
+        { "inline array length", { 64, 256, 1024, 4096, 16384, 65536 }, function(n)
+            local out = {}
+            for i = 1, n do out[i] = tostring(i) end
+            return "a = [" .. table.concat(out, ", ") .. "]\n"
+        end },
+        { "dotted key fan-out", { 64, 256, 1024, 4096, 16384 }, function(n)
+            -- n tables under 1, each made by a dotted key
+            return lines(n, function(i) return ("t.k%d.v = %d"):format(i, i) end)
+        end },
+        { "string length", { 64, 1024, 16384, 262144, 1048576 }, function(n)
+            return "s = \"" .. ("abcdefgh"):rep(n / 8) .. "\"\n"
+        end },
+        { "escaped string length", { 64, 1024, 16384, 262144, 1048576 }, function(n)
+            return "s = \"" .. ("ab\\\"cd\\n"):rep(n / 8) .. "\"\n"
+        end },
+        -- the same 4096 values, with this percentage of them dates
+        { "date density %", { 0, 25, 50, 75, 100 }, function(n)
+            return lines(4096, function(i)
+                if (i * n) % 100 < n then return ("d%d = %s"):format(i, DATES[i % #DATES + 1]) end
+                return ("v%d = %d"):format(i, i)
+            end)
+        end },
+    }
+
+    -- best seconds per call of fn, from as many calls as fit in min_time, and the lua heap it left behind in bytes
+    local function measure(fn)
+        collectgarbage("collect")
+        collectgarbage("stop")
+        local before = collectgarbage("count")
+        local result = fn()
+        local heap = (collectgarbage("count") - before) * 1024
+        collectgarbage("restart")
+        local best = math.huge
+        local total, start = 0, os.clock()
+        repeat
+            local t = os.clock()
+            fn()
+            local elapsed = os.clock() - t
+            if elapsed < best then best = elapsed end
+            total = os.clock() - start
+        until total >= min_time
+        -- calls faster than the clock are timed together
+        if best == 0 then
+            local n, t = 0, os.clock()
+            repeat
+                fn()
+                n = n + 1
+            until os.clock() - t >= min_time
+            best = (os.clock() - t) / n
+        end
+        return best, heap, result
+    end
+
+    local header = ("%-22s %8s %10s %12s %10s %8s %12s %10s %8s"):format(
+        "shape", "size", "bytes", "dec ns/B", "dec heap/B", "growth", "enc ns/B", "enc heap/B", "growth")
+    print(header)
+    for _, shape in ipairs(shapes) do
+        local name, sizes, gen = shape[1], shape[2], shape[3]
+        local prev
+        for _, size in ipairs(sizes) do
+            local n = (name:sub(-1) == "%") and size or size * max_scale
+            local doc = gen(n)
+            local bytes = #doc
+            local dec_time, dec_heap, data = measure(function() return assert(tomlua.decode(doc)) end)
+            local enc_time, enc_heap, out = measure(function() return assert(tomlua.encode(data)) end)
+            local out_bytes = #out
+            local dec_growth, enc_growth = "", ""
+            -- only meaningful when the document grows with the size
+            if prev and bytes > prev.bytes * 1.5 then
+                dec_growth = ("%.2f"):format(math.log(dec_time / prev.dec_time) / math.log(bytes / prev.bytes))
+                enc_growth = ("%.2f"):format(math.log(enc_time / prev.enc_time) / math.log(out_bytes / prev.out_bytes))
+            end
+            print(("%-22s %8d %10d %12.2f %10.2f %8s %12.2f %10.2f %8s"):format(
+                name, n, bytes,
+                dec_time * 1e9 / bytes, dec_heap / bytes, dec_growth,
+                enc_time * 1e9 / out_bytes, enc_heap / out_bytes, enc_growth))
+            prev = { bytes = bytes, out_bytes = out_bytes, dec_time = dec_time, enc_time = enc_time }
+        end
+    end
+end
@@ -38,6 +38,8 @@ if tonumber(arg[2]) == 1 then
 	end)
 elseif tonumber(arg[2]) == 2 then
 	dofile(here .. 'bench.lua')(here, arg[3] and tonumber(arg[3]) or 100, run_toml_edit)
+elseif tonumber(arg[2]) == 3 then
+	dofile(here .. 'scaling.lua')(here, arg[3] and tonumber(arg[3]) or 1, arg[4] and tonumber(arg[4]) or 0.05)
 else
 	local test = require("gambiarra")
 